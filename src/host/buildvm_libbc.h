@@ -2,44 +2,94 @@
 
 static const int libbc_endian = 0;
 
-static const uint8_t libbc_code[] = {
 #if LJ_FR2
+static const uint8_t libbc_code[] = {
 0,1,2,0,0,1,2,24,1,0,0,76,1,2,0,241,135,158,166,3,220,203,178,130,4,0,1,2,0,
 0,1,2,24,1,0,0,76,1,2,0,243,244,148,165,20,198,190,199,252,3,0,1,2,0,0,0,3,
 16,0,5,0,21,1,0,0,76,1,2,0,0,2,10,0,0,0,16,16,0,12,0,16,1,9,0,41,2,1,0,21,3,
 0,0,41,4,1,0,77,2,8,128,18,6,1,0,18,8,5,0,59,9,5,0,66,6,3,2,10,6,0,0,89,7,1,
-128,76,6,2,0,79,2,248,127,88,0,60,0,75,0,1,0,0,2,11,0,0,0,17,16,0,12,0,16,1,
+128,76,6,2,0,79,2,248,127,88,0,55,0,75,0,1,0,0,2,11,0,0,0,17,16,0,12,0,16,1,
 9,0,43,2,0,0,18,3,0,0,41,4,0,0,89,5,7,128,18,7,1,0,18,9,5,0,18,10,6,0,66,7,
-3,2,10,7,0,0,89,8,1,128,76,7,2,0,70,5,3,3,82,5,247,127,88,0,60,0,75,0,1,0,0,
-1,2,0,0,0,3,16,0,12,0,21,1,0,0,76,1,2,0,0,2,10,0,0,2,31,16,0,12,0,21,2,0,0,
-11,1,0,0,89,3,7,128,8,2,0,0,89,3,24,128,59,3,2,0,43,4,0,0,64,4,2,0,76,3,2,0,
-89,3,19,128,16,1,14,0,41,3,1,0,3,3,1,0,89,3,15,128,3,1,2,0,89,3,13,128,59,3,
-1,0,22,4,1,1,18,5,2,0,41,6,1,0,77,4,4,128,23,8,1,7,59,9,7,0,64,9,8,0,79,4,252,
-127,88,0,60,0,43,4,0,0,64,4,2,0,76,3,2,0,75,0,1,0,0,2,0,5,12,0,0,0,37,16,0,
-12,0,16,1,14,0,16,2,14,0,16,3,14,0,11,4,0,0,89,5,1,128,18,4,0,0,16,4,12,0,3,
-1,2,0,89,5,26,128,33,5,1,3,0,2,3,0,89,6,4,128,2,3,1,0,89,6,2,128,4,4,0,0,89,
-6,10,128,18,6,1,0,18,7,2,0,41,8,1,0,77,6,4,128,32,10,5,9,59,11,9,0,64,11,10,
-4,79,6,252,127,88,0,60,0,89,6,9,128,18,6,2,0,18,7,1,0,41,8,255,255,77,6,4,128,
-32,10,5,9,59,11,9,0,64,11,10,4,79,6,252,127,88,0,60,0,76,4,2,0,0
+3,2,10,7,0,0,89,8,1,128,76,7,2,0,70,5,3,3,82,5,247,127,88,0,55,0,75,0,1,0,0,
+1,2,0,0,0,3,16,0,12,0,21,1,0,0,76,1,2,0,2,0,18,1,0,3,201,1,71,0,0,3,16,0,12,
+0,10,1,0,0,89,2,1,128,16,1,9,0,41,2,1,0,21,3,0,0,41,4,0,0,43,5,0,0,85,6,190,
+128,88,0,55,0,1,2,3,0,89,6,179,128,85,6,178,128,88,0,55,0,59,6,2,0,59,7,3,0,
+43,8,0,0,15,0,1,0,89,9,6,128,18,9,1,0,18,11,7,0,18,12,6,0,66,9,3,2,18,8,9,0,
+89,9,5,128,0,7,6,0,89,9,2,128,43,8,1,0,89,9,1,128,43,8,2,0,15,0,8,0,89,9,2,
+128,64,7,2,0,64,6,3,0,33,9,2,3,9,9,0,0,89,9,1,128,89,6,153,128,33,9,2,3,18,
+10,2,0,41,11,2,0,41,12,1,0,3,11,9,0,89,13,10,128,85,13,9,128,88,0,55,0,32,13,
+11,11,36,13,13,9,3,11,13,0,89,13,1,128,32,10,12,10,18,12,11,0,32,11,11,11,89,
+13,244,127,59,13,10,0,59,7,2,0,18,6,13,0,15,0,1,0,89,13,6,128,18,13,1,0,18,
+15,6,0,18,16,7,0,66,13,3,2,18,8,13,0,89,13,5,128,0,6,7,0,89,13,2,128,43,8,1,
+0,89,13,1,128,43,8,2,0,15,0,8,0,89,13,3,128,64,7,10,0,64,6,2,0,89,13,18,128,
+59,7,3,0,15,0,1,0,89,13,6,128,18,13,1,0,18,15,7,0,18,16,6,0,66,13,3,2,18,8,
+13,0,89,13,5,128,0,7,6,0,89,13,2,128,43,8,1,0,89,13,1,128,43,8,2,0,15,0,8,0,
+89,13,2,128,64,7,10,0,64,6,3,0,33,13,2,3,9,13,1,0,89,13,1,128,89,6,94,128,43,
+13,0,0,59,14,10,0,23,13,0,3,18,11,14,0,59,14,13,0,64,14,10,0,64,11,13,0,18,
+10,2,0,85,14,57,128,88,0,55,0,85,14,20,128,88,0,55,0,22,10,0,10,59,6,10,0,15,
+0,1,0,89,14,6,128,18,14,1,0,18,16,6,0,18,17,11,0,66,14,3,2,18,8,14,0,89,14,
+5,128,0,6,11,0,89,14,2,128,43,8,1,0,89,14,1,128,43,8,2,0,15,0,8,0,89,14,2,128,
+3,3,10,0,89,14,235,127,15,0,8,0,89,14,2,128,45,14,0,0,66,14,1,1,85,14,20,128,
+88,0,55,0,23,13,0,13,59,7,13,0,15,0,1,0,89,14,6,128,18,14,1,0,18,16,11,0,18,
+17,7,0,66,14,3,2,18,8,14,0,89,14,5,128,0,11,7,0,89,14,2,128,43,8,1,0,89,14,
+1,128,43,8,2,0,15,0,8,0,89,14,2,128,3,13,2,0,89,14,235,127,15,0,8,0,89,14,2,
+128,45,14,0,0,66,14,1,1,1,13,10,0,89,14,1,128,89,14,3,128,64,7,10,0,64,6,13,
+0,89,14,198,127,23,14,0,3,59,15,10,0,64,15,14,0,64,11,10,0,33,14,2,10,33,15,
+10,3,1,14,15,0,89,14,4,128,18,13,2,0,23,10,0,10,22,2,1,10,89,14,3,128,22,13,
+0,10,18,10,3,0,23,3,1,13,1,13,10,0,89,14,86,127,14,0,5,0,89,14,1,128,52,5,0,
+0,22,14,0,4,60,2,14,5,22,14,1,4,60,3,14,5,22,4,1,4,18,2,13,0,18,3,10,0,89,6,
+75,127,9,4,2,0,89,6,1,128,75,0,1,0,23,6,0,4,56,2,6,5,56,3,4,5,23,4,1,4,89,6,
+65,127,75,0,1,0,0,192,2,4,0,0
+};
+
+static const struct { const char *name; int ofs; } libbc_map[] = {
+{"math_deg",0},
+{"math_rad",25},
+{"string_len",50},
+{"table_foreachi",69},
+{"table_foreach",140},
+{"table_getn",215},
+{"table_sort",234},
+{NULL,1051}
+};
 #else
+static const uint8_t libbc_code[] = {
 0,1,2,0,0,1,2,24,1,0,0,76,1,2,0,241,135,158,166,3,220,203,178,130,4,0,1,2,0,
 0,1,2,24,1,0,0,76,1,2,0,243,244,148,165,20,198,190,199,252,3,0,1,2,0,0,0,3,
 16,0,5,0,21,1,0,0,76,1,2,0,0,2,9,0,0,0,16,16,0,12,0,16,1,9,0,41,2,1,0,21,3,
 0,0,41,4,1,0,77,2,8,128,18,6,1,0,18,7,5,0,59,8,5,0,66,6,3,2,10,6,0,0,89,7,1,
-128,76,6,2,0,79,2,248,127,88,0,60,0,75,0,1,0,0,2,10,0,0,0,17,16,0,12,0,16,1,
+128,76,6,2,0,79,2,248,127,88,0,55,0,75,0,1,0,0,2,10,0,0,0,17,16,0,12,0,16,1,
 9,0,43,2,0,0,18,3,0,0,41,4,0,0,89,5,7,128,18,7,1,0,18,8,5,0,18,9,6,0,66,7,3,
-2,10,7,0,0,89,8,1,128,76,7,2,0,70,5,3,3,82,5,247,127,88,0,60,0,75,0,1,0,0,1,
-2,0,0,0,3,16,0,12,0,21,1,0,0,76,1,2,0,0,2,10,0,0,2,31,16,0,12,0,21,2,0,0,11,
-1,0,0,89,3,7,128,8,2,0,0,89,3,24,128,59,3,2,0,43,4,0,0,64,4,2,0,76,3,2,0,89,
-3,19,128,16,1,14,0,41,3,1,0,3,3,1,0,89,3,15,128,3,1,2,0,89,3,13,128,59,3,1,
-0,22,4,1,1,18,5,2,0,41,6,1,0,77,4,4,128,23,8,1,7,59,9,7,0,64,9,8,0,79,4,252,
-127,88,0,60,0,43,4,0,0,64,4,2,0,76,3,2,0,75,0,1,0,0,2,0,5,12,0,0,0,37,16,0,
-12,0,16,1,14,0,16,2,14,0,16,3,14,0,11,4,0,0,89,5,1,128,18,4,0,0,16,4,12,0,3,
-1,2,0,89,5,26,128,33,5,1,3,0,2,3,0,89,6,4,128,2,3,1,0,89,6,2,128,4,4,0,0,89,
-6,10,128,18,6,1,0,18,7,2,0,41,8,1,0,77,6,4,128,32,10,5,9,59,11,9,0,64,11,10,
-4,79,6,252,127,88,0,60,0,89,6,9,128,18,6,2,0,18,7,1,0,41,8,255,255,77,6,4,128,
-32,10,5,9,59,11,9,0,64,11,10,4,79,6,252,127,88,0,60,0,76,4,2,0,0
-#endif
+2,10,7,0,0,89,8,1,128,76,7,2,0,70,5,3,3,82,5,247,127,88,0,55,0,75,0,1,0,0,1,
+2,0,0,0,3,16,0,12,0,21,1,0,0,76,1,2,0,2,0,17,1,0,3,201,1,71,0,0,3,16,0,12,0,
+10,1,0,0,89,2,1,128,16,1,9,0,41,2,1,0,21,3,0,0,41,4,0,0,43,5,0,0,85,6,190,128,
+88,0,55,0,1,2,3,0,89,6,179,128,85,6,178,128,88,0,55,0,59,6,2,0,59,7,3,0,43,
+8,0,0,15,0,1,0,89,9,6,128,18,9,1,0,18,10,7,0,18,11,6,0,66,9,3,2,18,8,9,0,89,
+9,5,128,0,7,6,0,89,9,2,128,43,8,1,0,89,9,1,128,43,8,2,0,15,0,8,0,89,9,2,128,
+64,7,2,0,64,6,3,0,33,9,2,3,9,9,0,0,89,9,1,128,89,6,153,128,33,9,2,3,18,10,2,
+0,41,11,2,0,41,12,1,0,3,11,9,0,89,13,10,128,85,13,9,128,88,0,55,0,32,13,11,
+11,36,13,13,9,3,11,13,0,89,13,1,128,32,10,12,10,18,12,11,0,32,11,11,11,89,13,
+244,127,59,13,10,0,59,7,2,0,18,6,13,0,15,0,1,0,89,13,6,128,18,13,1,0,18,14,
+6,0,18,15,7,0,66,13,3,2,18,8,13,0,89,13,5,128,0,6,7,0,89,13,2,128,43,8,1,0,
+89,13,1,128,43,8,2,0,15,0,8,0,89,13,3,128,64,7,10,0,64,6,2,0,89,13,18,128,59,
+7,3,0,15,0,1,0,89,13,6,128,18,13,1,0,18,14,7,0,18,15,6,0,66,13,3,2,18,8,13,
+0,89,13,5,128,0,7,6,0,89,13,2,128,43,8,1,0,89,13,1,128,43,8,2,0,15,0,8,0,89,
+13,2,128,64,7,10,0,64,6,3,0,33,13,2,3,9,13,1,0,89,13,1,128,89,6,94,128,43,13,
+0,0,59,14,10,0,23,13,0,3,18,11,14,0,59,14,13,0,64,14,10,0,64,11,13,0,18,10,
+2,0,85,14,57,128,88,0,55,0,85,14,20,128,88,0,55,0,22,10,0,10,59,6,10,0,15,0,
+1,0,89,14,6,128,18,14,1,0,18,15,6,0,18,16,11,0,66,14,3,2,18,8,14,0,89,14,5,
+128,0,6,11,0,89,14,2,128,43,8,1,0,89,14,1,128,43,8,2,0,15,0,8,0,89,14,2,128,
+3,3,10,0,89,14,235,127,15,0,8,0,89,14,2,128,45,14,0,0,66,14,1,1,85,14,20,128,
+88,0,55,0,23,13,0,13,59,7,13,0,15,0,1,0,89,14,6,128,18,14,1,0,18,15,11,0,18,
+16,7,0,66,14,3,2,18,8,14,0,89,14,5,128,0,11,7,0,89,14,2,128,43,8,1,0,89,14,
+1,128,43,8,2,0,15,0,8,0,89,14,2,128,3,13,2,0,89,14,235,127,15,0,8,0,89,14,2,
+128,45,14,0,0,66,14,1,1,1,13,10,0,89,14,1,128,89,14,3,128,64,7,10,0,64,6,13,
+0,89,14,198,127,23,14,0,3,59,15,10,0,64,15,14,0,64,11,10,0,33,14,2,10,33,15,
+10,3,1,14,15,0,89,14,4,128,18,13,2,0,23,10,0,10,22,2,1,10,89,14,3,128,22,13,
+0,10,18,10,3,0,23,3,1,13,1,13,10,0,89,14,86,127,14,0,5,0,89,14,1,128,52,5,0,
+0,22,14,0,4,60,2,14,5,22,14,1,4,60,3,14,5,22,4,1,4,18,2,13,0,18,3,10,0,89,6,
+75,127,9,4,2,0,89,6,1,128,75,0,1,0,23,6,0,4,56,2,6,5,56,3,4,5,23,4,1,4,89,6,
+65,127,75,0,1,0,0,192,2,4,0,0
 };
 
 static const struct { const char *name; int ofs; } libbc_map[] = {
@@ -49,8 +99,8 @@ static const struct { const char *name; int ofs; } libbc_map[] = {
 {"table_foreachi",69},
 {"table_foreach",140},
 {"table_getn",215},
-{"table_remove",234},
-{"table_move",367},
-{NULL,522}
+{"table_sort",234},
+{NULL,1051}
 };
+#endif
 
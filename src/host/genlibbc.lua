@@ -13,7 +13,9 @@ local bcnames = vmdef.bcnames
 
 local format = string.format
 
-local isbe = (string.byte(string.dump(function() end), 5) % 2 == 1)
+local dumpflags = string.byte(string.dump(function() end), 5)
+local isbe = (dumpflags % 2 == 1)
+local isfr2 = (bit.band(dumpflags, 8) ~= 0)
 
 local function usage(arg)
   io.stderr:write("Usage: ", arg and arg[0] or "genlibbc",
@@ -57,7 +59,9 @@ local function transform_lua(code)
     fixup.PAIRS = true
     return format("nil, %s, 0", var)
   end)
-  return "return "..code, fixup
+  -- Code with upvalues declares them first and returns the function itself.
+  if not string.match(code, "^%s*local%s") then code = "return "..code end
+  return code, fixup
 end
 
 local function read_uleb128(p)
@@ -144,11 +148,27 @@ local function find_defs(src)
   return defs
 end
 
-local function gen_header(defs)
+-- The bytecode differs with and without the FR2 frame layout. Each run can
+-- only dump the layout of the running VM, so the other one is kept from the
+-- previous header. Run it with both a GC64 and a non-GC64 build.
+local function read_modes(name)
+  local modes = {}
+  local fp = name ~= "-" and io.open(name)
+  if fp then
+    local old = fp:read("*a")
+    fp:close()
+    local fr2, nofr2 = string.match(old,
+				    "\n#if LJ_FR2\n(.-)#else\n(.-)#endif\n")
+    if fr2 then
+      modes[true], modes[false] = fr2, nofr2
+    end
+  end
+  return modes
+end
+
+local function gen_mode(defs)
   local t = {}
   local function w(x) t[#t+1] = x end
-  w("/* This is a generated file. DO NOT EDIT! */\n\n")
-  w("static const int libbc_endian = ") w(isbe and 1 or 0) w(";\n\n")
   local s = ""
   for _,name in ipairs(defs) do
     s = s .. defs[name]
@@ -168,7 +188,21 @@ local function gen_header(defs)
     w('{"'); w(name); w('",'); w(m) w('},\n')
     m = m + #defs[name]
   end
-  w("{NULL,"); w(m); w("}\n};\n\n")
+  w("{NULL,"); w(m); w("}\n};\n")
+  return table.concat(t)
+end
+
+local function gen_header(defs, modes)
+  local t = {}
+  local function w(x) t[#t+1] = x end
+  modes[isfr2] = gen_mode(defs)
+  w("/* This is a generated file. DO NOT EDIT! */\n\n")
+  w("static const int libbc_endian = ") w(isbe and 1 or 0) w(";\n\n")
+  w("#if LJ_FR2\n")
+  w(modes[true] or '#error "Missing FR2 bytecode. Run genlibbc with GC64."\n')
+  w("#else\n")
+  w(modes[false] or '#error "Missing bytecode. Run genlibbc without GC64."\n')
+  w("#endif\n\n")
   return table.concat(t)
 end
 
@@ -192,6 +226,6 @@ end
 local outfile = parse_arg(arg)
 local src = read_files(arg)
 local defs = find_defs(src)
-local hdr = gen_header(defs)
+local hdr = gen_header(defs, read_modes(outfile))
 write_file(outfile, hdr)
 
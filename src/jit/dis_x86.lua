@@ -239,6 +239,10 @@ nil,"||psrlvVSXrvm","||psravdXrvm","||psllvVSXrvm",
 --8x
 [0x8c] = "||pmaskmovXrvVSm",
 [0x8e] = "||pmaskmovVSmXvr",
+--Bx
+[0xb9] = "||sz*,fmadd231ssXrvm,fmadd231sdXrvm",
+[0xbb] = "||sz*,fmsub231ssXrvm,fmsub231sdXrvm",
+[0xbd] = "||sz*,fnmadd231ssXrvm,fnmadd231sdXrvm",
 --Dx
 [0xdc] = "||aesencXrvm", [0xdd] = "||aesenclastXrvm",
 [0xde] = "||aesdecXrvm", [0xdf] = "||aesdeclastXrvm",
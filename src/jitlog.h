@@ -26,6 +26,7 @@ LUA_API void jitlog_close(JITLogUserContext *usrcontext);
 LUA_API int jitlog_save(JITLogUserContext *usrcontext, const char *path);
 LUA_API void jitlog_reset(JITLogUserContext *usrcontext);
 LUA_API void jitlog_savehotcounts(JITLogUserContext *usrcontext);
+LUA_API int jitlog_heapsnapshot(JITLogUserContext *usrcontext, lua_State *L);
 
 #endif
 
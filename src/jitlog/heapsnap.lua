@@ -0,0 +1,305 @@
+--[[
+  Analysis of the heap snapshots written by jitlog.heapsnapshot().
+
+  dominators(snap) computes the immediate dominator of every object reachable
+  from the GC roots and the size each object retains, i.e. the memory that
+  would be freed if the object became unreachable. The dominators are found
+  with the iterative algorithm from Cooper, Harvey and Kennedy,
+  "A Simple, Fast Dominance Algorithm".
+
+  Usage as a tool: luajit jitlog/heapsnap.lua jitlog.bin [count]
+]]--
+
+require("table.new")
+local format = string.format
+local tinsert = table.insert
+local tconcat = table.concat
+
+local lib = {}
+
+local function typename(snap, i)
+  return snap.owner.enums.gcobjtype[snap.objtype[i]]
+end
+lib.typename = typename
+
+-- Number the objects reachable from the roots in DFS postorder. The virtual
+-- root node n+1 holds the edges to the GC roots.
+local function postorder(snap, targets)
+  local n = snap.count
+  local edgestart = snap.edgestart
+  local po, order = table.new(n + 1, 0), table.new(n + 1, 0)
+  local stack, pos = {n + 1}, {edgestart[n + 1]}
+  local top, count = 1, 0
+  po[n + 1] = -1
+  while top > 0 do
+    local u, j = stack[top], pos[top]
+    if j < edgestart[u + 1] then
+      pos[top] = j + 1
+      local v = targets[j]
+      if v ~= 0 and not po[v] then
+        po[v] = -1
+        top = top + 1
+        stack[top], pos[top] = v, edgestart[v]
+      end
+    else
+      stack[top] = nil
+      top = top - 1
+      count = count + 1
+      po[u], order[count] = count, u
+    end
+  end
+  return po, order, count
+end
+
+function lib.dominators(snap)
+  if snap.idom then
+    return snap
+  end
+  local n = snap.count
+  local address, size, edges = snap.address, snap.size, snap.edges
+  local edgestart = snap.edgestart
+
+  -- Map edge addresses to object indices. References to objects outside of
+  -- the snapshot (like the fixed empty string) become 0.
+  local index = table.new(0, n)
+  for i = 1, n do
+    index[address[i]] = i
+  end
+  local targets = table.new(#edges + #snap.roots, 0)
+  for j = 1, #edges do
+    targets[j] = index[edges[j]] or 0
+  end
+  for _, root in ipairs(snap.roots) do
+    tinsert(targets, index[root] or 0)
+  end
+  edgestart[n + 2] = #targets + 1
+
+  local po, order, count = postorder(snap, targets)
+
+  -- Predecessor lists indexed by postorder number.
+  local predstart, preds = table.new(count + 1, 0), table.new(#targets, 0)
+  for b = 1, count + 1 do
+    predstart[b] = 0
+  end
+  for b = 1, count do
+    local u = order[b]
+    for j = edgestart[u], edgestart[u + 1] - 1 do
+      local v = targets[j]
+      if v ~= 0 then
+        predstart[po[v]] = predstart[po[v]] + 1
+      end
+    end
+  end
+  local total = 1
+  for b = 1, count + 1 do
+    total, predstart[b] = total + predstart[b], total
+  end
+  local fill = {}
+  for b = 1, count do
+    fill[b] = predstart[b]
+  end
+  for b = 1, count do
+    local u = order[b]
+    for j = edgestart[u], edgestart[u + 1] - 1 do
+      local v = targets[j]
+      if v ~= 0 then
+        local pv = po[v]
+        preds[fill[pv]] = b
+        fill[pv] = fill[pv] + 1
+      end
+    end
+  end
+
+  -- A dominator always has a higher postorder number than the nodes it
+  -- dominates, which is what intersect walks towards.
+  local idom = table.new(count, 0)
+  idom[count] = count
+  local changed = true
+  while changed do
+    changed = false
+    for b = count - 1, 1, -1 do
+      local new
+      for k = predstart[b], predstart[b + 1] - 1 do
+        local p = preds[k]
+        if idom[p] then
+          if not new then
+            new = p
+          else
+            local a = p
+            while a ~= new do
+              while a < new do a = idom[a] end
+              while new < a do new = idom[new] end
+            end
+          end
+        end
+      end
+      if idom[b] ~= new then
+        idom[b] = new
+        changed = true
+      end
+    end
+  end
+
+  -- Children come before their dominator in postorder, so one pass sums up
+  -- the retained sizes.
+  local retained = table.new(count, 0)
+  for b = 1, count - 1 do
+    retained[b] = size[order[b]]
+  end
+  retained[count] = 0
+  for b = 1, count - 1 do
+    local d = idom[b]
+    retained[d] = retained[d] + retained[b]
+  end
+
+  local objidom, objretained = table.new(n, 0), table.new(n, 0)
+  for b = 1, count - 1 do
+    local u = order[b]
+    local d = idom[b]
+    objidom[u] = d == count and 0 or order[d]
+    objretained[u] = retained[b]
+  end
+  snap.index = index
+  snap.idom = objidom
+  snap.retained = objretained
+  snap.reachable = count - 1
+  snap.reachablesize = retained[count]
+  return snap
+end
+
+-- Objects sorted by the size they retain, largest first.
+function lib.topretainers(snap, limit)
+  lib.dominators(snap)
+  local retained = snap.retained
+  local list = {}
+  for i = 1, snap.count do
+    if retained[i] then
+      tinsert(list, i)
+    end
+  end
+  table.sort(list, function(a, b) return retained[a] > retained[b] end)
+  if limit then
+    for i = #list, limit + 1, -1 do
+      list[i] = nil
+    end
+  end
+  return list
+end
+
+-- Object count and size of each object type.
+function lib.typestats(snap)
+  local stats = {}
+  for i = 1, snap.count do
+    local name = typename(snap, i)
+    local entry = stats[name]
+    if not entry then
+      entry = {name = name, count = 0, size = 0}
+      stats[name] = entry
+    end
+    entry.count = entry.count + 1
+    entry.size = entry.size + snap.size[i]
+  end
+  return stats
+end
+
+local function firstedge(snap, i, objtype)
+  lib.dominators(snap)
+  for j = snap.edgestart[i], snap.edgestart[i + 1] - 1 do
+    local target = snap.index[snap.edges[j]]
+    if target and typename(snap, target) == objtype then
+      return target
+    end
+  end
+end
+
+-- The first roots are written in this order by the VM.
+local rootnames = {"main thread", "globals", "registry"}
+
+function lib.describe(snap, i)
+  local owner = snap.owner
+  local name = typename(snap, i)
+  local address = snap.address[i]
+  for k, root in ipairs(rootnames) do
+    if snap.roots[k] == address then
+      return format("%s 0x%x (%s)", name, address, root)
+    end
+  end
+  if name == "string" then
+    local s = owner.strings[address]
+    if s then
+      if #s > 40 then
+        s = s:sub(1, 40).."..."
+      end
+      return format("string %q", s)
+    end
+  elseif name == "proto" then
+    local pt = owner.proto_lookup[address]
+    if pt then
+      return "proto "..pt:get_location()
+    end
+  elseif name == "function" then
+    local pt = firstedge(snap, i, "proto")
+    pt = pt and owner.proto_lookup[snap.address[pt]]
+    if pt then
+      return "function "..pt:get_location()
+    end
+  end
+  return format("%s 0x%x", name, address)
+end
+
+-- The chain of dominators from an object up to the GC roots.
+function lib.dominatorpath(snap, i)
+  lib.dominators(snap)
+  local path = {}
+  while i and i ~= 0 do
+    tinsert(path, i)
+    i = snap.idom[i]
+  end
+  return path
+end
+
+function lib.report(snap, limit)
+  lib.dominators(snap)
+  local out = {}
+  tinsert(out, format("Heap snapshot: %d objects, %d reachable retaining %d bytes, GC total %d bytes",
+                      snap.count, snap.reachable, snap.reachablesize, snap.totalmem))
+  local stats = {}
+  for _, entry in pairs(lib.typestats(snap)) do
+    tinsert(stats, entry)
+  end
+  table.sort(stats, function(a, b) return a.size > b.size end)
+  for _, entry in ipairs(stats) do
+    tinsert(out, format("  %-10s %10d objects %12d bytes", entry.name, entry.count, entry.size))
+  end
+  tinsert(out, "Largest retainers:")
+  for _, i in ipairs(lib.topretainers(snap, limit or 20)) do
+    local path = lib.dominatorpath(snap, i)
+    local chain = {}
+    for k = 2, math.min(#path, 4) do
+      chain[k - 1] = lib.describe(snap, path[k])
+    end
+    tinsert(out, format("  %12d %10d  %s", snap.retained[i], snap.size[i], lib.describe(snap, i)))
+    if #chain > 0 then
+      tinsert(out, "      held by "..tconcat(chain, " <- "))
+    end
+  end
+  return tconcat(out, "\n")
+end
+
+if ... ~= "jitlog.heapsnap" then
+  local path, limit = ...
+  if not path then
+    io.stderr:write("usage: luajit jitlog/heapsnap.lua jitlog.bin [count]\n")
+    os.exit(1)
+  end
+  local reader = require("jitlog.reader").parsefile(path)
+  if #reader.heapsnapshots == 0 then
+    io.stderr:write("no heap snapshots in "..path.."\n")
+    os.exit(1)
+  end
+  for _, snap in ipairs(reader.heapsnapshots) do
+    print(lib.report(snap, tonumber(limit)))
+  end
+end
+
+return lib
@@ -212,6 +212,24 @@ local msgs = {
     "counts_length :  u16",
     "counts : u16[counts_length]",
   },
+
+  {
+    name = "gcobj",
+    "objtype : 8",
+    "address : GCRefPtr",
+    "size : u32",
+    "edgecount : u32",
+    "edges : GCRef[edgecount]",
+  },
+
+  {
+    name = "heapsnapshot",
+    "time : timestamp",
+    "totalmem : u64",
+    "objcount : u32",
+    "rootcount : u32",
+    "roots : GCRef[rootcount]",
+  },
 }
 
 return msgs
@@ -404,6 +404,7 @@ local flush_reason =  {
   "profiletoggle",
   "set_builtinmt",
   "set_immutableuv",
+  "freeze_table",
 }
 
 function base_actions:alltraceflush(msg)
@@ -451,6 +452,56 @@ function base_actions:gcstate(msg)
   return self.gcstate, gcstates[prevstate]
 end
 
+local function newheapsnap(owner)
+  return {
+    owner = owner,
+    count = 0,
+    address = {},
+    objtype = {},
+    size = {},
+    -- Edges of object i are edges[edgestart[i]] to edges[edgestart[i+1]-1]
+    edgestart = {1},
+    edges = {},
+  }
+end
+
+function base_actions:gcobj(msg)
+  local snap = self.pending_heapsnap
+  if not snap then
+    snap = newheapsnap(self)
+    self.pending_heapsnap = snap
+  end
+  local n = snap.count + 1
+  local edges, refs = snap.edges, msg:get_edges()
+  local e = snap.edgestart[n] - 1
+  snap.count = n
+  snap.address[n] = addrtonum(msg.address)
+  snap.objtype[n] = msg:get_objtype()
+  snap.size[n] = msg.size
+  for i = 0, msg.edgecount-1 do
+    edges[e + i + 1] = addrtonum(refs[i])
+  end
+  snap.edgestart[n + 1] = e + msg.edgecount + 1
+  return snap, n
+end
+
+function base_actions:heapsnapshot(msg)
+  local snap = self.pending_heapsnap or newheapsnap(self)
+  self.pending_heapsnap = nil
+  assert(snap.count == msg.objcount, "heap snapshot is missing objects")
+  snap.time = msg.time
+  snap.eventid = self.eventid
+  snap.totalmem = tonumber(msg.totalmem)
+  local roots, refs = {}, msg:get_roots()
+  for i = 0, msg.rootcount-1 do
+    roots[i + 1] = addrtonum(refs[i])
+  end
+  snap.roots = roots
+  tinsert(self.heapsnapshots, snap)
+  self:log_msg("heapsnapshot", "HeapSnapshot: %d objects, MemTotal = %dMB", snap.count, snap.totalmem/(1024*1024))
+  return snap
+end
+
 local logreader = {}
 
 function logreader:log(fmt, ...)
@@ -749,6 +800,7 @@ local function makereader(mixins)
     flushes = {},
     traces = {},
     aborts = {},
+    heapsnapshots = {},
     exits = 0,
     gcexits = 0, -- number of trace exits force triggered by the GC being in the 'atomic' or 'finalize' states
     gccount = 0, -- number GC full cycles that have been seen in the log
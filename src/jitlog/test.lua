@@ -377,7 +377,55 @@ function tests.protoloaded()
   assert(result.protos[2].createdid > result.protos[1].createdid)
 end
 
+function tests.heapsnapshot()
+  local heapsnap = require("jitlog.heapsnap")
+  jitlog.start()
+  local holder = {inner = {}}
+  for i = 1, 100 do
+    holder.inner[i] = "heapsnap"..i
+  end
+  local weak = setmetatable({}, {__mode = "v"})
+  weak[1] = holder.inner
+  local count = jitlog.heapsnapshot()
+  local result = parselog(jitlog.savetostring())
+  assert(#result.heapsnapshots == 1)
+  local snap = heapsnap.dominators(result.heapsnapshots[1])
+  assert(snap.count == count)
+  assert(snap.reachable > 0 and snap.reachable <= count)
+
+  -- Find the inner table through one of its strings and check it retains them.
+  -- The string is built at runtime so it isn't also held by a proto constant.
+  local name = "heapsnap"..50
+  local inner
+  for i = 1, snap.count do
+    if heapsnap.typename(snap, i) == "string" and result.strings[snap.address[i]] == name then
+      inner = snap.idom[i]
+    end
+  end
+  assert(inner and heapsnap.typename(snap, inner) == "table")
+  assert(snap.retained[inner] > snap.size[inner] + 100 * 16)
+  assert(snap.retained[snap.idom[inner]] > snap.retained[inner])
+  assert(heapsnap.report(snap, 5))
+  holder, weak = nil, nil
+end
 
+function tests.heapsnapshot_noretain()
+  jitlog.start()
+  local big = ("x"):rep(1024*1024)..tostring({})
+  jitlog.heapsnapshot()
+  -- The snapshot must not keep the strings it wrote alive.
+  collectgarbage()
+  local before = collectgarbage("count")
+  big = nil
+  collectgarbage()
+  assert(before - collectgarbage("count") > 1000)
+  local result = parselog(jitlog.savetostring())
+  local found = false
+  for _, s in pairs(result.strings) do
+    if #s > 1024*1024 then found = true end
+  end
+  assert(found)
+end
 
 local failed = false
 
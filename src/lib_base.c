@@ -133,6 +133,8 @@ LJLIB_ASM(setmetatable)		LJLIB_REC(.)
   GCtab *mt = lj_lib_checktabornil(L, 2);
   if (!tvisnil(lj_meta_lookup(L, L->base, MM_metatable)))
     lj_err_caller(L, LJ_ERR_PROTMT);
+  if (tabisfrozen(t))
+    lj_err_caller(L, LJ_ERR_TABFROZ);
   setgcref(t->metatable, obj2gco(mt));
   if (mt) { lj_gc_objbarriert(L, t, mt); }
   settabV(L, L->base-1-LJ_FR2, t);
@@ -219,7 +221,7 @@ LJLIB_CF(rawlen)		LJLIB_REC(.)
 }
 #endif
 
-LJLIB_CF(unpack)
+LJLIB_CF(unpack)		LJLIB_REC(.)
 {
   GCtab *t = lj_lib_checktab(L, 1);
   int32_t n, i = lj_lib_optint(L, 2, 1);
@@ -536,24 +538,17 @@ LJLIB_SET(_VERSION)
 
 #define LJLIB_MODULE_coroutine
 
-LJLIB_CF(coroutine_status)
+LJLIB_CF(coroutine_status)	LJLIB_REC(.)
 {
-  const char *s;
   lua_State *co;
   if (!(L->top > L->base && tvisthread(L->base)))
     lj_err_arg(L, 1, LJ_ERR_NOCORO);
   co = threadV(L->base);
-  if (co == L) s = "running";
-  else if (co->status == LUA_YIELD) s = "suspended";
-  else if (co->status != LUA_OK) s = "dead";
-  else if (co->base > tvref(co->stack)+1+LJ_FR2) s = "normal";
-  else if (co->top == co->base) s = "dead";
-  else s = "suspended";
-  lua_pushstring(L, s);
+  lua_pushstring(L, lj_state_costatusname[lj_state_costatus(L, co)]);
   return 1;
 }
 
-LJLIB_CF(coroutine_running)
+LJLIB_CF(coroutine_running)	LJLIB_REC(.)
 {
 #if LJ_52
   int ismain = lua_pushthread(L);
@@ -566,9 +561,9 @@ LJLIB_CF(coroutine_running)
 #endif
 }
 
-LJLIB_CF(coroutine_isyieldable)
+LJLIB_CF(coroutine_isyieldable)	LJLIB_REC(.)
 {
-  setboolV(L->top++, cframe_canyield(L->cframe));
+  setboolV(L->top++, lj_state_canyield(L));
   return 1;
 }
 
@@ -646,6 +646,28 @@ JIT_PARAMDEF(JIT_PARAMINIT)
 #include <sys/utsname.h>
 #endif
 
+#if LJ_TARGET_X86ORX64 && LJ_HASJIT
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+/* Check whether the OS saves the SSE and AVX register state (XCR0). */
+static int jit_cpu_osavx(void)
+{
+#if defined(__GNUC__)
+  uint32_t lo, hi;
+  __asm__ __volatile__(".byte 0x0f, 0x01, 0xd0"  /* xgetbv */
+		       : "=a" (lo), "=d" (hi) : "c" (0));
+  UNUSED(hi);
+  return (lo & 6) == 6;
+#elif defined(_MSC_VER) && _MSC_VER >= 1600
+  return (_xgetbv(0) & 6) == 6;
+#else
+  return 0;
+#endif
+}
+#endif
+
 /* Arch-dependent CPU detection. */
 static uint32_t jit_cpudetect(lua_State *L)
 {
@@ -669,10 +691,15 @@ static uint32_t jit_cpudetect(lua_State *L)
       if (fam >= 0x00000f00)  /* K8, K10. */
 	flags |= JIT_F_PREFER_IMUL;
     }
+    /* AVX needs OSXSAVE and the OS must save the YMM registers, too. */
+    if ((features[2] & 0x18000000) == 0x18000000 && jit_cpu_osavx())
+      flags |= JIT_F_AVX | ((features[2] >> 12)&1) * JIT_F_FMA;
     if (vendor[0] >= 7) {
       uint32_t xfeatures[4];
       lj_vm_cpuid(7, xfeatures);
       flags |= ((xfeatures[1] >> 8)&1) * JIT_F_BMI2;
+      if ((flags & JIT_F_AVX))
+	flags |= ((xfeatures[1] >> 5)&1) * JIT_F_AVX2;
     }
 #endif
   }
@@ -25,6 +25,7 @@
 #include "lj_bcdump.h"
 #include "lj_char.h"
 #include "lj_strfmt.h"
+#include "lj_strmatch.h"
 #include "lj_lib.h"
 
 /* ------------------------------------------------------------------------ */
@@ -138,288 +139,8 @@ LJLIB_CF(string_dump)
 /* macro to `unsign' a character */
 #define uchar(c)        ((unsigned char)(c))
 
-#define CAP_UNFINISHED	(-1)
-#define CAP_POSITION	(-2)
-
-typedef struct MatchState {
-  const char *src_init;  /* init of source string */
-  const char *src_end;  /* end (`\0') of source string */
-  lua_State *L;
-  int level;  /* total number of captures (finished or unfinished) */
-  int depth;
-  struct {
-    const char *init;
-    ptrdiff_t len;
-  } capture[LUA_MAXCAPTURES];
-} MatchState;
-
 #define L_ESC		'%'
 
-static int check_capture(MatchState *ms, int l)
-{
-  l -= '1';
-  if (l < 0 || l >= ms->level || ms->capture[l].len == CAP_UNFINISHED)
-    lj_err_caller(ms->L, LJ_ERR_STRCAPI);
-  return l;
-}
-
-static int capture_to_close(MatchState *ms)
-{
-  int level = ms->level;
-  for (level--; level>=0; level--)
-    if (ms->capture[level].len == CAP_UNFINISHED) return level;
-  lj_err_caller(ms->L, LJ_ERR_STRPATC);
-  return 0;  /* unreachable */
-}
-
-static const char *classend(MatchState *ms, const char *p)
-{
-  switch (*p++) {
-  case L_ESC:
-    if (*p == '\0')
-      lj_err_caller(ms->L, LJ_ERR_STRPATE);
-    return p+1;
-  case '[':
-    if (*p == '^') p++;
-    do {  /* look for a `]' */
-      if (*p == '\0')
-	lj_err_caller(ms->L, LJ_ERR_STRPATM);
-      if (*(p++) == L_ESC && *p != '\0')
-	p++;  /* skip escapes (e.g. `%]') */
-    } while (*p != ']');
-    return p+1;
-  default:
-    return p;
-  }
-}
-
-static const unsigned char match_class_map[32] = {
-  0,LJ_CHAR_ALPHA,0,LJ_CHAR_CNTRL,LJ_CHAR_DIGIT,0,0,LJ_CHAR_GRAPH,0,0,0,0,
-  LJ_CHAR_LOWER,0,0,0,LJ_CHAR_PUNCT,0,0,LJ_CHAR_SPACE,0,
-  LJ_CHAR_UPPER,0,LJ_CHAR_ALNUM,LJ_CHAR_XDIGIT,0,0,0,0,0,0,0
-};
-
-static int match_class(int c, int cl)
-{
-  if ((cl & 0xc0) == 0x40) {
-    int t = match_class_map[(cl&0x1f)];
-    if (t) {
-      t = lj_char_isa(c, t);
-      return (cl & 0x20) ? t : !t;
-    }
-    if (cl == 'z') return c == 0;
-    if (cl == 'Z') return c != 0;
-  }
-  return (cl == c);
-}
-
-static int matchbracketclass(int c, const char *p, const char *ec)
-{
-  int sig = 1;
-  if (*(p+1) == '^') {
-    sig = 0;
-    p++;  /* skip the `^' */
-  }
-  while (++p < ec) {
-    if (*p == L_ESC) {
-      p++;
-      if (match_class(c, uchar(*p)))
-	return sig;
-    }
-    else if ((*(p+1) == '-') && (p+2 < ec)) {
-      p+=2;
-      if (uchar(*(p-2)) <= c && c <= uchar(*p))
-	return sig;
-    }
-    else if (uchar(*p) == c) return sig;
-  }
-  return !sig;
-}
-
-static int singlematch(int c, const char *p, const char *ep)
-{
-  switch (*p) {
-  case '.': return 1;  /* matches any char */
-  case L_ESC: return match_class(c, uchar(*(p+1)));
-  case '[': return matchbracketclass(c, p, ep-1);
-  default:  return (uchar(*p) == c);
-  }
-}
-
-static const char *match(MatchState *ms, const char *s, const char *p);
-
-static const char *matchbalance(MatchState *ms, const char *s, const char *p)
-{
-  if (*p == 0 || *(p+1) == 0)
-    lj_err_caller(ms->L, LJ_ERR_STRPATU);
-  if (*s != *p) {
-    return NULL;
-  } else {
-    int b = *p;
-    int e = *(p+1);
-    int cont = 1;
-    while (++s < ms->src_end) {
-      if (*s == e) {
-	if (--cont == 0) return s+1;
-      } else if (*s == b) {
-	cont++;
-      }
-    }
-  }
-  return NULL;  /* string ends out of balance */
-}
-
-static const char *max_expand(MatchState *ms, const char *s,
-			      const char *p, const char *ep)
-{
-  ptrdiff_t i = 0;  /* counts maximum expand for item */
-  while ((s+i)<ms->src_end && singlematch(uchar(*(s+i)), p, ep))
-    i++;
-  /* keeps trying to match with the maximum repetitions */
-  while (i>=0) {
-    const char *res = match(ms, (s+i), ep+1);
-    if (res) return res;
-    i--;  /* else didn't match; reduce 1 repetition to try again */
-  }
-  return NULL;
-}
-
-static const char *min_expand(MatchState *ms, const char *s,
-			      const char *p, const char *ep)
-{
-  for (;;) {
-    const char *res = match(ms, s, ep+1);
-    if (res != NULL)
-      return res;
-    else if (s<ms->src_end && singlematch(uchar(*s), p, ep))
-      s++;  /* try with one more repetition */
-    else
-      return NULL;
-  }
-}
-
-static const char *start_capture(MatchState *ms, const char *s,
-				 const char *p, int what)
-{
-  const char *res;
-  int level = ms->level;
-  if (level >= LUA_MAXCAPTURES) lj_err_caller(ms->L, LJ_ERR_STRCAPN);
-  ms->capture[level].init = s;
-  ms->capture[level].len = what;
-  ms->level = level+1;
-  if ((res=match(ms, s, p)) == NULL)  /* match failed? */
-    ms->level--;  /* undo capture */
-  return res;
-}
-
-static const char *end_capture(MatchState *ms, const char *s,
-			       const char *p)
-{
-  int l = capture_to_close(ms);
-  const char *res;
-  ms->capture[l].len = s - ms->capture[l].init;  /* close capture */
-  if ((res = match(ms, s, p)) == NULL)  /* match failed? */
-    ms->capture[l].len = CAP_UNFINISHED;  /* undo capture */
-  return res;
-}
-
-static const char *match_capture(MatchState *ms, const char *s, int l)
-{
-  size_t len;
-  l = check_capture(ms, l);
-  len = (size_t)ms->capture[l].len;
-  if ((size_t)(ms->src_end-s) >= len &&
-      memcmp(ms->capture[l].init, s, len) == 0)
-    return s+len;
-  else
-    return NULL;
-}
-
-static const char *match(MatchState *ms, const char *s, const char *p)
-{
-  if (++ms->depth > LJ_MAX_XLEVEL)
-    lj_err_caller(ms->L, LJ_ERR_STRPATX);
-  init: /* using goto's to optimize tail recursion */
-  switch (*p) {
-  case '(':  /* start capture */
-    if (*(p+1) == ')')  /* position capture? */
-      s = start_capture(ms, s, p+2, CAP_POSITION);
-    else
-      s = start_capture(ms, s, p+1, CAP_UNFINISHED);
-    break;
-  case ')':  /* end capture */
-    s = end_capture(ms, s, p+1);
-    break;
-  case L_ESC:
-    switch (*(p+1)) {
-    case 'b':  /* balanced string? */
-      s = matchbalance(ms, s, p+2);
-      if (s == NULL) break;
-      p+=4;
-      goto init;  /* else s = match(ms, s, p+4); */
-    case 'f': {  /* frontier? */
-      const char *ep; char previous;
-      p += 2;
-      if (*p != '[')
-	lj_err_caller(ms->L, LJ_ERR_STRPATB);
-      ep = classend(ms, p);  /* points to what is next */
-      previous = (s == ms->src_init) ? '\0' : *(s-1);
-      if (matchbracketclass(uchar(previous), p, ep-1) ||
-	 !matchbracketclass(uchar(*s), p, ep-1)) { s = NULL; break; }
-      p=ep;
-      goto init;  /* else s = match(ms, s, ep); */
-      }
-    default:
-      if (lj_char_isdigit(uchar(*(p+1)))) {  /* capture results (%0-%9)? */
-	s = match_capture(ms, s, uchar(*(p+1)));
-	if (s == NULL) break;
-	p+=2;
-	goto init;  /* else s = match(ms, s, p+2) */
-      }
-      goto dflt;  /* case default */
-    }
-    break;
-  case '\0':  /* end of pattern */
-    break;  /* match succeeded */
-  case '$':
-    /* is the `$' the last char in pattern? */
-    if (*(p+1) != '\0') goto dflt;
-    if (s != ms->src_end) s = NULL;  /* check end of string */
-    break;
-  default: dflt: {  /* it is a pattern item */
-    const char *ep = classend(ms, p);  /* points to what is next */
-    int m = s<ms->src_end && singlematch(uchar(*s), p, ep);
-    switch (*ep) {
-    case '?': {  /* optional */
-      const char *res;
-      if (m && ((res=match(ms, s+1, ep+1)) != NULL)) {
-	s = res;
-	break;
-      }
-      p=ep+1;
-      goto init;  /* else s = match(ms, s, ep+1); */
-      }
-    case '*':  /* 0 or more repetitions */
-      s = max_expand(ms, s, p, ep);
-      break;
-    case '+':  /* 1 or more repetitions */
-      s = (m ? max_expand(ms, s+1, p, ep) : NULL);
-      break;
-    case '-':  /* 0 or more repetitions (minimum) */
-      s = min_expand(ms, s, p, ep);
-      break;
-    default:
-      if (m) { s++; p=ep; goto init; }  /* else s = match(ms, s+1, ep); */
-      s = NULL;
-      break;
-    }
-    break;
-    }
-  }
-  ms->depth--;
-  return s;
-}
-
 static void push_onecapture(MatchState *ms, int i, const char *s, const char *e)
 {
   if (i >= ms->level) {
@@ -475,61 +196,51 @@ static int str_find_aux(lua_State *L, int find)
   } else {  /* Search for pattern. */
     MatchState ms;
     const char *pstr = strdata(p);
-    const char *sstr = strdata(s) + st;
+    const char *q, *e;
     int anchor = 0;
     if (*pstr == '^') { pstr++; anchor = 1; }
-    ms.L = L;
-    ms.src_init = strdata(s);
-    ms.src_end = strdata(s) + s->len;
-    do {  /* Loop through string and try to match the pattern. */
-      const char *q;
-      ms.level = ms.depth = 0;
-      q = match(&ms, sstr, pstr);
-      if (q) {
-	if (find) {
-	  setintV(L->top++, (int32_t)(sstr-(strdata(s)-1)));
-	  setintV(L->top++, (int32_t)(q-strdata(s)));
-	  return push_captures(&ms, NULL, NULL) + 2;
-	} else {
-	  return push_captures(&ms, sstr, q);
-	}
+    lj_strmatch_init(&ms, L, strdata(s), s->len, p);
+    q = lj_strmatch_find(&ms, strdata(s) + st, pstr, anchor, &e);
+    if (q) {
+      if (find) {
+	setintV(L->top++, (int32_t)(q-(strdata(s)-1)));
+	setintV(L->top++, (int32_t)(e-strdata(s)));
+	return push_captures(&ms, NULL, NULL) + 2;
+      } else {
+	return push_captures(&ms, q, e);
       }
-    } while (sstr++ < ms.src_end && !anchor);
+    }
   }
   setnilV(L->top-1);  /* Not found. */
   return 1;
 }
 
-LJLIB_CF(string_find)		LJLIB_REC(.)
+LJLIB_CF(string_find)		LJLIB_REC(string_find 1)
 {
   return str_find_aux(L, 1);
 }
 
-LJLIB_CF(string_match)
+LJLIB_CF(string_match)		LJLIB_REC(string_find 0)
 {
   return str_find_aux(L, 0);
 }
 
-LJLIB_NOREG LJLIB_CF(string_gmatch_aux)
+LJLIB_NOREG LJLIB_CF(string_gmatch_aux)	LJLIB_REC(.)
 {
-  const char *p = strVdata(lj_lib_upvalue(L, 2));
+  GCstr *pat = strV(lj_lib_upvalue(L, 2));
+  const char *p = strdata(pat);
   GCstr *str = strV(lj_lib_upvalue(L, 1));
   const char *s = strdata(str);
   TValue *tvpos = lj_lib_upvalue(L, 3);
   const char *src = s + tvpos->u32.lo;
   MatchState ms;
-  ms.L = L;
-  ms.src_init = s;
-  ms.src_end = s + str->len;
-  for (; src <= ms.src_end; src++) {
-    const char *e;
-    ms.level = ms.depth = 0;
-    if ((e = match(&ms, src, p)) != NULL) {
-      int32_t pos = (int32_t)(e - s);
-      if (e == src) pos++;  /* Ensure progress for empty match. */
-      tvpos->u32.lo = (uint32_t)pos;
-      return push_captures(&ms, src, e);
-    }
+  const char *e;
+  lj_strmatch_init(&ms, L, s, str->len, pat);
+  if (src <= ms.src_end && (src = lj_strmatch_find(&ms, src, p, 0, &e))) {
+    int32_t pos = (int32_t)(e - s);
+    if (e == src) pos++;  /* Ensure progress for empty match. */
+    tvpos->u32.lo = (uint32_t)pos;
+    return push_captures(&ms, src, e);
   }
   return 0;  /* not found */
 }
@@ -597,11 +308,12 @@ static void add_value(MatchState *ms, luaL_Buffer *b,
   luaL_addvalue(b);  /* add result to accumulator */
 }
 
-LJLIB_CF(string_gsub)
+LJLIB_CF(string_gsub)		LJLIB_REC(.)
 {
   size_t srcl;
   const char *src = luaL_checklstring(L, 1, &srcl);
-  const char *p = luaL_checkstring(L, 2);
+  GCstr *pat = lj_lib_checkstr(L, 2);
+  const char *p = strdata(pat);
   int  tr = lua_type(L, 3);
   int max_s = luaL_optint(L, 4, (int)(srcl+1));
   int anchor = (*p == '^') ? (p++, 1) : 0;
@@ -612,16 +324,14 @@ LJLIB_CF(string_gsub)
 	tr == LUA_TFUNCTION || tr == LUA_TTABLE))
     lj_err_arg(L, 3, LJ_ERR_NOSFT);
   luaL_buffinit(L, &b);
-  ms.L = L;
-  ms.src_init = src;
-  ms.src_end = src+srcl;
+  lj_strmatch_init(&ms, L, src, (MSize)srcl, pat);
   while (n < max_s) {
-    const char *e;
-    ms.level = ms.depth = 0;
-    e = match(&ms, src, p);
+    const char *e = lj_strmatch_match(&ms, src, p);
     if (e) {
       n++;
       add_value(&ms, &b, src, e);
+      if (tr == LUA_TFUNCTION || tr == LUA_TTABLE)  /* Cache may change. */
+	ms.prog = lj_strmatch_prog(L, pat);
     }
     if (e && e>src) /* non empty match? */
       src = e;  /* skip it */
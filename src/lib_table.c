@@ -18,6 +18,8 @@
 #include "lj_err.h"
 #include "lj_buf.h"
 #include "lj_tab.h"
+#include "lj_meta.h"
+#include "lj_trace.h"
 #include "lj_ff.h"
 #include "lj_lib.h"
 
@@ -84,17 +86,11 @@ LJLIB_CF(table_insert)		LJLIB_REC(.)
   if (nargs != 2*sizeof(TValue)) {
     if (nargs != 3*sizeof(TValue))
       lj_err_caller(L, LJ_ERR_TABINS);
+    n = lj_lib_checkint(L, 2);
+    if ((int64_t)i - n > 0x7fffffff)
+      lj_err_arg(L, 2, LJ_ERR_TABMOVE);
     /* NOBARRIER: This just moves existing elements around. */
-    for (n = lj_lib_checkint(L, 2); i > n; i--) {
-      /* The set may invalidate the get pointer, so need to do it first! */
-      TValue *dst = lj_tab_setint(L, t, i);
-      cTValue *src = lj_tab_getint(t, i-1);
-      if (src) {
-	copyTV(L, dst, src);
-      } else {
-	setnilV(dst);
-      }
-    }
+    if (i > n) lj_tab_move(L, t, n+1, t, n, i-n);
     i = n;
   }
   {
@@ -105,49 +101,44 @@ LJLIB_CF(table_insert)		LJLIB_REC(.)
   return 0;
 }
 
-LJLIB_LUA(table_remove) /*
-  function(t, pos)
-    CHECK_tab(t)
-    local len = #t
-    if pos == nil then
-      if len ~= 0 then
-	local old = t[len]
-	t[len] = nil
-	return old
-      end
-    else
-      CHECK_int(pos)
-      if pos >= 1 and pos <= len then
-	local old = t[pos]
-	for i=pos+1,len do
-	  t[i-1] = t[i]
-	end
-	t[len] = nil
-	return old
-      end
-    end
-  end
-*/
+LJLIB_CF(table_remove)		LJLIB_REC(.)
+{
+  GCtab *t = lj_lib_checktab(L, 1);
+  int32_t e = (int32_t)lj_tab_len(t);
+  int32_t pos = lj_lib_optint(L, 2, e);
+  if (L->base+1 < L->top && !tvisnil(L->base+1)) {
+    if (!(1 <= pos && pos <= e))  /* Nothing to remove? */
+      return 0;
+  } else if (e == 0) {
+    return 0;
+  }
+  lua_rawgeti(L, 1, pos);  /* Get previous value. */
+  /* NOBARRIER: This just moves existing elements around. */
+  lj_tab_move(L, t, pos, t, pos+1, e-pos);
+  setnilV(lj_tab_setint(L, t, e));  /* Remove (last) value. */
+  return 1;  /* Return previous value. */
+}
 
-LJLIB_LUA(table_move) /*
-  function(a1, f, e, t, a2)
-    CHECK_tab(a1)
-    CHECK_int(f)
-    CHECK_int(e)
-    CHECK_int(t)
-    if a2 == nil then a2 = a1 end
-    CHECK_tab(a2)
-    if e >= f then
-      local d = t - f
-      if t > e or t <= f or a2 ~= a1 then
-	for i=f,e do a2[i+d] = a1[i] end
-      else
-	for i=e,f,-1 do a2[i+d] = a1[i] end
-      end
-    end
-    return a2
-  end
-*/
+LJLIB_CF(table_move)		LJLIB_REC(.)
+{
+  GCtab *a1 = lj_lib_checktab(L, 1);
+  int32_t f = lj_lib_checkint(L, 2);
+  int32_t e = lj_lib_checkint(L, 3);
+  int32_t t = lj_lib_checkint(L, 4);
+  GCtab *a2 = a1;
+  if (L->base+4 < L->top && !tvisnil(L->base+4))
+    a2 = lj_lib_checktab(L, 5);
+  if (e >= f) {
+    int64_t n = (int64_t)e - f + 1;
+    if (n > 0x7fffffff)
+      lj_err_arg(L, 3, LJ_ERR_TABMOVE);
+    if ((int64_t)t + n - 1 > 0x7fffffff)
+      lj_err_arg(L, 4, LJ_ERR_TABWRAP);
+    lj_tab_move(L, a2, t, a1, f, (int32_t)n);
+  }
+  settabV(L, L->top++, a2);
+  return 1;
+}
 
 LJLIB_CF(table_concat)		LJLIB_REC(.)
 {
@@ -171,100 +162,79 @@ LJLIB_CF(table_concat)		LJLIB_REC(.)
 
 /* ------------------------------------------------------------------------ */
 
-static void set2(lua_State *L, int i, int j)
-{
-  lua_rawseti(L, 1, i);
-  lua_rawseti(L, 1, j);
-}
-
-static int sort_comp(lua_State *L, int a, int b)
-{
-  if (!lua_isnil(L, 2)) {  /* function? */
-    int res;
-    lua_pushvalue(L, 2);
-    lua_pushvalue(L, a-1);  /* -1 to compensate function */
-    lua_pushvalue(L, b-2);  /* -2 to compensate function and `a' */
-    lua_call(L, 2, 1);
-    res = lua_toboolean(L, -1);
-    lua_pop(L, 1);
-    return res;
-  } else {  /* a < b? */
-    return lua_lessthan(L, a, b);
-  }
-}
-
-static void auxsort(lua_State *L, int l, int u)
-{
-  while (l < u) {  /* for tail recursion */
-    int i, j;
-    /* sort elements a[l], a[(l+u)/2] and a[u] */
-    lua_rawgeti(L, 1, l);
-    lua_rawgeti(L, 1, u);
-    if (sort_comp(L, -1, -2))  /* a[u] < a[l]? */
-      set2(L, l, u);  /* swap a[l] - a[u] */
-    else
-      lua_pop(L, 2);
-    if (u-l == 1) break;  /* only 2 elements */
-    i = (l+u)/2;
-    lua_rawgeti(L, 1, i);
-    lua_rawgeti(L, 1, l);
-    if (sort_comp(L, -2, -1)) {  /* a[i]<a[l]? */
-      set2(L, i, l);
-    } else {
-      lua_pop(L, 1);  /* remove a[l] */
-      lua_rawgeti(L, 1, u);
-      if (sort_comp(L, -1, -2))  /* a[u]<a[i]? */
-	set2(L, i, u);
-      else
-	lua_pop(L, 2);
-    }
-    if (u-l == 2) break;  /* only 3 elements */
-    lua_rawgeti(L, 1, i);  /* Pivot */
-    lua_pushvalue(L, -1);
-    lua_rawgeti(L, 1, u-1);
-    set2(L, i, u-1);
-    /* a[l] <= P == a[u-1] <= a[u], only need to sort from l+1 to u-2 */
-    i = l; j = u-1;
-    for (;;) {  /* invariant: a[l..i] <= P <= a[j..u] */
-      /* repeat ++i until a[i] >= P */
-      while (lua_rawgeti(L, 1, ++i), sort_comp(L, -1, -2)) {
-	if (i>=u) lj_err_caller(L, LJ_ERR_TABSORT);
-	lua_pop(L, 1);  /* remove a[i] */
-      }
-      /* repeat --j until a[j] <= P */
-      while (lua_rawgeti(L, 1, --j), sort_comp(L, -3, -1)) {
-	if (j<=l) lj_err_caller(L, LJ_ERR_TABSORT);
-	lua_pop(L, 1);  /* remove a[j] */
-      }
-      if (j<i) {
-	lua_pop(L, 3);  /* pop pivot, a[i], a[j] */
-	break;
-      }
-      set2(L, i, j);
-    }
-    lua_rawgeti(L, 1, u-1);
-    lua_rawgeti(L, 1, i);
-    set2(L, u-1, i);  /* swap pivot (a[u-1]) with a[i] */
-    /* a[l..i-1] <= a[i] == P <= a[i+1..u] */
-    /* adjust so that smaller half is in [j..i] and larger one in [l..u] */
-    if (i-l < u-i) {
-      j=l; i=i-1; l=i+2;
-    } else {
-      j=i+1; i=u; u=j-2;
-    }
-    auxsort(L, j, i);  /* call recursively the smaller one */
-  }  /* repeat the routine for the larger one */
-}
+LJLIB_LUA(table_sort) /*
+  local sorterr
+  return function(...)
+    local t, f = ...
+    CHECK_tab(t)
+    if f ~= nil then CHECK_func(f) end
+    local lo, up, sp, stack = 1, #t, 0, nil
+    while true do
+      while lo < up do
+	local a, b, c = t[lo], t[up]
+	if f then c = f(b, a) else c = b < a end
+	if c then t[lo] = b; t[up] = a end
+	if up - lo == 1 then break end
+	-- Raw accesses to t need an integer key, even with dual-number mode.
+	-- So halve without a division, which would give a double.
+	local d, i, p, h = up - lo, lo, 2, 1
+	while p <= d do
+	  if d % (p + p) >= p then i = i + h end
+	  h = p; p = p + p
+	end
+	a, b = t[i], t[lo]
+	if f then c = f(a, b) else c = a < b end
+	if c then
+	  t[i] = b; t[lo] = a
+	else
+	  b = t[up]
+	  if f then c = f(b, a) else c = b < a end
+	  if c then t[i] = b; t[up] = a end
+	end
+	if up - lo == 2 then break end
+	local j
+	p, j = t[i], up - 1
+	t[i] = t[j]; t[j] = p
+	i = lo
+	while true do
+	  repeat
+	    i = i + 1; a = t[i]
+	    if f then c = f(a, p) else c = a < p end
+	  until not c or i >= up
+	  if c then sorterr() end
+	  repeat
+	    j = j - 1; b = t[j]
+	    if f then c = f(p, b) else c = p < b end
+	  until not c or j <= lo
+	  if c then sorterr() end
+	  if j < i then break end
+	  t[i] = b; t[j] = a
+	end
+	t[up-1] = t[i]; t[i] = p
+	if i - lo < up - i then
+	  j = lo; i = i - 1; lo = i + 2
+	else
+	  j = i + 1; i = up; up = j - 2
+	end
+	if j < i then
+	  if not stack then stack = {} end
+	  stack[sp+1] = lo; stack[sp+2] = up; sp = sp + 2
+	  lo = j; up = i
+	end
+      end
+      if sp == 0 then return end
+      lo = stack[sp-1]; up = stack[sp]; sp = sp - 2
+    end
+  end
+*/
 
-LJLIB_CF(table_sort)
+/* Upvalue of table.sort. Reports the error at the caller of table.sort. */
+static int table_sorterr(lua_State *L)
 {
-  GCtab *t = lj_lib_checktab(L, 1);
-  int32_t n = (int32_t)lj_tab_len(t);
-  lua_settop(L, 2);
-  if (!tvisnil(L->base+1))
-    lj_lib_checkfunc(L, 2);
-  auxsort(L, 1, n);
-  return 0;
+  luaL_where(L, 2);
+  lua_pushstring(L, err2msg(LJ_ERR_TABSORT));
+  lua_concat(L, 2);
+  return lua_error(L);
 }
 
 #if LJ_52
@@ -295,10 +265,35 @@ LJLIB_NOREG LJLIB_CF(table_new)		LJLIB_REC(.)
 
 LJLIB_NOREG LJLIB_CF(table_clear)	LJLIB_REC(.)
 {
-  lj_tab_clear(lj_lib_checktab(L, 1));
+  GCtab *t = lj_lib_checktab(L, 1);
+  if (tabisfrozen(t))
+    lj_err_msg(L, LJ_ERR_TABFROZ);
+  lj_tab_clear(t);
   return 0;
 }
 
+LJLIB_NOREG LJLIB_CF(table_freeze)
+{
+  GCtab *t = lj_lib_checktab(L, 1);
+  GCtab *mt = tabref(t->metatable);
+  cTValue *mode = mt ? lj_meta_fastg(G(L), mt, MM_mode) : NULL;
+  /* Loads from frozen tables are constant, but the GC clears weak slots. */
+  if (mode && tvisstr(mode) && (strchr(strVdata(mode), 'k') ||
+				strchr(strVdata(mode), 'v')))
+    lj_err_caller(L, LJ_ERR_TABFRWK);
+#if LJ_HASJIT
+  if (!L2J(L)->frozentab) {
+    /* Existing traces have no frozen checks for their stores. */
+    if (lj_trace_flushall(L, FLUSHREASON_FREEZE_TABLE))
+      lj_err_caller(L, LJ_ERR_NOGCMM);
+    L2J(L)->frozentab = 1;
+  }
+#endif
+  t->marked |= LJ_GC_FROZEN;
+  L->top = L->base+1;
+  return 1;
+}
+
 static int luaopen_table_new(lua_State *L)
 {
   return lj_lib_postreg(L, lj_cf_table_new, FF_table_new, "new");
@@ -309,6 +304,11 @@ static int luaopen_table_clear(lua_State *L)
   return lj_lib_postreg(L, lj_cf_table_clear, FF_table_clear, "clear");
 }
 
+static int luaopen_table_freeze(lua_State *L)
+{
+  return lj_lib_postreg(L, lj_cf_table_freeze, FF_table_freeze, "freeze");
+}
+
 /* ------------------------------------------------------------------------ */
 
 #include "lj_libdef.h"
@@ -316,12 +316,18 @@ static int luaopen_table_clear(lua_State *L)
 LUALIB_API int luaopen_table(lua_State *L)
 {
   LJ_LIB_REG(L, LUA_TABLIBNAME, table);
+  lua_getfield(L, -1, "sort");
+  lua_pushcfunction(L, table_sorterr);
+  lua_setupvalue(L, -2, 1);
+  lua_pop(L, 1);
 #if LJ_52
   lua_getglobal(L, "unpack");
   lua_setfield(L, -2, "unpack");
 #endif
   lj_lib_prereg(L, LUA_TABLIBNAME ".new", luaopen_table_new, tabV(L->top-1));
   lj_lib_prereg(L, LUA_TABLIBNAME ".clear", luaopen_table_clear, tabV(L->top-1));
+  lj_lib_prereg(L, LUA_TABLIBNAME ".freeze", luaopen_table_freeze,
+		tabV(L->top-1));
   return 1;
 }
 
@@ -205,6 +205,16 @@ static int CALL_MUNMAP(void *ptr, size_t size)
   return 0;
 }
 
+/* Let the OS discard the pages of a free memory range. */
+static int CALL_DECOMMIT(void *ptr, size_t size)
+{
+  DWORD olderr = GetLastError();
+  void *p = VirtualAlloc(ptr, size, MEM_RESET, PAGE_READWRITE);
+  SetLastError(olderr);
+  return p ? 0 : -1;
+}
+#define LJ_ALLOC_DECOMMIT	1
+
 #elif LJ_ALLOC_MMAP
 
 #define MMAP_PROT		(PROT_READ|PROT_WRITE)
@@ -365,6 +375,18 @@ static int CALL_MUNMAP(void *ptr, size_t size)
   return ret;
 }
 
+#ifdef MADV_DONTNEED
+/* Let the OS discard the pages of a free memory range. */
+static int CALL_DECOMMIT(void *ptr, size_t size)
+{
+  int olderr = errno;
+  int ret = madvise(ptr, size, MADV_DONTNEED);
+  errno = olderr;
+  return ret;
+}
+#define LJ_ALLOC_DECOMMIT	1
+#endif
+
 #if LJ_ALLOC_MREMAP
 /* Need to define _GNU_SOURCE to get the mremap prototype. */
 static void *CALL_MREMAP_(void *ptr, size_t osz, size_t nsz, int flags)
@@ -492,6 +514,10 @@ typedef unsigned int flag_t;           /* The type of various bit flag sets */
 #define is_direct(p)\
   (!((p)->head & PINUSE_BIT) && ((p)->prev_foot & IS_DIRECT_BIT))
 
+/* Size of the mapping holding a direct chunk */
+#define direct_mmsize(p)\
+  (chunksize(p) + ((p)->prev_foot & ~IS_DIRECT_BIT) + DIRECT_FOOT_PAD)
+
 /* Get the internal overhead associated with chunk p */
 #define overhead_for(p)\
  (is_direct(p)? DIRECT_CHUNK_OVERHEAD : CHUNK_OVERHEAD)
@@ -549,6 +575,9 @@ struct malloc_state {
   mchunkptr  top;
   size_t     trim_check;
   size_t     release_checks;
+  size_t     footprint;		/* Memory mapped from the OS. */
+  size_t     decommitted;	/* Free memory discarded by the last decommit. */
+  size_t     decommit_skips;	/* Decommit requests skipped since the last. */
   mchunkptr  smallbins[(NSMALLBINS+1)*2];
   tbinptr    treebins[NTREEBINS];
   msegment   seg;
@@ -999,8 +1028,10 @@ static void *alloc_sys(mstate m, size_t nb)
   /* Directly map large chunks */
   if (LJ_UNLIKELY(nb >= DEFAULT_MMAP_THRESHOLD)) {
     void *mem = direct_alloc(nb);
-    if (mem != 0)
+    if (mem != 0) {
+      m->footprint += direct_mmsize(mem2chunk(mem));
       return mem;
+    }
   }
 
   {
@@ -1017,6 +1048,7 @@ static void *alloc_sys(mstate m, size_t nb)
 
   if (tbase != CMFAIL) {
     msegmentptr sp = &m->seg;
+    m->footprint += tsize;
     /* Try to merge with an existing segment */
     while (sp != 0 && tbase != sp->base + sp->size)
       sp = sp->next;
@@ -1078,6 +1110,7 @@ static size_t release_unused_segments(mstate m)
 	}
 	if (CALL_MUNMAP(base, size) == 0) {
 	  released += size;
+	  m->footprint -= size;
 	  /* unlink obsoleted record */
 	  sp = pred;
 	  sp->next = next;
@@ -1120,6 +1153,7 @@ static int alloc_trim(mstate m, size_t pad)
 
       if (released != 0) {
 	sp->size -= released;
+	m->footprint -= released;
 	init_top(m, m->top, m->topsize - released);
       }
     }
@@ -1135,6 +1169,101 @@ static int alloc_trim(mstate m, size_t pad)
   return (released != 0)? 1 : 0;
 }
 
+/* ------------------------- decommitting free memory --------------------- */
+
+#if LJ_ALLOC_DECOMMIT
+
+/*
+** The whole pages inside a free chunk are handed back to the OS, but stay
+** mapped. The chunk header and the partial pages at both ends are kept.
+** The chunk size is stamped right after the header, so a chunk that is
+** still free at the next pass doesn't need another syscall.
+*/
+#define decommit_stamp(p)	(*(size_t *)((char *)(p) + sizeof(tchunk)))
+
+/* Smaller free chunks are likely to be reused soon, so they are kept. */
+#define DECOMMIT_THRESHOLD	((size_t)64U * (size_t)1024U)
+
+/* Decommit when a quarter of the committed memory is free, but at least
+** every DECOMMIT_RATE requests, since the committed size is an estimate.
+*/
+#define DECOMMIT_RATE		16
+
+/* Clear the stamp of a chunk which is handed out again. */
+#define decommit_reset(mem, n) \
+  { if ((n) >= LJ_PAGESIZE) decommit_stamp(mem2chunk(mem)) = 0; }
+
+static size_t decommit_chunk(mchunkptr p, size_t psize)
+{
+  char *start = (char *)page_align((size_t)p + sizeof(tchunk) + SIZE_T_SIZE);
+  char *end = (char *)(((size_t)p + psize) & ~(LJ_PAGESIZE - SIZE_T_ONE));
+  if (psize < DECOMMIT_THRESHOLD || end <= start)
+    return 0;
+  if (decommit_stamp(p) != psize) {
+    if (CALL_DECOMMIT(start, (size_t)(end - start)) != 0)
+      return 0;
+    decommit_stamp(p) = psize;
+  }
+  return (size_t)(end - start);
+}
+
+static size_t decommit_tree(tchunkptr t)
+{
+  size_t released = 0;
+  while (t != 0) {
+    tchunkptr u = t;
+    do {  /* Chunks of the same size hang off the tree node. */
+      released += decommit_chunk((mchunkptr)u, chunksize(u));
+      u = u->fd;
+    } while (u != t);
+    released += decommit_tree(t->child[1]);
+    t = t->child[0];
+  }
+  return released;
+}
+
+#else
+#define decommit_reset(mem, n)	UNUSED(mem)
+#endif
+
+/* Release unused segments and discard the pages of large free chunks.
+** The top chunk is already trimmed on free and the dv chunk is the next
+** to be split, so both are left alone.
+*/
+void lj_alloc_decommit(void *msp, size_t used)
+{
+  mstate m = (mstate)msp;
+  size_t released = 0;
+  size_t committed = m->footprint > m->decommitted ?
+		     m->footprint - m->decommitted : 0;
+  if (++m->decommit_skips < DECOMMIT_RATE &&
+      (committed <= used || committed - used < (committed >> 2)))
+    return;  /* Not enough free memory to be worth the page faults. */
+  m->decommit_skips = 0;
+  release_unused_segments(m);
+#if LJ_ALLOC_DECOMMIT
+  {
+    bindex_t i;
+    compute_tree_index(DECOMMIT_THRESHOLD, i);
+    for (; i < NTREEBINS; i++)
+      released += decommit_tree(*treebin_at(m, i));
+  }
+#else
+  UNUSED(released);
+#endif
+  m->decommitted = released;
+}
+
+/* Get the mapped and committed memory. The latter is an estimate, since
+** the pages discarded by the last decommit may have been reused since.
+*/
+void lj_alloc_stats(void *msp, size_t *mapped, size_t *committed)
+{
+  mstate m = (mstate)msp;
+  *mapped = m->footprint;
+  *committed = m->footprint > m->decommitted ? m->footprint - m->decommitted : 0;
+}
+
 /* ---------------------------- malloc support --------------------------- */
 
 /* allocate a large request from the best fitting chunk in a treebin */
@@ -1250,6 +1379,7 @@ void *lj_alloc_create(void)
     m->seg.base = tbase;
     m->seg.size = tsize;
     m->release_checks = MAX_RELEASE_CHECK_RATE;
+    m->footprint = tsize;
     init_bins(m);
     mn = next_chunk(mem2chunk(m));
     init_top(m, mn, (size_t)((tbase + tsize) - (char *)mn) - TOP_FOOT_SIZE);
@@ -1365,7 +1495,8 @@ static LJ_NOINLINE void *lj_alloc_free(void *msp, void *ptr)
       if ((prevsize & IS_DIRECT_BIT) != 0) {
 	prevsize &= ~IS_DIRECT_BIT;
 	psize += prevsize + DIRECT_FOOT_PAD;
-	CALL_MUNMAP((char *)p - prevsize, psize);
+	if (CALL_MUNMAP((char *)p - prevsize, psize) == 0)
+	  fm->footprint -= psize;
 	return NULL;
       } else {
 	mchunkptr prev = chunk_minus_offset(p, prevsize);
@@ -1438,7 +1569,10 @@ static LJ_NOINLINE void *lj_alloc_realloc(void *msp, void *ptr, size_t nsize)
 
     /* Try to either shrink or extend into top. Else malloc-copy-free */
     if (is_direct(oldp)) {
+      size_t oldmmsize = direct_mmsize(oldp);
       newp = direct_resize(oldp, nb);  /* this may return NULL. */
+      if (newp != 0)
+	m->footprint += direct_mmsize(newp) - oldmmsize;
     } else if (oldsize >= nb) { /* already big enough */
       size_t rsize = oldsize - nb;
       newp = oldp;
@@ -1466,6 +1600,7 @@ static LJ_NOINLINE void *lj_alloc_realloc(void *msp, void *ptr, size_t nsize)
       void *newmem = lj_alloc_malloc(m, nsize);
       if (newmem != 0) {
 	size_t oc = oldsize - overhead_for(oldp);
+	decommit_reset(newmem, nsize);
 	memcpy(newmem, ptr, oc < nsize ? oc : nsize);
 	lj_alloc_free(m, ptr);
       }
@@ -1480,7 +1615,10 @@ void *lj_alloc_f(void *msp, void *ptr, size_t osize, size_t nsize)
   if (nsize == 0) {
     return lj_alloc_free(msp, ptr);
   } else if (ptr == NULL) {
-    return lj_alloc_malloc(msp, nsize);
+    void *mem = lj_alloc_malloc(msp, nsize);
+    if (mem != NULL)
+      decommit_reset(mem, nsize);
+    return mem;
   } else {
     return lj_alloc_realloc(msp, ptr, nsize);
   }
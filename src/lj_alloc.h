@@ -12,6 +12,8 @@
 LJ_FUNC void *lj_alloc_create(void);
 LJ_FUNC void lj_alloc_destroy(void *msp);
 LJ_FUNC void *lj_alloc_f(void *msp, void *ptr, size_t osize, size_t nsize);
+LJ_FUNC void lj_alloc_decommit(void *msp, size_t used);
+LJ_FUNC void lj_alloc_stats(void *msp, size_t *mapped, size_t *committed);
 #endif
 
 #endif
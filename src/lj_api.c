@@ -10,6 +10,7 @@
 #define LUA_CORE
 
 #include "lj_obj.h"
+#include "luajit.h"
 #include "lj_gc.h"
 #include "lj_err.h"
 #include "lj_debug.h"
@@ -25,6 +26,7 @@
 #include "lj_vm.h"
 #include "lj_strscan.h"
 #include "lj_strfmt.h"
+#include "lj_alloc.h"
 
 /* -- Common helper functions --------------------------------------------- */
 
@@ -1021,6 +1023,8 @@ LUA_API int lua_setmetatable(lua_State *L, int idx)
   }
   g = G(L);
   if (tvistab(o)) {
+    if (tabisfrozen(tabV(o)))
+      lj_err_msg(L, LJ_ERR_TABFROZ);
     setgcref(tabV(o)->metatable, obj2gco(mt));
     if (mt)
       lj_gc_objbarriert(L, tabV(o), mt);
@@ -1276,6 +1280,47 @@ LUA_API int lua_gc(lua_State *L, int what, int data)
   return res;
 }
 
+LJ_STATIC_ASSERT(LUAJIT_MEM__MAX == ~LJ_TUDATA-~LJ_TSTR+1);
+
+/* Set memory limit in bytes (0 = no limit). Returns the previous limit. */
+LUA_API size_t luaJIT_setmemlimit(lua_State *L, size_t limit)
+{
+  global_State *g = G(L);
+  size_t olimit = g->gc.limit == LJ_MAX_MEM ? 0 : (size_t)g->gc.limit;
+  g->gc.limit = (limit == 0 || limit > (size_t)LJ_MAX_MEM) ? LJ_MAX_MEM :
+		(GCSize)limit;
+  if (g->gc.threshold > g->gc.limit && g->gc.threshold != LJ_MAX_MEM)
+    g->gc.threshold = g->gc.total;  /* Let the GC catch up. */
+  return olimit;
+}
+
+/* Get total memory in use and optionally the memory per object type. */
+LUA_API size_t luaJIT_memstats(lua_State *L, size_t *typesize)
+{
+  global_State *g = G(L);
+  if (typesize) {
+    int i;
+    for (i = 0; i < LUAJIT_MEM__MAX; i++)
+      typesize[i] = (size_t)g->gc.typesize[i];
+  }
+  return (size_t)g->gc.total;
+}
+
+LUA_API int luaJIT_allocstats(lua_State *L, size_t *mapped, size_t *committed)
+{
+#ifndef LUAJIT_USE_SYSMALLOC
+  global_State *g = G(L);
+  if (g->allocf == lj_alloc_f) {
+    lj_alloc_stats(g->allocd, mapped, committed);
+    return 1;
+  }
+#else
+  UNUSED(L);
+#endif
+  *mapped = *committed = 0;
+  return 0;
+}
+
 LUA_API lua_Alloc lua_getallocf(lua_State *L, void **ud)
 {
   global_State *g = G(L);
@@ -505,6 +505,15 @@
 #define LJ_HASFFI		1
 #endif
 
+/* Packed SIMD kernels for vectorized loops need the x86 intrinsics. */
+#if LJ_HASJIT && LJ_HASFFI && LJ_TARGET_X86ORX64 && defined(__GNUC__) && \
+    (defined(__clang__) || __GNUC__ > 4 || \
+     (__GNUC__ == 4 && __GNUC_MINOR__ >= 9))
+#define LJ_HASVEC		1
+#else
+#define LJ_HASVEC		0
+#endif
+
 #if defined(LUAJIT_DISABLE_PROFILE)
 #define LJ_HASPROFILE		0
 #elif LJ_TARGET_POSIX
@@ -12,6 +12,7 @@
 
 #include "lj_gc.h"
 #include "lj_str.h"
+#include "lj_buf.h"
 #include "lj_tab.h"
 #include "lj_frame.h"
 #if LJ_HASFFI
@@ -36,6 +37,9 @@
 
 /* -- Assembler state and common macros ----------------------------------- */
 
+/* Max. number of spill slots available for sharing. */
+#define ASM_MAXFREESPILL	16
+
 /* Assembler state. */
 typedef struct ASMState {
   RegCost cost[RID_MAX];  /* Reference and blended allocation cost for regs. */
@@ -63,6 +67,8 @@ typedef struct ASMState {
 
   int32_t evenspill;	/* Next even spill slot. */
   int32_t oddspill;	/* Next odd spill slot (or 0). */
+  IRRef1 *lastuse;	/* Last use of instructions (or 0), from REF_FIRST. */
+  MSize nfreespill;	/* Number of spill slots available for sharing. */
 
   IRRef curins;		/* Reference of current instruction. */
   IRRef stopins;	/* Stop assembly before hitting this instruction. */
@@ -89,11 +95,13 @@ typedef struct ASMState {
   MCode *invmcp;	/* Points to invertible loop branch (or NULL). */
   MCode *flagmcp;	/* Pending opportunity to merge flag setting ins. */
   MCode *realign;	/* Realign loop if not NULL. */
+  int realignfar;	/* Realigned loop keeps its near loop branch. */
 
 #ifdef RID_NUM_KREF
   intptr_t krefk[RID_NUM_KREF];
 #endif
   IRRef1 phireg[RID_MAX];  /* PHI register references. */
+  uint32_t freespill[ASM_MAXFREESPILL];  /* Spill slots for sharing. */
   uint16_t parentmap[LJ_MAX_JSLOTS];  /* Parent instruction to RegSP map. */
 } ASMState;
 
@@ -367,25 +375,106 @@ static Reg ra_rematk(ASMState *as, IRRef ref)
   return r;
 }
 
+/* -- Spill slot sharing -------------------------------------------------- */
+
+/*
+** Instructions with disjoint live ranges share their spill slots.
+**
+** Due to the backwards assembly, the first time an instruction gets a
+** register or a spill slot marks its last use. This covers fused operands
+** and snapshot references, too. Once the definition of an instruction has
+** been assembled, its spill slot can be reused by any instruction whose
+** last use lies before that definition.
+**
+** The live ranges of PHIs and of invariants used inside the loop wrap
+** around the loop, so these never share. Neither do 32 bit targets, where
+** the two halves of a HIOP pair may be assembled out of order.
+*/
+
+#define FREESPILL(slot, is64, ref)	((slot) + ((is64) << 8) + ((ref) << 16))
+#define freespill_slot(fs)	((int32_t)((fs) & 255))
+#define freespill_is64(fs)	(((fs) >> 8) & 1)
+#define freespill_ref(fs)	((IRRef)((fs) >> 16))
+
+/* Record the last use of an instruction. */
+static LJ_AINLINE void ra_lastuse(ASMState *as, IRRef ref)
+{
+  if (LJ_64 && ref >= REF_FIRST && !as->lastuse[ref - REF_FIRST])
+    as->lastuse[ref - REF_FIRST] = (IRRef1)as->curins;
+}
+
+/* Check whether the spill slot of an instruction may be shared. */
+static int ra_canshare(ASMState *as, IRRef ref)
+{
+  IRIns *ir = IR(ref);
+  return !irt_isphi(ir->t) && ir->o != IR_PHI &&
+	 !(ref < as->loopref && as->lastuse[ref - REF_FIRST] >= as->loopref);
+}
+
+/* Make the spill slot of a defined instruction available for sharing. */
+static void ra_freespill(ASMState *as, IRRef ref)
+{
+  IRIns *ir = IR(ref);
+  /* Sunk instructions keep the delta to their allocation in ir->s. */
+  if (ir->r == RID_SINK || ir->r == RID_SUNK)
+    return;
+  if (ra_hasspill(ir->s) && as->nfreespill < ASM_MAXFREESPILL &&
+      ra_canshare(as, ref)) {
+    lua_assert(ir->s < as->evenspill);
+    as->freespill[as->nfreespill++] = FREESPILL(ir->s, irt_is64(ir->t), ref);
+  }
+}
+
+/* Get a shared spill slot. Picks the one with the closest definition. */
+static int32_t ra_sharespill(ASMState *as, IRIns *ir)
+{
+  IRRef ref = (IRRef)(ir - as->ir);
+  if (LJ_64 && ref >= REF_FIRST) {
+    ra_lastuse(as, ref);  /* Forcing a spill slot is a use, too. */
+    if (ra_canshare(as, ref)) {
+      IRRef use = as->lastuse[ref - REF_FIRST];
+      MSize i, best = as->nfreespill;
+      for (i = 0; i < as->nfreespill; i++) {
+	uint32_t fs = as->freespill[i];
+	if (freespill_ref(fs) > use && (freespill_is64(fs) || !irt_is64(ir->t)) &&
+	    (best == as->nfreespill ||
+	     freespill_ref(fs) < freespill_ref(as->freespill[best])))
+	  best = i;
+      }
+      if (best < as->nfreespill) {
+	int32_t slot = freespill_slot(as->freespill[best]);
+	lua_assert(slot < as->evenspill);
+	as->freespill[best] = as->freespill[--as->nfreespill];
+	RA_DBGX((as, "spshare   $f $s", ref, slot));
+	return slot;
+      }
+    }
+  }
+  return SPS_NONE;
+}
+
 /* Force a spill. Allocate a new spill slot if needed. */
 static int32_t ra_spill(ASMState *as, IRIns *ir)
 {
   int32_t slot = ir->s;
   lua_assert(ir >= as->ir + REF_TRUE);
   if (!ra_hasspill(slot)) {
-    if (irt_is64(ir->t)) {
-      slot = as->evenspill;
-      as->evenspill += 2;
-    } else if (as->oddspill) {
-      slot = as->oddspill;
-      as->oddspill = 0;
-    } else {
-      slot = as->evenspill;
-      as->oddspill = slot+1;
-      as->evenspill += 2;
+    slot = ra_sharespill(as, ir);
+    if (!ra_hasspill(slot)) {
+      if (irt_is64(ir->t)) {
+	slot = as->evenspill;
+	as->evenspill += 2;
+      } else if (as->oddspill) {
+	slot = as->oddspill;
+	as->oddspill = 0;
+      } else {
+	slot = as->evenspill;
+	as->oddspill = slot+1;
+	as->evenspill += 2;
+      }
+      if (as->evenspill > 256)
+	lj_trace_err(as->J, LJ_TRERR_SPILLOV);
     }
-    if (as->evenspill > 256)
-      lj_trace_err(as->J, LJ_TRERR_SPILLOV);
     ir->s = (uint8_t)slot;
   }
   return sps_scale(slot);
@@ -607,6 +696,7 @@ static Reg ra_allocref(ASMState *as, IRRef ref, RegSet allow)
   RegSet pick = as->freeset & allow;
   Reg r;
   lua_assert(ra_noreg(ir->r));
+  ra_lastuse(as, ref);
   if (pick) {
     /* First check register hint from propagation or PHI. */
     if (ra_hashint(ir->r)) {
@@ -886,7 +976,9 @@ static void asm_snap_alloc1(ASMState *as, IRRef ref)
 	  asm_snap_alloc1(as, (ir+1)->op2);
       } else
 #endif
-      {  /* Allocate stored values for TNEW, TDUP and CNEW. */
+      if (ir->o == IR_FNEW) {  /* Allocate parent closure. */
+	asm_snap_alloc1(as, ir->op1);
+      } else {  /* Allocate stored values for TNEW, TDUP and CNEW. */
 	IRIns *irs;
 	lua_assert(ir->o == IR_TNEW || ir->o == IR_TDUP || ir->o == IR_CNEW);
 	for (irs = IR(as->snapref-1); irs > ir; irs--)
@@ -1026,6 +1118,16 @@ static uint32_t ir_khash(IRIns *ir)
   return hashrot(lo, hi);
 }
 
+/* Get the BASE delta for RETF. Its target is either the PC to return to
+** in a Lua frame or the frame link of a vararg frame.
+*/
+static int32_t asm_retf_delta(const void *pc)
+{
+  if (((uintptr_t)pc & FRAME_TYPE) == FRAME_VARG)
+    return (int32_t)((uintptr_t)pc >> 3);
+  return 1+LJ_FR2+bc_a(*((const BCIns *)pc - 1));
+}
+
 /* -- Allocations --------------------------------------------------------- */
 
 static void asm_gencall(ASMState *as, const CCallInfo *ci, IRRef *args);
@@ -1066,6 +1168,28 @@ static void asm_tdup(ASMState *as, IRIns *ir)
   asm_gencall(as, ci, args);
 }
 
+static void asm_fnew(ASMState *as, IRIns *ir)
+{
+  const CCallInfo *ci = &lj_ir_callinfo[IRCALL_lj_func_newL_jit];
+  IRIns *ira = IR(ir->op1);
+  IRRef args[4];
+  args[0] = ASMREF_L;  /* lua_State *L    */
+  args[1] = ir->op2;   /* GCproto *pt     */
+  as->gcsteps++;
+  if (ira->o == IR_CARG) {
+    args[2] = ira->op1;  /* GCfuncL *parent */
+    args[3] = ira->op2;  /* TValue *base    */
+    asm_setupresult(as, ir, ci);  /* GCfunc * */
+    asm_gencall(as, ci, args);
+  } else {  /* No local upvalues, so no base needed. */
+    args[2] = ir->op1;
+    args[3] = ASMREF_TMP1;
+    asm_setupresult(as, ir, ci);  /* GCfunc * */
+    asm_gencall(as, ci, args);
+    ra_allockreg(as, 0, ra_releasetmp(as, ASMREF_TMP1));
+  }
+}
+
 static void asm_gc_check(ASMState *as);
 
 /* Explicit GC step. */
@@ -1073,7 +1197,7 @@ static void asm_gcstep(ASMState *as, IRIns *ir)
 {
   IRIns *ira;
   for (ira = IR(as->stopins+1); ira < ir; ira++)
-    if ((ira->o == IR_TNEW || ira->o == IR_TDUP ||
+    if ((ira->o == IR_TNEW || ira->o == IR_TDUP || ira->o == IR_FNEW ||
 	 (LJ_HASFFI && (ira->o == IR_CNEW || ira->o == IR_CNEWI))) &&
 	ra_used(ira))
       as->gcsteps++;
@@ -1705,6 +1829,7 @@ static void asm_ir(ASMState *as, IRIns *ir)
   case IR_TNEW: asm_tnew(as, ir); break;
   case IR_TDUP: asm_tdup(as, ir); break;
   case IR_CNEW: case IR_CNEWI: asm_cnew(as, ir); break;
+  case IR_FNEW: asm_fnew(as, ir); break;
 
   /* Buffer operations. */
   case IR_BUFHDR: asm_bufhdr(as, ir); break;
@@ -2056,6 +2181,12 @@ static void asm_setup_regsp(ASMState *as)
 
   inloop = 0;
   as->evenspill = SPS_FIRST;
+  as->nfreespill = 0;
+  if (LJ_64) {
+    MSize sz = (nins - REF_FIRST) * sizeof(IRRef1);
+    as->lastuse = (IRRef1 *)lj_buf_tmp(as->J->L, sz);
+    memset(as->lastuse, 0, sz);
+  }
   for (lastir = IR(nins); ir < lastir; ir++) {
     if (sink) {
       if (ir->r == RID_SINK)
@@ -2133,6 +2264,10 @@ static void asm_setup_regsp(ASMState *as)
       /* fallthrough */
 #endif
     /* C calls evict all scratch regs and return results in RID_RET. */
+    case IR_FNEW:
+      if (REGARG_NUMGPR < 4 && as->evenspill < 4)
+	as->evenspill = 4;  /* lj_func_newL_jit needs 4 args. */
+      /* fallthrough */
     case IR_SNEW: case IR_XSNEW: case IR_NEWREF: case IR_BUFPUT:
       if (REGARG_NUMGPR < 3 && as->evenspill < 3)
 	as->evenspill = 3;  /* lj_str_new and lj_tab_newkey need 3 args. */
@@ -2281,6 +2416,7 @@ void lj_asm_trace(jit_State *J, GCtrace *T)
   as->flags = J->flags;
   as->loopref = J->loopref;
   as->realign = NULL;
+  as->realignfar = 0;
   as->loopinv = 0;
   as->parent = J->parent ? traceref(J, J->parent) : NULL;
 
@@ -2319,9 +2455,6 @@ void lj_asm_trace(jit_State *J, GCtrace *T)
   */
   for (;;) {
     as->mcp = as->mctop;
-#ifdef LUA_USE_ASSERT
-    as->mcp_prev = as->mcp;
-#endif
     as->ir = J->curfinal->ir;  /* Use the copied IR. */
     as->curins = J->cur.nins = as->orignins;
 
@@ -2330,6 +2463,9 @@ void lj_asm_trace(jit_State *J, GCtrace *T)
 
     /* General trace setup. Emit tail of trace. */
     asm_tail_prep(as);
+#ifdef LUA_USE_ASSERT
+    as->mcp_prev = as->mcp;
+#endif
     as->mcloop = NULL;
     as->flagmcp = NULL;
     as->topslot = 0;
@@ -2351,6 +2487,8 @@ void lj_asm_trace(jit_State *J, GCtrace *T)
       RA_DBG_REF();
       checkmclim(as);
       asm_ir(as, ir);
+      if (LJ_64)
+	ra_freespill(as, (IRRef)(ir - as->ir));
     }
 
     if (as->realign && J->curfinal->nins >= T->nins)
@@ -481,7 +481,7 @@ static void asm_retf(ASMState *as, IRIns *ir)
 {
   Reg base = ra_alloc1(as, REF_BASE, RSET_GPR);
   void *pc = ir_kptr(IR(ir->op2));
-  int32_t delta = 1+LJ_FR2+bc_a(*((const BCIns *)pc - 1));
+  int32_t delta = asm_retf_delta(pc);
   as->topslot -= (BCReg)delta;
   if ((int32_t)as->topslot < 0) as->topslot = 0;
   irt_setmark(IR(REF_BASE)->t);  /* Children must not coalesce with BASE reg. */
@@ -1214,7 +1214,7 @@ static void asm_cnew(ASMState *as, IRIns *ir)
   CTypeID id = (CTypeID)IR(ir->op1)->i;
   CTSize sz;
   CTInfo info = lj_ctype_info(cts, id, &sz);
-  const CCallInfo *ci = &lj_ir_callinfo[IRCALL_lj_mem_newgco];
+  const CCallInfo *ci = &lj_ir_callinfo[IRCALL_lj_cdata_newgco];
   IRRef args[4];
   RegSet allow = (RSET_GPR & ~RSET_SCRATCH);
   RegSet drop = RSET_SCRATCH;
@@ -1253,7 +1253,7 @@ static void asm_cnew(ASMState *as, IRIns *ir)
     return;
   }
 
-  /* Initialize gct and ctypeid. lj_mem_newgco() already sets marked. */
+  /* Initialize gct and ctypeid. lj_cdata_newgco() already sets marked. */
   {
     uint32_t k = emit_isk12(ARMI_MOV, id);
     Reg r = k ? RID_R1 : ra_allock(as, id, allow);
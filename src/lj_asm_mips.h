@@ -426,7 +426,7 @@ static void asm_retf(ASMState *as, IRIns *ir)
 {
   Reg base = ra_alloc1(as, REF_BASE, RSET_GPR);
   void *pc = ir_kptr(IR(ir->op2));
-  int32_t delta = 1+LJ_FR2+bc_a(*((const BCIns *)pc - 1));
+  int32_t delta = asm_retf_delta(pc);
   as->topslot -= (BCReg)delta;
   if ((int32_t)as->topslot < 0) as->topslot = 0;
   irt_setmark(IR(REF_BASE)->t);  /* Children must not coalesce with BASE reg. */
@@ -1514,7 +1514,7 @@ static void asm_cnew(ASMState *as, IRIns *ir)
   CTypeID id = (CTypeID)IR(ir->op1)->i;
   CTSize sz;
   CTInfo info = lj_ctype_info(cts, id, &sz);
-  const CCallInfo *ci = &lj_ir_callinfo[IRCALL_lj_mem_newgco];
+  const CCallInfo *ci = &lj_ir_callinfo[IRCALL_lj_cdata_newgco];
   IRRef args[4];
   RegSet drop = RSET_SCRATCH;
   lua_assert(sz != CTSIZE_INVALID || (ir->o == IR_CNEW && ir->op2 != REF_NIL));
@@ -1559,7 +1559,7 @@ static void asm_cnew(ASMState *as, IRIns *ir)
     return;
   }
 
-  /* Initialize gct and ctypeid. lj_mem_newgco() already sets marked. */
+  /* Initialize gct and ctypeid. lj_cdata_newgco() already sets marked. */
   emit_tsi(as, MIPSI_SB, RID_RET+1, RID_RET, offsetof(GCcdata, gct));
   emit_tsi(as, MIPSI_SH, RID_TMP, RID_RET, offsetof(GCcdata, ctypeid));
   emit_ti(as, MIPSI_LI, RID_RET+1, ~LJ_TCDATA);
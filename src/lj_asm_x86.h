@@ -63,7 +63,7 @@ static void asm_guardcc(ASMState *as, int cc)
     *(int32_t *)(p+1) = jmprel(p+5, target);
     target = p;
     cc ^= 1;
-    if (as->realign) {
+    if (as->realign && !as->realignfar) {
       if (LJ_GC64 && LJ_UNLIKELY(as->mrm.base == RID_RIP))
 	as->mrm.ofs += 2;  /* Fixup RIP offset for pending fused load. */
       emit_sjcc(as, cc, target);
@@ -131,9 +131,11 @@ static IRRef asm_fuseabase(ASMState *as, IRRef ref)
   as->mrm.ofs = 0;
   if (irb->o == IR_FLOAD) {
     IRIns *ira = IR(irb->op1);
-    lua_assert(irb->op2 == IRFL_TAB_ARRAY);
+    /* Node arrays are only indexed by table traversals. */
+    lua_assert(irb->op2 == IRFL_TAB_ARRAY || irb->op2 == IRFL_TAB_NODE);
     /* We can avoid the FLOAD of t->array for colocated arrays. */
-    if (ira->o == IR_TNEW && ira->op1 <= LJ_MAX_COLOSIZE &&
+    if (irb->op2 == IRFL_TAB_ARRAY &&
+	ira->o == IR_TNEW && ira->op1 <= LJ_MAX_COLOSIZE &&
 	!neverfuse(as) && noconflict(as, irb->op1, IR_NEWREF, 1)) {
       as->mrm.ofs = (int32_t)sizeof(GCtab);  /* Ofs to colocated array. */
       return irb->op1;  /* Table obj. */
@@ -761,7 +763,7 @@ static void asm_retf(ASMState *as, IRIns *ir)
   Reg rpc = ra_scratch(as, rset_exclude(RSET_GPR, base));
 #endif
   void *pc = ir_kptr(IR(ir->op2));
-  int32_t delta = 1+LJ_FR2+bc_a(*((const BCIns *)pc - 1));
+  int32_t delta = asm_retf_delta(pc);
   as->topslot -= (BCReg)delta;
   if ((int32_t)as->topslot < 0) as->topslot = 0;
   irt_setmark(IR(REF_BASE)->t);  /* Children must not coalesce with BASE reg. */
@@ -1662,7 +1664,8 @@ static void asm_sload(ASMState *as, IRIns *ir)
   lua_assert(!(ir->op2 & IRSLOAD_PARENT));  /* Handled by asm_head_side(). */
   lua_assert(irt_isguard(t) || !(ir->op2 & IRSLOAD_TYPECHECK));
   lua_assert(LJ_DUALNUM ||
-	     !irt_isint(t) || (ir->op2 & (IRSLOAD_CONVERT|IRSLOAD_FRAME)));
+	     !irt_isint(t) ||
+	     (ir->op2 & (IRSLOAD_CONVERT|IRSLOAD_FRAME|IRSLOAD_KEYINDEX)));
   if ((ir->op2 & IRSLOAD_CONVERT) && irt_isguard(t) && irt_isint(t)) {
     Reg left = ra_scratch(as, RSET_FPR);
     asm_tointg(as, ir, left);  /* Frees dest reg. Do this before base alloc. */
@@ -1727,7 +1730,10 @@ static void asm_sload(ASMState *as, IRIns *ir)
   if ((ir->op2 & IRSLOAD_TYPECHECK)) {
     /* Need type check, even if the load result is unused. */
     asm_guardcc(as, irt_isnum(t) ? CC_AE : CC_NE);
-    if (LJ_64 && irt_type(t) >= IRT_NUM) {
+    if ((ir->op2 & IRSLOAD_KEYINDEX)) {
+      emit_u32(as, LJ_KEYINDEX);
+      emit_rmro(as, XO_ARITHi, XOg_CMP, base, ofs+4);
+    } else if (LJ_64 && irt_type(t) >= IRT_NUM) {
       lua_assert(irt_isinteger(t) || irt_isnum(t));
 #if LJ_GC64
       emit_u32(as, LJ_TISNUM << 15);
@@ -1778,7 +1784,7 @@ static void asm_cnew(ASMState *as, IRIns *ir)
   CTypeID id = (CTypeID)IR(ir->op1)->i;
   CTSize sz;
   CTInfo info = lj_ctype_info(cts, id, &sz);
-  const CCallInfo *ci = &lj_ir_callinfo[IRCALL_lj_mem_newgco];
+  const CCallInfo *ci = &lj_ir_callinfo[IRCALL_lj_cdata_newgco];
   IRRef args[4];
   lua_assert(sz != CTSIZE_INVALID || (ir->o == IR_CNEW && ir->op2 != REF_NIL));
 
@@ -2028,7 +2034,7 @@ static int asm_swapops(ASMState *as, IRIns *ir)
   return 0;  /* Otherwise don't swap. */
 }
 
-static void asm_fparith(ASMState *as, IRIns *ir, x86Op xo)
+static void asm_fparith(ASMState *as, IRIns *ir, x86Op xo, x86Op xv)
 {
   IRRef lref = ir->op1;
   IRRef rref = ir->op2;
@@ -2040,6 +2046,24 @@ static void asm_fparith(ASMState *as, IRIns *ir, x86Op xo)
     ra_noweak(as, right);
   }
   dest = ra_dest(as, ir, allow);
+  if ((as->flags & JIT_F_AVX)) {  /* Non-destructive 3-operand VEX form. */
+    Reg left;
+    if (lref == rref) {
+      left = right = ra_alloc1(as, lref, RSET_FPR);
+    } else {
+      allow = RSET_FPR;
+      if (ra_noreg(right)) {
+	if (asm_swapops(as, ir)) {
+	  IRRef tmp = lref; lref = rref; rref = tmp;
+	}
+	right = asm_fuseload(as, rref, allow);
+      }
+      if (right != RID_MRM) rset_clear(allow, right);
+      left = ra_alloc1(as, lref, allow);
+    }
+    emit_mrm(as, xv ^ VEX_VREG(left), dest, right);
+    return;
+  }
   if (lref == rref) {
     right = dest;
   } else if (ra_noreg(right)) {
@@ -2175,27 +2199,58 @@ static int asm_lea(ASMState *as, IRIns *ir)
   return 1;  /* Success. */
 }
 
+/* Fuse FP multiply-add/sub into an FMA3 instruction. Opt-in with -O+fma. */
+static int asm_fusemadd(ASMState *as, IRIns *ir, x86Op xv, x86Op xvr)
+{
+  IRRef lref = ir->op1, rref = ir->op2;
+  IRIns *irm;
+  if ((as->flags & (JIT_F_FMA|JIT_F_OPT_FMA)) == (JIT_F_FMA|JIT_F_OPT_FMA) &&
+      lref != rref &&
+      ((mayfuse(as, lref) && (irm = IR(lref), irm->o == IR_MUL) &&
+       ra_noreg(irm->r)) ||
+       (mayfuse(as, rref) && (irm = IR(rref), irm->o == IR_MUL) &&
+       (rref = lref, xv = xvr, ra_noreg(irm->r))))) {
+    /* dest = dest op (left * right), with dest preloaded with the addend. */
+    Reg dest = ra_dest(as, ir, RSET_FPR);
+    RegSet allow = rset_exclude(RSET_FPR, dest);
+    Reg left, right;
+    if (irm->op1 == irm->op2) {
+      left = right = ra_alloc1(as, irm->op1, allow);
+    } else {
+      right = asm_fuseload(as, irm->op2, allow);
+      if (right != RID_MRM) rset_clear(allow, right);
+      left = ra_alloc1(as, irm->op1, allow);
+    }
+    emit_mrm(as, xv ^ VEX_VREG(left), dest, right);
+    ra_left(as, dest, rref);
+    return 1;
+  }
+  return 0;
+}
+
 static void asm_add(ASMState *as, IRIns *ir)
 {
-  if (irt_isnum(ir->t))
-    asm_fparith(as, ir, XO_ADDSD);
-  else if ((as->flags & JIT_F_LEA_AGU) || as->flagmcp == as->mcp ||
+  if (irt_isnum(ir->t)) {
+    if (!asm_fusemadd(as, ir, XV_FMADD231SD, XV_FMADD231SD))
+      asm_fparith(as, ir, XO_ADDSD, XV_ADDSD);
+  } else if ((as->flags & JIT_F_LEA_AGU) || as->flagmcp == as->mcp ||
 	   irt_is64(ir->t) || !asm_lea(as, ir))
     asm_intarith(as, ir, XOg_ADD);
 }
 
 static void asm_sub(ASMState *as, IRIns *ir)
 {
-  if (irt_isnum(ir->t))
-    asm_fparith(as, ir, XO_SUBSD);
-  else  /* Note: no need for LEA trick here. i-k is encoded as i+(-k). */
+  if (irt_isnum(ir->t)) {
+    if (!asm_fusemadd(as, ir, XV_FMSUB231SD, XV_FNMADD231SD))
+      asm_fparith(as, ir, XO_SUBSD, XV_SUBSD);
+  } else  /* Note: no need for LEA trick here. i-k is encoded as i+(-k). */
     asm_intarith(as, ir, XOg_SUB);
 }
 
 static void asm_mul(ASMState *as, IRIns *ir)
 {
   if (irt_isnum(ir->t))
-    asm_fparith(as, ir, XO_MULSD);
+    asm_fparith(as, ir, XO_MULSD, XV_MULSD);
   else
     asm_intarith(as, ir, XOg_X_IMUL);
 }
@@ -2208,7 +2263,7 @@ static void asm_div(ASMState *as, IRIns *ir)
 					  IRCALL_lj_carith_divu64);
   else
 #endif
-    asm_fparith(as, ir, XO_DIVSD);
+    asm_fparith(as, ir, XO_DIVSD, XV_DIVSD);
 }
 
 static void asm_mod(ASMState *as, IRIns *ir)
@@ -2232,12 +2287,12 @@ static void asm_neg_not(ASMState *as, IRIns *ir, x86Group3 xg)
 static void asm_neg(ASMState *as, IRIns *ir)
 {
   if (irt_isnum(ir->t))
-    asm_fparith(as, ir, XO_XORPS);
+    asm_fparith(as, ir, XO_XORPS, XV_XORPS);
   else
     asm_neg_not(as, ir, XOg_NEG);
 }
 
-#define asm_abs(as, ir)		asm_fparith(as, ir, XO_ANDPS)
+#define asm_abs(as, ir)		asm_fparith(as, ir, XO_ANDPS, XV_ANDPS)
 
 static void asm_intmin_max(ASMState *as, IRIns *ir, int cc)
 {
@@ -2253,7 +2308,7 @@ static void asm_intmin_max(ASMState *as, IRIns *ir, int cc)
 static void asm_min(ASMState *as, IRIns *ir)
 {
   if (irt_isnum(ir->t))
-    asm_fparith(as, ir, XO_MINSD);
+    asm_fparith(as, ir, XO_MINSD, XV_MINSD);
   else
     asm_intmin_max(as, ir, CC_G);
 }
@@ -2261,7 +2316,7 @@ static void asm_min(ASMState *as, IRIns *ir)
 static void asm_max(ASMState *as, IRIns *ir)
 {
   if (irt_isnum(ir->t))
-    asm_fparith(as, ir, XO_MAXSD);
+    asm_fparith(as, ir, XO_MAXSD, XV_MAXSD);
   else
     asm_intmin_max(as, ir, CC_L);
 }
@@ -2405,7 +2460,7 @@ static void asm_comp(ASMState *as, IRIns *ir)
       } else {
 	/* Patched to mcloop by asm_loop_fixup. */
 	as->loopinv = 2;
-	if (as->realign)
+	if (as->realign && !as->realignfar)
 	  emit_sjcc(as, CC_P, as->mcp);
 	else
 	  emit_jcc(as, CC_P, as->mcp);
@@ -2722,7 +2777,15 @@ static void asm_stack_restore(ASMState *as, SnapShot *snap)
     IRIns *ir = IR(ref);
     if ((sn & SNAP_NORESTORE))
       continue;
-    if (irt_isnum(ir->t)) {
+    if ((sn & SNAP_KEYINDEX)) {
+      emit_movmroi(as, RID_BASE, ofs+4, LJ_KEYINDEX);
+      if (irref_isk(ref)) {
+	emit_movmroi(as, RID_BASE, ofs, ir->i);
+      } else {
+	Reg src = ra_alloc1(as, ref, rset_exclude(RSET_GPR, RID_BASE));
+	emit_movtomro(as, src, RID_BASE, ofs);
+      }
+    } else if (irt_isnum(ir->t)) {
       Reg src = ra_alloc1(as, ref, RSET_FPR);
       emit_rmro(as, XO_MOVSDto, src, RID_BASE, ofs);
     } else {
@@ -2809,14 +2872,21 @@ static void asm_gc_check(ASMState *as)
 
 /* -- Loop handling ------------------------------------------------------- */
 
+/* Loop alignment. The padding goes after the loop branch, so it never runs.
+** Small loops are aligned to 16 bytes, to get a short loop branch. With
+** -O+align, all loops are aligned to a cache line. This costs a retry of
+** the assembly for most loops, so it's off by default.
+*/
+#define MCLOOP_ALIGN(as)	(((as)->flags & JIT_F_OPT_ALIGN) ? 64 : 16)
+
 /* Fixup the loop branch. */
 static void asm_loop_fixup(ASMState *as)
 {
   MCode *p = as->mctop;
   MCode *target = as->mcp;
-  if (as->realign) {  /* Realigned loops use short jumps. */
+  if (as->realign && !as->realignfar) {  /* Realigned loops use short jumps. */
     as->realign = NULL;  /* Stop another retry. */
-    lua_assert(((intptr_t)target & 15) == 0);
+    lua_assert(((intptr_t)target & (MCLOOP_ALIGN(as)-1)) == 0);
     if (as->loopinv) {  /* Inverted loop branch? */
       p -= 5;
       p[0] = XI_JMP;
@@ -2845,12 +2915,24 @@ static void asm_loop_fixup(ASMState *as)
       *(int32_t *)(p-4) = (int32_t)(target - p);
       newloop = target+3;
     }
+    if (as->realign) {  /* Realigned larger loop, same code as before. */
+      as->realign = NULL;  /* Stop another retry. */
+      return;
+    }
     /* Realign small loops and shorten the loop branch. */
     if (newloop >= p - 128) {
-      as->realign = newloop;  /* Force a retry and remember alignment. */
-      as->curins = as->stopins;  /* Abort asm_trace now. */
-      as->T->nins = as->orignins;  /* Remove any added renames. */
+      as->realignfar = 0;
+    } else if ((as->flags & JIT_F_OPT_ALIGN) &&
+	       ((intptr_t)target & (MCLOOP_ALIGN(as)-1))) {
+      /* Realign larger loops, too. Only the padding shifts their code. */
+      newloop = target;
+      as->realignfar = 1;
+    } else {
+      return;
     }
+    as->realign = newloop;  /* Force a retry and remember alignment. */
+    as->curins = as->stopins;  /* Abort asm_trace now. */
+    as->T->nins = as->orignins;  /* Remove any added renames. */
   }
 }
 
@@ -2945,12 +3027,15 @@ static void asm_tail_prep(ASMState *as)
   MCode *p = as->mctop;
   /* Realign and leave room for backwards loop branch or exit branch. */
   if (as->realign) {
-    int i = ((int)(intptr_t)as->realign) & 15;
+    int i = ((int)(intptr_t)as->realign) & (MCLOOP_ALIGN(as)-1);
+    if (LJ_UNLIKELY(p - MCLOOP_ALIGN(as) < as->mclim))
+      asm_mclimit(as);  /* The padding may exceed the red zone. */
     /* Fill unused mcode tail with NOPs to make the prefetcher happy. */
     while (i-- > 0)
       *--p = XI_NOP;
     as->mctop = p;
-    p -= (as->loopinv ? 5 : 2);  /* Space for short/near jmp. */
+    /* Space for short/near jmp. */
+    p -= (as->loopinv || as->realignfar ? 5 : 2);
   } else {
     p -= 5;  /* Space for exit branch (near jmp). */
   }
@@ -219,6 +219,7 @@ static GCtab *bcread_ktab(LexState *ls)
       bcread_ktabk(ls, lj_tab_set(ls->L, t, &key));
     }
   }
+  lj_tab_newshape(ls->L, t);
   return t;
 }
 
@@ -343,6 +344,7 @@ GCproto *lj_bcread_proto(LexState *ls)
 
   /* Allocate prototype object and initialize its fields. */
   pt = (GCproto *)lj_mem_newgco(ls->L, (MSize)sizept);
+  lj_gc_acctinc(G(ls->L), ~LJ_TPROTO, sizept);
   pt->gct = ~LJ_TPROTO;
   pt->numparams = (uint8_t)numparams;
   pt->framesize = (uint8_t)framesize;
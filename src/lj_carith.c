@@ -426,4 +426,126 @@ int64_t lj_carith_powi64(int64_t x, int64_t k)
   return (int64_t)lj_carith_powu64((uint64_t)x, (uint64_t)k);
 }
 
+/* -- Vectorized loops over arrays of doubles ----------------------------- */
+
+#if LJ_HASVEC
+#include <immintrin.h>
+
+/* Packed loop over d[i] = x[i] op y[i]. Returns the first index left. */
+#define VEC_LOOP(expr) \
+  for (; i+VEC_N <= e; i += VEC_N) VEC_ST(d+i, (expr)); \
+  return i;
+
+/* Packed kernel for all modes. x or y may be the scalar k. */
+#define VEC_KERNEL(name) \
+  static VEC_ATTR intptr_t name(double *d, const double *x, const double *y, \
+				double k, int32_t mode, intptr_t i, \
+				intptr_t e) \
+  { \
+    VEC_T vk = VEC_SET1(k); \
+    switch (mode & (VEC_OPMASK|VEC_XK|VEC_YK)) { \
+    case VEC_ADD: VEC_LOOP(VEC_ADDP(VEC_LD(x+i), VEC_LD(y+i))) \
+    case VEC_ADD|VEC_XK: VEC_LOOP(VEC_ADDP(vk, VEC_LD(y+i))) \
+    case VEC_ADD|VEC_YK: VEC_LOOP(VEC_ADDP(VEC_LD(x+i), vk)) \
+    case VEC_SUB: VEC_LOOP(VEC_SUBP(VEC_LD(x+i), VEC_LD(y+i))) \
+    case VEC_SUB|VEC_XK: VEC_LOOP(VEC_SUBP(vk, VEC_LD(y+i))) \
+    case VEC_SUB|VEC_YK: VEC_LOOP(VEC_SUBP(VEC_LD(x+i), vk)) \
+    case VEC_MUL: VEC_LOOP(VEC_MULP(VEC_LD(x+i), VEC_LD(y+i))) \
+    case VEC_MUL|VEC_XK: VEC_LOOP(VEC_MULP(vk, VEC_LD(y+i))) \
+    case VEC_MUL|VEC_YK: VEC_LOOP(VEC_MULP(VEC_LD(x+i), vk)) \
+    case VEC_DIV: VEC_LOOP(VEC_DIVP(VEC_LD(x+i), VEC_LD(y+i))) \
+    case VEC_DIV|VEC_XK: VEC_LOOP(VEC_DIVP(vk, VEC_LD(y+i))) \
+    case VEC_DIV|VEC_YK: VEC_LOOP(VEC_DIVP(VEC_LD(x+i), vk)) \
+    case VEC_AXPY: VEC_LOOP(VEC_ADDP(VEC_MULP(VEC_LD(x+i), vk), VEC_LD(y+i))) \
+    default: return i; \
+    } \
+  }
+
+#define VEC_ATTR	__attribute__((target("sse2")))
+#define VEC_T		__m128d
+#define VEC_N		2
+#define VEC_LD		_mm_loadu_pd
+#define VEC_ST		_mm_storeu_pd
+#define VEC_SET1	_mm_set1_pd
+#define VEC_ADDP	_mm_add_pd
+#define VEC_SUBP	_mm_sub_pd
+#define VEC_MULP	_mm_mul_pd
+#define VEC_DIVP	_mm_div_pd
+VEC_KERNEL(carith_vec_sse2)
+#undef VEC_ATTR
+#undef VEC_T
+#undef VEC_N
+#undef VEC_LD
+#undef VEC_ST
+#undef VEC_SET1
+#undef VEC_ADDP
+#undef VEC_SUBP
+#undef VEC_MULP
+#undef VEC_DIVP
+
+/* Note: no FMA, even if the CPU has it. Each result is rounded twice, the
+** same as for the scalar loop.
+*/
+#define VEC_ATTR	__attribute__((target("avx2")))
+#define VEC_T		__m256d
+#define VEC_N		4
+#define VEC_LD		_mm256_loadu_pd
+#define VEC_ST		_mm256_storeu_pd
+#define VEC_SET1	_mm256_set1_pd
+#define VEC_ADDP	_mm256_add_pd
+#define VEC_SUBP	_mm256_sub_pd
+#define VEC_MULP	_mm256_mul_pd
+#define VEC_DIVP	_mm256_div_pd
+VEC_KERNEL(carith_vec_avx2)
+#undef VEC_ATTR
+#undef VEC_T
+#undef VEC_N
+#undef VEC_LD
+#undef VEC_ST
+#undef VEC_SET1
+#undef VEC_ADDP
+#undef VEC_SUBP
+#undef VEC_MULP
+#undef VEC_DIVP
+#undef VEC_KERNEL
+#undef VEC_LOOP
+
+/* Check whether an input array overlaps the output at another offset. */
+static int carith_vec_overlap(const double *x, double *d, intptr_t i,
+			      intptr_t e)
+{
+  uintptr_t xa = (uintptr_t)(x+i), xe = (uintptr_t)(x+e);
+  uintptr_t da = (uintptr_t)(d+i), de = (uintptr_t)(d+e);
+  return x != d && xa < de && da < xe;
+}
+
+/* Run d[i] = x[i] op y[i] for i = start..stop, as vectorized by the
+** recorder. Falls back to the scalar loop if the packed loop would give
+** other results, because the output overlaps an input at another offset.
+*/
+void lj_carith_vec(double *d, const double *x, const double *y, double k,
+		   int32_t mode, int32_t start, int32_t stop)
+{
+  intptr_t i = start, e = (intptr_t)stop + 1;
+  if (!(!(mode & VEC_XK) && carith_vec_overlap(x, d, i, e)) &&
+      !(!(mode & VEC_YK) && carith_vec_overlap(y, d, i, e))) {
+    if ((mode & VEC_AVX2))
+      i = carith_vec_avx2(d, x, y, k, mode, i, e);
+    else
+      i = carith_vec_sse2(d, x, y, k, mode, i, e);
+  }
+  for (; i < e; i++) {  /* Scalar loop for the remainder. */
+    double a = (mode & VEC_XK) ? k : x[i];
+    double b = (mode & VEC_YK) ? k : y[i];
+    switch (mode & VEC_OPMASK) {
+    case VEC_ADD: d[i] = a + b; break;
+    case VEC_SUB: d[i] = a - b; break;
+    case VEC_MUL: d[i] = a * b; break;
+    case VEC_DIV: d[i] = a / b; break;
+    default: a = a * k; d[i] = a + b; break;
+    }
+  }
+}
+#endif
+
 #endif
@@ -32,6 +32,18 @@ LJ_FUNC int64_t lj_carith_modi64(int64_t a, int64_t b);
 LJ_FUNC uint64_t lj_carith_powu64(uint64_t x, uint64_t k);
 LJ_FUNC int64_t lj_carith_powi64(int64_t x, int64_t k);
 
+#if LJ_HASVEC
+/* Modes for vectorized loops: d[i] = x[i] op y[i] or x[i]*k + y[i]. */
+enum { VEC_ADD, VEC_SUB, VEC_MUL, VEC_DIV, VEC_AXPY, VEC_OPMASK = 7 };
+#define VEC_XK		0x10	/* x[i] is the scalar k. */
+#define VEC_YK		0x20	/* y[i] is the scalar k. */
+#define VEC_AVX2	0x40	/* Use AVX2 instead of SSE2. */
+
+LJ_FUNC void lj_carith_vec(double *d, const double *x, const double *y,
+			   double k, int32_t mode, int32_t start,
+			   int32_t stop);
+#endif
+
 #endif
 
 #endif
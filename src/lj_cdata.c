@@ -40,6 +40,7 @@ GCcdata *lj_cdata_newv(lua_State *L, CTypeID id, CTSize sz, CTSize align)
   cdatav(cd)->extra = extra;
   cdatav(cd)->len = sz;
   g = G(L);
+  lj_gc_acctinc(g, ~LJ_TCDATA, extra + sz);
   setgcrefr(cd->nextgc, g->gc.root);
   setgcref(g->gc.root, obj2gco(cd));
   newwhite(g, obj2gco(cd));
@@ -58,6 +59,16 @@ GCcdata *lj_cdata_newx(CTState *cts, CTypeID id, CTSize sz, CTInfo info)
     return lj_cdata_newv(cts->L, id, sz, ctype_align(info));
 }
 
+#if LJ_HASJIT
+/* Allocate fixed-size C data object. Called from JIT-compiled code. */
+void * LJ_FASTCALL lj_cdata_newgco(lua_State *L, GCSize size)
+{
+  void *p = lj_mem_newgco(L, size);
+  lj_gc_acctinc(G(L), ~LJ_TCDATA, size);
+  return p;
+}
+#endif
+
 /* Free a C data object. */
 void LJ_FASTCALL lj_cdata_free(global_State *g, GCcdata *cd)
 {
@@ -78,8 +89,10 @@ void LJ_FASTCALL lj_cdata_free(global_State *g, GCcdata *cd)
     CTSize sz = ctype_hassize(ct->info) ? ct->size : CTSIZE_PTR;
     lua_assert(ctype_hassize(ct->info) || ctype_isfunc(ct->info) ||
 	       ctype_isextern(ct->info));
+    lj_gc_acctdec(g, ~LJ_TCDATA, sizeof(GCcdata) + sz);
     lj_mem_free(g, cd, sizeof(GCcdata) + sz);
   } else {
+    lj_gc_acctdec(g, ~LJ_TCDATA, sizecdatav(cd));
     lj_mem_free(g, memcdatav(cd), sizecdatav(cd));
   }
 }
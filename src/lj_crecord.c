@@ -1883,6 +1883,43 @@ void LJ_FASTCALL lj_crecord_tonumber(jit_State *J, RecordFFData *rd)
   }
 }
 
+/* -- Vectorized loops ---------------------------------------------------- */
+
+#if LJ_HASVEC
+/* Check for a pointer to or an array of doubles, which aren't volatile.
+** Arrays for stores must not be const, either.
+*/
+int lj_crecord_isvecarray(jit_State *J, cTValue *o, int store)
+{
+  CTState *cts = ctype_ctsG(J2G(J));
+  CType *ct;
+  CTInfo qual = 0;
+  if (!tviscdata(o)) return 0;
+  ct = ctype_raw(cts, cdataV(o)->ctypeid);
+  if (!(ctype_isptr(ct->info) && !ctype_isref(ct->info)) &&
+      !ctype_isarray(ct->info))
+    return 0;
+  for (ct = ctype_child(cts, ct); ctype_isattrib(ct->info);
+       ct = ctype_child(cts, ct))
+    if (ctype_attrib(ct->info) == CTA_QUAL) qual |= ct->size;
+  qual |= (ct->info & CTF_QUAL);
+  if ((qual & (store ? CTF_QUAL : CTF_VOLATILE))) return 0;
+  return ctype_isfp(ct->info) && ct->size == sizeof(double);
+}
+
+/* Specialize to the CTypeID of an array and get the pointer to its data. */
+TRef lj_crecord_vecarray(jit_State *J, TRef tr, cTValue *o)
+{
+  GCcdata *cd = argv2cdata(J, tr, o);
+  CType *ct = ctype_raw(ctype_ctsG(J2G(J)), cd->ctypeid);
+  if (ctype_isptr(ct->info)) {
+    IRType t = (LJ_64 && ct->size == 8) ? IRT_P64 : IRT_P32;
+    return emitir(IRT(IR_FLOAD, t), tr, IRFL_CDATA_PTR);
+  }
+  return emitir(IRT(IR_ADD, IRT_PTR), tr, lj_ir_kintp(J, sizeof(GCcdata)));
+}
+#endif
+
 #undef IR
 #undef emitir
 #undef emitconv
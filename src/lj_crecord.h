@@ -33,6 +33,10 @@ LJ_FUNC int LJ_FASTCALL recff_bit64_shift(jit_State *J, RecordFFData *rd);
 LJ_FUNC TRef recff_bit64_tohex(jit_State *J, RecordFFData *rd, TRef hdr);
 
 LJ_FUNC void LJ_FASTCALL lj_crecord_tonumber(jit_State *J, RecordFFData *rd);
+#if LJ_HASVEC
+LJ_FUNC int lj_crecord_isvecarray(jit_State *J, cTValue *o, int store);
+LJ_FUNC TRef lj_crecord_vecarray(jit_State *J, TRef tr, cTValue *o);
+#endif
 #endif
 
 #endif
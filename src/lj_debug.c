@@ -352,7 +352,7 @@ void lj_debug_addloc(lua_State *L, const char *msg,
 {
   if (frame) {
     GCfunc *fn = frame_func(frame);
-    if (isluafunc(fn)) {
+    if (isluafunc(fn) && funcproto(fn)->firstline != ~(BCLine)0) {
       BCLine line = debug_frameline(L, fn, nextframe);
       if (line >= 0) {
 	GCproto *pt = funcproto(fn);
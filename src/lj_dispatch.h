@@ -124,11 +124,17 @@ typedef struct GG_State {
 #define hotcount_set(gg, pc, val) \
   (hotcount_get((gg), (pc)) = (HotCount)(val))
 
+/* Loop hotcounts live in the LOOPHC after the loop instruction.
+** ITERN shares the LOOPHC following its ITERL.
+*/
+#define hotcount_loop_pc(pc) \
+  ((pc) + 1 + (bc_op(*(pc)) == BC_ITERN))
+
 #define hotcount_loop_get(pc) \
-  ((HotCount)(((pc)[1]) >> 16))
+  ((HotCount)((*hotcount_loop_pc(pc)) >> 16))
 
 #define hotcount_loop_set(pc, val) \
-  (pc)[1] = (((pc)[1] & 0xffff) | ((val) << 16))
+  (*hotcount_loop_pc(pc) = ((*hotcount_loop_pc(pc) & 0xffff) | ((val) << 16)))
 
 /* Dispatch table management. */
 LJ_FUNC void lj_dispatch_init(GG_State *GG);
@@ -525,6 +525,9 @@ static void emit_call_(ASMState *as, MCode *target)
 #define VEX_64IR(ir, r)		(r)
 #endif
 
+/* Register operand in the VEX.vvvv field. */
+#define VEX_VREG(r)		((uint32_t)((r) & (LJ_64 ? 15 : 7)) << 19)
+
 /* Generic move between two regs. */
 static void emit_movrr(ASMState *as, IRIns *ir, Reg dst, Reg src)
 {
@@ -16,6 +16,8 @@ ERRDEF(UDATAOV,	"userdata length overflow")
 ERRDEF(STKOV,	"stack overflow")
 ERRDEF(STKOVM,	"stack overflow (%s)")
 ERRDEF(TABOV,	"table overflow")
+ERRDEF(TABFROZ,	"attempt to modify a frozen table")
+ERRDEF(TABFRWK,	"cannot freeze a weak table")
 
 /* Table indexing. */
 ERRDEF(NANIDX,	"table index is NaN")
@@ -79,8 +81,10 @@ ERRDEF(CORUN,	"cannot resume running coroutine")
 ERRDEF(CODEAD,	"cannot resume dead coroutine")
 ERRDEF(COSUSP,	"cannot resume non-suspended coroutine")
 ERRDEF(TABINS,	"wrong number of arguments to " LUA_QL("insert"))
-ERRDEF(TABCAT,	"invalid value (%s) at index %d in table for " LUA_QL("concat"))
 ERRDEF(TABSORT,	"invalid order function for sorting")
+ERRDEF(TABMOVE,	"too many elements to move")
+ERRDEF(TABWRAP,	"destination wrap around")
+ERRDEF(TABCAT,	"invalid value (%s) at index %d in table for " LUA_QL("concat"))
 ERRDEF(IOCLFL,	"attempt to use a closed file")
 ERRDEF(IOSTDCL,	"standard file is closed")
 ERRDEF(OSUNIQF,	"unable to generate a unique filename")
@@ -12,6 +12,7 @@
 
 #include "lj_err.h"
 #include "lj_str.h"
+#include "lj_state.h"
 #include "lj_tab.h"
 #include "lj_frame.h"
 #include "lj_bc.h"
@@ -26,8 +27,10 @@
 #include "lj_crecord.h"
 #include "lj_dispatch.h"
 #include "lj_vm.h"
+#include "lj_char.h"
 #include "lj_strscan.h"
 #include "lj_strfmt.h"
+#include "lj_strmatch.h"
 
 /* Some local macros to save typing. Undef'd at the end. */
 #define IR(ref)			(&J->cur.ir[(ref)])
@@ -228,6 +231,7 @@ static void LJ_FASTCALL recff_setmetatable(jit_State *J, RecordFFData *rd)
     ix.tab = tr;
     copyTV(J->L, &ix.tabv, &rd->argv[0]);
     lj_record_mm_lookup(J, &ix, MM_metatable); /* Guard for no __metatable. */
+    lj_record_unfrozen(J, tr, tabV(&rd->argv[0]));
     fref = emitir(IRT(IR_FREF, IRT_PGC), tr, IRFL_TAB_META);
     mtref = tref_isnil(mt) ? lj_ir_knull(J, IRT_TAB) : mt;
     emitir(IRT(IR_FSTORE, IRT_TAB), fref, mtref);
@@ -330,6 +334,51 @@ static void LJ_FASTCALL recff_select(jit_State *J, RecordFFData *rd)
   }  /* else: Interpreter will throw. */
 }
 
+/* Specialize unpack() to the number of results seen while recording. */
+static void LJ_FASTCALL recff_unpack(jit_State *J, RecordFFData *rd)
+{
+  RecordIndex ix;
+  ix.tab = J->base[0];
+  if (tref_istab(ix.tab)) {
+    GCtab *t = tabV(&rd->argv[0]);
+    TRef trstart, trend;
+    int32_t start, end;
+    if (tref_isnil(J->base[1])) {
+      start = 1;
+      trstart = lj_ir_kint(J, 1);
+    } else {
+      start = argv2int(J, &rd->argv[1]);
+      trstart = lj_opt_narrow_toint(J, J->base[1]);
+    }
+    if (J->base[1] && !tref_isnil(J->base[2])) {
+      end = argv2int(J, &rd->argv[2]);
+      trend = lj_opt_narrow_toint(J, J->base[2]);
+    } else {
+      end = (int32_t)lj_tab_len(t);
+      trend = lj_ir_call(J, IRCALL_lj_tab_len, ix.tab);
+    }
+    if (start <= end) {
+      ptrdiff_t i, n = (ptrdiff_t)end - start + 1;
+      TRef tmp = emitir(IRTI(IR_SUB), trend, trstart);
+      if (J->baseslot + n > LJ_MAX_JSLOTS)
+	lj_trace_err_info(J, LJ_TRERR_STACKOV);
+      emitir(IRTGI(IR_EQ), tmp, lj_ir_kint(J, (int32_t)(n-1)));
+      settabV(J->L, &ix.tabv, t);
+      for (i = 0; i < n; i++) {
+	ix.val = 0; ix.idxchain = 0;
+	setintV(&ix.keyv, start + (int32_t)i);
+	ix.key = i ? emitir(IRTI(IR_ADD), trstart, lj_ir_kint(J, (int32_t)i)) :
+		     trstart;
+	J->base[i] = lj_record_idx(J, &ix);
+      }
+      rd->nres = n;
+    } else {  /* Empty range: return no results. */
+      emitir(IRTGI(IR_LT), trend, trstart);
+      rd->nres = 0;
+    }
+  }  /* else: Interpreter will throw. */
+}
+
 static void LJ_FASTCALL recff_tonumber(jit_State *J, RecordFFData *rd)
 {
   TRef tr = J->base[0];
@@ -505,6 +554,57 @@ static void LJ_FASTCALL recff_getfenv(jit_State *J, RecordFFData *rd)
   recff_nyiu(J, rd);
 }
 
+/* -- Coroutine library fast functions ------------------------------------ */
+
+/* The status of a coroutine only changes in calls with side effects, e.g.
+** resume or yield, which end the trace anyway. Specialize to the status
+** and the yieldability seen while recording.
+**
+** NYI: resume and yield. A trace can't switch to another Lua stack, and
+** the resume runs in a nested C frame, which a trace exit can't rebuild.
+** The traces on both sides of a switch are stitched instead.
+*/
+
+static void LJ_FASTCALL recff_coroutine_status(jit_State *J, RecordFFData *rd)
+{
+  TRef tr = J->base[0];
+  if (tref_isthread(tr)) {
+    int32_t st = lj_state_costatus(J->L, threadV(&rd->argv[0]));
+    TRef trst = lj_ir_call(J, IRCALL_lj_state_costatus, tr);
+    emitir(IRTGI(IR_EQ), trst, lj_ir_kint(J, st));
+    J->base[0] = lj_ir_kstr(J, lj_str_newz(J->L, lj_state_costatusname[st]));
+  }  /* else: Interpreter will throw. */
+}
+
+static void LJ_FASTCALL recff_coroutine_running(jit_State *J, RecordFFData *rd)
+{
+  TRef trl = emitir(IRT(IR_LREF, IRT_THREAD), 0, 0);
+  lua_State *mainth = mainthread(J2G(J));
+  int ismain = (J->L == mainth);
+  emitir(IRTG(ismain ? IR_EQ : IR_NE, IRT_THREAD), trl,
+	 lj_ir_kgc(J, obj2gco(mainth), IRT_THREAD));
+#if LJ_52
+  J->base[0] = trl;
+  J->base[1] = ismain ? TREF_TRUE : TREF_FALSE;
+  rd->nres = 2;
+#else
+  UNUSED(rd);
+  J->base[0] = ismain ? TREF_NIL : trl;
+#endif
+}
+
+static void LJ_FASTCALL recff_coroutine_isyieldable(jit_State *J,
+						    RecordFFData *rd)
+{
+  /* The recorder runs in a protected call. Check the frame of its caller. */
+  void *cf = cframe_prev(cframe_raw(J->L->cframe));
+  int32_t canyield = cframe_canyield(cf) ? 1 : 0;
+  TRef tr = lj_ir_call(J, IRCALL_lj_state_canyield);
+  emitir(IRTGI(IR_EQ), tr, lj_ir_kint(J, canyield));
+  J->base[0] = canyield ? TREF_TRUE : TREF_FALSE;
+  UNUSED(rd);
+}
+
 /* -- Math library fast functions ----------------------------------------- */
 
 static void LJ_FASTCALL recff_math_abs(jit_State *J, RecordFFData *rd)
@@ -904,6 +1004,43 @@ static void LJ_FASTCALL recff_string_op(jit_State *J, RecordFFData *rd)
   J->base[0] = emitir(IRT(IR_BUFSTR, IRT_STR), tr, hdr);
 }
 
+/* Load a result of the last pattern match on trace. */
+static TRef recff_strmatch_load(jit_State *J, IRType t, void *p)
+{
+  return emitir(IRT(IR_XLOAD, t), lj_ir_kptr(J, p), IRXLOAD_VOLATILE);
+}
+
+/* Return the match or the captures of a pattern match. */
+static void recff_strmatch_results(jit_State *J, RecordFFData *rd,
+				   int32_t ncap, uint32_t poscap, int find)
+{
+  StrMatchResult *res = &J->strmatch;
+  TRef *base = J->base;
+  int32_t i;
+  if (J->baseslot + ncap + 2 > LJ_MAX_JSLOTS)
+    lj_trace_err_info(J, LJ_TRERR_STACKOV);
+  if (find) {  /* string.find returns the position of the match first. */
+    TRef trpos = recff_strmatch_load(J, IRT_INT, &res->pos);
+    TRef trlen = recff_strmatch_load(J, IRT_INT, &res->len[0]);
+    base[0] = emitir(IRTI(IR_ADD), trpos, lj_ir_kint(J, 1));
+    base[1] = emitir(IRTI(IR_ADD), trpos, trlen);
+    base += 2;
+  } else if (ncap == 0) {  /* Otherwise the whole match is returned. */
+    ncap = -1;
+  }
+  for (i = 0; i < (ncap < 0 ? 1 : ncap); i++) {
+    int32_t k = ncap < 0 ? 0 : i+1;
+    TRef trlen = recff_strmatch_load(J, IRT_INT, &res->len[k]);
+    if ((poscap & (1u << i)) && ncap >= 0) {
+      base[i] = trlen;
+    } else {
+      TRef trptr = recff_strmatch_load(J, IRT_PGC, &res->ptr[k]);
+      base[i] = emitir(IRT(IR_SNEW, IRT_STR), trptr, trlen);
+    }
+  }
+  rd->nres = (find ? 2 : 0) + (ncap < 0 ? 1 : ncap);
+}
+
 static void LJ_FASTCALL recff_string_find(jit_State *J, RecordFFData *rd)
 {
   TRef trstr = lj_ir_tostr(J, J->base[0]);
@@ -936,7 +1073,7 @@ static void LJ_FASTCALL recff_string_find(jit_State *J, RecordFFData *rd)
 #endif
   }
   /* Fixed arg or no pattern matching chars? (Specialized to pattern string.) */
-  if ((J->base[2] && tref_istruecond(J->base[3])) ||
+  if ((rd->data && J->base[2] && tref_istruecond(J->base[3])) ||
       (emitir(IRTG(IR_EQ, IRT_STR), trpat, lj_ir_kstr(J, pat)),
        !lj_str_haspattern(pat))) {  /* Search for fixed string. */
     TRef trsptr = emitir(IRT(IR_STRREF, IRT_PGC), trstr, trstart);
@@ -947,20 +1084,124 @@ static void LJ_FASTCALL recff_string_find(jit_State *J, RecordFFData *rd)
     TRef trp0 = lj_ir_kkptr(J, NULL);
     if (lj_str_find(strdata(str)+(MSize)start, strdata(pat),
 		    str->len-(MSize)start, pat->len)) {
-      TRef pos;
       emitir(IRTG(IR_NE, IRT_PGC), tr, trp0);
-      pos = emitir(IRTI(IR_SUB), tr, emitir(IRT(IR_STRREF, IRT_PGC), trstr, tr0));
-      J->base[0] = emitir(IRTI(IR_ADD), pos, lj_ir_kint(J, 1));
-      J->base[1] = emitir(IRTI(IR_ADD), pos, trplen);
-      rd->nres = 2;
+      if (rd->data) {
+	TRef pos;
+	pos = emitir(IRTI(IR_SUB), tr, emitir(IRT(IR_STRREF, IRT_PGC), trstr, tr0));
+	J->base[0] = emitir(IRTI(IR_ADD), pos, lj_ir_kint(J, 1));
+	J->base[1] = emitir(IRTI(IR_ADD), pos, trplen);
+	rd->nres = 2;
+      } else {  /* string.match returns the pattern itself. */
+	J->base[0] = trpat;
+      }
     } else {
       emitir(IRTG(IR_EQ, IRT_PGC), tr, trp0);
       J->base[0] = TREF_NIL;
     }
   } else {  /* Search for pattern. */
+    uint32_t poscap;
+    int32_t ncap = lj_strmatch_captures(pat, &poscap);
+    MatchState ms;
+    const char *pstr = strdata(pat), *e;
+    int anchor = 0;
+    TRef tr;
+    if (ncap < 0) {  /* NYI: patterns that may throw an error. */
+      recff_nyiu(J, rd);
+      return;
+    }
+    if (*pstr == '^') { pstr++; anchor = 1; }
+    tr = lj_ir_call(J, IRCALL_lj_strmatch_jit, trstr, trpat, trstart);
+    lj_strmatch_init(&ms, J->L, strdata(str), str->len, pat);
+    if (lj_strmatch_find(&ms, strdata(str)+(MSize)start, pstr, anchor, &e)) {
+      emitir(IRTGI(IR_NE), tr, tr0);
+      recff_strmatch_results(J, rd, ncap, poscap, (int)rd->data);
+    } else {
+      emitir(IRTGI(IR_EQ), tr, tr0);
+      J->base[0] = TREF_NIL;
+    }
+  }
+}
+
+static void LJ_FASTCALL recff_string_gmatch_aux(jit_State *J, RecordFFData *rd)
+{
+  GCfunc *fn = J->fn;
+  GCstr *str = strV(&fn->c.upvalue[0]);
+  GCstr *pat = strV(&fn->c.upvalue[1]);
+  MSize pos = fn->c.upvalue[2].u32.lo;
+  uint32_t poscap;
+  int32_t ncap = lj_strmatch_captures(pat, &poscap);
+  MatchState ms;
+  const char *e;
+  TRef tr;
+  if (ncap < 0) {  /* NYI: patterns that may throw an error. */
     recff_nyiu(J, rd);
     return;
   }
+  /* Specialized to the pattern, which is checked by the helper. */
+  tr = lj_ir_call(J, IRCALL_lj_strmatch_gmatch_jit, J->base[-1-LJ_FR2],
+		  lj_ir_kstr(J, pat));
+  lj_strmatch_init(&ms, J->L, strdata(str), str->len, pat);
+  if (pos <= str->len &&
+      lj_strmatch_find(&ms, strdata(str) + pos, strdata(pat), 0, &e)) {
+    /* Update the position only after the guard. Exits must not skip a match. */
+    TRef trpos = emitir(IRT(IR_ADD, IRT_PGC), J->base[-1-LJ_FR2],
+      lj_ir_kint(J, (int32_t)offsetof(GCfuncC, upvalue[2].u32.lo)));
+    emitir(IRTGI(IR_EQ), tr, lj_ir_kint(J, 1));
+    emitir(IRT(IR_XSTORE, IRT_INT), trpos,
+	   recff_strmatch_load(J, IRT_INT, &J->strmatch.pos));
+    recff_strmatch_results(J, rd, ncap, poscap, 0);
+  } else {
+    emitir(IRTGI(IR_EQ), tr, lj_ir_kint(J, 0));
+    J->base[0] = TREF_NIL;
+  }
+}
+
+static void LJ_FASTCALL recff_string_gsub(jit_State *J, RecordFFData *rd)
+{
+  TRef trstr = lj_ir_tostr(J, J->base[0]);
+  TRef trpat = lj_ir_tostr(J, J->base[1]);
+  TRef trrepl = J->base[2];
+  if (tref_isstr(trrepl) && !J->base[3]) {
+    GCstr *pat = argv2str(J, &rd->argv[1]);
+    GCstr *repl = strV(&rd->argv[2]);
+    int32_t ncap = lj_strmatch_captures(pat, NULL);
+    const char *r = strdata(repl);
+    MSize i;
+    for (i = 0; ncap >= 0 && i < repl->len; i++)
+      if (r[i] == '%' && lj_char_isdigit((uint8_t)r[++i]) && r[i] != '0' &&
+	  r[i] - '1' >= (ncap ? ncap : 1))
+	ncap = -1;  /* Invalid capture index. */
+    if (ncap >= 0) {  /* Specialized to pattern and replacement string. */
+      TRef hdr, tr;
+      emitir(IRTG(IR_EQ, IRT_STR), trpat, lj_ir_kstr(J, pat));
+      emitir(IRTG(IR_EQ, IRT_STR), trrepl, lj_ir_kstr(J, repl));
+      hdr = recff_bufhdr(J);
+      tr = lj_ir_call(J, IRCALL_lj_strmatch_gsub_jit, hdr, trstr, trpat, trrepl);
+      J->base[0] = emitir(IRT(IR_BUFSTR, IRT_STR), tr, hdr);
+      J->base[1] = recff_strmatch_load(J, IRT_INT, &J->strmatch.pos);
+      rd->nres = 2;
+      return;
+    }
+  }
+  recff_nyiu(J, rd);  /* NYI: replacement functions and tables. */
+}
+
+/* Convert an argument for %s or %q, like string_fmt_tostring(). */
+static TRef recff_format_tostr(jit_State *J, TRef tr, TValue *o)
+{
+  RecordIndex ix;
+  if (tref_isstr(tr))
+    return tr;
+  if (!tr || !(tref_isnumber(tr) || tref_ispri(tr)))
+    return 0;  /* NYI: other types. */
+  ix.tab = tr;
+  copyTV(J->L, &ix.tabv, o);
+  if (lj_record_mm_lookup(J, &ix, MM_tostring))
+    return 0;  /* NYI: __tostring. */
+  if (tref_isnumber(tr))
+    return emitir(IRT(IR_TOSTR, IRT_STR), tr,
+		  tref_isnum(tr) ? IRTOSTR_NUM : IRTOSTR_INT);
+  return lj_ir_kstr(J, lj_strfmt_obj(J->L, o));
 }
 
 static void LJ_FASTCALL recff_string_format(jit_State *J, RecordFFData *rd)
@@ -1015,8 +1256,9 @@ static void LJ_FASTCALL recff_string_format(jit_State *J, RecordFFData *rd)
       if (LJ_SOFTFP32) lj_needsplit(J);
       break;
     case STRFMT_STR:
-      if (!tref_isstr(tra)) {
-	recff_nyiu(J, rd);  /* NYI: __tostring and non-string types for %s. */
+      tra = recff_format_tostr(J, tra, &rd->argv[arg-1]);
+      if (!tra) {
+	recff_nyiu(J, rd);
 	return;
       }
       if (sf == STRFMT_STR)  /* Shortcut for plain %s. */
@@ -1034,7 +1276,14 @@ static void LJ_FASTCALL recff_string_format(jit_State *J, RecordFFData *rd)
       else
 	tr = lj_ir_call(J, IRCALL_lj_strfmt_putfchar, tr, trsf, tra);
       break;
-    case STRFMT_PTR:  /* NYI */
+    case STRFMT_PTR:
+      if (!(tref_isstr(tra) || tref_istab(tra) || tref_isfunc(tra) ||
+	    tref_isthread(tra))) {
+	recff_nyiu(J, rd);  /* NYI: object data pointers and non-GC types. */
+	return;
+      }
+      tr = lj_ir_call(J, IRCALL_lj_strfmt_putptr, tr, tra);
+      break;
     case STRFMT_ERR:
     default:
       recff_nyiu(J, rd);
@@ -1046,6 +1295,28 @@ static void LJ_FASTCALL recff_string_format(jit_State *J, RecordFFData *rd)
 
 /* -- Table library fast functions ---------------------------------------- */
 
+/* Store to an array slot, which is known to be inside the array part. */
+static void recff_table_astore(jit_State *J, TRef tab, TRef key, TRef val)
+{
+  TRef tr = emitir(IRT(IR_FLOAD, IRT_PGC), tab, IRFL_TAB_ARRAY);
+  tr = emitir(IRT(IR_AREF, IRT_PGC), tr, key);
+  if (!LJ_DUALNUM && tref_isinteger(val))
+    val = emitir(IRTN(IR_CONV), val, IRCONV_NUM_INT);
+  emitir(IRT(IR_ASTORE, tref_type(val)), tr, val);
+  if (tref_isgcv(val))
+    emitir(IRT(IR_TBAR, IRT_NIL), tab, 0);
+}
+
+/* Move a block of array slots with lj_tab_amove() and check it succeeded.
+** The guard must come before any other store, since the snapshot for the
+** fast function call is used to fall back to the interpreter.
+*/
+static void recff_table_amove(jit_State *J, TRef tab, TRef d, TRef s, TRef n)
+{
+  TRef tr = lj_ir_call(J, IRCALL_lj_tab_amove, tab, d, tab, s, n);
+  emitir(IRTGI(IR_NE), tr, lj_ir_kint(J, 0));
+}
+
 static void LJ_FASTCALL recff_table_insert(jit_State *J, RecordFFData *rd)
 {
   RecordIndex ix;
@@ -1053,18 +1324,113 @@ static void LJ_FASTCALL recff_table_insert(jit_State *J, RecordFFData *rd)
   ix.val = J->base[1];
   rd->nres = 0;
   if (tref_istab(ix.tab) && ix.val) {
+    GCtab *t = tabV(&rd->argv[0]);
     if (!J->base[2]) {  /* Simple push: t[#t+1] = v */
       TRef trlen = lj_ir_call(J, IRCALL_lj_tab_len, ix.tab);
-      GCtab *t = tabV(&rd->argv[0]);
       ix.key = emitir(IRTI(IR_ADD), trlen, lj_ir_kint(J, 1));
       settabV(J->L, &ix.tabv, t);
       setintV(&ix.keyv, lj_tab_len(t) + 1);
       ix.idxchain = 0;
       lj_record_idx(J, &ix);  /* Set new value. */
-    } else {  /* Complex case: insert in the middle. */
-      recff_nyiu(J, rd);
-      return;
+    } else if (!J->base[3]) {  /* Insert in the middle: move up t[pos..#t]. */
+      int32_t len = (int32_t)lj_tab_len(t);
+      int32_t pos = argv2int(J, &rd->argv[1]);
+      if (pos >= 1 && pos <= len+1 && (MSize)len+2 <= t->asize) {
+	TRef trlen = lj_ir_call(J, IRCALL_lj_tab_len, ix.tab);
+	TRef trpos = lj_opt_narrow_toint(J, J->base[1]);
+	TRef trpos1 = emitir(IRTI(IR_SUB), trpos, lj_ir_kint(J, 1));
+	emitir(IRTGI(IR_ULE), trpos1, trlen);
+	recff_table_amove(J, ix.tab,
+			  emitir(IRTI(IR_ADD), trpos, lj_ir_kint(J, 1)), trpos,
+			  emitir(IRTI(IR_SUB), trlen, trpos1));
+	recff_table_astore(J, ix.tab, trpos, J->base[2]);  /* Set new value. */
+	J->needsnap = 1;
+      } else {  /* Outside of the array part or invalid position. */
+	recff_nyiu(J, rd);
+      }
+    }  /* else: Interpreter will throw. */
+  }  /* else: Interpreter will throw. */
+}
+
+static void LJ_FASTCALL recff_table_remove(jit_State *J, RecordFFData *rd)
+{
+  RecordIndex ix;
+  ix.tab = J->base[0];
+  rd->nres = 0;
+  if (tref_istab(ix.tab)) {
+    GCtab *t = tabV(&rd->argv[0]);
+    int32_t len = (int32_t)lj_tab_len(t);
+    TRef trlen = lj_ir_call(J, IRCALL_lj_tab_len, ix.tab);
+    settabV(J->L, &ix.tabv, t);
+    ix.idxchain = 0;
+    if (tref_isnil(J->base[1])) {  /* Simple pop: t[#t] = nil */
+      emitir(IRTGI(len ? IR_NE : IR_EQ), trlen, lj_ir_kint(J, 0));
+      if (len) {
+	ix.key = trlen;
+	setintV(&ix.keyv, len);
+	ix.val = 0;
+	J->base[0] = lj_record_idx(J, &ix);  /* Load previous value. */
+	rd->nres = 1;
+	ix.val = TREF_NIL;
+	lj_record_idx(J, &ix);  /* Remove value. */
+      }
+    } else {  /* Remove in the middle: move down t[pos+1..#t]. */
+      int32_t pos = argv2int(J, &rd->argv[1]);
+      TRef trpos = lj_opt_narrow_toint(J, J->base[1]);
+      TRef trpos1 = emitir(IRTI(IR_SUB), trpos, lj_ir_kint(J, 1));
+      if (pos >= 1 && pos <= len) {
+	if ((MSize)len+1 > t->asize) {  /* Outside of the array part. */
+	  recff_nyiu(J, rd);
+	  return;
+	}
+	emitir(IRTGI(IR_ULT), trpos1, trlen);
+	ix.key = trpos;
+	setintV(&ix.keyv, pos);
+	ix.val = 0;
+	J->base[0] = lj_record_idx(J, &ix);  /* Load previous value. */
+	rd->nres = 1;
+	recff_table_amove(J, ix.tab, trpos,
+			  emitir(IRTI(IR_ADD), trpos, lj_ir_kint(J, 1)),
+			  emitir(IRTI(IR_SUB), trlen, trpos));
+	recff_table_astore(J, ix.tab, trlen, TREF_NIL);  /* Remove last value. */
+	J->needsnap = 1;
+      } else {  /* Nothing to remove. */
+	emitir(IRTGI(IR_UGE), trpos1, trlen);
+      }
+    }
+  }  /* else: Interpreter will throw. */
+}
+
+static void LJ_FASTCALL recff_table_move(jit_State *J, RecordFFData *rd)
+{
+  TRef a1 = J->base[0], a2 = J->base[4];
+  if (tref_istab(a1) && J->base[1] && J->base[2] && J->base[3]) {
+    int32_t f = argv2int(J, &rd->argv[1]);
+    int32_t e = argv2int(J, &rd->argv[2]);
+    TRef trf = lj_opt_narrow_toint(J, J->base[1]);
+    TRef tre = lj_opt_narrow_toint(J, J->base[2]);
+    TRef trt = lj_opt_narrow_toint(J, J->base[3]);
+    if (!a2 || tref_isnil(a2))
+      a2 = a1;
+    else if (!tref_istab(a2))
+      return;  /* Interpreter will throw. */
+    if (e >= f) {
+      int64_t n = (int64_t)e - f + 1;
+      TRef trn;
+      if (n > 0x7fffffff || argv2int(J, &rd->argv[3]) + n - 1 > 0x7fffffff)
+	return;  /* Interpreter will throw. */
+      trn = emitir(IRTGI(IR_SUBOV), tre, trf);
+      emitir(IRTGI(IR_GE), tre, trf);
+      emitir(IRTGI(IR_ADDOV), trt, trn);  /* The destination must not wrap. */
+      trn = emitir(IRTGI(IR_ADDOV), trn, lj_ir_kint(J, 1));
+      lj_record_unfrozen(J, a2, tabV(a2 == a1 ? &rd->argv[0] : &rd->argv[4]));
+      lj_ir_call(J, IRCALL_lj_tab_move, a2, trt, a1, trf, trn);
+      J->needsnap = 1;
+    } else {
+      emitir(IRTGI(IR_LT), tre, trf);
     }
+    J->base[0] = a2;
+    rd->nres = 1;
   }  /* else: Interpreter will throw. */
 }
 
@@ -1100,6 +1466,7 @@ static void LJ_FASTCALL recff_table_clear(jit_State *J, RecordFFData *rd)
   TRef tr = J->base[0];
   if (tref_istab(tr)) {
     rd->nres = 0;
+    lj_record_unfrozen(J, tr, tabV(&rd->argv[0]));
     lj_ir_call(J, IRCALL_lj_tab_clear, tr);
     J->needsnap = 1;
   }  /* else: Interpreter will throw. */
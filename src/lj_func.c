@@ -19,6 +19,7 @@
 
 void LJ_FASTCALL lj_func_freeproto(global_State *g, GCproto *pt)
 {
+  lj_gc_acctdec(g, ~LJ_TPROTO, pt->sizept);
   lj_mem_free(g, pt, pt->sizept);
 }
 
@@ -50,6 +51,7 @@ static GCupval *func_finduv(lua_State *L, TValue *slot)
   }
   /* No matching upvalue found. Create a new one. */
   uv = lj_mem_newt(L, sizeof(GCupval), GCupval);
+  lj_gc_acctinc(g, ~LJ_TUPVAL, sizeof(GCupval));
   newwhite(g, uv);
   uv->gct = ~LJ_TUPVAL;
   uv->closed = 0;  /* Still open. */
@@ -69,6 +71,7 @@ static GCupval *func_finduv(lua_State *L, TValue *slot)
 static GCupval *func_emptyuv(lua_State *L)
 {
   GCupval *uv = (GCupval *)lj_mem_newgco(L, sizeof(GCupval));
+  lj_gc_acctinc(G(L), ~LJ_TUPVAL, sizeof(GCupval));
   uv->gct = ~LJ_TUPVAL;
   uv->closed = 1;
   setnilV(&uv->tv);
@@ -95,10 +98,26 @@ void LJ_FASTCALL lj_func_closeuv(lua_State *L, TValue *level)
   }
 }
 
+#if LJ_HASJIT
+/* Count the open upvalues pointing to some stack level or above. */
+int32_t LJ_FASTCALL lj_func_countuv(lua_State *L, TValue *level)
+{
+  GCupval *uv;
+  GCRef *pp = &L->openupval;
+  int32_t n = 0;
+  while (gcref(*pp) != NULL && uvval((uv = gco2uv(gcref(*pp)))) >= level) {
+    pp = &uv->nextgc;
+    n++;
+  }
+  return n;
+}
+#endif
+
 void LJ_FASTCALL lj_func_freeuv(global_State *g, GCupval *uv)
 {
   if (!uv->closed)
     unlinkuv(uv);
+  lj_gc_acctdec(g, ~LJ_TUPVAL, sizeof(GCupval));
   lj_mem_freet(g, uv);
 }
 
@@ -107,6 +126,7 @@ void LJ_FASTCALL lj_func_freeuv(global_State *g, GCupval *uv)
 GCfunc *lj_func_newC(lua_State *L, MSize nelems, GCtab *env)
 {
   GCfunc *fn = (GCfunc *)lj_mem_newgco(L, sizeCfunc(nelems));
+  lj_gc_acctinc(G(L), ~LJ_TFUNC, sizeCfunc(nelems));
   fn->c.gct = ~LJ_TFUNC;
   fn->c.ffid = FF_C;
   fn->c.nupvalues = (uint8_t)nelems;
@@ -120,6 +140,7 @@ static GCfunc *func_newL(lua_State *L, GCproto *pt, GCtab *env)
 {
   uint32_t count;
   GCfunc *fn = (GCfunc *)lj_mem_newgco(L, sizeLfunc((MSize)pt->sizeuv));
+  lj_gc_acctinc(G(L), ~LJ_TFUNC, sizeLfunc((MSize)pt->sizeuv));
   fn->l.gct = ~LJ_TFUNC;
   fn->l.ffid = FF_LUA;
   fn->l.nupvalues = 0;  /* Set to zero until upvalues are initialized. */
@@ -149,23 +170,22 @@ GCfunc *lj_func_newL_empty(lua_State *L, GCproto *pt, GCtab *env)
   return fn;
 }
 
-/* Do a GC check and create a new Lua function with inherited upvalues. */
-GCfunc *lj_func_newL_gc(lua_State *L, GCproto *pt, GCfuncL *parent)
+/* Create a new Lua function with inherited upvalues. */
+static GCfunc *func_newL_uv(lua_State *L, GCproto *pt, GCfuncL *parent,
+			    TValue *base)
 {
   GCfunc *fn;
   GCRef *puv;
   MSize i, nuv;
-  TValue *base;
-  lj_gc_check_fixtop(L);
   fn = func_newL(L, pt, tabref(parent->env));
   /* NOBARRIER: The GCfunc is new (marked white). */
   puv = parent->uvptr;
   nuv = pt->sizeuv;
-  base = L->base;
   for (i = 0; i < nuv; i++) {
     uint32_t v = proto_uv(pt)[i];
     GCupval *uv;
     if ((v & PROTO_UV_LOCAL)) {
+      lua_assert(base != NULL);
       uv = func_finduv(L, base + (v & 0xff));
       uv->immutable = ((v / PROTO_UV_IMMUTABLE) & 1);
       uv->dhash = (uint32_t)(uintptr_t)mref(parent->pc, char) ^ (v << 24);
@@ -178,10 +198,30 @@ GCfunc *lj_func_newL_gc(lua_State *L, GCproto *pt, GCfuncL *parent)
   return fn;
 }
 
+/* Do a GC check and create a new Lua function with inherited upvalues. */
+GCfunc *lj_func_newL_gc(lua_State *L, GCproto *pt, GCfuncL *parent)
+{
+  lj_gc_check_fixtop(L);
+  return func_newL_uv(L, pt, parent, L->base);
+}
+
+#if LJ_HASJIT
+/* Create a new Lua function from a trace or while restoring a trace exit.
+** L->base is not up-to-date on trace, so the frame base for local upvalues
+** is passed explicitly. The GC check is done by the trace.
+*/
+GCfunc *lj_func_newL_jit(lua_State *L, GCproto *pt, GCfuncL *parent,
+			 TValue *base)
+{
+  return func_newL_uv(L, pt, parent, base);
+}
+#endif
+
 void LJ_FASTCALL lj_func_free(global_State *g, GCfunc *fn)
 {
   MSize size = isluafunc(fn) ? sizeLfunc((MSize)fn->l.nupvalues) :
 			       sizeCfunc((MSize)fn->c.nupvalues);
+  lj_gc_acctdec(g, ~LJ_TFUNC, size);
   lj_mem_free(g, fn, size);
 }
 
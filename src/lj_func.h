@@ -14,11 +14,18 @@ LJ_FUNC void LJ_FASTCALL lj_func_freeproto(global_State *g, GCproto *pt);
 /* Upvalues. */
 LJ_FUNCA void LJ_FASTCALL lj_func_closeuv(lua_State *L, TValue *level);
 LJ_FUNC void LJ_FASTCALL lj_func_freeuv(global_State *g, GCupval *uv);
+#if LJ_HASJIT
+LJ_FUNC int32_t LJ_FASTCALL lj_func_countuv(lua_State *L, TValue *level);
+#endif
 
 /* Functions (closures). */
 LJ_FUNC GCfunc *lj_func_newC(lua_State *L, MSize nelems, GCtab *env);
 LJ_FUNC GCfunc *lj_func_newL_empty(lua_State *L, GCproto *pt, GCtab *env);
 LJ_FUNCA GCfunc *lj_func_newL_gc(lua_State *L, GCproto *pt, GCfuncL *parent);
+#if LJ_HASJIT
+LJ_FUNC GCfunc *lj_func_newL_jit(lua_State *L, GCproto *pt, GCfuncL *parent,
+				 TValue *base);
+#endif
 LJ_FUNC void LJ_FASTCALL lj_func_free(global_State *g, GCfunc *c);
 
 #endif
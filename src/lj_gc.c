@@ -14,6 +14,7 @@
 #include "lj_err.h"
 #include "lj_buf.h"
 #include "lj_str.h"
+#include "lj_strmatch.h"
 #include "lj_tab.h"
 #include "lj_func.h"
 #include "lj_udata.h"
@@ -27,6 +28,7 @@
 #include "lj_trace.h"
 #include "lj_vm.h"
 #include "lj_vmevent.h"
+#include "lj_alloc.h"
 
 #define GCSTEPSIZE	1024u
 #define GCSWEEPMAX	40
@@ -169,6 +171,8 @@ static int gc_traverse_tab(global_State *g, GCtab *t)
   GCtab *mt = tabref(t->metatable);
   if (mt)
     gc_markobj(g, mt);
+  if (gcref(t->shape))
+    gc_markobj(g, tabref(t->shape));
   mode = lj_meta_fastg(g, mt, MM_mode);
   if (mode && tvisstr(mode)) {  /* Valid __mode field? */
     const char *modestr = strVdata(mode);
@@ -300,6 +304,9 @@ static MSize gc_traverse_frames(global_State *g, lua_State *th)
 static void gc_traverse_thread(global_State *g, lua_State *th)
 {
   TValue *o, *top = th->top;
+  MSize used;
+  if (LJ_UNLIKELY(g->gc.emergency))  /* Slots above top may still be live. */
+    top = tvref(th->stack) + th->stacksize;
   for (o = tvref(th->stack)+1+LJ_FR2; o < top; o++)
     gc_marktv(g, o);
   if (g->gc.state == GCSatomic) {
@@ -308,7 +315,9 @@ static void gc_traverse_thread(global_State *g, lua_State *th)
       setnilV(o);
   }
   gc_markobj(g, tabref(th->env));
-  lj_state_shrinkstack(th, gc_traverse_frames(g, th));
+  used = gc_traverse_frames(g, th);
+  if (!g->gc.emergency)  /* The caller may hold pointers into the stack. */
+    lj_state_shrinkstack(th, used);
 }
 
 /* Propagate one gray object. Traverse it and turn it black. */
@@ -346,7 +355,8 @@ static size_t propagatemark(global_State *g)
     GCtrace *T = gco2trace(o);
     gc_traverse_trace(g, T);
     return ((sizeof(GCtrace)+7)&~7) + (T->nins-T->nk)*sizeof(IRIns) +
-	   T->nsnap*sizeof(SnapShot) + T->nsnapmap*sizeof(SnapEntry);
+	   T->nsnap*sizeof(SnapShot) +
+	   T->nsnapmap*(sizeof(SnapEntry)+sizeof(SnapRestore));
 #else
     lua_assert(0);
     return 0;
@@ -410,6 +420,8 @@ static GCRef *gc_sweep(global_State *g, GCRef *p, uint32_t lim)
       setgcrefr(*p, o->gch.nextgc);
       if (o == gcref(g->gc.root))
 	setgcrefr(g->gc.root, o->gch.nextgc);  /* Adjust list anchor. */
+      if (o == gcref(g->gc.anchored))
+	setgcrefr(g->gc.anchored, o->gch.nextgc);
       gc_freefunc[o->gch.gct - ~LJ_TSTR](g, o);
     }
   }
@@ -574,6 +586,25 @@ void lj_gc_freeall(global_State *g)
 
 /* -- Collector ----------------------------------------------------------- */
 
+/* Keep all objects that may not be anchored yet during an emergency GC.
+** These are the strings and the objects created since the last GC check.
+** They may still be partially initialized, so they are not traversed.
+*/
+static void gc_mark_unanchored(global_State *g)
+{
+  GCobj *o;
+  MSize i;
+  for (i = 0; i <= g->strmask; i++)
+    for (o = gcref(g->strhash[i]); o != NULL; o = gcnext(o))
+      gc_mark_str(gco2str(o));
+  for (o = gcref(g->gc.root); o != NULL && o != gcref(g->gc.anchored);
+       o = gcnext(o))
+    if (iswhite(o)) {
+      white2gray(o);
+      gray2black(o);
+    }
+}
+
 /* Atomic part of the GC cycle, transitioning from mark to sweep phase. */
 static void atomic(global_State *g, lua_State *L)
 {
@@ -598,10 +629,15 @@ static void atomic(global_State *g, lua_State *L)
   gc_mark_mmudata(g);  /* Mark them. */
   udsize += gc_propagate_gray(g);  /* And propagate the marks. */
 
+  if (LJ_UNLIKELY(g->gc.emergency))
+    gc_mark_unanchored(g);
+
   /* All marking done, clear weak tables. */
   gc_clearweak(gcref(g->gc.weak));
 
-  lj_buf_shrink(L, &g->tmpbuf);  /* Shrink temp buffer. */
+  if (!g->gc.emergency)  /* The allocation may be for the temp buffer. */
+    lj_buf_shrink(L, &g->tmpbuf);  /* Shrink temp buffer. */
+  lj_strmatch_flush(g, 0);  /* Free compiled patterns of dead strings. */
 
   /* Prepare for sweep phase. */
   g->gc.currentwhite = (uint8_t)otherwhite(g);  /* Flip current white. */
@@ -610,6 +646,17 @@ static void atomic(global_State *g, lua_State *L)
   g->gc.estimate = g->gc.total - (GCSize)udsize;  /* Initial estimate. */
 }
 
+/* Return the free memory of the built-in allocator to the OS. */
+static void gc_decommit(global_State *g)
+{
+#ifndef LUAJIT_USE_SYSMALLOC
+  if (g->allocf == lj_alloc_f)
+    lj_alloc_decommit(g->allocd, (size_t)g->gc.total);
+#else
+  UNUSED(g);
+#endif
+}
+
 /* GC state machine. Returns a cost estimate for each step performed. */
 static size_t gc_onestep(lua_State *L)
 {
@@ -646,7 +693,8 @@ static size_t gc_onestep(lua_State *L)
     lua_assert(old >= g->gc.total);
     g->gc.estimate -= old - g->gc.total;
     if (gcref(*mref(g->gc.sweep, GCRef)) == NULL) {
-      if (g->strnum <= (g->strmask >> 2) && g->strmask > LJ_MIN_STRTAB*2-1)
+      if (g->strnum <= (g->strmask >> 2) && g->strmask > LJ_MIN_STRTAB*2-1 &&
+	  !g->gc.emergency)
 	lj_str_resize(L, g->strmask >> 1);  /* Shrink string table. */
       if (gcref(g->gc.mmudata)) {  /* Need any finalizations? */
 	gc_setstate(g, GCSfinalize);
@@ -656,6 +704,7 @@ static size_t gc_onestep(lua_State *L)
       } else {  /* Otherwise skip this phase to help the JIT. */
 	gc_setstate(g, GCSpause);  /* End of GC cycle. */
 	g->gc.debt = 0;
+	gc_decommit(g);
       }
     }
     return GCSWEEPMAX*GCSWEEPCOST;
@@ -674,6 +723,7 @@ static size_t gc_onestep(lua_State *L)
 #endif
     gc_setstate(g, GCSpause);  /* End of GC cycle. */
     g->gc.debt = 0;
+    gc_decommit(g);
     return 0;
   default:
     lua_assert(0);
@@ -681,12 +731,33 @@ static size_t gc_onestep(lua_State *L)
   }
 }
 
+/* Soft memory limit. Start emergency collections above it. */
+#define gc_softlimit(g)		((g)->gc.limit - ((g)->gc.limit >> 3))
+
+/* Compute the threshold for the next GC cycle. */
+static GCSize gc_threshold(global_State *g)
+{
+  GCSize threshold = (g->gc.estimate/100) * g->gc.pause;
+  if (LJ_UNLIKELY(threshold > gc_softlimit(g)) && g->gc.limit != LJ_MAX_MEM) {
+    /* Don't collect over and over again, if the live data doesn't fit. */
+    threshold = g->gc.total < gc_softlimit(g) ? gc_softlimit(g) : g->gc.limit;
+  }
+  return threshold;
+}
+
 /* Perform a limited amount of incremental GC steps. */
 int LJ_FASTCALL lj_gc_step(lua_State *L)
 {
   global_State *g = G(L);
   GCSize lim;
   int32_t ostate = g->vmstate;
+  if (!tvref(g->jit_base))  /* Everything is anchored at a GC check. */
+    setgcrefr(g->gc.anchored, g->gc.root);
+  if (LJ_UNLIKELY(g->gc.total > gc_softlimit(g)) &&
+      g->gc.limit != LJ_MAX_MEM && !tvref(g->jit_base)) {
+    lj_gc_fullgc(L);  /* Emergency GC when approaching the memory limit. */
+    return 1;
+  }
   setvmstate(g, GC);
   lim = (GCSTEPSIZE/100) * g->gc.stepmul;
   if (lim == 0)
@@ -696,7 +767,7 @@ int LJ_FASTCALL lj_gc_step(lua_State *L)
   do {
     lim -= (GCSize)gc_onestep(L);
     if (g->gc.state == GCSpause) {
-      g->gc.threshold = (g->gc.estimate/100) * g->gc.pause;
+      g->gc.threshold = gc_threshold(g);
       g->vmstate = ostate;
       return 1;  /* Finished a GC cycle. */
     }
@@ -728,7 +799,9 @@ int LJ_FASTCALL lj_gc_step_jit(global_State *g, MSize steps)
   L->base = tvref(G(L)->jit_base);
   L->top = curr_topL(L);
   while (steps-- > 0 && lj_gc_step(L) == 0) {}
-  if ((G(L)->gc.state == GCSatomic || G(L)->gc.state == GCSfinalize)) {
+  if ((G(L)->gc.state == GCSatomic || G(L)->gc.state == GCSfinalize) ||
+      (G(L)->gc.total > gc_softlimit(G(L)) &&
+       G(L)->gc.limit != LJ_MAX_MEM)) {
     G(L)->gc.gcexit = 1;
     /* Return 1 to force a trace exit. */
     return 1;
@@ -758,7 +831,8 @@ void lj_gc_fullgc(lua_State *L)
   /* Now perform a full GC. */
   gc_setstate(g, GCSpause);
   do { gc_onestep(L); } while (g->gc.state != GCSpause);
-  g->gc.threshold = (g->gc.estimate/100) * g->gc.pause;
+  g->gc.threshold = gc_threshold(g);
+  setgcrefr(g->gc.anchored, g->gc.root);
   g->vmstate = ostate;
 }
 
@@ -822,11 +896,66 @@ void lj_gc_barriertrace(global_State *g, uint32_t traceno)
 
 /* -- Allocator ----------------------------------------------------------- */
 
+/* Emergency full GC from inside the allocator.
+**
+** Unlike a GC check, this may run while the caller holds references that
+** are not anchored anywhere. So it keeps all strings and all objects
+** created since the last GC check, doesn't shrink the stacks or the temp
+** buffer and leaves any finalizers to the next GC step.
+*/
+static void gc_emergency(lua_State *L)
+{
+  global_State *g = G(L);
+  int32_t ostate = g->vmstate;
+  setvmstate(g, GC);
+  g->gc.emergency = 1;
+  if (g->gc.state <= GCSatomic) {  /* Caught somewhere in the middle. */
+    setmref(g->gc.sweep, &g->gc.root);  /* Sweep everything (preserving it). */
+    setgcrefnull(g->gc.gray);  /* Reset lists from partial propagation. */
+    setgcrefnull(g->gc.grayagain);
+    setgcrefnull(g->gc.weak);
+    gc_setstate(g, GCSsweepstring);  /* Fast forward to the sweep phase. */
+    g->gc.sweepstr = 0;
+  }
+  while (g->gc.state == GCSsweepstring || g->gc.state == GCSsweep)
+    gc_onestep(L);  /* Finish sweep. */
+  gc_setstate(g, GCSpause);
+  do { gc_onestep(L); } while (g->gc.state != GCSpause &&
+			       g->gc.state != GCSfinalize);
+  g->gc.emergency = 0;
+  g->gc.threshold = gc_threshold(g);
+  g->vmstate = ostate;
+}
+
+/* Allocation of size bytes would exceed the memory limit. */
+static LJ_NOINLINE void gc_overlimit(lua_State *L, GCSize size)
+{
+  global_State *g = G(L);
+  if (g->gc.limit == LJ_MAX_MEM || g->vmstate == ~LJ_VMST_GC)
+    return;  /* No limit set or called by the GC itself. */
+  if (g->gc.threshold != LJ_MAX_MEM) {
+    /* Only from C code: the interpreter and the exit handler don't keep
+    ** L->top up to date, the JIT compiler and traces hold unanchored refs.
+    */
+    if (g->vmstate == ~LJ_VMST_C && !tvref(g->jit_base)) {
+      gc_emergency(L);
+      if (g->gc.total + size <= g->gc.limit)
+	return;  /* Fits now. */
+    }
+    g->gc.threshold = 0;  /* Force an emergency GC at the next GC check. */
+  }
+  /* Can't throw on trace. The next GC check forces a trace exit instead. */
+  if (!tvref(g->jit_base))
+    lj_err_mem(L);
+}
+
 /* Call pluggable memory allocator to allocate or resize a fragment. */
 void *lj_mem_realloc(lua_State *L, void *p, GCSize osz, GCSize nsz)
 {
   global_State *g = G(L);
   lua_assert((osz == 0) == (p == NULL));
+  if (LJ_UNLIKELY(nsz > osz && (g->gc.total - osz) + nsz > g->gc.limit))
+    gc_overlimit(L, nsz - osz);
   p = g->allocf(g->allocd, p, osz, nsz);
   if (p == NULL && nsz > 0)
     lj_err_mem(L);
@@ -840,7 +969,10 @@ void *lj_mem_realloc(lua_State *L, void *p, GCSize osz, GCSize nsz)
 void * LJ_FASTCALL lj_mem_newgco(lua_State *L, GCSize size)
 {
   global_State *g = G(L);
-  GCobj *o = (GCobj *)g->allocf(g->allocd, NULL, 0, size);
+  GCobj *o;
+  if (LJ_UNLIKELY(g->gc.total + size > g->gc.limit))
+    gc_overlimit(L, size);
+  o = (GCobj *)g->allocf(g->allocd, NULL, 0, size);
   if (o == NULL)
     lj_err_mem(L);
   lua_assert(checkptrGC(o));
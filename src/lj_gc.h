@@ -23,6 +23,7 @@ enum {
 #define LJ_GC_CDATA_FIN	0x10
 #define LJ_GC_FIXED	0x20
 #define LJ_GC_SFIXED	0x40
+#define LJ_GC_FROZEN	0x80	/* Only for tables. cdata use 0x80 for VLA. */
 
 #define LJ_GC_WHITES	(LJ_GC_WHITE0 | LJ_GC_WHITE1)
 #define LJ_GC_COLORS	(LJ_GC_WHITES | LJ_GC_BLACK)
@@ -44,6 +45,7 @@ enum {
 #define black2gray(x)	((x)->gch.marked &= (uint8_t)~LJ_GC_BLACK)
 #define fixstring(s)	((s)->marked |= LJ_GC_FIXED)
 #define markfinalized(x)	((x)->gch.marked |= LJ_GC_FINALIZED)
+#define tabisfrozen(t)	((t)->marked & LJ_GC_FROZEN)
 
 /* Collector. */
 LJ_FUNC size_t lj_gc_separateudata(global_State *g, int all);
@@ -106,6 +108,12 @@ static LJ_AINLINE void lj_gc_barrierback(global_State *g, GCtab *t)
   { if (iswhite(obj2gco(o)) && isblack(obj2gco(p))) \
       lj_gc_barrierf(G(L), obj2gco(p), obj2gco(o)); }
 
+/* Per-type memory accounting. Pass the gct of the owning object. */
+#define lj_gc_acctinc(g, gct, sz) \
+  ((g)->gc.typesize[(gct)-~LJ_TSTR] += (GCSize)(sz))
+#define lj_gc_acctdec(g, gct, sz) \
+  ((g)->gc.typesize[(gct)-~LJ_TSTR] -= (GCSize)(sz))
+
 /* Allocator. */
 LJ_FUNC void *lj_mem_realloc(lua_State *L, void *p, GCSize osz, GCSize nsz);
 LJ_FUNC void * LJ_FASTCALL lj_mem_newgco(lua_State *L, GCSize size);
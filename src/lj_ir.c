@@ -17,7 +17,9 @@
 #include "lj_gc.h"
 #include "lj_buf.h"
 #include "lj_str.h"
+#include "lj_state.h"
 #include "lj_tab.h"
+#include "lj_func.h"
 #include "lj_ir.h"
 #include "lj_jit.h"
 #include "lj_ircall.h"
@@ -31,6 +33,7 @@
 #include "lj_vm.h"
 #include "lj_strscan.h"
 #include "lj_strfmt.h"
+#include "lj_strmatch.h"
 #include "lj_lib.h"
 
 /* Some local macros to save typing. Undef'd at the end. */
@@ -110,6 +110,12 @@ typedef struct CCallInfo {
 #define IRCALLCOND_FFI32(x)		NULL
 #endif
 
+#if LJ_HASVEC
+#define IRCALLCOND_VEC(x)		x
+#else
+#define IRCALLCOND_VEC(x)		NULL
+#endif
+
 #if LJ_SOFTFP
 #define XA_FP		CCI_XA
 #define XA2_FP		(CCI_XA+CCI_XA)
@@ -146,6 +152,7 @@ typedef struct CCallInfo {
   _(ANY,	lj_strfmt_putint,	2,  FL, PGC, 0) \
   _(ANY,	lj_strfmt_putnum,	2,  FL, PGC, 0) \
   _(ANY,	lj_strfmt_putquoted,	2,  FL, PGC, 0) \
+  _(ANY,	lj_strfmt_putptr,	2,  FL, PGC, 0) \
   _(ANY,	lj_strfmt_putfxint,	3,   L, PGC, XA_64) \
   _(ANY,	lj_strfmt_putfnum_int,	3,   L, PGC, XA_FP) \
   _(ANY,	lj_strfmt_putfnum_uint,	3,   L, PGC, XA_FP) \
@@ -160,16 +167,27 @@ typedef struct CCallInfo {
   _(ANY,	lj_buf_putstr_upper,	2,  FL, PGC, 0) \
   _(ANY,	lj_buf_putstr_rep,	3,   L, PGC, 0) \
   _(ANY,	lj_buf_puttab,		5,   L, PGC, 0) \
+  _(ANY,	lj_strmatch_jit,	4,   S, INT, CCI_L) \
+  _(ANY,	lj_strmatch_gmatch_jit,	3,   S, INT, CCI_L) \
+  _(ANY,	lj_strmatch_gsub_jit,	4,   S, PGC, 0) \
   _(ANY,	lj_buf_tostr,		1,  FL, STR, 0) \
   _(ANY,	lj_tab_new_ah,		3,   A, TAB, CCI_L) \
   _(ANY,	lj_tab_new1,		2,  FS, TAB, CCI_L) \
   _(ANY,	lj_tab_dup,		2,  FS, TAB, CCI_L) \
   _(ANY,	lj_tab_clear,		1,  FS, NIL, 0) \
+  _(ANY,	lj_tab_amove,		5,   S, INT, 0) \
+  _(ANY,	lj_tab_move,		6,   S, NIL, CCI_L) \
   _(ANY,	lj_tab_newkey,		3,   S, PGC, CCI_L) \
   _(ANY,	lj_tab_len,		1,  FL, INT, 0) \
+  _(ANY,	lj_tab_nextidx,		2,  FL, INT, 0) \
   _(ANY,	lj_gc_step_jit,		2,  FS, NIL, CCI_L) \
   _(ANY,	lj_gc_barrieruv,	2,  FS, NIL, 0) \
-  _(ANY,	lj_mem_newgco,		2,  FS, PGC, CCI_L) \
+  _(ANY,	lj_func_newL_jit,	4,   S, FUNC, CCI_L) \
+  _(ANY,	lj_func_countuv,	2,  FL, INT, CCI_L) \
+  _(ANY,	lj_func_closeuv,	2,  FS, NIL, CCI_L) \
+  _(ANY,	lj_state_costatus,	2,   L, INT, CCI_L) \
+  _(ANY,	lj_state_canyield,	1,   L, INT, CCI_L) \
+  _(FFI,	lj_cdata_newgco,	2,  FS, PGC, CCI_L) \
   _(ANY,	lj_math_random_step, 1, FS, NUM, CCI_CASTU64) \
   _(ANY,	lj_vm_modi,		2,  FN, INT, 0) \
   _(ANY,	sinh,			1,   N, NUM, XA_FP) \
@@ -234,6 +252,7 @@ typedef struct CCallInfo {
   _(FFI,	memcpy,			3,   S, PTR, 0) \
   _(FFI,	memset,			3,   S, PTR, 0) \
   _(FFI,	lj_vm_errno,		0,   S, INT, CCI_NOFPRCLOBBER) \
+  _(VEC,	lj_carith_vec,		7,   S, NIL, 0) \
   _(FFI32,	lj_carith_mul64,	2,   N, I64, XA2_64|CCI_NOFPRCLOBBER) \
   _(FFI32,	lj_carith_shl64,	2,   N, U64, XA_64|CCI_NOFPRCLOBBER) \
   _(FFI32,	lj_carith_shr64,	2,   N, U64, XA_64|CCI_NOFPRCLOBBER) \
@@ -20,10 +20,14 @@
 #define JIT_F_PREFER_IMUL	0x00000080
 #define JIT_F_LEA_AGU		0x00000100
 #define JIT_F_BMI2		0x00000200
+#define JIT_F_AVX		0x00000400
+#define JIT_F_FMA		0x00000800
+#define JIT_F_AVX2		0x00001000
 
 /* Names for the CPU-specific flags. Must match the order above. */
 #define JIT_F_CPU_FIRST		JIT_F_SSE2
-#define JIT_F_CPUSTRING		"\4SSE2\4SSE3\6SSE4.1\3AMD\4ATOM\4BMI2"
+#define JIT_F_CPUSTRING \
+  "\4SSE2\4SSE3\6SSE4.1\3AMD\4ATOM\4BMI2\3AVX\3FMA\4AVX2"
 #elif LJ_TARGET_ARM
 #define JIT_F_ARMV6_		0x00000010
 #define JIT_F_ARMV6T2_		0x00000020
@@ -61,7 +65,7 @@
 #endif
 
 /* Optimization flags. */
-#define JIT_F_OPT_MASK		0x0fff0000
+#define JIT_F_OPT_MASK		0x1fff0000
 
 #define JIT_F_OPT_FOLD		0x00010000
 #define JIT_F_OPT_CSE		0x00020000
@@ -73,18 +77,27 @@
 #define JIT_F_OPT_ABC		0x00800000
 #define JIT_F_OPT_SINK		0x01000000
 #define JIT_F_OPT_FUSE		0x02000000
+#define JIT_F_OPT_FMA		0x04000000
+#define JIT_F_OPT_VEC		0x08000000
+#define JIT_F_OPT_ALIGN		0x10000000
 
 /* Optimizations names for -O. Must match the order above. */
 #define JIT_F_OPT_FIRST		JIT_F_OPT_FOLD
 #define JIT_F_OPTSTRING	\
-  "\4fold\3cse\3dce\3fwd\3dse\6narrow\4loop\3abc\4sink\4fuse"
+  "\4fold\3cse\3dce\3fwd\3dse\6narrow\4loop\3abc\4sink\4fuse\3fma\3vec\5align"
 
 /* Optimization levels set a fixed combination of flags. */
 #define JIT_F_OPT_0	0
 #define JIT_F_OPT_1	(JIT_F_OPT_FOLD|JIT_F_OPT_CSE|JIT_F_OPT_DCE)
 #define JIT_F_OPT_2	(JIT_F_OPT_1|JIT_F_OPT_NARROW|JIT_F_OPT_LOOP)
 #define JIT_F_OPT_3	(JIT_F_OPT_2|\
-  JIT_F_OPT_FWD|JIT_F_OPT_DSE|JIT_F_OPT_ABC|JIT_F_OPT_SINK|JIT_F_OPT_FUSE)
+  JIT_F_OPT_FWD|JIT_F_OPT_DSE|JIT_F_OPT_ABC|JIT_F_OPT_SINK|JIT_F_OPT_FUSE|\
+  JIT_F_OPT_VEC)
+/* Note: JIT_F_OPT_FMA is never on by default, since FMA skips the
+** intermediate rounding step and may change the results.
+** JIT_F_OPT_ALIGN is a layout mode for large trace sets. It's off by
+** default, since it costs an extra assembly pass for most loops.
+*/
 #define JIT_F_OPT_DEFAULT	JIT_F_OPT_3
 
 #if LJ_TARGET_WINDOWS || LJ_64
@@ -139,6 +152,7 @@ typedef enum {
   LJ_TRACE_IDLE,	/* Trace compiler idle. */
   LJ_TRACE_ACTIVE = 0x10,
   LJ_TRACE_RECORD,	/* Bytecode recording active. */
+  LJ_TRACE_RECORD_1ST,	/* Record 1st instruction, too. */
   LJ_TRACE_START,	/* New trace started. */
   LJ_TRACE_END,		/* End of trace. */
   LJ_TRACE_ASM,		/* Assemble trace. */
@@ -188,12 +202,15 @@ typedef uint32_t SnapEntry;
 #define SNAP_CONT		0x020000	/* Continuation slot. */
 #define SNAP_NORESTORE		0x040000	/* No need to restore slot. */
 #define SNAP_SOFTFPNUM		0x080000	/* Soft-float number. */
+#define SNAP_KEYINDEX		0x100000	/* Traversal key index. */
 LJ_STATIC_ASSERT(SNAP_FRAME == TREF_FRAME);
 LJ_STATIC_ASSERT(SNAP_CONT == TREF_CONT);
+LJ_STATIC_ASSERT(SNAP_KEYINDEX == TREF_KEYINDEX);
 
 #define SNAP(slot, flags, ref)	(((SnapEntry)(slot) << 24) + (flags) + (ref))
 #define SNAP_TR(slot, tr) \
-  (((SnapEntry)(slot) << 24) + ((tr) & (TREF_CONT|TREF_FRAME|TREF_REFMASK)))
+  (((SnapEntry)(slot) << 24) + \
+   ((tr) & (TREF_KEYINDEX|TREF_CONT|TREF_FRAME|TREF_REFMASK)))
 #if !LJ_FR2
 #define SNAP_MKPC(pc)		((SnapEntry)u32ptr(pc))
 #endif
@@ -203,6 +220,15 @@ LJ_STATIC_ASSERT(SNAP_CONT == TREF_CONT);
 #define snap_isframe(sn)	((sn) & SNAP_FRAME)
 #define snap_setref(sn, ref)	(((sn) & (0xffff0000&~SNAP_NORESTORE)) | (ref))
 
+/* Precomputed restore of a snapshot entry: RegSP and IR type. */
+typedef uint32_t SnapRestore;
+
+#define SNAPRESTORE(rs, t) \
+  ((SnapRestore)(rs) + ((SnapRestore)(t) << 16) + 0x01000000)
+#define SNAPRESTORE_SLOW	0	/* Needs the generic restore. */
+#define snaprestore_rs(sr)	((sr) & 0xffff)
+#define snaprestore_type(sr)	((uint8_t)((sr) >> 16))
+
 static LJ_AINLINE const BCIns *snap_pc(SnapEntry *sn)
 {
 #if LJ_FR2
@@ -251,6 +277,7 @@ typedef struct GCtrace {
   uint16_t nsnapmap;	/* Number of snapshot map elements. */
   SnapShot *snap;	/* Snapshot array. */
   SnapEntry *snapmap;	/* Snapshot map. */
+  SnapRestore *snaprestore;  /* Restore plan for each snapshot map entry. */
   GCRef startpt;	/* Starting prototype. */
   MRef startpc;		/* Bytecode PC of starting instruction. */
   BCIns startins;	/* Original bytecode of starting instruction. */
@@ -316,6 +343,13 @@ typedef struct ScEvEntry {
   uint8_t dir;		/* Direction. 1: +, 0: -. */
 } ScEvEntry;
 
+/* Results of the last pattern match on trace. */
+typedef struct StrMatchResult {
+  int32_t pos;		/* Start of match, next position or substitutions. */
+  int32_t len[LUA_MAXCAPTURES+1];  /* Length of match/capture or position. */
+  MRef ptr[LUA_MAXCAPTURES+1];  /* Start of match/capture. */
+} StrMatchResult;
+
 /* Reverse bytecode map (IRRef -> PC). Only for selected instructions. */
 typedef struct RBCHashEntry {
   MRef pc;		/* Bytecode PC. */
@@ -444,6 +478,7 @@ typedef struct jit_State {
   uint8_t needsplit;	/* Need SPLIT pass. */
 #endif
   uint8_t retryrec;	/* Retry recording. */
+  uint8_t frozentab;	/* A table has been frozen, stores need guards. */
 
   GCRef *trace;		/* Array of traces. */
   TraceNo freetrace;	/* Start of scan for next free trace. */
@@ -469,6 +504,7 @@ typedef struct jit_State {
   uint32_t bpropslot;	/* Round-robin index into bpropcache slots. */
 
   ScEvEntry scev;	/* Scalar evolution analysis cache slots. */
+  StrMatchResult strmatch;  /* Results of pattern matching on trace. */
 
   const BCIns *startpc;	/* Bytecode PC of starting instruction. */
   TraceNo parent;	/* Parent of current side trace (0 for root traces). */
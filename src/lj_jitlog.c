@@ -5,11 +5,17 @@
 #include "lj_lib.h"
 #include "lj_trace.h"
 #include "lj_tab.h"
+#include "lj_state.h"
 #include "lj_gc.h"
 #include "lj_buf.h"
 #include "lj_vmevent.h"
 #include "lj_debug.h"
 #include "lj_ircall.h"
+#include "lj_frame.h"
+#include "lj_meta.h"
+#if LJ_HASFFI
+#include "lj_ctype.h"
+#endif
 #include "luajit.h"
 #include "lauxlib.h"
 
@@ -28,6 +34,7 @@ typedef struct JITLogState {
   uint32_t protocount;
   GCtab *funcs;
   uint32_t funccount;
+  GCtab *snapseen;  /* Strings and protos written by the current heap snapshot. */
   GCfunc *startfunc;
   GCproto *lastpt;
   BCPos lastpc;
@@ -145,18 +152,8 @@ static const uint8_t* collectvarinfo(GCproto* pt)
 
 }
 
-static void memorize_proto(JITLogState *context, GCproto *pt)
+static void write_gcproto(JITLogState *context, GCproto *pt)
 {
-  lua_State *L = mainthread(context->g);
-  TValue key;
-  int i;
-  memorize_string(context, strref(pt->chunkname));
-  setprotoV(L, &key, pt);
-  /* Only write each proto once to the jitlog */
-  if (!memorize_gcref(L, context->protos, &key, &context->protocount)) {
-    return;
-  }
-
   uint8_t *lineinfo = mref(pt->lineinfo, uint8_t);
   uint32_t linesize = 0;
   if (mref(pt->lineinfo, void)) {
@@ -172,6 +169,21 @@ static void memorize_proto(JITLogState *context, GCproto *pt)
   size_t vinfosz = collectvarinfo(pt)-proto_varinfo(pt);
   lua_assert(vinfosz < 0xffffffff);
 
+  log_gcproto(context->g, pt, proto_bc(pt), proto_bc(pt), mref(pt->k, GCRef),  lineinfo, linesize, proto_varinfo(pt), (uint32_t)vinfosz);
+}
+
+static void memorize_proto(JITLogState *context, GCproto *pt)
+{
+  lua_State *L = mainthread(context->g);
+  TValue key;
+  int i;
+  memorize_string(context, strref(pt->chunkname));
+  setprotoV(L, &key, pt);
+  /* Only write each proto once to the jitlog */
+  if (!memorize_gcref(L, context->protos, &key, &context->protocount)) {
+    return;
+  }
+
   for(i = 0; i != pt->sizekgc; i++){
     GCobj *o = proto_kgc(pt, -(i + 1));
     /* We want the string constants to be able to tell what fields are being accessed by the bytecode */
@@ -180,7 +192,7 @@ static void memorize_proto(JITLogState *context, GCproto *pt)
     }
   }
 
-  log_gcproto(context->g, pt, proto_bc(pt), proto_bc(pt), mref(pt->k, GCRef),  lineinfo, linesize, proto_varinfo(pt), (uint32_t)vinfosz);
+  write_gcproto(context, pt);
 }
 
 static void memorize_func(JITLogState *context, GCfunc *fn)
@@ -434,6 +446,19 @@ static const char *const gcstates[] = {
   "finalize",
 };
 
+/* Indexed by gct - ~LJ_TSTR, the same order as LUAJIT_MEM_*. */
+static const char *const gcobjtypes[] = {
+  "string",
+  "upvalue",
+  "thread",
+  "proto",
+  "function",
+  "trace",
+  "cdata",
+  "table",
+  "userdata",
+};
+
 static const char *const flushreason[] = {
   "other",
   "user_requested",
@@ -442,6 +467,7 @@ static const char *const flushreason[] = {
   "profile_toggle",
   "set_builtinmt",
   "set_immutableuv",
+  "freeze_table",
 };
 
 static const char *const bc_names[] = {
@@ -509,6 +535,7 @@ static void write_header(JITLogState *context)
 
   write_enum(context, "gcstate", gcstates);
   write_enum(context, "flushreason", flushreason);
+  write_enum(context, "gcobjtype", gcobjtypes);
   write_enum(context, "bc", bc_names);
   write_enum(context, "fastfuncs", fastfunc_names);
   write_enum(context, "terror", terror);
@@ -519,6 +546,274 @@ static void write_header(JITLogState *context)
   write_enum(context, "irfields", irfield_names);
 }
 
+/* -- Heap snapshot ------------------------------------------------------- */
+
+static void snap_edge(SBuf *sb, GCobj *o)
+{
+  GCRef *ref = (GCRef *)lj_buf_more(sb, sizeof(GCRef));
+  setgcrefp(*ref, o);
+  setsbufP(sb, sbufP(sb) + sizeof(GCRef));
+}
+
+static void snap_edgetv(SBuf *sb, cTValue *tv)
+{
+  if (tvisgcv(tv))
+    snap_edge(sb, gcV(tv));
+}
+
+/*
+** Collect the outgoing references of an object the same way the GC marks
+** them, so weak references don't retain anything. Returns the object size.
+*/
+static uint32_t snap_traverse(global_State *g, SBuf *sb, GCobj *o)
+{
+  switch (o->gch.gct) {
+  case ~LJ_TSTR:
+    return (uint32_t)sizestring(gco2str(o));
+  case ~LJ_TUPVAL:
+    snap_edgetv(sb, uvval(gco2uv(o)));
+    return sizeof(GCupval);
+  case ~LJ_TTHREAD: {
+    lua_State *th = gco2th(o);
+    TValue *tv;
+    GCobj *uv;
+    for (tv = tvref(th->stack)+1+LJ_FR2; tv < th->top; tv++)
+      snap_edgetv(sb, tv);
+#if !LJ_FR2
+    for (tv = th->base-1; tv > tvref(th->stack); tv = frame_prev(tv))
+      snap_edge(sb, obj2gco(frame_func(tv)));
+#endif
+    snap_edge(sb, obj2gco(tabref(th->env)));
+    for (uv = gcref(th->openupval); uv; uv = gcnext(uv))
+      snap_edge(sb, uv);
+    return (uint32_t)(sizeof(lua_State) + sizeof(TValue) * th->stacksize);
+    }
+  case ~LJ_TPROTO: {
+    GCproto *pt = gco2pt(o);
+    ptrdiff_t i;
+    snap_edge(sb, obj2gco(proto_chunkname(pt)));
+    for (i = -(ptrdiff_t)pt->sizekgc; i < 0; i++)
+      snap_edge(sb, proto_kgc(pt, i));
+#if LJ_HASJIT
+    if (pt->trace)
+      snap_edge(sb, obj2gco(traceref(G2J(g), pt->trace)));
+#endif
+    return pt->sizept;
+    }
+  case ~LJ_TFUNC: {
+    GCfunc *fn = gco2func(o);
+    uint32_t i;
+    snap_edge(sb, obj2gco(tabref(fn->c.env)));
+    if (isluafunc(fn)) {
+      snap_edge(sb, obj2gco(funcproto(fn)));
+      for (i = 0; i < fn->l.nupvalues; i++)
+	snap_edge(sb, gcref(fn->l.uvptr[i]));
+      return sizeLfunc((MSize)fn->l.nupvalues);
+    } else {
+      for (i = 0; i < fn->c.nupvalues; i++)
+	snap_edgetv(sb, &fn->c.upvalue[i]);
+      return sizeCfunc((MSize)fn->c.nupvalues);
+    }
+    }
+#if LJ_HASJIT
+  case ~LJ_TTRACE: {
+    GCtrace *T = gco2trace(o);
+    jit_State *J = G2J(g);
+    IRRef ref;
+    for (ref = T->nk; ref < REF_TRUE; ref++) {
+      IRIns *ir = &T->ir[ref];
+      if (ir->o == IR_KGC)
+	snap_edge(sb, ir_kgc(ir));
+      if (irt_is64(ir->t) && ir->o != IR_KNULL)
+	ref++;
+    }
+    if (T->link) snap_edge(sb, obj2gco(traceref(J, T->link)));
+    if (T->nextroot) snap_edge(sb, obj2gco(traceref(J, T->nextroot)));
+    if (T->nextside) snap_edge(sb, obj2gco(traceref(J, T->nextside)));
+    snap_edge(sb, gcref(T->startpt));
+    return (uint32_t)(((sizeof(GCtrace)+7)&~7) + (T->nins-T->nk)*sizeof(IRIns) +
+		      T->nsnap*sizeof(SnapShot) +
+		      T->nsnapmap*(sizeof(SnapEntry)+sizeof(SnapRestore)));
+    }
+#endif
+#if LJ_HASFFI
+  case ~LJ_TCDATA: {
+    GCcdata *cd = gco2cd(o);
+    CType *ct;
+    if (cdataisv(cd))
+      return (uint32_t)sizecdatav(cd);
+    ct = ctype_raw(ctype_ctsG(g), cd->ctypeid);
+    return sizeof(GCcdata) + (ctype_hassize(ct->info) ? ct->size : CTSIZE_PTR);
+    }
+#endif
+  case ~LJ_TTAB: {
+    GCtab *t = gco2tab(o);
+    GCtab *mt = tabref(t->metatable);
+    cTValue *mode = lj_meta_fastg(g, mt, MM_mode);
+    int weak = 0;
+    if (mt)
+      snap_edge(sb, obj2gco(mt));
+    if (gcref(t->shape))
+      snap_edge(sb, gcref(t->shape));
+    if (mode && tvisstr(mode)) {
+      const char *modestr = strVdata(mode);
+      int c;
+      while ((c = *modestr++)) {
+	if (c == 'k') weak |= LJ_GC_WEAKKEY;
+	else if (c == 'v') weak |= LJ_GC_WEAKVAL;
+      }
+#if LJ_HASFFI
+      if (weak && ctype_ctsG(g) && ctype_ctsG(g)->finalizer == t)
+	weak = LJ_GC_WEAKKEY;
+#endif
+    }
+    if (!(weak & LJ_GC_WEAKVAL)) {
+      MSize i;
+      for (i = 0; i < t->asize; i++)
+	snap_edgetv(sb, arrayslot(t, i));
+    }
+    if (t->hmask > 0 && weak != LJ_GC_WEAK) {
+      Node *node = noderef(t->node);
+      MSize i;
+      for (i = 0; i <= t->hmask; i++) {
+	Node *n = &node[i];
+	if (!tvisnil(&n->val)) {
+	  if (!(weak & LJ_GC_WEAKKEY)) snap_edgetv(sb, &n->key);
+	  if (!(weak & LJ_GC_WEAKVAL)) snap_edgetv(sb, &n->val);
+	}
+      }
+    }
+    return (uint32_t)(sizeof(GCtab) + sizeof(TValue) * t->asize +
+		      (t->hmask ? sizeof(Node) * (t->hmask + 1) : 0));
+    }
+  case ~LJ_TUDATA: {
+    GCudata *ud = gco2ud(o);
+    if (tabref(ud->metatable))
+      snap_edge(sb, obj2gco(tabref(ud->metatable)));
+    snap_edge(sb, obj2gco(tabref(ud->env)));
+    return (uint32_t)sizeudata(ud);
+    }
+  default:
+    lua_assert(0);
+    return 0;
+  }
+}
+
+/*
+** Check whether a string or proto still needs to be written. Unlike the
+** memorize_* functions, this only adds it to the set of the current snapshot,
+** so the snapshot doesn't keep the whole heap alive for the rest of the log.
+*/
+static int snap_isnew(JITLogState *context, GCtab *logged, cTValue *key)
+{
+  lua_State *L = mainthread(context->g);
+  TValue *slot;
+  if (!tvisnil(lj_tab_get(L, logged, key)))
+    return 0;
+  slot = lj_tab_set(L, context->snapseen, key);
+  if (!tvisnil(slot))
+    return 0;
+  setboolV(slot, 1);
+  return 1;
+}
+
+static void snap_string(JITLogState *context, GCstr *s)
+{
+  TValue key;
+  setstrV(mainthread(context->g), &key, s);
+  if (snap_isnew(context, context->strings, &key))
+    log_gcstring(context->g, s, strdata(s));
+}
+
+static void snap_proto(JITLogState *context, GCproto *pt)
+{
+  TValue key;
+  ptrdiff_t i;
+  snap_string(context, strref(pt->chunkname));
+  setprotoV(mainthread(context->g), &key, pt);
+  if (!snap_isnew(context, context->protos, &key))
+    return;
+  for (i = -(ptrdiff_t)pt->sizekgc; i < 0; i++) {
+    GCobj *o = proto_kgc(pt, i);
+    if (o->gch.gct == ~LJ_TSTR)
+      snap_string(context, gco2str(o));
+  }
+  write_gcproto(context, pt);
+}
+
+static void snap_writeobj(JITLogState *context, SBuf *sb, GCobj *o)
+{
+  uint32_t size;
+  setsbufP(sb, sbufB(sb));
+  size = snap_traverse(context->g, sb, o);
+  /* Our own lookup tables would otherwise share ownership of every string
+  ** and proto in the log.
+  */
+  if (o == obj2gco(context->strings) || o == obj2gco(context->protos) ||
+      o == obj2gco(context->funcs) || o == obj2gco(context->snapseen))
+    setsbufP(sb, sbufB(sb));
+  /* Strings and protos are only written once, so their contents and source
+  ** locations are shared with the rest of the log.
+  */
+  if (o->gch.gct == ~LJ_TSTR)
+    snap_string(context, gco2str(o));
+  else if (o->gch.gct == ~LJ_TPROTO)
+    snap_proto(context, gco2pt(o));
+  log_gcobj(context->g, o->gch.gct - ~LJ_TSTR, o, size,
+	    (GCRef *)sbufB(sb), (uint32_t)(sbuflen(sb) / sizeof(GCRef)));
+}
+
+static uint32_t snap_writelist(JITLogState *context, SBuf *sb, GCobj *o)
+{
+  uint32_t count = 0;
+  for (; o; o = gcnext(o), count++)
+    snap_writeobj(context, sb, o);
+  return count;
+}
+
+static uint32_t write_heapsnapshot(JITLogState *context, lua_State *L)
+{
+  global_State *g = context->g;
+  SBuf *sb = lj_buf_tmp_(L);
+  uint32_t count = 0;
+  MSize i;
+  GCupval *uv;
+  GCobj *o;
+  /* Anchor the set on the stack. It's garbage after the snapshot. */
+  context->snapseen = lj_tab_new(L, 0, 0);
+  settabV(L, L->top, context->snapseen);
+  incr_top(L);
+  count += snap_writelist(context, sb, gcref(g->gc.root));
+  for (i = 0; i <= g->strmask; i++)
+    count += snap_writelist(context, sb, gcref(g->strhash[i]));
+  /* Open upvalues are only linked to their thread. */
+  for (uv = uvnext(&g->uvhead); uv != &g->uvhead; uv = uvnext(uv), count++)
+    snap_writeobj(context, sb, obj2gco(uv));
+  /* Userdata and cdata waiting to be finalized. */
+  if ((o = gcref(g->gc.mmudata)) != NULL) {
+    do {
+      o = gcnext(o);
+      snap_writeobj(context, sb, o);
+      count++;
+    } while (o != gcref(g->gc.mmudata));
+  }
+  /* The same roots as gc_mark_start, plus the current thread. */
+  setsbufP(sb, sbufB(sb));
+  snap_edge(sb, obj2gco(mainthread(g)));
+  snap_edge(sb, obj2gco(tabref(mainthread(g)->env)));
+  snap_edgetv(sb, &g->registrytv);
+  for (i = 0; i < GCROOT_MAX; i++)
+    if (gcref(g->gcroot[i]) != NULL)
+      snap_edge(sb, gcref(g->gcroot[i]));
+  if (L != mainthread(g))
+    snap_edge(sb, obj2gco(L));
+  log_heapsnapshot(g, g->gc.total, count, (GCRef *)sbufB(sb),
+		   (uint32_t)(sbuflen(sb) / sizeof(GCRef)));
+  context->snapseen = NULL;
+  L->top--;
+  return count;
+}
+
 static int jitlog_isrunning(lua_State *L)
 {
   void* current_context = NULL;
@@ -646,6 +941,17 @@ LUA_API void jitlog_savehotcounts(JITLogUserContext *usrcontext)
 #endif
 }
 
+/*
+** Run a full GC and write every object left in the heap with its size and
+** outgoing references, followed by the GC roots. Returns the object count.
+*/
+LUA_API int jitlog_heapsnapshot(JITLogUserContext *usrcontext, lua_State *L)
+{
+  JITLogState *context = usr2ctx(usrcontext);
+  lj_gc_fullgc(L);
+  return (int)write_heapsnapshot(context, L);
+}
+
 /* -- Lua module to control the JITLog ------------------------------------ */
 
 static JITLogState* jlib_getstate(lua_State *L)
@@ -684,6 +990,13 @@ static int jlib_addmarker(lua_State *L)
   return 0;
 }
 
+static int jlib_heapsnapshot(lua_State *L)
+{
+  JITLogState *context = jlib_getstate(L);
+  lua_pushinteger(L, jitlog_heapsnapshot(ctx2usr(context), L));
+  return 1;
+}
+
 static int jlib_reset(lua_State *L)
 {
   JITLogState *context = jlib_getstate(L);
@@ -760,6 +1073,7 @@ static const luaL_Reg jitlog_lib[] = {
   {"savetostring", jlib_savetostring},
   {"getsize", jlib_getsize},
   {"addmarker", jlib_addmarker},
+  {"heapsnapshot", jlib_heapsnapshot},
 #if LJ_HASJIT
   {"snap_hotcounts", jlib_snap_hotcounts},
   {"cmp_hotcounts", jlib_cmp_hotcounts},
@@ -168,10 +168,12 @@ TValue *lj_meta_tset(lua_State *L, cTValue *o, cTValue *k)
       GCtab *t = tabV(o);
       cTValue *tv = lj_tab_get(L, t, k);
       if (LJ_LIKELY(!tvisnil(tv))) {
+	if (LJ_UNLIKELY(tabisfrozen(t))) lj_err_msg(L, LJ_ERR_TABFROZ);
 	t->nomm = 0;  /* Invalidate negative metamethod cache. */
 	lj_gc_anybarriert(L, t);
 	return (TValue *)tv;
       } else if (!(mo = lj_meta_fast(L, tabref(t->metatable), MM_newindex))) {
+	if (LJ_UNLIKELY(tabisfrozen(t))) lj_err_msg(L, LJ_ERR_TABFROZ);
 	t->nomm = 0;  /* Invalidate negative metamethod cache. */
 	lj_gc_anybarriert(L, t);
 	if (tv != niltv(L))
@@ -425,6 +427,11 @@ TValue *lj_meta_comp(lua_State *L, cTValue *o1, cTValue *o2, int op)
 void lj_meta_istype(lua_State *L, BCReg ra, BCReg tp)
 {
   L->top = curr_topL(L);
+  if (frame_isvarg(L->base-1)) {
+    /* A vararg builtin copies its arguments to the first slots. */
+    TValue *top = L->base + frame_delta(L->base-1) - 1 - LJ_FR2;
+    if (top < L->top) L->top = top;
+  }
   ra++; tp--;
   lua_assert(LJ_DUALNUM || tp != ~LJ_TNUMX);  /* ISTYPE -> ISNUM broken. */
   if (LJ_DUALNUM && tp == ~LJ_TNUMX) lj_lib_checkint(L, ra);
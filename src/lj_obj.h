@@ -282,6 +282,9 @@ typedef const TValue cTValue;
 #define LJ_TISGCV		(LJ_TSTR+1)
 #define LJ_TISTABUD		LJ_TTAB
 
+/* Upper 32 bits of a specialized ITERN control var. Lower 32 bits: index. */
+#define LJ_KEYINDEX		0xfffe7fffu
+
 #if LJ_GC64
 #define LJ_GCVMASK		(((uint64_t)1 << 47) - 1)
 #endif
@@ -494,8 +497,11 @@ typedef struct GCtab {
   MRef node;		/* Hash part. */
   uint32_t asize;	/* Size of array part (keys [0, asize-1]). */
   uint32_t hmask;	/* Hash part mask (size of hash part - 1). */
+  GCRef shape;		/* Key layout of the hash part (or NULL). */
 #if LJ_GC64
   MRef freetop;		/* Top of free elements. */
+#else
+  uint32_t unused;	/* Keep the colocated array part aligned. */
 #endif
 } GCtab;
 
@@ -582,6 +588,7 @@ typedef struct GCState {
   uint8_t state;	/* GC state. */
   uint8_t nocdatafin;	/* No cdata finalizer called. */
   uint8_t gcexit;
+  uint8_t emergency;	/* Emergency GC from inside the allocator. */
   MSize sweepstr;	/* Sweep position in string table. */
   GCRef root;		/* List of all collectable objects. */
   MRef sweep;		/* Sweep position in root list. */
@@ -589,12 +596,18 @@ typedef struct GCState {
   GCRef grayagain;	/* List of objects for atomic traversal. */
   GCRef weak;		/* List of weak tables (to be cleared). */
   GCRef mmudata;	/* List of userdata (to be finalized). */
+  GCRef anchored;	/* Newest object known to be anchored. */
   GCSize debt;		/* Debt (how much GC is behind schedule). */
   GCSize estimate;	/* Estimate of memory actually in use. */
   MSize stepmul;	/* Incremental GC step granularity. */
   MSize pause;		/* Pause between successive GC cycles. */
+  GCSize limit;		/* Memory limit (LJ_MAX_MEM: no limit). */
+  GCSize typesize[~LJ_TUDATA-~LJ_TSTR+1];  /* Memory per object type. */
 } GCState;
 
+/* Number of cached compiled patterns (power of 2). */
+#define STRMATCH_CACHE	64
+
 /* Global state, shared by all threads of a Lua universe. */
 typedef struct global_State {
   GCRef *strhash;	/* String hash table (hash chain anchors). */
@@ -626,6 +639,7 @@ typedef struct global_State {
   MRef jit_base;	/* Current JIT code L->base or NULL. */
   MRef ctype_state;	/* Pointer to C type state. */
   GCRef gcroot[GCROOT_MAX];  /* GC roots. */
+  MRef strmatch[STRMATCH_CACHE];  /* Cache of compiled patterns. */
 
   luaJIT_vmevent_callback vmevent_cb; /* User set VM event callback. */
   void *vmevent_data;                 /* VM event callback data. */
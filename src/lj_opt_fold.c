@@ -164,7 +164,7 @@ typedef IRRef (LJ_FASTCALL *FoldFunc)(jit_State *J);
   ((ref) < J->chain[IR_LOOP] && \
    (J->chain[IR_SNEW] || J->chain[IR_XSNEW] || \
     J->chain[IR_TNEW] || J->chain[IR_TDUP] || \
-    J->chain[IR_CNEW] || J->chain[IR_CNEWI] || \
+    J->chain[IR_CNEW] || J->chain[IR_CNEWI] || J->chain[IR_FNEW] || \
     J->chain[IR_BUFSTR] || J->chain[IR_TOSTR] || J->chain[IR_CALLA]))
 
 /* -- Constant folding for FP numbers ------------------------------------- */
@@ -593,7 +593,7 @@ LJFOLD(BUFSTR any any)
 LJFOLDF(bufstr_kfold_cse)
 {
   lua_assert(fleft->o == IR_BUFHDR || fleft->o == IR_BUFPUT ||
-	     fleft->o == IR_CALLL);
+	     fleft->o == IR_CALLL || fleft->o == IR_CALLS);
   if (LJ_LIKELY(J->flags & JIT_F_OPT_FOLD)) {
     if (fleft->o == IR_BUFHDR) {  /* No put operations? */
       if (!(fleft->op2 & IRBUFHDR_APPEND))  /* Empty buffer? */
@@ -614,10 +614,12 @@ LJFOLDF(bufstr_kfold_cse)
       IRIns *irs = IR(ref), *ira = fleft, *irb = IR(irs->op1);
       while (ira->o == irb->o && ira->op2 == irb->op2) {
 	lua_assert(ira->o == IR_BUFHDR || ira->o == IR_BUFPUT ||
-		   ira->o == IR_CALLL || ira->o == IR_CARG);
+		   ira->o == IR_CALLL || ira->o == IR_CALLS ||
+		   ira->o == IR_CARG);
 	if (ira->o == IR_BUFHDR && !(ira->op2 & IRBUFHDR_APPEND))
 	  return ref;  /* CSE succeeded. */
-	if (ira->o == IR_CALLL && ira->op2 == IRCALL_lj_buf_puttab)
+	if ((ira->o == IR_CALLL && ira->op2 == IRCALL_lj_buf_puttab) ||
+	    ira->o == IR_CALLS)
 	  break;
 	ira = IR(ira->op1);
 	irb = IR(irb->op1);
@@ -2210,15 +2212,47 @@ LJFOLDF(fload_tab_tdup_hmask)
   return NEXTFOLD;
 }
 
+LJFOLD(FLOAD TDUP IRFL_TAB_SHAPE)
+LJFOLDF(fload_tab_tdup_shape)
+{
+  GCtab *t = ir_ktab(IR(fleft->op1));
+  if (LJ_LIKELY(J->flags & JIT_F_OPT_FOLD) && gcref(t->shape) &&
+      lj_opt_fwd_tptr(J, fins->op1))
+    return lj_ir_ktab(J, tabref(t->shape));
+  return NEXTFOLD;
+}
+
+/* The layout of a frozen table never changes. */
+LJFOLD(FLOAD KGC IRFL_TAB_ASIZE)
+LJFOLD(FLOAD KGC IRFL_TAB_HMASK)
+LJFOLD(FLOAD KGC IRFL_TAB_SHAPE)
+LJFOLDF(fload_tab_frozen)
+{
+  GCtab *t = ir_ktab(fleft);
+  if (LJ_LIKELY(J->flags & JIT_F_OPT_FOLD) && tabisfrozen(t)) {
+    if (fins->op2 == IRFL_TAB_ASIZE)
+      return INTFOLD((int32_t)t->asize);
+    else if (fins->op2 == IRFL_TAB_HMASK)
+      return INTFOLD((int32_t)t->hmask);
+    else if (gcref(t->shape))
+      return lj_ir_ktab(J, tabref(t->shape));
+  }
+  return NEXTFOLD;
+}
+
 LJFOLD(HREF any any)
 LJFOLD(FLOAD any IRFL_TAB_ARRAY)
 LJFOLD(FLOAD any IRFL_TAB_NODE)
 LJFOLD(FLOAD any IRFL_TAB_ASIZE)
 LJFOLD(FLOAD any IRFL_TAB_HMASK)
+LJFOLD(FLOAD any IRFL_TAB_SHAPE)
 LJFOLDF(fload_tab_ah)
 {
   TRef tr = lj_opt_cse(J);
-  return lj_opt_fwd_tptr(J, tref_ref(tr)) ? tr : EMITFOLD;
+  if (lj_opt_fwd_tptr(J, tref_ref(tr)) ||
+      (fins->op2 != IRFL_TAB_SHAPE && lj_opt_fwd_tshape(J, tref_ref(tr))))
+    return tr;
+  return EMITFOLD;
 }
 
 /* Strings are immutable, so we can safely FOLD/CSE the related FLOAD. */
@@ -2248,6 +2282,28 @@ LJFOLDF(fload_str_len_tostr)
   return NEXTFOLD;
 }
 
+/* The prototype of a new closure is known and it inherits the parent's env. */
+LJFOLD(FLOAD FNEW IRFL_FUNC_PC)
+LJFOLDF(fload_func_pc_fnew)
+{
+  if (LJ_LIKELY(J->flags & JIT_F_OPT_FOLD)) {
+    PHIBARRIER(fleft);
+    return lj_ir_kptr(J, proto_bc(ir_kproto(IR(fleft->op2))));
+  }
+  return NEXTFOLD;
+}
+
+LJFOLD(FLOAD FNEW IRFL_FUNC_ENV)
+LJFOLDF(fload_func_env_fnew)
+{
+  if (LJ_LIKELY(J->flags & JIT_F_OPT_FOLD)) {
+    PHIBARRIER(fleft);
+    fins->op1 = IR(fleft->op1)->o == IR_CARG ? IR(fleft->op1)->op1 : fleft->op1;
+    return RETRYFOLD;
+  }
+  return NEXTFOLD;
+}
+
 /* The C type ID of cdata objects is immutable. */
 LJFOLD(FLOAD KGC IRFL_CDATA_CTYPEID)
 LJFOLDF(fload_cdata_typeid_kgc)
@@ -2300,7 +2356,10 @@ LJFOLD(FLOAD any IRFL_CDATA_CTYPEID)
 LJFOLD(FLOAD any IRFL_CDATA_PTR)
 LJFOLD(FLOAD any IRFL_CDATA_INT)
 LJFOLD(FLOAD any IRFL_CDATA_INT64)
-LJFOLD(VLOAD any any)  /* Vararg loads have no corresponding stores. */
+/* Vararg loads have no corresponding stores. Neither have the key/value loads
+** of table traversals, which are only done once per node and iteration.
+*/
+LJFOLD(VLOAD any any)
 LJFOLDX(lj_opt_cse)
 
 /* All other field loads need alias analysis. */
@@ -2403,6 +2462,7 @@ LJFOLD(RETF any any)  /* Modifies BASE. */
 LJFOLD(TNEW any any)
 LJFOLD(TDUP any)
 LJFOLD(CNEW any any)
+LJFOLD(FNEW any any)
 LJFOLD(XSNEW any any)
 LJFOLD(BUFHDR any any)
 LJFOLDX(lj_ir_emit)
@@ -128,6 +128,24 @@ static AliasRet aa_ahref(jit_State *J, IRIns *refa, IRIns *refb)
     return aa_table(J, ta, tb);  /* Try to disambiguate tables. */
 }
 
+/* Check whether there's no aliasing table.clear or table block move. */
+static int fwd_aa_tab_clear(jit_State *J, IRRef lim, IRRef ta)
+{
+  IRRef ref = J->chain[IR_CALLS];
+  while (ref > lim) {
+    IRIns *calls = IR(ref);
+    if (calls->op2 == IRCALL_lj_tab_clear ||
+	calls->op2 == IRCALL_lj_tab_amove || calls->op2 == IRCALL_lj_tab_move) {
+      IRRef tb = calls->op1;  /* The destination table is the first arg. */
+      while (IR(tb)->o == IR_CARG) tb = IR(tb)->op1;
+      if (ta == tb || aa_table(J, ta, tb) != ALIAS_NO)
+	return 0;  /* Conflict. */
+    }
+    ref = calls->prev;
+  }
+  return 1;  /* No conflict. Can safely FOLD/CSE. */
+}
+
 /* Array and hash load forwarding. */
 static TRef fwd_ahload(jit_State *J, IRRef xref)
 {
@@ -152,7 +170,8 @@ static TRef fwd_ahload(jit_State *J, IRRef xref)
     IRIns *ir = (xr->o == IR_HREFK || xr->o == IR_AREF) ? IR(xr->op1) : xr;
     IRRef tab = ir->op1;
     ir = IR(tab);
-    if (ir->o == IR_TNEW || (ir->o == IR_TDUP && irref_isk(xr->op2))) {
+    if ((ir->o == IR_TNEW || (ir->o == IR_TDUP && irref_isk(xr->op2))) &&
+	fwd_aa_tab_clear(J, tab, tab)) {
       /* A NEWREF with a number key may end up pointing to the array part.
       ** But it's referenced from HSTORE and not found in the ASTORE chain.
       ** For now simply consider this a conflict without forwarding anything.
@@ -275,7 +294,7 @@ TRef LJ_FASTCALL lj_opt_fwd_hrefk(jit_State *J)
     ref = newref->prev;
   }
   /* No conflicting NEWREF: key location unchanged for HREFK of TDUP. */
-  if (IR(tab)->o == IR_TDUP)
+  if (IR(tab)->o == IR_TDUP && fwd_aa_tab_clear(J, tab, tab))
     fins->t.irt &= ~IRT_GUARD;  /* Drop HREFK guard. */
 docse:
   return CSEFOLD;
@@ -306,21 +325,7 @@ int LJ_FASTCALL lj_opt_fwd_href_nokey(jit_State *J)
     ref = store->prev;
   }
 
-  return 1;  /* No conflict. Can fold to niltv. */
-}
-
-/* Check whether there's no aliasing table.clear. */
-static int fwd_aa_tab_clear(jit_State *J, IRRef lim, IRRef ta)
-{
-  IRRef ref = J->chain[IR_CALLS];
-  while (ref > lim) {
-    IRIns *calls = IR(ref);
-    if (calls->op2 == IRCALL_lj_tab_clear &&
-	(ta == calls->op1 || aa_table(J, ta, calls->op1) != ALIAS_NO))
-      return 0;  /* Conflict. */
-    ref = calls->prev;
-  }
-  return 1;  /* No conflict. Can safely FOLD/CSE. */
+  return fwd_aa_tab_clear(J, lim, fins->op1);  /* Can fold to niltv? */
 }
 
 /* Check whether there's no aliasing NEWREF/table.clear for the left operand. */
@@ -337,6 +342,34 @@ int LJ_FASTCALL lj_opt_fwd_tptr(jit_State *J, IRRef lim)
   return fwd_aa_tab_clear(J, lim, ta);
 }
 
+/* Check for a shape guard on the left operand, which proves that the key
+** layout hasn't changed since lim, despite any aliasing NEWREF/table.clear.
+** A shape object is never reinstalled, so the same shape both before lim
+** and after the last conflict implies the same array/node pointers.
+*/
+int LJ_FASTCALL lj_opt_fwd_tshape(jit_State *J, IRRef lim)
+{
+  IRRef ta = fins->op1;
+  IRRef ref = J->chain[IR_EQ];
+  IRRef kshape = 0;
+  while (ref) {
+    IRIns *ir = IR(ref);
+    IRIns *irf = IR(ir->op1);
+    if (irt_isguard(ir->t) && irref_isk(ir->op2) && irf->o == IR_FLOAD &&
+	irf->op2 == IRFL_TAB_SHAPE && irf->op1 == ta) {
+      if (!kshape) {  /* Most recent shape guard. */
+	if (ref < lim || !lj_opt_fwd_tptr(J, ref))
+	  return 0;
+	kshape = ir->op2;
+      } else if (ref < lim && ir->op2 == kshape) {
+	return 1;  /* Same shape before lim. */
+      }
+    }
+    ref = ir->prev;
+  }
+  return 0;
+}
+
 /* ASTORE/HSTORE elimination. */
 TRef LJ_FASTCALL lj_opt_dse_ahstore(jit_State *J)
 {
@@ -362,7 +395,7 @@ TRef LJ_FASTCALL lj_opt_dse_ahstore(jit_State *J)
 	IRIns *ir;
 	/* Check for any intervening guards (includes conflicting loads). */
 	for (ir = IR(J->cur.nins-1); ir > store; ir--)
-	  if (irt_isguard(ir->t) || ir->o == IR_CALLL)
+	  if (irt_isguard(ir->t) || ir->o == IR_CALLL || ir->o == IR_CALLS)
 	    goto doemit;  /* No elimination possible. */
 	/* Remove redundant store from chain and replace with NOP. */
 	*refp = store->prev;
@@ -35,6 +35,57 @@ static IRIns *sink_checkalloc(jit_State *J, IRIns *irs)
   return ir;  /* Return allocation. */
 }
 
+/* Find table allocations which are stored exactly once.
+**
+** Such a table can be sunk into the allocation it's stored to. It's only
+** materialized together with that allocation, which keeps its identity
+** intact. Unless a snapshot after the store references it, too.
+** The single store is remembered in the prev field of the allocation.
+**
+** Note: sink_checkphi() uses the same prev field as the PHI value count of
+** PHI allocations. This doesn't clash: PHI allocations are never nested
+** (see sink_isnested()) and sink_mark_ins() clears their prev field at the
+** PHI, which comes after all stores and is seen first by the backwards
+** pass, before any PHI values are counted.
+*/
+static void sink_find_nested(jit_State *J)
+{
+  IRIns *ir, *irbase = IR(REF_BASE), *irlast = IR(J->cur.nins-1);
+  SnapNo i;
+  for (ir = irlast; ir > irbase; ir--)
+    if (ir->o == IR_TNEW || ir->o == IR_TDUP)
+      ir->prev = 0;
+  for (ir = irlast; ir > irbase; ir--) {
+    if (ir->o == IR_ASTORE || ir->o == IR_HSTORE || ir->o == IR_FSTORE ||
+	ir->o == IR_XSTORE || ir->o == IR_USTORE) {
+      IRIns *irv = IR(ir->op2);
+      if (irv->o == IR_TNEW || irv->o == IR_TDUP)  /* Stored more than once? */
+	irv->prev = irv->prev ? 1 : (IRRef1)(ir - J->cur.ir);
+    }
+  }
+  for (i = 0; i < J->cur.nsnap; i++) {
+    SnapShot *snap = &J->cur.snap[i];
+    SnapEntry *map = &J->cur.snapmap[snap->mapofs];
+    MSize n, nent = snap->nent;
+    for (n = 0; n < nent; n++) {
+      IRRef ref = snap_ref(map[n]);
+      if (!irref_isk(ref) && (IR(ref)->o == IR_TNEW || IR(ref)->o == IR_TDUP) &&
+	  IR(ref)->prev < snap->ref)
+	IR(ref)->prev = 1;  /* Snapshot after the store. */
+    }
+  }
+}
+
+/* Check whether a store puts a nested table into another table allocation. */
+static int sink_isnested(jit_State *J, IRIns *irs, IRIns *ira)
+{
+  IRIns *irv = IR(irs->op2);
+  return (irs->o == IR_ASTORE || irs->o == IR_HSTORE) && ira && ira != irv &&
+	 (ira->o == IR_TNEW || ira->o == IR_TDUP) &&
+	 (irv->o == IR_TNEW || irv->o == IR_TDUP) &&
+	 !irt_isphi(irv->t) && irv->prev == (IRRef1)(irs - J->cur.ir);
+}
+
 /* Recursively check whether a value depends on a PHI. */
 static int sink_phidep(jit_State *J, IRRef ref)
 {
@@ -69,7 +120,7 @@ static int sink_checkphi(jit_State *J, IRIns *ira, IRRef ref)
 ** - All guards.
 ** - Any remaining loads not eliminated by store-to-load forwarding.
 ** - Stores with non-constant keys.
-** - All stored values.
+** - All stored values, except for nested tables (see below).
 */
 static void sink_mark_ins(jit_State *J)
 {
@@ -90,7 +141,8 @@ static void sink_mark_ins(jit_State *J)
       IRIns *ira = sink_checkalloc(J, ir);
       if (!ira || (irt_isphi(ira->t) && !sink_checkphi(J, ira, ir->op2)))
 	irt_setmark(IR(ir->op1)->t);  /* Mark ineligible ref. */
-      irt_setmark(IR(ir->op2)->t);  /* Mark stored value. */
+      if (!sink_isnested(J, ir, ira))
+	irt_setmark(IR(ir->op2)->t);  /* Mark stored value. */
       break;
       }
 #if LJ_HASFFI
@@ -105,6 +157,11 @@ static void sink_mark_ins(jit_State *J)
     case IR_USTORE:
       irt_setmark(IR(ir->op2)->t);  /* Mark stored value. */
       break;
+    case IR_FNEW:
+      if (IR(ir->op1)->o == IR_CARG)
+	irt_setmark(ir->t);  /* NYI: sink closures with local upvalues. */
+      irt_setmark(IR(ir->op1)->t);  /* Mark parent closure. */
+      break;
 #if LJ_HASFFI
     case IR_CALLXS:
 #endif
@@ -162,6 +219,26 @@ static void sink_remark_phi(jit_State *J)
   } while (remark);
 }
 
+/* Iteratively mark nested tables stored to non-sinkable allocations. */
+static void sink_remark_nested(jit_State *J)
+{
+  IRIns *ir, *irbase = IR(REF_BASE);
+  int remark;
+  do {
+    remark = 0;
+    for (ir = IR(J->cur.nins-1); ir > irbase; ir--) {
+      if ((ir->o == IR_ASTORE || ir->o == IR_HSTORE) &&
+	  !irt_ismarked(IR(ir->op2)->t)) {
+	IRIns *ira = sink_checkalloc(J, ir);
+	if (sink_isnested(J, ir, ira) && irt_ismarked(ira->t)) {
+	  irt_setmark(IR(ir->op2)->t);
+	  remark = 1;
+	}
+      }
+    }
+  } while (remark);
+}
+
 /* Sweep instructions and tag sunken allocations and stores. */
 static void sink_sweep_ins(jit_State *J)
 {
@@ -189,7 +266,7 @@ static void sink_sweep_ins(jit_State *J)
 #if LJ_HASFFI
     case IR_CNEW: case IR_CNEWI:
 #endif
-    case IR_TNEW: case IR_TDUP:
+    case IR_TNEW: case IR_TDUP: case IR_FNEW:
       if (!irt_ismarked(ir->t)) {
 	ir->t.irt &= ~IRT_GUARD;
 	ir->prev = REGSP(RID_SINK, 0);
@@ -229,19 +306,31 @@ static void sink_sweep_ins(jit_State *J)
 **
 ** 1. Mark all non-sinkable allocations.
 ** 2. Then sink all remaining allocations and the related stores.
+**
+** A table stored to another sunk table is sunk, too. Both are materialized
+** together, only at the exits that need them.
+**
+** This is not partial escape analysis: an allocation is still either sunk
+** as a whole or allocated on trace. Materializing a sunk allocation at an
+** escape point on trace would need sunk-to-live transitions in the
+** assembler. But an allocation which only escapes on a rare branch, which
+** leaves the trace, stays sunk: the side trace for that branch allocates
+** it after snapshot replay.
 */
 void lj_opt_sink(jit_State *J)
 {
   const uint32_t need = (JIT_F_OPT_SINK|JIT_F_OPT_FWD|
 			 JIT_F_OPT_DCE|JIT_F_OPT_CSE|JIT_F_OPT_FOLD);
   if ((J->flags & need) == need &&
-      (J->chain[IR_TNEW] || J->chain[IR_TDUP] ||
+      (J->chain[IR_TNEW] || J->chain[IR_TDUP] || J->chain[IR_FNEW] ||
        (LJ_HASFFI && (J->chain[IR_CNEW] || J->chain[IR_CNEWI])))) {
     if (!J->loopref)
       sink_mark_snap(J, &J->cur.snap[J->cur.nsnap-1]);
+    sink_find_nested(J);
     sink_mark_ins(J);
     if (J->loopref)
       sink_remark_phi(J);
+    sink_remark_nested(J);
     sink_sweep_ins(J);
   }
 }
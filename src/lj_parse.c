@@ -1568,6 +1568,7 @@ static GCproto *fs_finish(LexState *ls, BCLine line)
 
   /* Allocate prototype and initialize its fields. */
   pt = (GCproto *)lj_mem_newgco(L, (MSize)sizept);
+  lj_gc_acctinc(G(L), ~LJ_TPROTO, sizept);
   pt->gct = ~LJ_TPROTO;
   pt->sizept = (MSize)sizept;
   pt->trace = 0;
@@ -1804,6 +1805,7 @@ static void expr_table(LexState *ls, ExpDesc *e)
 	}
       }
     }
+    lj_tab_newshape(fs->L, t);
     lj_gc_check(fs->L);
   }
 }
@@ -18,6 +18,10 @@
 #if LJ_HASFFI
 #include "lj_ctype.h"
 #endif
+#if LJ_HASVEC
+#include "lj_carith.h"
+#include "lj_crecord.h"
+#endif
 #include "lj_bc.h"
 #include "lj_ff.h"
 #if LJ_HASPROFILE
@@ -130,6 +134,11 @@ static void rec_check_slots(jit_State *J)
 #endif
 	lua_assert((J->slot[s+1+LJ_FR2] & TREF_FRAME));
 	depth++;
+      } else if ((tr & TREF_KEYINDEX)) {
+	lua_assert(tref_isint(tr));
+	lua_assert(tv->u32.hi == LJ_KEYINDEX);
+	if (tref_isk(tr))
+	  lua_assert((uint32_t)ir->i == tv->u32.lo);
       } else {
 	if (tvisnumber(tv))
 	  lua_assert(tref_isnumber(tr));  /* Could be IRT_INT etc., too. */
@@ -245,7 +254,7 @@ static void canonicalize_slots(jit_State *J)
   if (LJ_DUALNUM) return;
   for (s = J->baseslot+J->maxslot-1; s >= 1; s--) {
     TRef tr = J->slot[s];
-    if (tref_isinteger(tr)) {
+    if (tref_isinteger(tr) && !(tr & TREF_KEYINDEX)) {
       IRIns *ir = IR(tref_ref(tr));
       if (!(ir->o == IR_SLOAD && (ir->op2 & IRSLOAD_READONLY)))
 	J->slot[s] = emitir(IRTN(IR_CONV), tr, IRCONV_NUM_INT);
@@ -539,11 +548,130 @@ static LoopEvent rec_iterl(jit_State *J, const BCIns iterins)
   }
 }
 
+/* Record ISNEXT. */
+static void rec_isnext(jit_State *J, BCReg ra)
+{
+  cTValue *b = &J->L->base[ra-3];
+  if (!LJ_TARGET_X86ORX64) {  /* NYI: restore of traversal index. */
+    setintV(&J->errinfo, (int32_t)BC_ISNEXT);
+    lj_trace_err_info(J, LJ_TRERR_NYIBC);
+  }
+  if (tvisfunc(b) && funcV(b)->c.ffid == FF_next &&
+      tvistab(b+1) && tvisnil(b+2)) {
+    TRef trid = emitir(IRT(IR_FLOAD, IRT_U8), getslot(J, ra-3), IRFL_FUNC_FFID);
+    emitir(IRTGI(IR_EQ), trid, lj_ir_kint(J, FF_next));
+    (void)getslot(J, ra-2);  /* Type check for table. */
+    (void)getslot(J, ra-1);  /* Type check for nil control var. */
+    J->base[ra-1] = lj_ir_kint(J, 0) | TREF_KEYINDEX;
+    J->maxslot = ra;
+  } else {  /* Abort trace. Interpreter will despecialize bytecode. */
+    lj_trace_err(J, LJ_TRERR_RECERR);
+  }
+}
+
+/* Record ITERN.
+**
+** The control var holds the index of the next slot to check, which is
+** found with a call to lj_tab_nextidx(). The key and value are then
+** loaded from the array part or the hash part depending on the index.
+*/
+static LoopEvent rec_itern(jit_State *J, BCReg ra, BCReg rb)
+{
+  TValue *base = J->L->base;
+  GCtab *t;
+  TRef tab, ctl, idx, asize, key, val = 0;
+  int32_t i;
+  int direct = 0;
+  /* Since ITERN is recorded at the start, we need our own loop detection. */
+  if (J->pc == J->startpc && J->framedepth + J->retdepth == 0 &&
+      J->parent == 0 && J->exitno == 0) {
+    IRRef ref = REF_FIRST + LJ_HASPROFILE;
+#ifdef LUAJIT_ENABLE_CHECKHOOK
+    ref += 3;
+#endif
+    if (J->cur.nins > ref ||
+	(LJ_HASPROFILE && J->cur.nins == ref && J->cur.ir[ref-1].o != IR_PROF)) {
+      J->instunroll = 0;  /* Cannot continue unrolling across an ITERN. */
+      lj_record_stop(J, LJ_TRLINK_LOOP, J->cur.traceno);  /* Looping trace. */
+      return LOOPEV_ENTER;
+    }
+  }
+  J->maxslot = ra;
+  lj_snap_add(J);
+  ctl = J->base[ra-1];
+  if (!ctl && LJ_TARGET_X86ORX64)
+    ctl = sloadt(J, (int32_t)(ra-1), IRT_GUARD|IRT_INT,
+		 IRSLOAD_TYPECHECK|IRSLOAD_KEYINDEX) | TREF_KEYINDEX;
+  if (!(ctl & TREF_KEYINDEX)) {  /* NYI: other backends, ITERC fallback. */
+    setintV(&J->errinfo, (int32_t)BC_ITERN);
+    lj_trace_err_info(J, LJ_TRERR_NYIBC);
+  }
+  ctl &= ~TREF_KEYINDEX;
+  tab = getslot(J, ra-2);
+  lua_assert(tref_istab(tab) && tvistab(&base[ra-2]));
+  t = tabV(&base[ra-2]);
+  i = lj_tab_nextidx(t, base[ra-1].u32.lo);
+  if ((uint32_t)i == base[ra-1].u32.lo) {
+    /* The next slot is used. Skip the search, but check the value below. */
+    direct = 1;
+    idx = ctl;
+  } else {
+    idx = lj_ir_call(J, IRCALL_lj_tab_nextidx, tab, ctl);
+    if (i < 0) {  /* End of traversal. */
+      emitir(IRTGI(IR_LT), idx, lj_ir_kint(J, 0));
+      J->maxslot = ra-3;
+      J->pc += 2;
+      return LOOPEV_LEAVE;
+    }
+    emitir(IRTGI(IR_GE), idx, lj_ir_kint(J, 0));
+  }
+  asize = emitir(IRTI(IR_FLOAD), tab, IRFL_TAB_ASIZE);
+  if ((uint32_t)i < t->asize) {  /* Array part. */
+    emitir(IRTGI(IR_ULT), idx, asize);
+    key = LJ_DUALNUM ? idx : emitir(IRTN(IR_CONV), idx, IRCONV_NUM_INT);
+    if (rb > 2 || direct) {
+      IRType tv = itype2irt(arrayslot(t, i));
+      TRef arr = emitir(IRT(IR_FLOAD, IRT_PGC), tab, IRFL_TAB_ARRAY);
+      val = emitir(IRTG(IR_ALOAD, tv),
+		   emitir(IRT(IR_AREF, IRT_PGC), arr, idx), 0);
+      if (irtype_ispri(tv)) val = TREF_PRI(tv);
+    }
+  } else {  /* Hash part. Load key and value from the node as TValues. */
+    Node *n = &noderef(t->node)[i - t->asize];
+    IRType tk = itype2irt(&n->key);
+    TRef node = emitir(IRT(IR_FLOAD, IRT_PGC), tab, IRFL_TAB_NODE);
+    TRef nidx, nofs;
+    lua_assert(sizeof(Node) == 3*sizeof(TValue));
+    emitir(IRTGI(IR_UGE), idx, asize);
+    nidx = emitir(IRTI(IR_SUB), idx, asize);
+    if (direct)
+      emitir(IRTGI(IR_ULE), nidx, emitir(IRTI(IR_FLOAD), tab, IRFL_TAB_HMASK));
+    nofs = emitir(IRTI(IR_MUL), nidx, lj_ir_kint(J, 3));
+    if (rb > 2 || direct) {
+      IRType tv = itype2irt(&n->val);
+      val = emitir(IRTG(IR_VLOAD, tv),
+		   emitir(IRT(IR_AREF, IRT_PGC), node, nofs), 0);
+      if (irtype_ispri(tv)) val = TREF_PRI(tv);
+    }
+    key = emitir(IRTG(IR_VLOAD, tk),
+		 emitir(IRT(IR_AREF, IRT_PGC), node,
+			emitir(IRTI(IR_ADD), nofs, lj_ir_kint(J, 1))), 0);
+    if (irtype_ispri(tk)) key = TREF_PRI(tk);
+  }
+  J->base[ra-1] = emitir(IRTI(IR_ADD), idx, lj_ir_kint(J, 1)) | TREF_KEYINDEX;
+  J->base[ra] = key;
+  if (rb > 2) J->base[ra+1] = val;
+  J->maxslot = ra+rb-1;
+  J->needsnap = 1;
+  J->pc += bc_j(J->pc[1])+2;
+  return LOOPEV_ENTER;
+}
+
 /* Record LOOP/JLOOP. Now, that was easy. */
-static LoopEvent rec_loop(jit_State *J, BCReg ra)
+static LoopEvent rec_loop(jit_State *J, BCReg ra, int skip)
 {
   if (ra < J->maxslot) J->maxslot = ra;
-  J->pc++;
+  J->pc += skip;
   return LOOPEV_ENTER;
 }
 
@@ -570,6 +698,7 @@ static void rec_loop_interp(jit_State *J, const BCIns *pc, LoopEvent ev)
       /* Same loop? */
       if (ev == LOOPEV_LEAVE)  /* Must loop back to form a root trace. */
 	lj_trace_err(J, LJ_TRERR_LLEAVE);
+      if (bc_op(J->cur.startins) == BC_ITERN) return;  /* See rec_itern(). */
       lj_record_stop(J, LJ_TRLINK_LOOP, J->cur.traceno);  /* Looping trace. */
     } else if (ev != LOOPEV_LEAVE) {  /* Entering inner loop? */
       /* It's usually better to abort here and wait until the inner loop
@@ -662,7 +791,8 @@ static TRef rec_call_specialize(jit_State *J, GCfunc *fn, TRef tr)
   if (isluafunc(fn)) {
     GCproto *pt = funcproto(fn);
     /* Too many closures created? Probably not a monomorphic function. */
-    if (pt->flags >= PROTO_CLC_POLY) {  /* Specialize to prototype instead. */
+    if (pt->flags >= PROTO_CLC_POLY ||
+	IR(tref_ref(tr))->o == IR_FNEW) {  /* Specialize to prototype instead. */
       TRef trpt = emitir(IRT(IR_FLOAD, IRT_PGC), tr, IRFL_FUNC_PC);
       emitir(IRTG(IR_EQ, IRT_PGC), trpt, lj_ir_kptr(J, proto_bc(pt)));
       (void)lj_ir_kgc(J, obj2gco(pt), IRT_PROTO);  /* Prevent GC of proto. */
@@ -735,14 +865,41 @@ void lj_record_call(jit_State *J, BCReg func, ptrdiff_t nargs)
     lj_trace_err(J, LJ_TRERR_STACKOV);
 }
 
+/* Pop the vararg frame below the start of the trace. Guard for its size.
+** The slots from rbase up to maxslot must have a reference. They keep their
+** index, but are relative to the fixed frame now. The current instruction
+** is still valid there, so it gets a new snapshot, which is used by all
+** guards after the RETF.
+*/
+static void rec_varg_lower(jit_State *J, BCReg rbase, BCReg maxslot)
+{
+  cTValue *frame = J->L->base - 1;
+  TRef trpt = lj_ir_kgc(J, obj2gco(J->pt), IRT_PROTO);
+  TRef trft = lj_ir_kptr(J, (void *)(intptr_t)frame_ftsz(frame));
+  lua_assert(frame_isvarg(frame) && J->framedepth == 0);
+  lua_assert(J->baseslot == 1+LJ_FR2);
+  emitir(IRTG(IR_RETF, IRT_PGC), trpt, trft);
+  J->retdepth++;
+  memset(J->base-1-LJ_FR2, 0, sizeof(TRef)*(rbase+1+LJ_FR2));
+  J->maxslot = maxslot;
+  lj_snap_add(J);
+}
+
 /* Record tail call. */
 void lj_record_tailcall(jit_State *J, BCReg func, ptrdiff_t nargs)
 {
+  if (frame_isvarg(J->L->base - 1) && J->framedepth == 0) {
+    /* Tail call from vararg func to lower frame. */
+    ptrdiff_t i;
+    (void)getslot(J, func);
+    for (i = 1; i <= nargs; i++)
+      (void)getslot(J, func+LJ_FR2+i);
+    rec_varg_lower(J, func, func+1+LJ_FR2+(BCReg)nargs);
+  }
   rec_call_setup(J, func, nargs);
-  if (frame_isvarg(J->L->base - 1)) {
+  if (frame_isvarg(J->L->base - 1) && J->framedepth > 0) {
     BCReg cbase = (BCReg)frame_delta(J->L->base - 1);
-    if (--J->framedepth < 0)
-      lj_trace_err(J, LJ_TRERR_NYIRETL);
+    J->framedepth--;
     J->baseslot -= (BCReg)cbase;
     J->base -= cbase;
     func += cbase;
@@ -803,7 +960,7 @@ void lj_record_ret(jit_State *J, BCReg rbase, ptrdiff_t gotresults)
   }
   /* Return to lower frame via interpreter for unhandled cases. */
   if (J->framedepth == 0 && J->pt && bc_isret(bc_op(*J->pc)) &&
-       (!frame_islua(frame) ||
+       (!frame_islua(frame_isvarg(frame) ? frame_prevd(frame) : frame) ||
 	(J->parent == 0 && J->exitno == 0 &&
 	 !bc_isret(bc_op(J->cur.startins))))) {
     /* NYI: specialize to frame type and return directly, not via RET*. */
@@ -815,12 +972,19 @@ void lj_record_ret(jit_State *J, BCReg rbase, ptrdiff_t gotresults)
   }
   if (frame_isvarg(frame)) {
     BCReg cbase = (BCReg)frame_delta(frame);
-    if (--J->framedepth < 0)  /* NYI: return of vararg func to lower frame. */
+    if (J->framedepth > 0) {  /* Vararg frame is part of the trace. */
+      J->framedepth--;
+      lua_assert(J->baseslot > 1+LJ_FR2);
+      rbase += cbase;
+      J->baseslot -= (BCReg)cbase;
+      J->base -= cbase;
+    } else if (!J->pt || !bc_isret(bc_op(*J->pc)) || J->needsnap ||
+	       !frame_islua(frame_prevd(frame))) {
+      /* NYI: return of tailcalled ff in vararg func to lower frame. */
       lj_trace_err(J, LJ_TRERR_NYIRETL);
-    lua_assert(J->baseslot > 1+LJ_FR2);
-    rbase += cbase;
-    J->baseslot -= (BCReg)cbase;
-    J->base -= cbase;
+    } else {  /* Return of vararg func to lower frame. */
+      rec_varg_lower(J, rbase, rbase + (BCReg)gotresults);
+    }
     frame = frame_prevd(frame);
   }
   if (frame_islua(frame)) {  /* Return to Lua frame. */
@@ -1237,6 +1401,7 @@ static void rec_idx_bump(jit_State *J, RecordIndex *ix)
 	  if (tvistab(&array[i]))
 	    setnilV(&array[i]);
 	}
+	lj_tab_newshape(J->L, tpl);  /* Old duplicates keep the old shape. */
 	J->retryrec = 1;  /* Abort the trace at the end of recording. */
       }
     }
@@ -1244,37 +1409,112 @@ static void rec_idx_bump(jit_State *J, RecordIndex *ix)
 }
 #endif
 
+/* Affine form of an array index: scale*idx + x + ofs. */
+typedef struct RecordAffine {
+  int32_t scale;	/* Factor for the loop index. */
+  int64_t ofs;		/* Constant offset. */
+  IRRef xref;		/* Term independent of the loop index (or 0). */
+  int xneg;		/* Subtract the independent term. */
+} RecordAffine;
+
+/* Decompose an index into an affine function of the loop index. */
+static int rec_idx_affine(jit_State *J, IRRef ref, int32_t sign, int depth,
+			  RecordAffine *af)
+{
+  IRIns *ir = IR(ref);
+  if (ref == J->scev.idx) {
+    af->scale += sign;
+    return 1;
+  } else if (ir->o == IR_KINT) {
+    af->ofs += (int64_t)sign * ir->i;
+    return 1;
+  } else if (depth > 0 && irt_isint(ir->t)) {
+    if (ir->o == IR_ADD || ir->o == IR_ADDOV)
+      return rec_idx_affine(J, ir->op1, sign, depth-1, af) &&
+	     rec_idx_affine(J, ir->op2, sign, depth-1, af);
+    if (ir->o == IR_SUB || ir->o == IR_SUBOV)
+      return rec_idx_affine(J, ir->op1, sign, depth-1, af) &&
+	     rec_idx_affine(J, ir->op2, -sign, depth-1, af);
+    if (ir->o == IR_CONV && irt_isguard(ir->t) &&
+	(ir->op2 & IRCONV_MODEMASK) == IRCONV_INT_NUM) {
+      /* Checked conversion of k*idx, with an integral k. */
+      IRIns *irm = IR(ir->op1);
+      if (irm->o == IR_MUL && irref_isk(irm->op2) &&
+	  IR(irm->op1)->o == IR_CONV && IR(irm->op1)->op1 == J->scev.idx) {
+	lua_Number n = ir_knum(IR(irm->op2))->n;
+	int32_t k = lj_num2int(n);
+	if (n == (lua_Number)k && k >= -0x7fff && k <= 0x7fff) {
+	  af->scale += sign * k;
+	  return 1;
+	}
+      }
+    }
+  }
+  /* Otherwise it must be a single term that doesn't depend on the index. */
+  if (!af->xref && irt_isint(ir->t) &&
+      (ref < J->scev.idx || ir->o == IR_SLOAD ||
+       (ir->o == IR_CONV && IR(ir->op1)->o == IR_SLOAD))) {
+    af->xref = ref;
+    af->xneg = sign < 0;
+    return 1;
+  }
+  return 0;
+}
+
 /* Record bounds-check. */
-static void rec_idx_abc(jit_State *J, TRef asizeref, TRef ikey, uint32_t asize)
+static void rec_idx_abc(jit_State *J, TRef asizeref, TRef ikey, int32_t k,
+			uint32_t asize)
 {
   /* Try to emit invariant bounds checks. */
   if ((J->flags & (JIT_F_OPT_LOOP|JIT_F_OPT_ABC)) ==
       (JIT_F_OPT_LOOP|JIT_F_OPT_ABC)) {
-    IRRef ref = tref_ref(ikey);
-    IRIns *ir = IR(ref);
-    int32_t ofs = 0;
-    IRRef ofsref = 0;
-    /* Handle constant offsets. */
-    if (ir->o == IR_ADD && irref_isk(ir->op2)) {
-      ofsref = ir->op2;
-      ofs = IR(ofsref)->i;
-      ref = ir->op1;
-      ir = IR(ref);
-    }
-    /* Got scalar evolution analysis results for this reference? */
-    if (ref == J->scev.idx) {
-      int32_t stop;
+    RecordAffine af;
+    af.scale = 0;
+    af.ofs = 0;
+    af.xref = 0;
+    af.xneg = 0;
+    /* Got scalar evolution analysis results for an affine index? */
+    if (rec_idx_affine(J, tref_ref(ikey), 1, 4, &af) && af.scale != 0 &&
+	af.ofs == (int32_t)af.ofs) {
+      IRIns *ir = IR(J->scev.idx);
+      cTValue *o = &(J->L->base - J->baseslot)[ir->op1];
+      int64_t idx, stop, start = 0, kstart = 0;
       lua_assert(irt_isint(J->scev.t) && ir->o == IR_SLOAD);
-      stop = numberVint(&(J->L->base - J->baseslot)[ir->op1 + FORL_STOP]);
-      /* Runtime value for stop of loop is within bounds? */
-      if ((uint64_t)stop + ofs < (uint64_t)asize) {
+      idx = numberVint(&o[FORL_IDX]);
+      stop = numberVint(&o[FORL_STOP]);
+      if (J->scev.start) {
+	kstart = (int64_t)af.scale * IR(J->scev.start)->i + af.ofs;
+	start = (int64_t)k + (int64_t)af.scale * (IR(J->scev.start)->i - idx);
+      }
+      /* The keys for start and stop bracket all keys of the loop.
+      ** Runtime value of the key for stop is within bounds?
+      ** An independent term needs an invariant check for start, too.
+      */
+      if ((uint64_t)(k + af.scale * (stop - idx)) < (uint64_t)asize &&
+	  (!af.xref || (J->scev.start && kstart == (int32_t)kstart &&
+			(uint64_t)start < (uint64_t)asize))) {
+	IRType t = af.xref ? IRT_INT : IRT_P32;
+	TRef tr = J->scev.stop;
+	if (af.scale != 1)
+	  tr = emitir(IRTGI(IR_MULOV), tr, lj_ir_kint(J, af.scale));
+	if (af.xref)
+	  tr = emitir(IRTGI(af.xneg ? IR_SUBOV : IR_ADDOV), tr, af.xref);
+	if (af.ofs)
+	  tr = emitir(IRTGI(IR_ADDOV), tr, lj_ir_kint(J, (int32_t)af.ofs));
 	/* Emit invariant bounds check for stop. */
-	emitir(IRTG(IR_ABC, IRT_P32), asizeref, ofs == 0 ? J->scev.stop :
-	       emitir(IRTI(IR_ADD), J->scev.stop, ofsref));
-	/* Emit invariant bounds check for start, if not const or negative. */
-	if (!(J->scev.dir && J->scev.start &&
-	      (int64_t)IR(J->scev.start)->i + ofs >= 0))
-	  emitir(IRTG(IR_ABC, IRT_P32), asizeref, ikey);
+	emitir(IRTG(IR_ABC, t), asizeref, tr);
+	if (af.xref) {
+	  /* Emit invariant bounds check for start. Not marked, since the
+	  ** copy in the loop must remain if the term turns out variant.
+	  */
+	  tr = lj_ir_kint(J, (int32_t)kstart);
+	  tr = emitir(IRTGI(af.xneg ? IR_SUBOV : IR_ADDOV), tr, af.xref);
+	  emitir(IRTG(IR_ABC, t), asizeref, tr);
+	} else if (!(J->scev.start && (af.scale > 0) == J->scev.dir &&
+		     kstart >= 0)) {
+	  /* Emit bounds check for the first key, if not const or negative. */
+	  emitir(IRTG(IR_ABC, t), asizeref, ikey);
+	}
 	return;
       }
     }
@@ -1303,7 +1543,7 @@ static TRef rec_idx_key(jit_State *J, RecordIndex *ix, IRRef *rbref,
       TRef asizeref = emitir(IRTI(IR_FLOAD), ix->tab, IRFL_TAB_ASIZE);
       if ((MSize)k < t->asize) {  /* Currently an array key? */
 	TRef arrayref;
-	rec_idx_abc(J, asizeref, ikey, t->asize);
+	rec_idx_abc(J, asizeref, ikey, k, t->asize);
 	arrayref = emitir(IRT(IR_FLOAD, IRT_PGC), ix->tab, IRFL_TAB_ARRAY);
 	return emitir(IRT(IR_AREF, IRT_PGC), arrayref, ikey);
       } else {  /* Currently not in array (may be an array extension)? */
@@ -1340,14 +1580,21 @@ static TRef rec_idx_key(jit_State *J, RecordIndex *ix, IRRef *rbref,
     MSize hslot = (MSize)((char *)ix->oldv - (char *)&noderef(t->node)[0].val);
     if (t->hmask > 0 && hslot <= t->hmask*(MSize)sizeof(Node) &&
 	hslot <= 65535*(MSize)sizeof(Node)) {
-      TRef node, kslot, hm;
+      TRef node, kslot;
+      GCtab *shape = gcref(t->shape) ? tabref(t->shape) : NULL;
       *rbref = J->cur.nins;  /* Mark possible rollback point. */
       *rbguard = J->guardemit;
-      hm = emitir(IRTI(IR_FLOAD), ix->tab, IRFL_TAB_HMASK);
-      emitir(IRTGI(IR_EQ), hm, lj_ir_kint(J, (int32_t)t->hmask));
+      if (shape) {  /* Guard on the shape, which implies the key slot. */
+	TRef sh = emitir(IRT(IR_FLOAD, IRT_TAB), ix->tab, IRFL_TAB_SHAPE);
+	emitir(IRTG(IR_EQ, IRT_TAB), sh, lj_ir_ktab(J, shape));
+      } else {
+	TRef hm = emitir(IRTI(IR_FLOAD), ix->tab, IRFL_TAB_HMASK);
+	emitir(IRTGI(IR_EQ), hm, lj_ir_kint(J, (int32_t)t->hmask));
+      }
       node = emitir(IRT(IR_FLOAD, IRT_PGC), ix->tab, IRFL_TAB_NODE);
       kslot = lj_ir_kslot(J, key, hslot / sizeof(Node));
-      return emitir(IRTG(IR_HREFK, IRT_PGC), node, kslot);
+      return emitir(shape ? IRT(IR_HREFK, IRT_PGC) : IRTG(IR_HREFK, IRT_PGC),
+		    node, kslot);
     }
   }
   /* Fall back to a regular hash lookup. */
@@ -1371,6 +1618,22 @@ static int nommstr(jit_State *J, TRef key)
   return 1;  /* CANNOT be a metamethod name. */
 }
 
+/* Guard that a table is not frozen before storing to it. */
+void lj_record_unfrozen(jit_State *J, TRef tr, GCtab *t)
+{
+  if (tabisfrozen(t))
+    lj_trace_err(J, LJ_TRERR_TABFROZ);
+  if (J->frozentab) {
+    IROp op = IR(tref_ref(tr))->o;
+    /* Tables allocated on the trace cannot be frozen. */
+    if (op != IR_TNEW && op != IR_TDUP) {
+      TRef tmp = emitir(IRT(IR_FLOAD, IRT_U8), tr, IRFL_TAB_MARKED);
+      tmp = emitir(IRTI(IR_BAND), tmp, lj_ir_kint(J, LJ_GC_FROZEN));
+      emitir(IRTGI(IR_EQ), tmp, lj_ir_kint(J, 0));
+    }
+  }
+}
+
 /* Record indexed load/store. */
 TRef lj_record_idx(jit_State *J, RecordIndex *ix)
 {
@@ -1422,6 +1685,16 @@ TRef lj_record_idx(jit_State *J, RecordIndex *ix)
     }
   }
 
+  /* Loads with constant keys from constant frozen tables are constant. */
+  if (ix->val == 0 && tref_isk(ix->tab) && tref_isk(ix->key) &&
+      tabisfrozen(tabV(&ix->tabv))) {
+    cTValue *tv = lj_tab_get(J->L, tabV(&ix->tabv), &ix->keyv);
+    if (!tvisnil(tv)) {
+      TRef tr = lj_record_constify(J, tv);
+      if (tr) return tr;
+    }
+  }
+
   /* Record the key lookup. */
   xref = rec_idx_key(J, ix, &rbref, &rbguard);
   xrefop = IR(tref_ref(xref))->o;
@@ -1470,6 +1743,7 @@ TRef lj_record_idx(jit_State *J, RecordIndex *ix)
 	goto handlemm;
       }
       lua_assert(!hasmm);
+      lj_record_unfrozen(J, ix->tab, tabV(&ix->tabv));
       if (oldv == niltvg(J2G(J))) {  /* Need to insert a new key. */
 	TRef key = ix->key;
 	if (tref_isinteger(key))  /* NEWREF needs a TValue as a key. */
@@ -1481,22 +1755,25 @@ TRef lj_record_idx(jit_State *J, RecordIndex *ix)
 	  rec_idx_bump(J, ix);
 #endif
       }
-    } else if (!lj_opt_fwd_wasnonnil(J, loadop, tref_ref(xref))) {
-      /* Cannot derive that the previous value was non-nil, must do checks. */
-      if (xrefop == IR_HREF)  /* Guard against store to niltv. */
-	emitir(IRTG(IR_NE, IRT_PGC), xref, lj_ir_kkptr(J, niltvg(J2G(J))));
-      if (ix->idxchain) {  /* Metamethod lookup required? */
-	/* A check for NULL metatable is cheaper (hoistable) than a load. */
-	if (!mt) {
-	  TRef mtref = emitir(IRT(IR_FLOAD, IRT_TAB), ix->tab, IRFL_TAB_META);
-	  emitir(IRTG(IR_EQ, IRT_TAB), mtref, lj_ir_knull(J, IRT_TAB));
-	} else {
-	  IRType t = itype2irt(oldv);
-	  emitir(IRTG(loadop, t), xref, 0);  /* Guard for non-nil value. */
+    } else {
+      lj_record_unfrozen(J, ix->tab, tabV(&ix->tabv));
+      if (!lj_opt_fwd_wasnonnil(J, loadop, tref_ref(xref))) {
+	/* Cannot derive that the previous value was non-nil, must check. */
+	if (xrefop == IR_HREF)  /* Guard against store to niltv. */
+	  emitir(IRTG(IR_NE, IRT_PGC), xref, lj_ir_kkptr(J, niltvg(J2G(J))));
+	if (ix->idxchain) {  /* Metamethod lookup required? */
+	  /* A check for NULL metatable is cheaper (hoistable) than a load. */
+	  if (!mt) {
+	    TRef mtref = emitir(IRT(IR_FLOAD, IRT_TAB), ix->tab, IRFL_TAB_META);
+	    emitir(IRTG(IR_EQ, IRT_TAB), mtref, lj_ir_knull(J, IRT_TAB));
+	  } else {
+	    IRType t = itype2irt(oldv);
+	    emitir(IRTG(loadop, t), xref, 0);  /* Guard for non-nil value. */
+	  }
 	}
+      } else {
+	keybarrier = 0;  /* Previous non-nil value kept the key alive. */
       }
-    } else {
-      keybarrier = 0;  /* Previous non-nil value kept the key alive. */
     }
     /* Convert int to number before storing. */
     if (!LJ_DUALNUM && tref_isinteger(ix->val))
@@ -1562,6 +1839,8 @@ static int rec_upvalue_constify(jit_State *J, GCupval *uvp)
 #endif
     if (!(tvistab(o) || tvisudata(o) || tvisthread(o)))
       return 1;
+    if (tvistab(o) && tabisfrozen(tabV(o)))
+      return 1;  /* Frozen tables are meant to be long-lived. */
   }
   return 0;
 }
@@ -1572,12 +1851,24 @@ static TRef rec_upvalue(jit_State *J, uint32_t uv, TRef val)
   GCupval *uvp = &gcref(J->fn->l.uvptr[uv])->uv;
   TRef fn = getcurrf(J);
   IRRef uref;
-  int needbarrier = 0;
+  int needbarrier = 0, knownslot = 0;
+  /* The upvalues of a closure created on trace are known. */
+  while (IR(tref_ref(fn))->o == IR_FNEW) {
+    IRIns *ir = IR(tref_ref(fn));
+    uint32_t v = proto_uv(ir_kproto(IR(ir->op2)))[uv];
+    if ((v & PROTO_UV_LOCAL)) {  /* Open upvalue aliases a slot of its frame. */
+      knownslot = 1;
+      break;
+    }
+    /* Otherwise it's the same upvalue as in the parent closure. */
+    fn = IR(ir->op1)->o == IR_CARG ? IR(ir->op1)->op1 : ir->op1;
+    uv = v;
+  }
   if (rec_upvalue_constify(J, uvp)) {  /* Try to constify immutable upvalue. */
     TRef tr, kfunc;
     lua_assert(val == 0);
     if (!tref_isk(fn)) {  /* Late specialization of current function. */
-      if (J->pt->flags >= PROTO_CLC_POLY)
+      if (J->pt->flags >= PROTO_CLC_POLY || fn != getcurrf(J) || knownslot)
 	goto noconstify;
       kfunc = lj_ir_kfunc(J, J->fn);
       emitir(IRTG(IR_EQ, IRT_FUNC), fn, kfunc);
@@ -1596,16 +1887,18 @@ noconstify:
   /* Note: this effectively limits LJ_MAX_UPVAL to 127. */
   uv = (uv << 8) | (hashrot(uvp->dhash, uvp->dhash + HASH_BIAS) & 0xff);
   if (!uvp->closed) {
-    uref = tref_ref(emitir(IRTG(IR_UREFO, IRT_PGC), fn, uv));
     /* In current stack? */
     if (uvval(uvp) >= tvref(J->L->stack) &&
 	uvval(uvp) < tvref(J->L->maxstack)) {
       int32_t slot = (int32_t)(uvval(uvp) - (J->L->base - J->baseslot));
       if (slot >= 0) {  /* Aliases an SSA slot? */
-	emitir(IRTG(IR_EQ, IRT_PGC),
-	       REF_BASE,
-	       emitir(IRT(IR_ADD, IRT_PGC), uref,
-		      lj_ir_kint(J, (slot - 1 - LJ_FR2) * -8)));
+	if (!knownslot) {
+	  uref = tref_ref(emitir(IRTG(IR_UREFO, IRT_PGC), fn, uv));
+	  emitir(IRTG(IR_EQ, IRT_PGC),
+		 REF_BASE,
+		 emitir(IRT(IR_ADD, IRT_PGC), uref,
+			lj_ir_kint(J, (slot - 1 - LJ_FR2) * -8)));
+	}
 	slot -= (int32_t)J->baseslot;  /* Note: slot number may be negative! */
 	if (val == 0) {
 	  return getslot(J, slot);
@@ -1616,6 +1909,7 @@ noconstify:
 	}
       }
     }
+    uref = tref_ref(emitir(IRTG(IR_UREFO, IRT_PGC), fn, uv));
     emitir(IRTG(IR_UGT, IRT_PGC),
 	   emitir(IRT(IR_SUB, IRT_PGC), uref, REF_BASE),
 	   lj_ir_kint(J, (J->baseslot + J->maxslot) * 8));
@@ -1640,6 +1934,127 @@ noconstify:
   }
 }
 
+/* -- Closures ------------------------------------------------------------ */
+
+/* Record closure creation. */
+static TRef rec_fnew(jit_State *J, GCproto *pt)
+{
+  TRef fn = getcurrf(J);
+  MSize i;
+  for (i = 0; i < pt->sizeuv; i++)
+    if ((proto_uv(pt)[i] & PROTO_UV_LOCAL)) {
+      /* Pass the frame base for the new open upvalues, too. */
+      TRef base = emitir(IRT(IR_ADD, IRT_PGC), REF_BASE,
+			 lj_ir_kint(J, (J->baseslot - 1 - LJ_FR2) * 8));
+      fn = emitir(IRT(IR_CARG, IRT_NIL), fn, base);
+      break;
+    }
+  return emitir(IRTG(IR_FNEW, IRT_FUNC), fn,
+		lj_ir_kgc(J, obj2gco(pt), IRT_PROTO));
+}
+
+/* Find a closure that refers to the open upvalue of a slot.
+** A closure created on trace must have been created after the last closing
+** of upvalues or return to a lower frame. Otherwise it may refer to an
+** upvalue that has been closed already. Any other closure must be checked.
+*/
+static TRef rec_uclo_closure(jit_State *J, GCupval *uvp, BCReg s,
+			     uint32_t *uv)
+{
+  int32_t ofs = (int32_t)(J->baseslot - 1 - LJ_FR2 + s) * 8;
+  IRRef ref, lim = J->chain[IR_RETF];
+  BCReg k;
+  for (ref = J->chain[IR_CALLS]; ref > lim; ref = IR(ref)->prev)
+    if (IR(ref)->op2 == IRCALL_lj_func_closeuv) {
+      lim = ref;
+      break;
+    }
+  for (ref = J->chain[IR_FNEW]; ref > lim; ref = IR(ref)->prev) {
+    IRIns *ir = IR(ref), *irb;
+    GCproto *pt = ir_kproto(IR(ir->op2));
+    int32_t base = 0;
+    MSize i;
+    if (IR(ir->op1)->o != IR_CARG)
+      continue;  /* No local upvalues. */
+    irb = IR(IR(ir->op1)->op2);
+    if (irb->o == IR_ADD) {
+      lua_assert(irb->op1 == REF_BASE && irref_isk(irb->op2));
+      base = IR(irb->op2)->i;
+    }
+    for (i = 0; i < pt->sizeuv; i++) {
+      uint32_t v = proto_uv(pt)[i];
+      if ((v & PROTO_UV_LOCAL) && base + (int32_t)(v & 0xff) * 8 == ofs) {
+	*uv = (i << 8) | (hashrot(uvp->dhash, uvp->dhash + HASH_BIAS) & 0xff);
+	return emitir(IRTG(IR_UREFO, IRT_PGC), TREF(ref, IRT_FUNC), *uv);
+      }
+    }
+  }
+  for (k = 0; k < J->maxslot; k++) {
+    TValue *o = &J->L->base[k];
+    if (J->base[k] && tvisfunc(o) && isluafunc(funcV(o))) {
+      GCfunc *fn = funcV(o);
+      uint32_t i;
+      for (i = 0; i < fn->l.nupvalues; i++)
+	if (gcref(fn->l.uvptr[i]) == obj2gco(uvp)) {
+	  TRef uref;
+	  *uv = (i << 8) | (hashrot(uvp->dhash, uvp->dhash + HASH_BIAS) & 0xff);
+	  uref = emitir(IRTG(IR_UREFO, IRT_PGC), J->base[k], *uv);
+	  /* Check that the upvalue still points to the slot. */
+	  emitir(IRTG(IR_EQ, IRT_PGC), REF_BASE,
+		 emitir(IRT(IR_ADD, IRT_PGC), uref, lj_ir_kint(J, -ofs)));
+	  return uref;
+	}
+    }
+  }
+  return 0;
+}
+
+/* Record closing of upvalues. */
+static void rec_uclo(jit_State *J, BCReg ra)
+{
+  TValue *level = J->L->base + ra;
+  GCRef *pp = &J->L->openupval;
+  GCupval *uvp;
+  TRef trlevel, tr;
+  int32_t n = 0;
+  trlevel = emitir(IRT(IR_ADD, IRT_PGC), REF_BASE,
+		   lj_ir_kint(J, (J->baseslot - 1 - LJ_FR2 + ra) * 8));
+  while (gcref(*pp) != NULL && uvval((uvp = gco2uv(gcref(*pp)))) >= level) {
+    pp = &uvp->nextgc;
+    n++;
+  }
+  /* Check that the same number of upvalues needs to be closed. */
+  tr = lj_ir_call(J, IRCALL_lj_func_countuv, trlevel);
+  emitir(IRTGI(IR_EQ), tr, lj_ir_kint(J, n));
+  if (n == 0)
+    return;
+  /*
+  ** The stack slots may not be up-to-date on trace. Store the current values
+  ** through the open upvalues, before they are copied by closing them. This
+  ** needs a closure created on trace, that holds each of these upvalues.
+  */
+  for (pp = &J->L->openupval; n > 0; n--, pp = &uvp->nextgc) {
+    BCReg s;
+    uint32_t uv;
+    TRef uref;
+    uvp = gco2uv(gcref(*pp));
+    s = (BCReg)(uvval(uvp) - J->L->base);
+    if (!J->base[s])
+      continue;  /* The stack slot is still unmodified. */
+    uref = rec_uclo_closure(J, uvp, s, &uv);
+    if (!uref)
+      lj_trace_err(J, LJ_TRERR_NYIUCLO);
+    {
+      TRef val = J->base[s];
+      if (!LJ_DUALNUM && tref_isinteger(val))
+	val = emitir(IRTN(IR_CONV), val, IRCONV_NUM_INT);
+      emitir(IRT(IR_USTORE, tref_type(val)), uref, val);
+    }
+  }
+  lj_ir_call(J, IRCALL_lj_func_closeuv, trlevel);
+  J->needsnap = 1;
+}
+
 /* -- Record calls to Lua functions --------------------------------------- */
 
 /* Check unroll limits for calls. */
@@ -1785,12 +2200,22 @@ static void rec_varg(jit_State *J, BCReg dst, ptrdiff_t nresults)
   } else {  /* Unknown number of varargs passed to trace. */
     TRef fr = emitir(IRTI(IR_SLOAD), LJ_FR2, IRSLOAD_READONLY|IRSLOAD_FRAME);
     int32_t frofs = 8*(1+LJ_FR2+numparams)+FRAME_VARG;
+    int exact = 0;
+    if (nresults < 0 && !select_detect(J)) {
+      /* Specialize to the number of varargs passed, e.g. for f(...). */
+      if (nvararg < 0) nvararg = 0;
+      if (J->baseslot + dst + (BCReg)nvararg >= LJ_MAX_JSLOTS)
+	lj_trace_err(J, LJ_TRERR_STACKOV);
+      nresults = nvararg;
+      J->maxslot = dst + (BCReg)nvararg;
+      exact = 1;
+    }
     if (nresults >= 0) {  /* Known fixed number of results. */
       ptrdiff_t i;
       if (nvararg > 0) {
 	ptrdiff_t nload = nvararg >= nresults ? nresults : nvararg;
 	TRef vbase;
-	if (nvararg >= nresults)
+	if (nvararg >= nresults && !exact)
 	  emitir(IRTGI(IR_GE), fr, lj_ir_kint(J, frofs+8*(int32_t)nresults));
 	else
 	  emitir(IRTGI(IR_EQ), fr,
@@ -1813,11 +2238,14 @@ static void rec_varg(jit_State *J, BCReg dst, ptrdiff_t nresults)
 	J->base[dst+i] = TREF_NIL;
       if (dst + (BCReg)nresults > J->maxslot)
 	J->maxslot = dst + (BCReg)nresults;
-    } else if (select_detect(J)) {  /* y = select(x, ...) */
+    } else {  /* y = select(x, ...) */
       TRef tridx = J->base[dst-1];
       TRef tr = TREF_NIL;
       ptrdiff_t idx = lj_ffrecord_select_mode(J, tridx, &J->L->base[dst-1]);
-      if (idx < 0) goto nyivarg;
+      if (idx < 0) {
+	setintV(&J->errinfo, BC_VARG);
+	lj_trace_err_info(J, LJ_TRERR_NYIBC);
+      }
       if (idx != 0 && !tref_isinteger(tridx))
 	tridx = emitir(IRTGI(IR_CONV), tridx, IRCONV_INT_NUM|IRCONV_INDEX);
       if (idx != 0 && tref_isk(tridx)) {
@@ -1831,7 +2259,7 @@ static void rec_varg(jit_State *J, BCReg dst, ptrdiff_t nresults)
 	tr = emitir(IRTI(IR_BSHR), tmp, lj_ir_kint(J, 3));
 	if (idx != 0) {
 	  tridx = emitir(IRTI(IR_ADD), tridx, lj_ir_kint(J, -1));
-	  rec_idx_abc(J, tr, tridx, (uint32_t)nvararg);
+	  rec_idx_abc(J, tr, tridx, (int32_t)idx-1, (uint32_t)nvararg);
 	}
       } else {
 	TRef tmp = lj_ir_kint(J, frofs);
@@ -1856,10 +2284,6 @@ static void rec_varg(jit_State *J, BCReg dst, ptrdiff_t nresults)
       J->base[dst-2-LJ_FR2] = tr;
       J->maxslot = dst-1-LJ_FR2;
       J->bcskip = 2;  /* Skip CALLM + select. */
-    } else {
-    nyivarg:
-      setintV(&J->errinfo, BC_VARG);
-      lj_trace_err_info(J, LJ_TRERR_NYIBC);
     }
   }
 }
@@ -2290,12 +2714,19 @@ void lj_record_ins(jit_State *J)
 
   /* -- Table ops --------------------------------------------------------- */
 
-  case BC_GGET: case BC_GSET:
-    settabV(J->L, &ix.tabv, tabref(J->fn->l.env));
+  case BC_GGET: case BC_GSET: {
+    GCtab *env = tabref(J->fn->l.env);
+    /* Give the environment a shape, so each constant global key turns into
+    ** a cell: a fixed node slot, validated by a single shape guard.
+    */
+    if (!gcref(env->shape) && env->hmask > 0)
+      lj_tab_newshape(J->L, env);
+    settabV(J->L, &ix.tabv, env);
     ix.tab = emitir(IRT(IR_FLOAD, IRT_TAB), getcurrf(J), IRFL_FUNC_ENV);
     ix.idxchain = LJ_MAX_IDXCHAIN;
     rc = lj_record_idx(J, &ix);
     break;
+    }
 
   case BC_TGETB: case BC_TSETB:
     setintV(&ix.keyv, (int32_t)rc);
@@ -2326,6 +2757,9 @@ void lj_record_ins(jit_State *J)
     setgcref(J->rbchash[(rc & (RBCHASH_SLOTS-1))].pt, obj2gco(J->pt));
 #endif
     break;
+  case BC_FNEW:
+    rc = rec_fnew(J, gco2pt(proto_kgc(J->pt, ~(ptrdiff_t)rc)));
+    break;
 
   /* -- Calls and vararg handling ----------------------------------------- */
 
@@ -2393,8 +2827,11 @@ void lj_record_ins(jit_State *J)
   case BC_ITERL:
     rec_loop_interp(J, pc, rec_iterl(J, *pc));
     break;
+  case BC_ITERN:
+    rec_loop_interp(J, pc, rec_itern(J, ra, rb));
+    break;
   case BC_LOOP:
-    rec_loop_interp(J, pc, rec_loop(J, ra));
+    rec_loop_interp(J, pc, rec_loop(J, ra, 1));
     break;
 
   case BC_JFORL:
@@ -2404,7 +2841,9 @@ void lj_record_ins(jit_State *J)
     rec_loop_jit(J, rc, rec_iterl(J, traceref(J, rc)->startins));
     break;
   case BC_JLOOP:
-    rec_loop_jit(J, rc, rec_loop(J, ra));
+    rec_loop_jit(J, rc, rec_loop(J, ra,
+				 !bc_isret(bc_op(traceref(J, rc)->startins)) &&
+				 bc_op(traceref(J, rc)->startins) != BC_ITERN));
     break;
 
   case BC_IFORL:
@@ -2418,10 +2857,17 @@ void lj_record_ins(jit_State *J)
   case BC_LOOPHC:
     break;
 
+  case BC_ISNEXT:
+    rec_isnext(J, ra);
+    break;
+
   case BC_JMP:
     if (ra < J->maxslot)
       J->maxslot = ra;  /* Shrink used slots. */
     break;
+  case BC_UCLO:
+    rec_uclo(J, ra);
+    break;
 
   /* -- Function headers -------------------------------------------------- */
 
@@ -2450,11 +2896,6 @@ void lj_record_ins(jit_State *J)
       lj_ffrecord_func(J);
       break;
     }
-    /* fallthrough */
-  case BC_ITERN:
-  case BC_ISNEXT:
-  case BC_UCLO:
-  case BC_FNEW:
     setintV(&J->errinfo, (int32_t)op);
     lj_trace_err_info(J, LJ_TRERR_NYIBC);
     break;
@@ -2480,6 +2921,208 @@ void lj_record_ins(jit_State *J)
     lj_trace_err(J, LJ_TRERR_TRACEOV);
 }
 
+/* -- Vectorized loops ---------------------------------------------------- */
+
+#if LJ_HASVEC
+/* A simple FORL loop over arrays of doubles like
+**
+**   for i=a,b do d[i] = x[i] * y[i] end
+**   for i=a,b do d[i] = x[i] * k + y[i] end
+**
+** is replaced with a call to a packed SIMD kernel. The body is decoded
+** into a small expression tree first, since it must be matched as a whole
+** before any IR is emitted. Anything else is left to the normal recorder.
+**
+** Note: reductions like s = s + x[i] are not vectorized, since the
+** reassociation would change the results.
+*/
+
+enum { VECN_ARR, VECN_SCAL, VECN_BIN };
+
+typedef struct VecNode {
+  uint8_t kind;		/* VECN_* kind. */
+  uint8_t op;		/* VEC_* operation for VECN_BIN. */
+  uint8_t a, b;		/* Operand nodes for VECN_BIN. */
+  BCReg slot;		/* Slot for VECN_ARR and VECN_SCAL. */
+  cTValue *k;		/* Or the number constant for VECN_SCAL. */
+} VecNode;
+
+#define VEC_MAXINS	8	/* Max. instructions in the loop body. */
+#define VEC_MAXTMP	8	/* Max. temporary slots in the loop body. */
+
+/* Decoder state for the loop body. */
+typedef struct VecState {
+  VecNode node[VEC_MAXINS*3+1];  /* Node 0 is unused. */
+  uint8_t tmp[VEC_MAXTMP];  /* Nodes for temporary slots, 0 = undefined. */
+  uint32_t nnode;
+  BCReg ra, ext;
+} VecState;
+
+/* Add a node for a slot operand or a number constant. */
+static uint32_t vec_operand(jit_State *J, VecState *vs, BCReg s, cTValue *k)
+{
+  VecNode *n;
+  if (!k) {
+    if (s > vs->ext) {  /* Temporary slot. */
+      return s-vs->ext-1 < VEC_MAXTMP ? vs->tmp[s-vs->ext-1] : 0;
+    } else if (s >= vs->ra || !tvisnumber(&J->L->base[s])) {
+      return 0;
+    }
+  }
+  n = &vs->node[vs->nnode];
+  n->kind = VECN_SCAL;
+  n->slot = s;
+  n->k = k;
+  return vs->nnode++;
+}
+
+/* Set a temporary slot to a node. */
+static int vec_settmp(VecState *vs, BCReg s, uint32_t n)
+{
+  if (n == 0 || s <= vs->ext || s-vs->ext-1 >= VEC_MAXTMP) return 0;
+  vs->tmp[s-vs->ext-1] = (uint8_t)n;
+  return 1;
+}
+
+/* Decode the loop body. Returns the node stored to d[i] or 0. */
+static uint32_t vec_decode(jit_State *J, VecState *vs, const BCIns *pc,
+			   const BCIns *pe, BCReg *dslot)
+{
+  if (pe - pc > VEC_MAXINS) return 0;
+  for (; pc < pe; pc++) {
+    BCIns ins = *pc;
+    BCReg a = bc_a(ins), b = bc_b(ins), c = bc_c(ins);
+    VecNode *n = &vs->node[vs->nnode];
+    uint32_t x, y;
+    switch (bc_op(ins)) {
+    case BC_TGETV:
+      if (c != vs->ext || b >= vs->ra ||
+	  !lj_crecord_isvecarray(J, &J->L->base[b], 0))
+	return 0;
+      n->kind = VECN_ARR;
+      n->slot = b;
+      if (!vec_settmp(vs, a, vs->nnode++)) return 0;
+      break;
+    case BC_TSETV:
+      if (pc+1 != pe || c != vs->ext || b >= vs->ra ||
+	  !lj_crecord_isvecarray(J, &J->L->base[b], 1))
+	return 0;
+      *dslot = b;
+      return vec_operand(J, vs, a, NULL);
+    case BC_ADDVV: case BC_SUBVV: case BC_MULVV: case BC_DIVVV:
+      x = vec_operand(J, vs, b, NULL);
+      y = vec_operand(J, vs, c, NULL);
+      goto binop;
+    case BC_ADDVN: case BC_SUBVN: case BC_MULVN: case BC_DIVVN:
+      x = vec_operand(J, vs, b, NULL);
+      y = vec_operand(J, vs, 0, proto_knumtv(J->pt, c));
+      goto binop;
+    case BC_ADDNV: case BC_SUBNV: case BC_MULNV: case BC_DIVNV:
+      x = vec_operand(J, vs, 0, proto_knumtv(J->pt, c));
+      y = vec_operand(J, vs, b, NULL);
+    binop:
+      if (x == 0 || y == 0) return 0;
+      n = &vs->node[vs->nnode];
+      n->kind = VECN_BIN;
+      n->op = (uint8_t)((bc_op(ins) - BC_ADDVN) % 5);  /* ADD, SUB, ... */
+      n->a = (uint8_t)x;
+      n->b = (uint8_t)y;
+      if (!vec_settmp(vs, a, vs->nnode++)) return 0;
+      break;
+    default:
+      return 0;
+    }
+  }
+  return 0;
+}
+
+/* Match the stored node to a mode for lj_carith_vec. Returns -1 if none. */
+static int32_t vec_match(VecState *vs, uint32_t d, uint32_t *x, uint32_t *y,
+			 uint32_t *k, int fma)
+{
+  VecNode *n = &vs->node[d], *l, *r;
+  if (n->kind != VECN_BIN) return -1;
+  l = &vs->node[n->a]; r = &vs->node[n->b];
+  if (l->kind == VECN_ARR && r->kind == VECN_ARR) {
+    *x = n->a; *y = n->b;
+    return n->op;
+  } else if (l->kind == VECN_ARR && r->kind == VECN_SCAL) {
+    *x = n->a; *k = n->b;
+    return n->op|VEC_YK;
+  } else if (l->kind == VECN_SCAL && r->kind == VECN_ARR) {
+    *k = n->a; *y = n->b;
+    return n->op|VEC_XK;
+  } else if (n->op == VEC_ADD && !fma) {  /* Match x[i]*k + y[i]. */
+    uint32_t m = n->a, a = n->b;
+    if (l->kind == VECN_ARR) { m = n->b; a = n->a; }
+    n = &vs->node[m];
+    if (vs->node[a].kind != VECN_ARR || n->kind != VECN_BIN ||
+	n->op != VEC_MUL)
+      return -1;
+    l = &vs->node[n->a]; r = &vs->node[n->b];
+    if (l->kind == VECN_ARR && r->kind == VECN_SCAL) {
+      *x = n->a; *k = n->b;
+    } else if (l->kind == VECN_SCAL && r->kind == VECN_ARR) {
+      *k = n->a; *x = n->b;
+    } else {
+      return -1;
+    }
+    *y = a;
+    return VEC_AXPY;
+  }
+  return -1;
+}
+
+/* Get the pointer to the data of an array node. */
+static TRef vec_array(jit_State *J, VecState *vs, uint32_t n)
+{
+  BCReg s;
+  if (n == 0) return lj_ir_kptr(J, NULL);
+  s = vs->node[n].slot;
+  return lj_crecord_vecarray(J, getslot(J, s), &J->L->base[s]);
+}
+
+/* Try to record a whole FORL loop as a call to a vectorized kernel. */
+static int rec_vecloop(jit_State *J)
+{
+  const BCIns *fori = J->pc-1, *forl = J->startpc;
+  IRIns *irstep = IR(J->scev.step);
+  VecState vs;
+  uint32_t dn, xn = 0, yn = 0, kn = 0;
+  BCReg dslot = 0;
+  int32_t mode;
+  TRef d, x, y, k;
+  if (J->scev.t.irt != IRT_INT || irstep->o != IR_KINT || irstep->i != 1)
+    return 0;
+  vs.ra = bc_a(*fori);
+  vs.ext = vs.ra + FORL_EXT;
+  vs.nnode = 1;
+  memset(vs.tmp, 0, sizeof(vs.tmp));
+  dn = vec_decode(J, &vs, J->pc, forl, &dslot);
+  if (dn == 0) return 0;
+  mode = vec_match(&vs, dn, &xn, &yn, &kn, (J->flags & JIT_F_OPT_FMA));
+  if (mode < 0) return 0;
+  if ((J->flags & JIT_F_AVX2)) mode |= VEC_AVX2;
+  d = lj_crecord_vecarray(J, getslot(J, dslot), &J->L->base[dslot]);
+  x = vec_array(J, &vs, xn);
+  y = vec_array(J, &vs, yn);
+  if (kn == 0) {
+    k = lj_ir_knum_zero(J);
+  } else if (vs.node[kn].k) {
+    k = lj_ir_knum(J, numberVnum(vs.node[kn].k));
+  } else {
+    k = lj_ir_tonum(J, getslot(J, vs.node[kn].slot));
+  }
+  lj_ir_call(J, IRCALL_lj_carith_vec, d, x, y, k, lj_ir_kint(J, mode),
+	     J->base[vs.ext], TREF(J->scev.stop, IRT_INT));
+  /* Continue in the interpreter after the loop. */
+  J->pc = forl+1;
+  J->maxslot = vs.ra;
+  lj_record_stop(J, LJ_TRLINK_INTERP, 0);
+  return 1;
+}
+#endif
+
 /* -- Recording setup ----------------------------------------------------- */
 
 /* Setup recording for a root trace started by a hot loop. */
@@ -2503,6 +3146,13 @@ static const BCIns *rec_setup_root(jit_State *J)
     lua_assert(bc_op(pc[-1]) == BC_JMP);
     J->bc_min = pc;
     break;
+  case BC_ITERN:
+    lua_assert(bc_op(pc[1]) == BC_ITERL);
+    J->maxslot = ra;
+    J->bc_extent = (MSize)(-bc_j(pc[1]))*sizeof(BCIns);
+    J->bc_min = pc+2+bc_j(pc[1]);
+    J->state = LJ_TRACE_RECORD_1ST;  /* Record this first ITERN, too. */
+    break;
   case BC_LOOP:
     /* Only check BC range for real loops, but not for "repeat until true". */
     pcj = pc + bc_j(ins);
@@ -2612,9 +3262,13 @@ void lj_record_setup(jit_State *J)
     ** at the start! So snapshot #0 needs to point to the *next* instruction.
     */
     lj_snap_add(J);
-    if (bc_op(J->cur.startins) == BC_FORL)
+    if (bc_op(J->cur.startins) == BC_FORL) {
       rec_for_loop(J, J->pc-1, &J->scev, 1);
-    else if (bc_op(J->cur.startins) == BC_ITERC)
+#if LJ_HASVEC
+      if ((J->flags & JIT_F_OPT_VEC) && rec_vecloop(J))
+	return;
+#endif
+    } else if (bc_op(J->cur.startins) == BC_ITERC)
       J->startpc = NULL;
     if (1 + J->pt->framesize >= LJ_MAX_JSLOTS)
       lj_trace_err(J, LJ_TRERR_STACKOV);
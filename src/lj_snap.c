@@ -12,6 +12,7 @@
 
 #include "lj_gc.h"
 #include "lj_tab.h"
+#include "lj_func.h"
 #include "lj_state.h"
 #include "lj_frame.h"
 #include "lj_bc.h"
@@ -257,7 +258,7 @@ static BCReg snap_usedef(jit_State *J, uint8_t *udf,
 	return 0;
       }
       break;
-    case BCMfunc: return maxslot;  /* NYI: will abort, anyway. */
+    case BCMfunc: return maxslot;  /* Closures may capture any slot. */
     default: break;
     }
     switch (bcmode_a(op)) {
@@ -413,7 +414,8 @@ static TRef snap_dedup(jit_State *J, SnapEntry *map, MSize nmax, IRRef ref)
   MSize j;
   for (j = 0; j < nmax; j++)
     if (snap_ref(map[j]) == ref)
-      return J->slot[snap_slot(map[j])] & ~(SNAP_CONT|SNAP_FRAME);
+      return J->slot[snap_slot(map[j])] &
+	     ~(SNAP_KEYINDEX|SNAP_CONT|SNAP_FRAME);
   return 0;
 }
 
@@ -453,6 +455,94 @@ static LJ_AINLINE int snap_sunk_store(GCtrace *T, IRIns *ira, IRIns *irs)
   return snap_sunk_store2(T, ira, irs);
 }
 
+/* Emit PVALs for the values of a sunk allocation and its sunk stores. */
+static void snap_sunk_pvals(jit_State *J, GCtrace *T, SnapEntry *map,
+			    MSize nent, BloomFilter seen, IRIns *ir,
+			    IRIns *irlast)
+{
+  lua_assert(ir->o == IR_TNEW || ir->o == IR_TDUP || ir->o == IR_FNEW ||
+	     ir->o == IR_CNEW || ir->o == IR_CNEWI);
+  if (ir->op1 >= T->nk) snap_pref(J, T, map, nent, seen, ir->op1);
+  if (ir->op2 >= T->nk) snap_pref(J, T, map, nent, seen, ir->op2);
+  if (LJ_HASFFI && ir->o == IR_CNEWI) {
+    if (LJ_32 && ir+1 < T->ir + T->nins && (ir+1)->o == IR_HIOP)
+      snap_pref(J, T, map, nent, seen, (ir+1)->op2);
+  } else {
+    IRIns *irs;
+    for (irs = ir+1; irs < irlast; irs++)
+      if (irs->r == RID_SINK && snap_sunk_store(T, ir, irs)) {
+	if (T->ir[irs->op2].r == RID_SUNK)  /* Nested sunk allocation. */
+	  snap_sunk_pvals(J, T, map, nent, seen, &T->ir[irs->op2], irlast);
+	else if (snap_pref(J, T, map, nent, seen, irs->op2) == 0)
+	  snap_pref(J, T, map, nent, seen, T->ir[irs->op2].op1);
+	else if ((LJ_SOFTFP32 || (LJ_32 && LJ_HASFFI)) &&
+		 irs+1 < irlast && (irs+1)->o == IR_HIOP)
+	  snap_pref(J, T, map, nent, seen, (irs+1)->op2);
+      }
+  }
+}
+
+/* Replay a sunk allocation and its sunk stores. */
+static TRef snap_replay_sunk(jit_State *J, GCtrace *T, SnapEntry *map,
+			     MSize nent, BloomFilter seen, IRIns *ir,
+			     IRIns *irlast)
+{
+  IRIns *irs;
+  TRef op1 = ir->op1, op2 = ir->op2, tr;
+  if (op1 >= T->nk) op1 = snap_pref(J, T, map, nent, seen, op1);
+  if (op2 >= T->nk) op2 = snap_pref(J, T, map, nent, seen, op2);
+  tr = emitir(ir->ot, op1, op2);
+  for (irs = ir+1; irs < irlast; irs++)
+    if (irs->r == RID_SINK && snap_sunk_store(T, ir, irs)) {
+      IRIns *irr = &T->ir[irs->op1];
+      TRef val, key = irr->op2, tmp = tr;
+      if (irr->o != IR_FREF) {
+	IRIns *irk = &T->ir[key];
+	if (irr->o == IR_HREFK)
+	  key = lj_ir_kslot(J, snap_replay_const(J, &T->ir[irk->op1]),
+			    irk->op2);
+	else
+	  key = snap_replay_const(J, irk);
+	if (irr->o == IR_HREFK || irr->o == IR_AREF) {
+	  IRIns *irf = &T->ir[irr->op1];
+	  tmp = emitir(irf->ot, tmp, irf->op2);
+	}
+      }
+      tmp = emitir(irr->ot, tmp, key);
+      if (T->ir[irs->op2].r == RID_SUNK) {  /* Nested sunk allocation. */
+	val = snap_replay_sunk(J, T, map, nent, seen, &T->ir[irs->op2], irlast);
+      } else {
+	val = snap_pref(J, T, map, nent, seen, irs->op2);
+	if (val == 0) {
+	  IRIns *irc = &T->ir[irs->op2];
+	  lua_assert(irc->o == IR_CONV && irc->op2 == IRCONV_NUM_INT);
+	  val = snap_pref(J, T, map, nent, seen, irc->op1);
+	  val = emitir(IRTN(IR_CONV), val, IRCONV_NUM_INT);
+	} else if ((LJ_SOFTFP32 || (LJ_32 && LJ_HASFFI)) &&
+		   irs+1 < irlast && (irs+1)->o == IR_HIOP) {
+	  IRType t = IRT_I64;
+	  if (LJ_SOFTFP32 && irt_type((irs+1)->t) == IRT_SOFTFP)
+	    t = IRT_NUM;
+	  lj_needsplit(J);
+	  if (irref_isk(irs->op2) && irref_isk((irs+1)->op2)) {
+	    uint64_t k = (uint32_t)T->ir[irs->op2].i +
+			 ((uint64_t)T->ir[(irs+1)->op2].i << 32);
+	    val = lj_ir_k64(J, t == IRT_I64 ? IR_KINT64 : IR_KNUM, k);
+	  } else {
+	    val = emitir_raw(IRT(IR_HIOP, t), val,
+		    snap_pref(J, T, map, nent, seen, (irs+1)->op2));
+	  }
+	  tmp = emitir(IRT(irs->o, t), tmp, val);
+	  continue;
+	}
+      }
+      tmp = emitir(irs->ot, tmp, val);
+    } else if (LJ_HASFFI && irs->o == IR_XBAR && ir->o == IR_CNEW) {
+      emitir(IRT(IR_XBAR, IRT_NIL), 0, 0);
+    }
+  return tr;
+}
+
 /* Replay snapshot state to setup side trace. */
 void lj_snap_replay(jit_State *J, GCtrace *T)
 {
@@ -491,7 +581,8 @@ void lj_snap_replay(jit_State *J, GCtrace *T)
       tr = emitir_raw(IRT(IR_SLOAD, t), s, mode);
     }
   setslot:
-    J->slot[s] = tr | (sn&(SNAP_CONT|SNAP_FRAME));  /* Same as TREF_* flags. */
+    /* Same as TREF_* flags. */
+    J->slot[s] = tr | (sn&(SNAP_KEYINDEX|SNAP_CONT|SNAP_FRAME));
     J->framedepth += ((sn & (SNAP_CONT|SNAP_FRAME)) && (s != LJ_FR2));
     if ((sn & SNAP_FRAME))
       J->baseslot = s+1;
@@ -507,24 +598,7 @@ void lj_snap_replay(jit_State *J, GCtrace *T)
       if (regsp_reg(ir->r) == RID_SUNK) {
 	if (J->slot[snap_slot(sn)] != snap_slot(sn)) continue;
 	pass23 = 1;
-	lua_assert(ir->o == IR_TNEW || ir->o == IR_TDUP ||
-		   ir->o == IR_CNEW || ir->o == IR_CNEWI);
-	if (ir->op1 >= T->nk) snap_pref(J, T, map, nent, seen, ir->op1);
-	if (ir->op2 >= T->nk) snap_pref(J, T, map, nent, seen, ir->op2);
-	if (LJ_HASFFI && ir->o == IR_CNEWI) {
-	  if (LJ_32 && refp+1 < T->nins && (ir+1)->o == IR_HIOP)
-	    snap_pref(J, T, map, nent, seen, (ir+1)->op2);
-	} else {
-	  IRIns *irs;
-	  for (irs = ir+1; irs < irlast; irs++)
-	    if (irs->r == RID_SINK && snap_sunk_store(T, ir, irs)) {
-	      if (snap_pref(J, T, map, nent, seen, irs->op2) == 0)
-		snap_pref(J, T, map, nent, seen, T->ir[irs->op2].op1);
-	      else if ((LJ_SOFTFP32 || (LJ_32 && LJ_HASFFI)) &&
-		       irs+1 < irlast && (irs+1)->o == IR_HIOP)
-		snap_pref(J, T, map, nent, seen, (irs+1)->op2);
-	    }
-	}
+	snap_sunk_pvals(J, T, map, nent, seen, ir, irlast);
       } else if (!irref_isk(refp) && !regsp_used(ir->prev)) {
 	lua_assert(ir->o == IR_CONV && ir->op2 == IRCONV_NUM_INT);
 	J->slot[snap_slot(sn)] = snap_pref(J, T, map, nent, seen, ir->op1);
@@ -536,16 +610,13 @@ void lj_snap_replay(jit_State *J, GCtrace *T)
       IRRef refp = snap_ref(sn);
       IRIns *ir = &T->ir[refp];
       if (regsp_reg(ir->r) == RID_SUNK) {
-	TRef op1, op2;
 	if (J->slot[snap_slot(sn)] != snap_slot(sn)) {  /* De-dup allocs. */
 	  J->slot[snap_slot(sn)] = J->slot[J->slot[snap_slot(sn)]];
 	  continue;
 	}
-	op1 = ir->op1;
-	if (op1 >= T->nk) op1 = snap_pref(J, T, map, nent, seen, op1);
-	op2 = ir->op2;
-	if (op2 >= T->nk) op2 = snap_pref(J, T, map, nent, seen, op2);
 	if (LJ_HASFFI && ir->o == IR_CNEWI) {
+	  TRef op1 = snap_pref(J, T, map, nent, seen, ir->op1);
+	  TRef op2 = snap_pref(J, T, map, nent, seen, ir->op2);
 	  if (LJ_32 && refp+1 < T->nins && (ir+1)->o == IR_HIOP) {
 	    lj_needsplit(J);  /* Emit joining HIOP. */
 	    op2 = emitir_raw(IRT(IR_HIOP, IRT_I64), op2,
@@ -553,53 +624,8 @@ void lj_snap_replay(jit_State *J, GCtrace *T)
 	  }
 	  J->slot[snap_slot(sn)] = emitir(ir->ot & ~(IRT_MARK|IRT_ISPHI), op1, op2);
 	} else {
-	  IRIns *irs;
-	  TRef tr = emitir(ir->ot, op1, op2);
-	  J->slot[snap_slot(sn)] = tr;
-	  for (irs = ir+1; irs < irlast; irs++)
-	    if (irs->r == RID_SINK && snap_sunk_store(T, ir, irs)) {
-	      IRIns *irr = &T->ir[irs->op1];
-	      TRef val, key = irr->op2, tmp = tr;
-	      if (irr->o != IR_FREF) {
-		IRIns *irk = &T->ir[key];
-		if (irr->o == IR_HREFK)
-		  key = lj_ir_kslot(J, snap_replay_const(J, &T->ir[irk->op1]),
-				    irk->op2);
-		else
-		  key = snap_replay_const(J, irk);
-		if (irr->o == IR_HREFK || irr->o == IR_AREF) {
-		  IRIns *irf = &T->ir[irr->op1];
-		  tmp = emitir(irf->ot, tmp, irf->op2);
-		}
-	      }
-	      tmp = emitir(irr->ot, tmp, key);
-	      val = snap_pref(J, T, map, nent, seen, irs->op2);
-	      if (val == 0) {
-		IRIns *irc = &T->ir[irs->op2];
-		lua_assert(irc->o == IR_CONV && irc->op2 == IRCONV_NUM_INT);
-		val = snap_pref(J, T, map, nent, seen, irc->op1);
-		val = emitir(IRTN(IR_CONV), val, IRCONV_NUM_INT);
-	      } else if ((LJ_SOFTFP32 || (LJ_32 && LJ_HASFFI)) &&
-			 irs+1 < irlast && (irs+1)->o == IR_HIOP) {
-		IRType t = IRT_I64;
-		if (LJ_SOFTFP32 && irt_type((irs+1)->t) == IRT_SOFTFP)
-		  t = IRT_NUM;
-		lj_needsplit(J);
-		if (irref_isk(irs->op2) && irref_isk((irs+1)->op2)) {
-		  uint64_t k = (uint32_t)T->ir[irs->op2].i +
-			       ((uint64_t)T->ir[(irs+1)->op2].i << 32);
-		  val = lj_ir_k64(J, t == IRT_I64 ? IR_KINT64 : IR_KNUM, k);
-		} else {
-		  val = emitir_raw(IRT(IR_HIOP, t), val,
-			  snap_pref(J, T, map, nent, seen, (irs+1)->op2));
-		}
-		tmp = emitir(IRT(irs->o, t), tmp, val);
-		continue;
-	      }
-	      tmp = emitir(irs->ot, tmp, val);
-	    } else if (LJ_HASFFI && irs->o == IR_XBAR && ir->o == IR_CNEW) {
-	      emitir(IRT(IR_XBAR, IRT_NIL), 0, 0);
-	    }
+	  J->slot[snap_slot(sn)] = snap_replay_sunk(J, T, map, nent, seen,
+						   ir, irlast);
 	}
       }
     }
@@ -617,20 +643,10 @@ static void snap_unsink(jit_State *J, GCtrace *T, ExitState *ex,
 			SnapNo snapno, BloomFilter rfilt,
 			IRIns *ir, TValue *o);
 
-/* Restore a value from the trace exit state. */
-static void snap_restoreval(jit_State *J, GCtrace *T, ExitState *ex,
-			    SnapNo snapno, BloomFilter rfilt,
-			    IRRef ref, TValue *o)
+/* Restore a value from a register or spill slot of the exit state. */
+static LJ_AINLINE void snap_restorereg(jit_State *J, ExitState *ex,
+				       RegSP rs, IRType1 t, TValue *o)
 {
-  IRIns *ir = &T->ir[ref];
-  IRType1 t = ir->t;
-  RegSP rs = ir->prev;
-  if (irref_isk(ref)) {  /* Restore constant slot. */
-    lj_ir_kvalue(J->L, o, ir);
-    return;
-  }
-  if (LJ_UNLIKELY(bloomtest(rfilt, ref)))
-    rs = snap_renameref(T, snapno, ref, rs);
   if (ra_hasspill(regsp_spill(rs))) {  /* Restore from spill slot. */
     int32_t *sps = &ex->spill[regsp_spill(rs)];
     if (irt_isinteger(t)) {
@@ -650,12 +666,7 @@ static void snap_restoreval(jit_State *J, GCtrace *T, ExitState *ex,
     }
   } else {  /* Restore from register. */
     Reg r = regsp_reg(rs);
-    if (ra_noreg(r)) {
-      lua_assert(ir->o == IR_CONV && ir->op2 == IRCONV_NUM_INT);
-      snap_restoreval(J, T, ex, snapno, rfilt, ir->op1, o);
-      if (LJ_DUALNUM) setnumV(o, (lua_Number)intV(o));
-      return;
-    } else if (irt_isinteger(t)) {
+    if (irt_isinteger(t)) {
       setintV(o, (int32_t)ex->gpr[r-RID_MIN_GPR]);
 #if !LJ_SOFTFP
     } else if (irt_isnum(t)) {
@@ -677,6 +688,28 @@ static void snap_restoreval(jit_State *J, GCtrace *T, ExitState *ex,
   }
 }
 
+/* Restore a value from the trace exit state. */
+static void snap_restoreval(jit_State *J, GCtrace *T, ExitState *ex,
+			    SnapNo snapno, BloomFilter rfilt,
+			    IRRef ref, TValue *o)
+{
+  IRIns *ir = &T->ir[ref];
+  RegSP rs = ir->prev;
+  if (irref_isk(ref)) {  /* Restore constant slot. */
+    lj_ir_kvalue(J->L, o, ir);
+    return;
+  }
+  if (LJ_UNLIKELY(bloomtest(rfilt, ref)))
+    rs = snap_renameref(T, snapno, ref, rs);
+  if (!ra_hasspill(regsp_spill(rs)) && ra_noreg(regsp_reg(rs))) {
+    lua_assert(ir->o == IR_CONV && ir->op2 == IRCONV_NUM_INT);
+    snap_restoreval(J, T, ex, snapno, rfilt, ir->op1, o);
+    if (LJ_DUALNUM) setnumV(o, (lua_Number)intV(o));
+    return;
+  }
+  snap_restorereg(J, ex, rs, ir->t, o);
+}
+
 #if LJ_HASFFI
 /* Restore raw data from the trace exit state. */
 static void snap_restoredata(GCtrace *T, ExitState *ex,
@@ -744,8 +777,16 @@ static void snap_unsink(jit_State *J, GCtrace *T, ExitState *ex,
 			SnapNo snapno, BloomFilter rfilt,
 			IRIns *ir, TValue *o)
 {
-  lua_assert(ir->o == IR_TNEW || ir->o == IR_TDUP ||
+  lua_assert(ir->o == IR_TNEW || ir->o == IR_TDUP || ir->o == IR_FNEW ||
 	     ir->o == IR_CNEW || ir->o == IR_CNEWI);
+  if (ir->o == IR_FNEW) {
+    TValue tmp;
+    /* Only closures without local upvalues are sunk, so no base is needed. */
+    snap_restoreval(J, T, ex, snapno, rfilt, ir->op1, &tmp);
+    setfuncV(J->L, o, lj_func_newL_jit(J->L, ir_kproto(&T->ir[ir->op2]),
+				       &funcV(&tmp)->l, NULL));
+    return;
+  }
 #if LJ_HASFFI
   if (ir->o == IR_CNEW || ir->o == IR_CNEWI) {
     CTState *cts = ctype_cts(J->L);
@@ -815,7 +856,10 @@ static void snap_unsink(jit_State *J, GCtrace *T, ExitState *ex,
 	  lj_ir_kvalue(J->L, &tmp, irk);
 	  val = lj_tab_set(J->L, t, &tmp);
 	  /* NOBARRIER: The table is new (marked white). */
-	  snap_restoreval(J, T, ex, snapno, rfilt, irs->op2, val);
+	  if (T->ir[irs->op2].r == RID_SUNK)  /* Nested sunk allocation. */
+	    snap_unsink(J, T, ex, snapno, rfilt, &T->ir[irs->op2], val);
+	  else
+	    snap_restoreval(J, T, ex, snapno, rfilt, irs->op2, val);
 	  if (LJ_SOFTFP32 && irs+1 < T->ir + T->nins && (irs+1)->o == IR_HIOP) {
 	    snap_restoreval(J, T, ex, snapno, rfilt, (irs+1)->op2, &tmp);
 	    val->u32.hi = tmp.u32.lo;
@@ -825,6 +869,39 @@ static void snap_unsink(jit_State *J, GCtrace *T, ExitState *ex,
   }
 }
 
+/* Precompute the restore plan for all snapshots of a finished trace.
+** Plain values in a register or spill slot are resolved up front, including
+** any renames. Constants, sunk allocations and special slots are left to
+** the generic restore.
+*/
+void lj_snap_restoreplan(GCtrace *T)
+{
+  SnapNo snapno;
+  for (snapno = 0; snapno < T->nsnap; snapno++) {
+    SnapShot *snap = &T->snap[snapno];
+    SnapEntry *map = &T->snapmap[snap->mapofs];
+    SnapRestore *plan = &T->snaprestore[snap->mapofs];
+    BloomFilter rfilt = snap_renamefilter(T, snapno);
+    MSize n, nent = snap->nent;
+    for (n = 0; n < nent; n++) {
+      SnapEntry sn = map[n];
+      IRRef ref = snap_ref(sn);
+      SnapRestore sr = SNAPRESTORE_SLOW;
+      if (!(sn & (SNAP_NORESTORE|SNAP_SOFTFPNUM|SNAP_KEYINDEX|
+		  SNAP_CONT|SNAP_FRAME)) && !irref_isk(ref)) {
+	IRIns *ir = &T->ir[ref];
+	RegSP rs = ir->prev;
+	if (bloomtest(rfilt, ref))
+	  rs = snap_renameref(T, snapno, ref, rs);
+	if (ir->r != RID_SUNK &&
+	    (ra_hasspill(regsp_spill(rs)) || !ra_noreg(regsp_reg(rs))))
+	  sr = SNAPRESTORE(rs, irt_type(ir->t));
+      }
+      plan[n] = sr;
+    }
+  }
+}
+
 /* Restore interpreter state from exit state with the help of a snapshot. */
 const BCIns *lj_snap_restore(jit_State *J, void *exptr)
 {
@@ -834,6 +911,7 @@ const BCIns *lj_snap_restore(jit_State *J, void *exptr)
   SnapShot *snap = &T->snap[snapno];
   MSize n, nent = snap->nent;
   SnapEntry *map = &T->snapmap[snap->mapofs];
+  SnapRestore *plan = &T->snaprestore[snap->mapofs];
 #if !LJ_FR2 || defined(LUA_USE_ASSERT)
   SnapEntry *flinks = &T->snapmap[snap_nextofs(T, snap)-1-LJ_FR2];
 #endif
@@ -861,7 +939,12 @@ const BCIns *lj_snap_restore(jit_State *J, void *exptr)
 #endif
   for (n = 0; n < nent; n++) {
     SnapEntry sn = map[n];
-    if (!(sn & SNAP_NORESTORE)) {
+    SnapRestore sr = plan[n];
+    if (LJ_LIKELY(sr != SNAPRESTORE_SLOW)) {  /* Fast path from the plan. */
+      IRType1 t;
+      t.irt = snaprestore_type(sr);
+      snap_restorereg(J, ex, snaprestore_rs(sr), t, &frame[snap_slot(sn)]);
+    } else if (!(sn & SNAP_NORESTORE)) {
       TValue *o = &frame[snap_slot(sn)];
       IRRef ref = snap_ref(sn);
       IRIns *ir = &T->ir[ref];
@@ -881,6 +964,10 @@ const BCIns *lj_snap_restore(jit_State *J, void *exptr)
 	TValue tmp;
 	snap_restoreval(J, T, ex, snapno, rfilt, ref+1, &tmp);
 	o->u32.hi = tmp.u32.lo;
+      } else if ((sn & SNAP_KEYINDEX)) {
+	/* The traversal index has been restored as an integer. Undo this. */
+	o->u32.lo = (uint32_t)(LJ_DUALNUM ? intV(o) : lj_num2int(numV(o)));
+	o->u32.hi = LJ_KEYINDEX;
 #if !LJ_FR2
       } else if ((sn & (SNAP_CONT|SNAP_FRAME))) {
 	/* Overwrite tag with frame link. */
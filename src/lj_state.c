@@ -14,6 +14,7 @@
 #include "lj_err.h"
 #include "lj_buf.h"
 #include "lj_str.h"
+#include "lj_strmatch.h"
 #include "lj_tab.h"
 #include "lj_func.h"
 #include "lj_meta.h"
@@ -65,6 +66,8 @@ static void resizestack(lua_State *L, MSize n)
   st = (TValue *)lj_mem_realloc(L, tvref(L->stack),
 				(MSize)(oldsize*sizeof(TValue)),
 				(MSize)(realsize*sizeof(TValue)));
+  lj_gc_acctdec(G(L), ~LJ_TTHREAD, oldsize*sizeof(TValue));
+  lj_gc_acctinc(G(L), ~LJ_TTHREAD, realsize*sizeof(TValue));
   setmref(L->stack, st);
   delta = (char *)st - (char *)oldst;
   setmref(L->maxstack, st + n);
@@ -126,6 +129,8 @@ void LJ_FASTCALL lj_state_growstack1(lua_State *L)
 static void stack_init(lua_State *L1, lua_State *L)
 {
   TValue *stend, *st = lj_mem_newvec(L, LJ_STACK_START+LJ_STACK_EXTRA, TValue);
+  lj_gc_acctinc(G(L), ~LJ_TTHREAD,
+		(LJ_STACK_START+LJ_STACK_EXTRA)*sizeof(TValue));
   setmref(L1->stack, st);
   L1->stacksize = LJ_STACK_START + LJ_STACK_EXTRA;
   stend = st + L1->stacksize;
@@ -137,6 +142,29 @@ static void stack_init(lua_State *L1, lua_State *L)
     setnilV(st++);
 }
 
+/* -- Coroutine status ---------------------------------------------------- */
+
+LJ_DATADEF const char *const lj_state_costatusname[] = {
+  "suspended", "running", "normal", "dead"
+};
+
+/* Get status of a coroutine, as seen from the running coroutine L. */
+int32_t lj_state_costatus(lua_State *L, lua_State *co)
+{
+  if (co == L) return LJ_COSTATUS_RUNNING;
+  else if (co->status == LUA_YIELD) return LJ_COSTATUS_SUSPENDED;
+  else if (co->status != LUA_OK) return LJ_COSTATUS_DEAD;
+  else if (co->base > tvref(co->stack)+1+LJ_FR2) return LJ_COSTATUS_NORMAL;
+  else if (co->top == co->base) return LJ_COSTATUS_DEAD;
+  else return LJ_COSTATUS_SUSPENDED;
+}
+
+/* Check whether the running coroutine can yield. */
+int32_t lj_state_canyield(lua_State *L)
+{
+  return cframe_canyield(L->cframe) ? 1 : 0;
+}
+
 /* -- State handling ------------------------------------------------------ */
 
 /* Open parts that may cause memory-allocation errors. */
@@ -171,8 +199,17 @@ static void close_state(lua_State *L)
 #endif
   lj_mem_freevec(g, g->strhash, g->strmask+1, GCRef);
   lj_buf_free(g, &g->tmpbuf);
+  lj_strmatch_flush(g, 1);
+  lj_gc_acctdec(g, ~LJ_TTHREAD, L->stacksize*sizeof(TValue));
   lj_mem_freevec(g, tvref(L->stack), L->stacksize, TValue);
   lua_assert(g->gc.total == sizeof(GG_State));
+#ifdef LUA_USE_ASSERT
+  {
+    int i;
+    for (i = 0; i <= ~LJ_TUDATA-~LJ_TSTR; i++)
+      lua_assert(g->gc.typesize[i] == 0);
+  }
+#endif
 #ifndef LUAJIT_USE_SYSMALLOC
   if (g->allocf == lj_alloc_f)
     lj_alloc_destroy(g->allocd);
@@ -218,6 +255,7 @@ LUA_API lua_State *lua_newstate(lua_Alloc f, void *ud)
   g->gc.total = sizeof(GG_State);
   g->gc.pause = LUAI_GCPAUSE;
   g->gc.stepmul = LUAI_GCMUL;
+  g->gc.limit = LJ_MAX_MEM;
   lj_dispatch_init((GG_State *)L);
   L->status = LUA_ERRERR+1;  /* Avoid touching the stack upon memory error. */
   if (lj_vm_cpcall(L, NULL, NULL, cpluaopen) != 0) {
@@ -274,6 +312,7 @@ LUA_API void lua_close(lua_State *L)
 lua_State *lj_state_new(lua_State *L)
 {
   lua_State *L1 = lj_mem_newobj(L, lua_State);
+  lj_gc_acctinc(G(L), ~LJ_TTHREAD, sizeof(lua_State));
   L1->gct = ~LJ_TTHREAD;
   L1->dummy_ffid = FF_C;
   L1->status = LUA_OK;
@@ -296,6 +335,8 @@ void LJ_FASTCALL lj_state_free(global_State *g, lua_State *L)
     setgcrefnull(g->cur_L);
   lj_func_closeuv(L, tvref(L->stack));
   lua_assert(gcref(L->openupval) == NULL);
+  lj_gc_acctdec(g, ~LJ_TTHREAD,
+		sizeof(lua_State) + L->stacksize*sizeof(TValue));
   lj_mem_freevec(g, tvref(L->stack), L->stacksize, TValue);
   lj_mem_freet(g, L);
 }
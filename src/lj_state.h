@@ -26,6 +26,17 @@ static LJ_AINLINE void lj_state_checkstack(lua_State *L, MSize need)
     lj_state_growstack(L, need);
 }
 
+/* Coroutine status, see coroutine.status(). */
+enum {
+  LJ_COSTATUS_SUSPENDED, LJ_COSTATUS_RUNNING, LJ_COSTATUS_NORMAL,
+  LJ_COSTATUS_DEAD
+};
+
+LJ_DATA const char *const lj_state_costatusname[];
+
+LJ_FUNC int32_t lj_state_costatus(lua_State *L, lua_State *co);
+LJ_FUNC int32_t lj_state_canyield(lua_State *L);
+
 LJ_FUNC lua_State *lj_state_new(lua_State *L);
 LJ_FUNC void LJ_FASTCALL lj_state_free(global_State *g, lua_State *L);
 #if LJ_64 && !LJ_GC64 && !(defined(LUAJIT_USE_VALGRIND) && defined(LUAJIT_USE_SYSMALLOC))
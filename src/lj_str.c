@@ -172,6 +172,7 @@ GCstr *lj_str_new(lua_State *L, const char *str, size_t lenx)
   }
   /* Nope, create a new string. */
   s = lj_mem_newt(L, sizeof(GCstr)+len+1, GCstr);
+  lj_gc_acctinc(g, ~LJ_TSTR, sizeof(GCstr)+len+1);
   newwhite(g, s);
   s->gct = ~LJ_TSTR;
   s->len = len;
@@ -192,6 +193,7 @@ GCstr *lj_str_new(lua_State *L, const char *str, size_t lenx)
 void LJ_FASTCALL lj_str_free(global_State *g, GCstr *s)
 {
   g->strnum--;
+  lj_gc_acctdec(g, ~LJ_TSTR, sizestring(s));
   lj_mem_free(g, s, sizestring(s));
 }
 
@@ -0,0 +1,722 @@
+/*
+** Lua pattern matching.
+** Copyright (C) 2005-2017 Mike Pall. See Copyright Notice in luajit.h
+**
+** Major portions taken verbatim or adapted from the Lua interpreter.
+** Copyright (C) 1994-2008 Lua.org, PUC-Rio. See Copyright Notice in lua.h
+*/
+
+#define lj_strmatch_c
+#define LUA_CORE
+
+#include "lj_obj.h"
+#include "lj_gc.h"
+#include "lj_err.h"
+#include "lj_buf.h"
+#include "lj_char.h"
+#include "lj_strmatch.h"
+#if LJ_HASJIT
+#include "lj_jit.h"
+#include "lj_dispatch.h"
+#include "lj_strfmt.h"
+#endif
+
+/* -- Matcher ------------------------------------------------------------- */
+
+/* macro to `unsign' a character */
+#define uchar(c)        ((unsigned char)(c))
+
+#define L_ESC		'%'
+
+static int check_capture(MatchState *ms, int l)
+{
+  l -= '1';
+  if (l < 0 || l >= ms->level || ms->capture[l].len == CAP_UNFINISHED)
+    lj_err_caller(ms->L, LJ_ERR_STRCAPI);
+  return l;
+}
+
+static int capture_to_close(MatchState *ms)
+{
+  int level = ms->level;
+  for (level--; level>=0; level--)
+    if (ms->capture[level].len == CAP_UNFINISHED) return level;
+  lj_err_caller(ms->L, LJ_ERR_STRPATC);
+  return 0;  /* unreachable */
+}
+
+static const char *classend(MatchState *ms, const char *p)
+{
+  if (ms->prog) {
+    const MatchItem *mi = &ms->prog->item[p - ms->pat];
+    if (mi->kind != MATCH_NONE)
+      return p + mi->len;
+  }
+  switch (*p++) {
+  case L_ESC:
+    if (*p == '\0')
+      lj_err_caller(ms->L, LJ_ERR_STRPATE);
+    return p+1;
+  case '[':
+    if (*p == '^') p++;
+    do {  /* look for a `]' */
+      if (*p == '\0')
+	lj_err_caller(ms->L, LJ_ERR_STRPATM);
+      if (*(p++) == L_ESC && *p != '\0')
+	p++;  /* skip escapes (e.g. `%]') */
+    } while (*p != ']');
+    return p+1;
+  default:
+    return p;
+  }
+}
+
+static const unsigned char match_class_map[32] = {
+  0,LJ_CHAR_ALPHA,0,LJ_CHAR_CNTRL,LJ_CHAR_DIGIT,0,0,LJ_CHAR_GRAPH,0,0,0,0,
+  LJ_CHAR_LOWER,0,0,0,LJ_CHAR_PUNCT,0,0,LJ_CHAR_SPACE,0,
+  LJ_CHAR_UPPER,0,LJ_CHAR_ALNUM,LJ_CHAR_XDIGIT,0,0,0,0,0,0,0
+};
+
+static int match_class(int c, int cl)
+{
+  if ((cl & 0xc0) == 0x40) {
+    int t = match_class_map[(cl&0x1f)];
+    if (t) {
+      t = lj_char_isa(c, t);
+      return (cl & 0x20) ? t : !t;
+    }
+    if (cl == 'z') return c == 0;
+    if (cl == 'Z') return c != 0;
+  }
+  return (cl == c);
+}
+
+static int matchbracketclass(int c, const char *p, const char *ec)
+{
+  int sig = 1;
+  if (*(p+1) == '^') {
+    sig = 0;
+    p++;  /* skip the `^' */
+  }
+  while (++p < ec) {
+    if (*p == L_ESC) {
+      p++;
+      if (match_class(c, uchar(*p)))
+	return sig;
+    }
+    else if ((*(p+1) == '-') && (p+2 < ec)) {
+      p+=2;
+      if (uchar(*(p-2)) <= c && c <= uchar(*p))
+	return sig;
+    }
+    else if (uchar(*p) == c) return sig;
+  }
+  return !sig;
+}
+
+static int singlematch(MatchState *ms, int c, const char *p, const char *ep)
+{
+  if (ms->prog) {
+    const MatchItem *mi = &ms->prog->item[p - ms->pat];
+    switch (mi->kind) {
+    case MATCH_CHAR: return mi->c == c;
+    case MATCH_ANY: return 1;
+    case MATCH_SET: return strmatch_inset(ms->prog, mi, c);
+    default: break;
+    }
+  }
+  switch (*p) {
+  case '.': return 1;  /* matches any char */
+  case L_ESC: return match_class(c, uchar(*(p+1)));
+  case '[': return matchbracketclass(c, p, ep-1);
+  default:  return (uchar(*p) == c);
+  }
+}
+
+static const char *match(MatchState *ms, const char *s, const char *p);
+
+static const char *matchbalance(MatchState *ms, const char *s, const char *p)
+{
+  if (*p == 0 || *(p+1) == 0)
+    lj_err_caller(ms->L, LJ_ERR_STRPATU);
+  if (*s != *p) {
+    return NULL;
+  } else {
+    int b = *p;
+    int e = *(p+1);
+    int cont = 1;
+    while (++s < ms->src_end) {
+      if (*s == e) {
+	if (--cont == 0) return s+1;
+      } else if (*s == b) {
+	cont++;
+      }
+    }
+  }
+  return NULL;  /* string ends out of balance */
+}
+
+static const char *max_expand(MatchState *ms, const char *s,
+			      const char *p, const char *ep)
+{
+  ptrdiff_t i = 0;  /* counts maximum expand for item */
+  while ((s+i)<ms->src_end && singlematch(ms, uchar(*(s+i)), p, ep))
+    i++;
+  /* keeps trying to match with the maximum repetitions */
+  while (i>=0) {
+    const char *res = match(ms, (s+i), ep+1);
+    if (res) return res;
+    i--;  /* else didn't match; reduce 1 repetition to try again */
+  }
+  return NULL;
+}
+
+static const char *min_expand(MatchState *ms, const char *s,
+			      const char *p, const char *ep)
+{
+  for (;;) {
+    const char *res = match(ms, s, ep+1);
+    if (res != NULL)
+      return res;
+    else if (s<ms->src_end && singlematch(ms, uchar(*s), p, ep))
+      s++;  /* try with one more repetition */
+    else
+      return NULL;
+  }
+}
+
+static const char *start_capture(MatchState *ms, const char *s,
+				 const char *p, int what)
+{
+  const char *res;
+  int level = ms->level;
+  if (level >= LUA_MAXCAPTURES) lj_err_caller(ms->L, LJ_ERR_STRCAPN);
+  ms->capture[level].init = s;
+  ms->capture[level].len = what;
+  ms->level = level+1;
+  if ((res=match(ms, s, p)) == NULL)  /* match failed? */
+    ms->level--;  /* undo capture */
+  return res;
+}
+
+static const char *end_capture(MatchState *ms, const char *s,
+			       const char *p)
+{
+  int l = capture_to_close(ms);
+  const char *res;
+  ms->capture[l].len = s - ms->capture[l].init;  /* close capture */
+  if ((res = match(ms, s, p)) == NULL)  /* match failed? */
+    ms->capture[l].len = CAP_UNFINISHED;  /* undo capture */
+  return res;
+}
+
+static const char *match_capture(MatchState *ms, const char *s, int l)
+{
+  size_t len;
+  l = check_capture(ms, l);
+  len = (size_t)ms->capture[l].len;
+  if ((size_t)(ms->src_end-s) >= len &&
+      memcmp(ms->capture[l].init, s, len) == 0)
+    return s+len;
+  else
+    return NULL;
+}
+
+static const char *match(MatchState *ms, const char *s, const char *p)
+{
+  if (++ms->depth > LJ_MAX_XLEVEL)
+    lj_err_caller(ms->L, LJ_ERR_STRPATX);
+  init: /* using goto's to optimize tail recursion */
+  switch (*p) {
+  case '(':  /* start capture */
+    if (*(p+1) == ')')  /* position capture? */
+      s = start_capture(ms, s, p+2, CAP_POSITION);
+    else
+      s = start_capture(ms, s, p+1, CAP_UNFINISHED);
+    break;
+  case ')':  /* end capture */
+    s = end_capture(ms, s, p+1);
+    break;
+  case L_ESC:
+    switch (*(p+1)) {
+    case 'b':  /* balanced string? */
+      s = matchbalance(ms, s, p+2);
+      if (s == NULL) break;
+      p+=4;
+      goto init;  /* else s = match(ms, s, p+4); */
+    case 'f': {  /* frontier? */
+      const char *ep; char previous;
+      p += 2;
+      if (*p != '[')
+	lj_err_caller(ms->L, LJ_ERR_STRPATB);
+      ep = classend(ms, p);  /* points to what is next */
+      previous = (s == ms->src_init) ? '\0' : *(s-1);
+      if (singlematch(ms, uchar(previous), p, ep) ||
+	 !singlematch(ms, uchar(*s), p, ep)) { s = NULL; break; }
+      p=ep;
+      goto init;  /* else s = match(ms, s, ep); */
+      }
+    default:
+      if (lj_char_isdigit(uchar(*(p+1)))) {  /* capture results (%0-%9)? */
+	s = match_capture(ms, s, uchar(*(p+1)));
+	if (s == NULL) break;
+	p+=2;
+	goto init;  /* else s = match(ms, s, p+2) */
+      }
+      goto dflt;  /* case default */
+    }
+    break;
+  case '\0':  /* end of pattern */
+    break;  /* match succeeded */
+  case '$':
+    /* is the `$' the last char in pattern? */
+    if (*(p+1) != '\0') goto dflt;
+    if (s != ms->src_end) s = NULL;  /* check end of string */
+    break;
+  default: dflt: {  /* it is a pattern item */
+    const char *ep = classend(ms, p);  /* points to what is next */
+    int m = s<ms->src_end && singlematch(ms, uchar(*s), p, ep);
+    switch (*ep) {
+    case '?': {  /* optional */
+      const char *res;
+      if (m && ((res=match(ms, s+1, ep+1)) != NULL)) {
+	s = res;
+	break;
+      }
+      p=ep+1;
+      goto init;  /* else s = match(ms, s, ep+1); */
+      }
+    case '*':  /* 0 or more repetitions */
+      s = max_expand(ms, s, p, ep);
+      break;
+    case '+':  /* 1 or more repetitions */
+      s = (m ? max_expand(ms, s+1, p, ep) : NULL);
+      break;
+    case '-':  /* 0 or more repetitions (minimum) */
+      s = min_expand(ms, s, p, ep);
+      break;
+    default:
+      if (m) { s++; p=ep; goto init; }  /* else s = match(ms, s+1, ep); */
+      s = NULL;
+      break;
+    }
+    break;
+    }
+  }
+  ms->depth--;
+  return s;
+}
+
+/* -- Compiled patterns --------------------------------------------------- */
+
+/*
+** A compiled pattern holds the decoded pattern item for each offset of the
+** pattern string. Character classes are turned into bitmaps, so matching a
+** single character doesn't need to parse the pattern again. Offsets that
+** would raise an error are left to the matcher.
+*/
+
+/* Compile the pattern item at offset p. Returns its class or -1. */
+static int strmatch_item(MatchItem *mi, const char *p, int nset)
+{
+  const char *ep = p+1;
+  switch (*p) {
+  case '\0':
+    return -1;
+  case '.':
+    mi->kind = MATCH_ANY;
+    break;
+  case L_ESC: {
+    int cl = uchar(*(p+1));
+    if (cl == '\0')
+      return -1;
+    ep = p+2;
+    if ((cl & 0xc0) == 0x40 &&
+	(match_class_map[cl & 0x1f] || cl == 'z' || cl == 'Z')) {
+      mi->kind = MATCH_SET;
+    } else {
+      mi->kind = MATCH_CHAR;
+      mi->c = (uint8_t)cl;
+    }
+    break;
+    }
+  case '[':
+    if (*ep == '^') ep++;
+    do {  /* look for a `]' */
+      if (*ep == '\0')
+	return -1;
+      if (*(ep++) == L_ESC && *ep != '\0')
+	ep++;  /* skip escapes (e.g. `%]') */
+    } while (*ep != ']');
+    ep++;
+    mi->kind = MATCH_SET;
+    break;
+  default:
+    mi->kind = MATCH_CHAR;
+    mi->c = uchar(*p);
+    break;
+  }
+  mi->len = (uint8_t)(ep - p);
+  if (mi->kind == MATCH_SET)
+    mi->c = (uint8_t)nset;
+  return mi->kind;
+}
+
+static MatchProg *strmatch_compile(lua_State *L, GCstr *pat)
+{
+  const char *p = strdata(pat);
+  MSize i, n = pat->len, nset = 0, ofs;
+  MatchProg *mp;
+  for (i = 0; i < n; i++) {
+    MatchItem mi;
+    if (strmatch_item(&mi, p+i, 0) == MATCH_SET)
+      nset++;
+  }
+  ofs = (MSize)((sizeof(MatchProg) + n*sizeof(MatchItem) + 3) & ~(size_t)3);
+  mp = (MatchProg *)lj_mem_new(L, ofs + nset*32);
+  setgcref(mp->pat, obj2gco(pat));
+  mp->size = ofs + nset*32;
+  mp->cls = (uint32_t *)((char *)mp + ofs);
+  memset(mp->cls, 0, nset*32);
+  for (i = 0, nset = 0; i < n; i++) {
+    MatchItem *mi = &mp->item[i];
+    int kind = strmatch_item(mi, p+i, (int)nset);
+    if (kind == MATCH_SET) {
+      uint32_t *bm = &mp->cls[nset++ * 8];
+      int c;
+      for (c = 0; c < 256; c++)
+	if (p[i] == '[' ? matchbracketclass(c, p+i, p+i+mi->len-1) :
+			  match_class(c, uchar(p[i+1])))
+	  bm[c >> 5] |= 1u << (c & 31);
+    } else if (kind < 0) {
+      mi->kind = MATCH_NONE;
+    }
+  }
+  mp->item[n].kind = MATCH_NONE;  /* End of pattern. */
+  return mp;
+}
+
+/* Get the compiled pattern from the cache or compile it. */
+MatchProg *lj_strmatch_prog(lua_State *L, GCstr *p)
+{
+  global_State *g = G(L);
+  MRef *slot = &g->strmatch[p->hash & (STRMATCH_CACHE-1)];
+  MatchProg *mp = mref(*slot, MatchProg), *omp;
+  if (LJ_LIKELY(mp && gcref(mp->pat) == obj2gco(p)))
+    return mp;
+  if (p->len > STRMATCH_MAXPAT)
+    return NULL;
+  /* Compile first, so the old entry stays valid if this throws. */
+  mp = strmatch_compile(L, p);
+  omp = mref(*slot, MatchProg);  /* Reload, the GC may have freed it. */
+  if (omp)
+    lj_mem_free(g, omp, omp->size);
+  setmref(*slot, mp);
+  return mp;
+}
+
+/* Free compiled patterns. Called before the GC frees unmarked strings. */
+void lj_strmatch_flush(global_State *g, int all)
+{
+  MSize i;
+  for (i = 0; i < STRMATCH_CACHE; i++) {
+    MatchProg *mp = mref(g->strmatch[i], MatchProg);
+    if (mp) {
+      GCobj *o = gcref(mp->pat);
+      if (all || (iswhite(o) && !(o->gch.marked & LJ_GC_FIXED))) {
+	lj_mem_free(g, mp, mp->size);
+	setmref(g->strmatch[i], NULL);
+      }
+    }
+  }
+}
+
+void lj_strmatch_init(MatchState *ms, lua_State *L,
+		      const char *s, MSize len, GCstr *p)
+{
+  ms->L = L;
+  ms->src_init = s;
+  ms->src_end = s + len;
+  ms->pat = strdata(p);
+  ms->prog = lj_strmatch_prog(L, p);
+}
+
+const char *lj_strmatch_match(MatchState *ms, const char *s, const char *p)
+{
+  ms->level = ms->depth = 0;
+  return match(ms, s, p);
+}
+
+/* Get the first item of a pattern, if every match must start with it. */
+static const MatchItem *strmatch_first(MatchState *ms, const char *p)
+{
+  const MatchItem *mi;
+  while (*p == '(')  /* Skip start of captures. */
+    p += *(p+1) == ')' ? 2 : 1;
+  if (*p == '\0' || *p == ')' || (*p == '$' && *(p+1) == '\0') ||
+      (*p == L_ESC && (*(p+1) == 'b' || *(p+1) == 'f' ||
+		       lj_char_isdigit(uchar(*(p+1))))))
+    return NULL;
+  mi = &ms->prog->item[p - ms->pat];
+  if (mi->kind == MATCH_NONE || mi->kind == MATCH_ANY)
+    return NULL;
+  p += mi->len;
+  if (*p == '?' || *p == '*' || *p == '-')
+    return NULL;  /* May match an empty string. */
+  return mi;
+}
+
+/* Find the first match of a pattern at or after s. */
+const char *lj_strmatch_find(MatchState *ms, const char *s, const char *p,
+			     int anchor, const char **e)
+{
+  const MatchItem *mi = (ms->prog && !anchor) ? strmatch_first(ms, p) : NULL;
+  do {  /* Loop through string and try to match the pattern. */
+    const char *q;
+    if (mi) {  /* Skip to the next possible start of a match. */
+      if (mi->kind == MATCH_CHAR) {
+	s = (const char *)memchr(s, mi->c, (size_t)(ms->src_end - s));
+	if (!s) return NULL;
+      } else {
+	while (s < ms->src_end && !strmatch_inset(ms->prog, mi, uchar(*s)))
+	  s++;
+	if (s == ms->src_end) return NULL;
+      }
+    }
+    q = lj_strmatch_match(ms, s, p);
+    if (q) {
+      *e = q;
+      return s;
+    }
+  } while (s++ < ms->src_end && !anchor);
+  return NULL;
+}
+
+/* -- Pattern analysis ---------------------------------------------------- */
+
+/*
+** Return the number of captures of a pattern and a bitmask of the position
+** captures. Returns -1 if matching the pattern may throw an error.
+**
+** The matcher only ever advances through the pattern, so the capture levels
+** at each pattern item do not depend on the subject string. Neither does
+** the max. recursion depth: match() recurses at most once per item.
+*/
+int32_t lj_strmatch_captures(GCstr *pat, uint32_t *poscap)
+{
+  const char *p = strdata(pat);
+  uint32_t open = 0, pos = 0;
+  int32_t level = 0, depth = 0;
+  while (*p) {
+    int quant = 1;
+    if (++depth >= LJ_MAX_XLEVEL)
+      return -1;  /* Pattern may be too complex. */
+    switch (*p) {
+    case '(':
+      if (level >= LUA_MAXCAPTURES)
+	return -1;
+      if (*(p+1) == ')') {
+	pos |= 1u << level;
+	p += 2;
+      } else {
+	open |= 1u << level;
+	p++;
+      }
+      level++;
+      continue;
+    case ')':
+      if (!open)
+	return -1;
+      open &= ~(1u << lj_fls(open));  /* Close innermost capture. */
+      p++;
+      continue;
+    case L_ESC:
+      if (*(p+1) == 'b') {
+	if (*(p+2) == '\0' || *(p+3) == '\0')
+	  return -1;
+	p += 4;
+	continue;
+      } else if (*(p+1) == 'f') {
+	p += 2;
+	if (*p != '[')
+	  return -1;
+	quant = 0;
+	break;
+      } else if (lj_char_isdigit(uchar(*(p+1)))) {
+	int l = *(p+1) - '1';
+	if (l < 0 || l >= level || (open & (1u << l)))
+	  return -1;
+	p += 2;
+	continue;
+      }
+      break;
+    case '$':
+      if (*(p+1) == '\0') {
+	p++;
+	continue;
+      }
+      break;
+    default:
+      break;
+    }
+    /* Single pattern item, like classend(), and its quantifier. */
+    if (*p == L_ESC) {
+      if (*++p == '\0')
+	return -1;
+      p++;
+    } else if (*p == '[') {
+      if (*++p == '^') p++;
+      do {
+	if (*p == '\0')
+	  return -1;
+	if (*(p++) == L_ESC && *p != '\0')
+	  p++;
+      } while (*p != ']');
+      p++;
+    } else {
+      p++;
+    }
+    if (quant && (*p == '?' || *p == '*' || *p == '+' || *p == '-'))
+      p++;
+  }
+  if (open)
+    return -1;  /* Unfinished capture. */
+  if (poscap) *poscap = pos;
+  return level;
+}
+
+#if LJ_HASJIT
+/* -- Helpers for traces -------------------------------------------------- */
+
+/*
+** Initialize the matcher for a trace helper, which must not throw. The
+** recorder rejects patterns that may raise an error and has compiled the
+** pattern. If it has been evicted from the cache since, match without the
+** compiled form instead of allocating a new one.
+*/
+static void strmatch_initjit(MatchState *ms, lua_State *L, GCstr *s,
+			     GCstr *p)
+{
+  MatchProg *mp = mref(G(L)->strmatch[p->hash & (STRMATCH_CACHE-1)],
+		       MatchProg);
+  ms->L = L;
+  ms->src_init = strdata(s);
+  ms->src_end = strdata(s) + s->len;
+  ms->pat = strdata(p);
+  ms->prog = (mp && gcref(mp->pat) == obj2gco(p)) ? mp : NULL;
+}
+
+/* Store match results for a trace. */
+static void strmatch_result(lua_State *L, MatchState *ms,
+			    const char *s, const char *e)
+{
+  StrMatchResult *res = &L2J(L)->strmatch;
+  int i;
+  res->pos = (int32_t)(s - ms->src_init);
+  res->len[0] = (int32_t)(e - s);
+  setmref(res->ptr[0], s);
+  for (i = 0; i < ms->level; i++) {
+    ptrdiff_t l = ms->capture[i].len;
+    if (l == CAP_POSITION)
+      l = ms->capture[i].init - ms->src_init + 1;
+    res->len[i+1] = (int32_t)l;
+    setmref(res->ptr[i+1], ms->capture[i].init);
+  }
+}
+
+/* Pattern search for string.find and string.match. */
+int32_t lj_strmatch_jit(lua_State *L, GCstr *s, GCstr *p, int32_t start)
+{
+  MatchState ms;
+  const char *pstr = strdata(p);
+  const char *q, *e;
+  int anchor = 0;
+  if (*pstr == '^') { pstr++; anchor = 1; }
+  strmatch_initjit(&ms, L, s, p);
+  q = lj_strmatch_find(&ms, strdata(s) + start, pstr, anchor, &e);
+  if (q) {
+    strmatch_result(L, &ms, q, e);
+    return 1;
+  }
+  return 0;
+}
+
+/*
+** Iterator of string.gmatch. Returns -1 for a different pattern.
+** The next position is stored by the trace after checking the result.
+*/
+int32_t lj_strmatch_gmatch_jit(lua_State *L, GCfunc *fn, GCstr *p)
+{
+  GCstr *str = strV(&fn->c.upvalue[0]);
+  MSize pos = fn->c.upvalue[2].u32.lo;
+  MatchState ms;
+  const char *q, *e;
+  if (strV(&fn->c.upvalue[1]) != p)
+    return -1;
+  if (pos > str->len)
+    return 0;
+  strmatch_initjit(&ms, L, str, p);
+  q = lj_strmatch_find(&ms, strdata(str) + pos, strdata(p), 0, &e);
+  if (q) {
+    strmatch_result(L, &ms, q, e);
+    L2J(L)->strmatch.pos = (int32_t)(e - strdata(str)) + (e == q);
+    return 1;
+  }
+  return 0;
+}
+
+/* Append the replacement string of string.gsub. */
+static SBuf *strmatch_putrepl(SBuf *sb, MatchState *ms, GCstr *repl,
+			      const char *s, const char *e)
+{
+  const char *r = strdata(repl);
+  MSize i;
+  for (i = 0; i < repl->len; i++) {
+    if (r[i] != L_ESC) {
+      lj_buf_putb(sb, r[i]);
+    } else if (!lj_char_isdigit(uchar(r[++i]))) {
+      lj_buf_putb(sb, r[i]);
+    } else if (r[i] == '0' || ms->level == 0) {
+      sb = lj_buf_putmem(sb, s, (MSize)(e - s));
+    } else {
+      int l = r[i] - '1';
+      if (ms->capture[l].len == CAP_POSITION)
+	sb = lj_strfmt_putint(sb,
+	  (int32_t)(ms->capture[l].init - ms->src_init) + 1);
+      else
+	sb = lj_buf_putmem(sb, ms->capture[l].init,
+			   (MSize)ms->capture[l].len);
+    }
+  }
+  return sb;
+}
+
+/* string.gsub with a replacement string. The caller checks the captures. */
+SBuf *lj_strmatch_gsub_jit(SBuf *sb, GCstr *s, GCstr *p, GCstr *repl)
+{
+  MatchState ms;
+  const char *src = strdata(s);
+  const char *pstr = strdata(p);
+  int anchor = (*pstr == '^') ? (pstr++, 1) : 0;
+  int32_t n = 0;
+  strmatch_initjit(&ms, sbufL(sb), s, p);
+  for (;;) {
+    const char *e = lj_strmatch_match(&ms, src, pstr);
+    if (e) {
+      n++;
+      sb = strmatch_putrepl(sb, &ms, repl, src, e);
+    }
+    if (e && e > src)  /* Non-empty match? */
+      src = e;  /* Skip it. */
+    else if (src < ms.src_end)
+      lj_buf_putb(sb, *src++);
+    else
+      break;
+    if (anchor)
+      break;
+  }
+  sb = lj_buf_putmem(sb, src, (MSize)(ms.src_end - src));
+  L2J(sbufL(sb))->strmatch.pos = n;
+  return sb;
+}
+#endif
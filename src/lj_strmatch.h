@@ -0,0 +1,78 @@
+/*
+** Lua pattern matching.
+** Copyright (C) 2005-2017 Mike Pall. See Copyright Notice in luajit.h
+*/
+
+#ifndef _LJ_STRMATCH_H
+#define _LJ_STRMATCH_H
+
+#include "lj_obj.h"
+
+#define CAP_UNFINISHED	(-1)
+#define CAP_POSITION	(-2)
+
+/* Kinds of compiled pattern items. */
+enum {
+  MATCH_NONE,		/* Not compiled, use the pattern string. */
+  MATCH_CHAR,		/* Literal character. */
+  MATCH_ANY,		/* Any character. */
+  MATCH_SET		/* Character class bitmap. */
+};
+
+/* Compiled pattern item. One for each pattern offset. */
+typedef struct MatchItem {
+  uint8_t kind;		/* Item kind (MATCH_*). */
+  uint8_t len;		/* Length of the item in the pattern. */
+  uint8_t c;		/* Literal character or index of class bitmap. */
+} MatchItem;
+
+/* Compiled pattern. */
+typedef struct MatchProg {
+  GCRef pat;		/* Pattern string. */
+  MSize size;		/* Size of the compiled pattern. */
+  uint32_t *cls;	/* Class bitmaps, 8 words each. */
+  MatchItem item[1];	/* Items, indexed by pattern offset. */
+} MatchProg;
+
+/* Max. length of compiled patterns. */
+#define STRMATCH_MAXPAT		255
+
+/* Check whether a character is in the class of a compiled item. */
+#define strmatch_inset(mp, mi, ch) \
+  (((mp)->cls[(mi)->c*8 + ((ch) >> 5)] >> ((ch) & 31)) & 1)
+
+/* Pattern matcher state. */
+typedef struct MatchState {
+  const char *src_init;  /* init of source string */
+  const char *src_end;  /* end (`\0') of source string */
+  const char *pat;  /* init of pattern string */
+  const MatchProg *prog;  /* compiled pattern or NULL */
+  lua_State *L;
+  int level;  /* total number of captures (finished or unfinished) */
+  int depth;
+  struct {
+    const char *init;
+    ptrdiff_t len;
+  } capture[LUA_MAXCAPTURES];
+} MatchState;
+
+LJ_FUNC MatchProg *lj_strmatch_prog(lua_State *L, GCstr *p);
+LJ_FUNC void lj_strmatch_flush(global_State *g, int all);
+LJ_FUNC void lj_strmatch_init(MatchState *ms, lua_State *L,
+			      const char *s, MSize len, GCstr *p);
+LJ_FUNC const char *lj_strmatch_match(MatchState *ms, const char *s,
+				      const char *p);
+LJ_FUNC const char *lj_strmatch_find(MatchState *ms, const char *s,
+				     const char *p, int anchor,
+				     const char **e);
+LJ_FUNC int32_t lj_strmatch_captures(GCstr *p, uint32_t *poscap);
+
+#if LJ_HASJIT
+LJ_FUNC int32_t lj_strmatch_jit(lua_State *L, GCstr *s, GCstr *p,
+				int32_t start);
+LJ_FUNC int32_t lj_strmatch_gmatch_jit(lua_State *L, GCfunc *fn, GCstr *p);
+LJ_FUNC SBuf *lj_strmatch_gsub_jit(SBuf *sb, GCstr *s, GCstr *p,
+				   GCstr *repl);
+#endif
+
+#endif
@@ -62,6 +62,7 @@ static LJ_AINLINE void newhpart(lua_State *L, GCtab *t, uint32_t hbits)
     lj_err_msg(L, LJ_ERR_TABOV);
   hsize = 1u << hbits;
   node = lj_mem_newvec(L, hsize, Node);
+  lj_gc_acctinc(G(L), ~LJ_TTAB, hsize*sizeof(Node));
   setmref(t->node, node);
   setfreetop(t, node, &node[hsize]);
   t->hmask = hsize-1;
@@ -105,11 +106,13 @@ static GCtab *newtab(lua_State *L, uint32_t asize, uint32_t hbits)
     Node *nilnode;
     lua_assert((sizeof(GCtab) & 7) == 0);
     t = (GCtab *)lj_mem_newgco(L, sizetabcolo(asize));
+    lj_gc_acctinc(G(L), ~LJ_TTAB, sizetabcolo(asize));
     t->gct = ~LJ_TTAB;
     t->nomm = (uint8_t)~0;
     t->colo = (int8_t)asize;
     setmref(t->array, (TValue *)((char *)t + sizeof(GCtab)));
     setgcrefnull(t->metatable);
+    setgcrefnull(t->shape);
     t->asize = asize;
     t->hmask = 0;
     nilnode = &G(L)->nilnode;
@@ -120,11 +123,13 @@ static GCtab *newtab(lua_State *L, uint32_t asize, uint32_t hbits)
   } else {  /* Otherwise separately allocate the array part. */
     Node *nilnode;
     t = lj_mem_newobj(L, GCtab);
+    lj_gc_acctinc(G(L), ~LJ_TTAB, sizeof(GCtab));
     t->gct = ~LJ_TTAB;
     t->nomm = (uint8_t)~0;
     t->colo = 0;
     setmref(t->array, NULL);
     setgcrefnull(t->metatable);
+    setgcrefnull(t->shape);
     t->asize = 0;  /* In case the array allocation fails. */
     t->hmask = 0;
     nilnode = &G(L)->nilnode;
@@ -136,6 +141,7 @@ static GCtab *newtab(lua_State *L, uint32_t asize, uint32_t hbits)
       if (asize > LJ_MAX_ASIZE)
 	lj_err_msg(L, LJ_ERR_TABOV);
       setmref(t->array, lj_mem_newvec(L, asize, TValue));
+      lj_gc_acctinc(G(L), ~LJ_TTAB, asize*sizeof(TValue));
       t->asize = asize;
     }
   }
@@ -187,6 +193,7 @@ GCtab * LJ_FASTCALL lj_tab_dup(lua_State *L, const GCtab *kt)
   t = newtab(L, kt->asize, kt->hmask > 0 ? lj_fls(kt->hmask)+1 : 0);
   lua_assert(kt->asize == t->asize && kt->hmask == t->hmask);
   t->nomm = 0;  /* Keys with metamethod names may be present. */
+  setgcrefr(t->shape, kt->shape);  /* Same key layout as the template. */
   asize = kt->asize;
   if (asize > 0) {
     TValue *array = tvref(t->array);
@@ -218,10 +225,26 @@ GCtab * LJ_FASTCALL lj_tab_dup(lua_State *L, const GCtab *kt)
   return t;
 }
 
+/* Give a template table a fresh shape.
+**
+** A shape is just an identity object. All tables duplicated from the
+** template share it, until their key layout is changed by lj_tab_newkey(),
+** lj_tab_resize() or lj_tab_clear(). The JIT compiler guards on the shape
+** instead of checking every constant key of an object-like table. It also
+** gives function environments a shape to turn globals into cells.
+*/
+void lj_tab_newshape(lua_State *L, GCtab *kt)
+{
+  GCtab *s = lj_tab_new(L, 0, 0);
+  setgcref(kt->shape, obj2gco(s));
+  lj_gc_objbarriert(L, kt, s);
+}
+
 /* Clear a table. */
 void LJ_FASTCALL lj_tab_clear(GCtab *t)
 {
   clearapart(t);
+  setgcrefnull(t->shape);
   if (t->hmask > 0) {
     Node *node = noderef(t->node);
     setfreetop(t, node, &node[t->hmask+1]);
@@ -232,24 +255,45 @@ void LJ_FASTCALL lj_tab_clear(GCtab *t)
 /* Free a table. */
 void LJ_FASTCALL lj_tab_free(global_State *g, GCtab *t)
 {
-  if (t->hmask > 0)
+  if (t->hmask > 0) {
+    lj_gc_acctdec(g, ~LJ_TTAB, (t->hmask+1)*sizeof(Node));
     lj_mem_freevec(g, noderef(t->node), t->hmask+1, Node);
-  if (t->asize > 0 && LJ_MAX_COLOSIZE != 0 && t->colo <= 0)
+  }
+  if (t->asize > 0 && LJ_MAX_COLOSIZE != 0 && t->colo <= 0) {
+    lj_gc_acctdec(g, ~LJ_TTAB, t->asize*sizeof(TValue));
     lj_mem_freevec(g, tvref(t->array), t->asize, TValue);
-  if (LJ_MAX_COLOSIZE != 0 && t->colo)
+  }
+  if (LJ_MAX_COLOSIZE != 0 && t->colo) {
+    lj_gc_acctdec(g, ~LJ_TTAB, sizetabcolo((uint32_t)t->colo & 0x7f));
     lj_mem_free(g, t, sizetabcolo((uint32_t)t->colo & 0x7f));
-  else
+  } else {
+    lj_gc_acctdec(g, ~LJ_TTAB, sizeof(GCtab));
     lj_mem_freet(g, t);
+  }
 }
 
 /* -- Table resizing ------------------------------------------------------ */
 
+/* Reinsert a key from the old hash part. The key is known to be absent. */
+static LJ_AINLINE TValue *reinsertkey(lua_State *L, GCtab *t, cTValue *key)
+{
+  lua_assert(!tvisint(key));
+  if (tvisnum(key)) {
+    lua_Number nk = numV(key);
+    int32_t k = lj_num2int(nk);
+    if ((uint32_t)k < t->asize && nk == (lua_Number)k)
+      return arrayslot(t, k);
+  }
+  return lj_tab_newkey(L, t, key);
+}
+
 /* Resize a table to fit the new array/hash part sizes. */
 void lj_tab_resize(lua_State *L, GCtab *t, uint32_t asize, uint32_t hbits)
 {
   Node *oldnode = noderef(t->node);
   uint32_t oldasize = t->asize;
   uint32_t oldhmask = t->hmask;
+  setgcrefnull(t->shape);  /* The key layout changes. */
   if (asize > oldasize) {  /* Array part grows? */
     TValue *array;
     uint32_t i;
@@ -259,12 +303,14 @@ void lj_tab_resize(lua_State *L, GCtab *t, uint32_t asize, uint32_t hbits)
       /* A colocated array must be separated and copied. */
       TValue *oarray = tvref(t->array);
       array = lj_mem_newvec(L, asize, TValue);
+      lj_gc_acctinc(G(L), ~LJ_TTAB, asize*sizeof(TValue));
       t->colo = (int8_t)(t->colo | 0x80);  /* Mark as separated (colo < 0). */
       for (i = 0; i < oldasize; i++)
 	copyTV(L, &array[i], &oarray[i]);
     } else {
       array = (TValue *)lj_mem_realloc(L, tvref(t->array),
 			  oldasize*sizeof(TValue), asize*sizeof(TValue));
+      lj_gc_acctinc(G(L), ~LJ_TTAB, (asize-oldasize)*sizeof(TValue));
     }
     setmref(t->array, array);
     t->asize = asize;
@@ -291,9 +337,11 @@ void lj_tab_resize(lua_State *L, GCtab *t, uint32_t asize, uint32_t hbits)
       if (!tvisnil(&array[i]))
 	copyTV(L, lj_tab_setinth(L, t, (int32_t)i), &array[i]);
     /* Physically shrink only separated arrays. */
-    if (LJ_MAX_COLOSIZE != 0 && t->colo <= 0)
+    if (LJ_MAX_COLOSIZE != 0 && t->colo <= 0) {
       setmref(t->array, lj_mem_realloc(L, array,
 	      oldasize*sizeof(TValue), asize*sizeof(TValue)));
+      lj_gc_acctdec(G(L), ~LJ_TTAB, (oldasize-asize)*sizeof(TValue));
+    }
   }
   if (oldhmask > 0) {  /* Reinsert pairs from old hash part. */
     global_State *g;
@@ -301,9 +349,10 @@ void lj_tab_resize(lua_State *L, GCtab *t, uint32_t asize, uint32_t hbits)
     for (i = 0; i <= oldhmask; i++) {
       Node *n = &oldnode[i];
       if (!tvisnil(&n->val))
-	copyTV(L, lj_tab_set(L, t, &n->key), &n->val);
+	copyTV(L, reinsertkey(L, t, &n->key), &n->val);
     }
     g = G(L);
+    lj_gc_acctdec(g, ~LJ_TTAB, (oldhmask+1)*sizeof(Node));
     lj_mem_freevec(g, oldnode, oldhmask+1, Node);
   }
 }
@@ -371,10 +420,30 @@ static uint32_t bestasize(uint32_t bins[], uint32_t *narray)
   return na;
 }
 
+/* Count the live keys of a large hash part without classifying them. */
+static uint32_t countlive(const GCtab *t)
+{
+  uint32_t total, i, hmask = t->hmask;
+  Node *node = noderef(t->node);
+  for (total = 0, i = 0; i <= hmask; i++)
+    total += !tvisnil(&node[i].val);
+  return total;
+}
+
 static void rehashtab(lua_State *L, GCtab *t, cTValue *ek)
 {
   uint32_t bins[LJ_MAX_ABITS];
   uint32_t total, asize, na, i;
+  if (t->hmask >= (1u << LJ_MIN_LARGEHBITS)-1 && !tvisnumber(ek)) {
+    /*
+    ** Growing a large hash part by a non-numeric key can't change the
+    ** optimal array size by much. Skip the costly integer key histogram
+    ** and only size the hash part for the live keys. This shortens the
+    ** pause caused by the rehash of a big table.
+    */
+    lj_tab_resize(L, t, t->asize, hsize2hbits(countlive(t)+1));
+    return;
+  }
   for (i = 0; i < LJ_MAX_ABITS; i++) bins[i] = 0;
   asize = countarray(t, bins);
   total = 1 + asize;
@@ -460,17 +529,32 @@ cTValue *lj_tab_get(lua_State *L, GCtab *t, cTValue *key)
 TValue *lj_tab_newkey(lua_State *L, GCtab *t, cTValue *key)
 {
   Node *n = hashkey(t, key);
+  if (LJ_UNLIKELY(tabisfrozen(t)))
+    lj_err_msg(L, LJ_ERR_TABFROZ);
+  setgcrefnull(t->shape);  /* The key layout changes. */
   if (!tvisnil(&n->val) || t->hmask == 0) {
     Node *nodebase = noderef(t->node);
-    Node *collide, *freenode = getfreetop(t, nodebase);
-    lua_assert(freenode >= nodebase && freenode <= nodebase+t->hmask+1);
-    do {
-      if (freenode == nodebase) {  /* No free node found? */
-	rehashtab(L, t, key);  /* Rehash table. */
-	return lj_tab_set(L, t, key);  /* Retry key insertion. */
-      }
-    } while (!tvisnil(&(--freenode)->key));
-    setfreetop(t, nodebase, freenode);
+    Node *collide, *freenode;
+    /*
+    ** Prefer a free node right after the main position. It's likely to be
+    ** in the same cache line, so chain walks touch fewer cache lines.
+    ** Nodes with a nil key are never above freetop, so it stays valid.
+    */
+    if (n+1 <= nodebase+t->hmask && tvisnil(&n[1].key)) {
+      freenode = n+1;
+    } else if (n+2 <= nodebase+t->hmask && tvisnil(&n[2].key)) {
+      freenode = n+2;
+    } else {
+      freenode = getfreetop(t, nodebase);
+      lua_assert(freenode >= nodebase && freenode <= nodebase+t->hmask+1);
+      do {
+	if (freenode == nodebase) {  /* No free node found? */
+	  rehashtab(L, t, key);  /* Rehash table. */
+	  return lj_tab_set(L, t, key);  /* Retry key insertion. */
+	}
+      } while (!tvisnil(&(--freenode)->key));
+      setfreetop(t, nodebase, freenode);
+    }
     lua_assert(freenode != &G(L)->nilnode);
     collide = hashkey(t, &n->key);
     if (collide != n) {  /* Colliding node not the main node? */
@@ -513,6 +597,8 @@ TValue *lj_tab_setinth(lua_State *L, GCtab *t, int32_t key)
 {
   TValue k;
   Node *n;
+  if (LJ_UNLIKELY(tabisfrozen(t)))
+    lj_err_msg(L, LJ_ERR_TABFROZ);
   k.n = (lua_Number)key;
   n = hashnum(t, &k);
   do {
@@ -526,6 +612,8 @@ TValue *lj_tab_setstr(lua_State *L, GCtab *t, GCstr *key)
 {
   TValue k;
   Node *n = hashstr(t, key);
+  if (LJ_UNLIKELY(tabisfrozen(t)))
+    lj_err_msg(L, LJ_ERR_TABFROZ);
   do {
     if (tvisstr(&n->key) && strV(&n->key) == key)
       return &n->val;
@@ -537,6 +625,8 @@ TValue *lj_tab_setstr(lua_State *L, GCtab *t, GCstr *key)
 TValue *lj_tab_set(lua_State *L, GCtab *t, cTValue *key)
 {
   Node *n;
+  if (LJ_UNLIKELY(tabisfrozen(t)))
+    lj_err_msg(L, LJ_ERR_TABFROZ);
   t->nomm = 0;  /* Invalidate negative metamethod cache. */
   if (tvisstr(key)) {
     return lj_tab_setstr(L, t, strV(key));
@@ -561,6 +651,50 @@ TValue *lj_tab_set(lua_State *L, GCtab *t, cTValue *key)
   return lj_tab_newkey(L, t, key);
 }
 
+/* -- Table block moves --------------------------------------------------- */
+
+/* Move the array slots st[s..s+n-1] to dt[d..d+n-1]. Both ranges must lie
+** inside the array parts of an unfrozen dt, otherwise nothing is moved and
+** 0 is returned.
+** Caveat: requires a write barrier for dt, unless dt == st.
+*/
+int32_t lj_tab_amove(GCtab *dt, int32_t d, GCtab *st, int32_t s, int32_t n)
+{
+  if (!tabisfrozen(dt) &&
+      (MSize)s <= st->asize && (MSize)n <= st->asize - (MSize)s &&
+      (MSize)d <= dt->asize && (MSize)n <= dt->asize - (MSize)d) {
+    memmove(arrayslot(dt, d), arrayslot(st, s), (size_t)n*sizeof(TValue));
+    return 1;
+  }
+  return 0;
+}
+
+/* Raw move of st[s..s+n-1] to dt[d..d+n-1], as done by table.move().
+** The caller ensures s+n-1 and d+n-1 don't overflow.
+*/
+void lj_tab_move(lua_State *L, GCtab *dt, int32_t d, GCtab *st, int32_t s,
+		 int32_t n)
+{
+  int32_t i;
+  if (n <= 0) return;
+  if (!lj_tab_amove(dt, d, st, s, n)) {
+    /* Overlapping upwards? */
+    int up = (dt == st && d > s && (uint32_t)d - (uint32_t)s < (uint32_t)n);
+    for (i = 0; i < n; i++) {
+      int32_t k = up ? n-1-i : i;
+      /* The set may invalidate the get pointer, so need to do it first! */
+      TValue *dst = lj_tab_setint(L, dt, d+k);
+      cTValue *src = lj_tab_getint(st, s+k);
+      if (src) {
+	copyTV(L, dst, src);
+      } else {
+	setnilV(dst);
+      }
+    }
+  }
+  if (dt != st) lj_gc_anybarriert(L, dt);
+}
+
 /* -- Table traversal ----------------------------------------------------- */
 
 /* Get the traversal index of a key. */
@@ -586,7 +720,7 @@ static uint32_t keyindex(lua_State *L, GCtab *t, cTValue *key)
 	return t->asize + (uint32_t)(n - noderef(t->node));
 	/* Hash key indexes: [t->asize..t->asize+t->nmask] */
     } while ((n = nextnode(n)));
-    if (key->u32.hi == 0xfffe7fff)  /* ITERN was despecialized while running. */
+    if (key->u32.hi == LJ_KEYINDEX)  /* ITERN was despecialized while running. */
       return key->u32.lo - 1;
     lj_err_msg(L, LJ_ERR_NEXTIDX);
     return 0;  /* unreachable */
@@ -594,25 +728,36 @@ static uint32_t keyindex(lua_State *L, GCtab *t, cTValue *key)
   return ~0u;  /* A nil key starts the traversal. */
 }
 
+/* Get the traversal index of the next non-nil slot, starting at index i.
+** Returns -1 at the end of the traversal.
+*/
+int32_t LJ_FASTCALL lj_tab_nextidx(GCtab *t, uint32_t i)
+{
+  for (; i < t->asize; i++)  /* First traverse the array keys. */
+    if (!tvisnil(arrayslot(t, i)))
+      return (int32_t)i;
+  for (i -= t->asize; i <= t->hmask; i++)  /* Then traverse the hash keys. */
+    if (!tvisnil(&noderef(t->node)[i].val))
+      return (int32_t)(t->asize + i);
+  return -1;  /* End of traversal. */
+}
+
 /* Advance to the next step in a table traversal. */
 int lj_tab_next(lua_State *L, GCtab *t, TValue *key)
 {
-  uint32_t i = keyindex(L, t, key);  /* Find predecessor key index. */
-  for (i++; i < t->asize; i++)  /* First traverse the array keys. */
-    if (!tvisnil(arrayslot(t, i))) {
-      setintV(key, i);
-      copyTV(L, key+1, arrayslot(t, i));
-      return 1;
-    }
-  for (i -= t->asize; i <= t->hmask; i++) {  /* Then traverse the hash keys. */
-    Node *n = &noderef(t->node)[i];
-    if (!tvisnil(&n->val)) {
-      copyTV(L, key, &n->key);
-      copyTV(L, key+1, &n->val);
-      return 1;
-    }
+  /* Start after the predecessor key index. */
+  int32_t i = lj_tab_nextidx(t, keyindex(L, t, key)+1);
+  if (i < 0)
+    return 0;  /* End of traversal. */
+  if ((uint32_t)i < t->asize) {
+    setintV(key, i);
+    copyTV(L, key+1, arrayslot(t, i));
+  } else {
+    Node *n = &noderef(t->node)[i - t->asize];
+    copyTV(L, key, &n->key);
+    copyTV(L, key+1, &n->val);
   }
-  return 0;  /* End of traversal. */
+  return 1;
 }
 
 /* -- Table length calculation -------------------------------------------- */
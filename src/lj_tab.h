@@ -7,6 +7,7 @@
 #define _LJ_TAB_H
 
 #include "lj_obj.h"
+#include "lj_gc.h"
 
 /* Hash constants. Tuned using a brute force search. */
 #define HASH_BIAS	(-0x04c11db7)
@@ -39,6 +40,7 @@ LJ_FUNC GCtab *lj_tab_new_ah(lua_State *L, int32_t a, int32_t h);
 LJ_FUNC GCtab * LJ_FASTCALL lj_tab_new1(lua_State *L, uint32_t ahsize);
 #endif
 LJ_FUNCA GCtab * LJ_FASTCALL lj_tab_dup(lua_State *L, const GCtab *kt);
+LJ_FUNC void lj_tab_newshape(lua_State *L, GCtab *kt);
 LJ_FUNC void LJ_FASTCALL lj_tab_clear(GCtab *t);
 LJ_FUNC void LJ_FASTCALL lj_tab_free(global_State *g, GCtab *t);
 #if LJ_HASFFI
@@ -65,8 +67,15 @@ LJ_FUNC TValue *lj_tab_set(lua_State *L, GCtab *t, cTValue *key);
 #define lj_tab_getint(t, key) \
   (inarray((t), (key)) ? arrayslot((t), (key)) : lj_tab_getinth((t), (key)))
 #define lj_tab_setint(L, t, key) \
-  (inarray((t), (key)) ? arrayslot((t), (key)) : lj_tab_setinth(L, (t), (key)))
+  (inarray((t), (key)) && !tabisfrozen((t)) ? arrayslot((t), (key)) : \
+   lj_tab_setinth(L, (t), (key)))
 
+LJ_FUNC int32_t lj_tab_amove(GCtab *dt, int32_t d, GCtab *st, int32_t s,
+			     int32_t n);
+LJ_FUNC void lj_tab_move(lua_State *L, GCtab *dt, int32_t d, GCtab *st,
+			 int32_t s, int32_t n);
+
+LJ_FUNCA int32_t LJ_FASTCALL lj_tab_nextidx(GCtab *t, uint32_t i);
 LJ_FUNCA int lj_tab_next(lua_State *L, GCtab *t, TValue *key);
 LJ_FUNCA MSize LJ_FASTCALL lj_tab_len(GCtab *t);
 
@@ -192,7 +192,10 @@ typedef struct {
 #define XO_f20f(o)	((uint32_t)(0x0ff2fc + (0x##o<<24)))
 #define XO_f30f(o)	((uint32_t)(0x0ff3fc + (0x##o<<24)))
 
+#define XV_0f(o)	((uint32_t)(0x78e1c4 + (0x##o<<24)))
+#define XV_f20f(o)	((uint32_t)(0x7be1c4 + (0x##o<<24)))
 #define XV_660f38(o)	((uint32_t)(0x79e2c4 + (0x##o<<24)))
+#define XV_660f38W(o)	((uint32_t)(0xf9e2c4 + (0x##o<<24)))
 #define XV_f20f38(o)	((uint32_t)(0x7be2c4 + (0x##o<<24)))
 #define XV_f20f3a(o)	((uint32_t)(0x7be3c4 + (0x##o<<24)))
 #define XV_f30f38(o)	((uint32_t)(0x7ae2c4 + (0x##o<<24)))
@@ -246,6 +249,17 @@ typedef enum {
   XV_SARX =	XV_f30f38(f7),
   XV_SHLX =	XV_660f38(f7),
   XV_SHRX =	XV_f20f38(f7),
+  XV_ADDSD =	XV_f20f(58),
+  XV_SUBSD =	XV_f20f(5c),
+  XV_MULSD =	XV_f20f(59),
+  XV_DIVSD =	XV_f20f(5e),
+  XV_MINSD =	XV_f20f(5d),
+  XV_MAXSD =	XV_f20f(5f),
+  XV_ANDPS =	XV_0f(54),
+  XV_XORPS =	XV_0f(57),
+  XV_FMADD231SD = XV_660f38W(b9),
+  XV_FMSUB231SD = XV_660f38W(bb),
+  XV_FNMADD231SD = XV_660f38W(bd),
 
   /* Variable-length opcodes. XO_* prefix. */
   XO_OR =	XO_(0b),
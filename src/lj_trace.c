@@ -14,6 +14,7 @@
 #include "lj_err.h"
 #include "lj_debug.h"
 #include "lj_str.h"
+#include "lj_tab.h"
 #include "lj_frame.h"
 #include "lj_state.h"
 #include "lj_bc.h"
@@ -124,9 +125,10 @@ GCtrace * LJ_FASTCALL lj_trace_alloc(lua_State *L, GCtrace *T)
   size_t szins = (T->nins-T->nk)*sizeof(IRIns);
   size_t sz = sztr + szins +
 	      T->nsnap*sizeof(SnapShot) +
-	      T->nsnapmap*sizeof(SnapEntry);
+	      T->nsnapmap*(sizeof(SnapEntry)+sizeof(SnapRestore));
   GCtrace *T2 = lj_mem_newt(L, (MSize)sz, GCtrace);
   char *p = (char *)T2 + sztr;
+  lj_gc_acctinc(G(L), ~LJ_TTRACE, sz);
   T2->gct = ~LJ_TTRACE;
   T2->marked = 0;
   T2->traceno = 0;
@@ -154,6 +156,8 @@ static void trace_save(jit_State *J, GCtrace *T)
   p += szins;
   TRACE_APPENDVEC(snap, nsnap, SnapShot)
   TRACE_APPENDVEC(snapmap, nsnapmap, SnapEntry)
+  T->snaprestore = (SnapRestore *)p;
+  lj_snap_restoreplan(T);
   J->cur.traceno = 0;
   J->curfinal = NULL;
   setgcrefp(J->trace[T->traceno], T);
@@ -167,15 +171,18 @@ static void trace_save(jit_State *J, GCtrace *T)
 void LJ_FASTCALL lj_trace_free(global_State *g, GCtrace *T)
 {
   jit_State *J = G2J(g);
+  size_t sz;
   if (T->traceno) {
     lj_gdbjit_deltrace(J, T);
     if (T->traceno < J->freetrace)
       J->freetrace = T->traceno;
     setgcrefnull(J->trace[T->traceno]);
   }
-  lj_mem_free(g, T,
-    ((sizeof(GCtrace)+7)&~7) + (T->nins-T->nk)*sizeof(IRIns) +
-    T->nsnap*sizeof(SnapShot) + T->nsnapmap*sizeof(SnapEntry));
+  sz = ((sizeof(GCtrace)+7)&~7) + (T->nins-T->nk)*sizeof(IRIns) +
+       T->nsnap*sizeof(SnapShot) +
+       T->nsnapmap*(sizeof(SnapEntry)+sizeof(SnapRestore));
+  lj_gc_acctdec(g, ~LJ_TTRACE, sz);
+  lj_mem_free(g, T, sz);
 }
 
 /* Re-enable compiling a prototype by unpatching any modified bytecode. */
@@ -213,7 +220,8 @@ static void trace_unpatch(jit_State *J, GCtrace *T)
     break;
   case BC_JITERL:
   case BC_JLOOP:
-    lua_assert(op == BC_ITERL || op == BC_LOOP || bc_isret(op));
+    lua_assert(op == BC_ITERL || op == BC_ITERN || op == BC_LOOP ||
+	       bc_isret(op));
     *pc = T->startins;
     break;
   case BC_JMP:
@@ -366,6 +374,21 @@ void lj_trace_freestate(global_State *g)
 
 /* -- Penalties and blacklisting ------------------------------------------ */
 
+/* Patch a loop or function header to stop counting hot events. */
+static void trace_nohotcount(BCIns *pc)
+{
+  if (bc_op(*pc) == BC_ITERN) {
+    /* No I* variant. Despecialize the traversal instead, like the VM. */
+    lua_assert(bc_op(pc[1]) == BC_ITERL);
+    setbc_op(pc, BC_ITERC);
+    pc += bc_j(pc[1])+1;
+    lua_assert(bc_op(*pc) == BC_ISNEXT);
+    setbc_op(pc, BC_JMP);
+  } else {
+    setbc_op(pc, (int)bc_op(*pc)+(int)BC_ILOOP-(int)BC_LOOP);
+  }
+}
+
 /* Blacklist a bytecode instruction. */
 static void blacklist_pc(jit_State *J, GCproto *pt, BCIns *pc)
 {
@@ -374,7 +397,7 @@ static void blacklist_pc(jit_State *J, GCproto *pt, BCIns *pc)
     eventdata.pt = pt;
     eventdata.pc = proto_bcpos(pt, pc);
   );
-  setbc_op(pc, (int)bc_op(*pc)+(int)BC_ILOOP-(int)BC_LOOP);
+  trace_nohotcount(pc);
   pt->flags |= PROTO_ILOOP;
 }
 
@@ -408,7 +431,7 @@ setpenalty:
     lua_assert(val == J->param[JIT_P_penaltyfunc] || val > pt->hotcount);
     pt->hotcount = val;
   } else {
-    lua_assert(bc_op(pc[1]) == BC_LOOPHC);
+    lua_assert(bc_op(*hotcount_loop_pc(pc)) == BC_LOOPHC);
     lua_assert(val == J->param[JIT_P_penaltyloop] || val > hotcount_loop_get(pc));
     hotcount_loop_set(pc, val);
   }
@@ -426,8 +449,9 @@ static void trace_start(jit_State *J)
     if (J->parent == 0 && J->exitno == 0) {
       /* Lazy bytecode patching to disable hotcount events. */
       lua_assert(bc_op(*J->pc) == BC_FORL || bc_op(*J->pc) == BC_ITERL ||
-		 bc_op(*J->pc) == BC_LOOP || bc_op(*J->pc) == BC_FUNCF);
-      setbc_op(J->pc, (int)bc_op(*J->pc)+(int)BC_ILOOP-(int)BC_LOOP);
+		 bc_op(*J->pc) == BC_ITERN || bc_op(*J->pc) == BC_LOOP ||
+		 bc_op(*J->pc) == BC_FUNCF);
+      trace_nohotcount((BCIns *)J->pc);
       J->pt->flags |= PROTO_ILOOP;
     }
     J->state = LJ_TRACE_IDLE;  /* Silently ignored. */
@@ -511,6 +535,9 @@ static void trace_stop(jit_State *J)
   case BC_RET1:
     *pc = BCINS_AD(BC_JLOOP, J->cur.snap[0].nslots, traceno);
     goto addroot;
+  case BC_ITERN:
+    *pc = BCINS_AD(BC_JLOOP, bc_a(J->cur.startins), traceno);
+    goto addroot;
   case BC_JMP:
     /* Patch exit branch in parent to side trace entry. */
     lua_assert(J->parent != 0 && J->cur.root != 0);
@@ -671,6 +698,9 @@ static TValue *trace_state(lua_State *L, lua_CFunction dummy, void *ud)
       lj_dispatch_update(J2G(J));
       break;
 
+    case LJ_TRACE_RECORD_1ST:
+      J->state = LJ_TRACE_RECORD;
+      /* fallthrough */
     case LJ_TRACE_RECORD:
       trace_pendpatch(J, 0);
       setvmstate(J2G(J), RECORD);
@@ -861,6 +891,30 @@ static TraceNo trace_exit_find(jit_State *J, MCode *pc)
 }
 #endif
 
+/* Perform the ITERN replaced by the JLOOP at pc and return the next pc.
+** The original instruction cannot be executed from the trace like a RET,
+** since ITERN needs the following ITERL.
+*/
+static const BCIns *trace_exit_itern(lua_State *L, const BCIns *pc, BCReg ra)
+{
+  TValue *o = L->base + ra;
+  GCtab *t = tabV(o-2);
+  int32_t i = lj_tab_nextidx(t, (o-1)->u32.lo);
+  lua_assert(bc_op(pc[1]) == BC_ITERL);
+  if (i < 0)
+    return pc+2;  /* End of traversal. */
+  if ((uint32_t)i < t->asize) {
+    setintV(o, i);
+    copyTV(L, o+1, arrayslot(t, i));
+  } else {
+    Node *n = &noderef(t->node)[i - t->asize];
+    copyTV(L, o, &n->key);
+    copyTV(L, o+1, &n->val);
+  }
+  (o-1)->u32.lo = (uint32_t)i+1;
+  return pc+2+bc_j(pc[1]);
+}
+
 /* A trace exited. Restore interpreter state. */
 int LJ_FASTCALL lj_trace_exit(jit_State *J, void *exptr)
 {
@@ -875,7 +929,7 @@ int LJ_FASTCALL lj_trace_exit(jit_State *J, void *exptr)
 #ifdef EXITSTATE_PCREG
   J->parent = trace_exit_find(J, (MCode *)(intptr_t)ex->gpr[EXITSTATE_PCREG]);
 #endif
-  T = traceref(J, J->parent); UNUSED(T);
+  T = traceref(J, J->parent);
 #ifdef EXITSTATE_CHECKEXIT
   if (J->exitno == T->nsnap) {  /* Treat stack check like a parent exit. */
     lua_assert(T->root != 0);
@@ -887,9 +941,15 @@ int LJ_FASTCALL lj_trace_exit(jit_State *J, void *exptr)
   lua_assert(T != NULL && J->exitno < T->nsnap);
   exd.J = J;
   exd.exptr = exptr;
-  errcode = lj_vm_cpcall(L, NULL, &exd, trace_exit_cp);
-  if (errcode)
-    return -errcode;  /* Return negated error code. */
+  if (LJ_LIKELY(!T->sinktags) &&
+      L->base + T->snap[J->exitno].topslot < tvref(L->maxstack)) {
+    /* Nothing to unsink and no stack to grow, so the restore can't throw. */
+    exd.pc = lj_snap_restore(J, exptr);
+  } else {
+    errcode = lj_vm_cpcall(L, NULL, &exd, trace_exit_cp);
+    if (errcode)
+      return -errcode;  /* Return negated error code. */
+  }
 
   lj_vmevent_callback_(L, VMEVENT_TRACE_EXIT,
     VMEventData_TExit eventdata;
@@ -924,15 +984,18 @@ int LJ_FASTCALL lj_trace_exit(jit_State *J, void *exptr)
   }
   if (bc_op(*pc) == BC_JLOOP) {
     BCIns *retpc = &traceref(J, bc_d(*pc))->startins;
-    if (bc_isret(bc_op(*retpc))) {
+    if (bc_isret(bc_op(*retpc)) || bc_op(*retpc) == BC_ITERN) {
       if (J->state == LJ_TRACE_RECORD) {
 	J->patchins = *pc;
 	J->patchpc = (BCIns *)pc;
 	*J->patchpc = *retpc;
 	J->bcskip = 1;
-      } else {
+      } else if (bc_isret(bc_op(*retpc))) {
 	pc = retpc;
 	setcframe_pc(cf, pc);
+      } else {
+	pc = trace_exit_itern(L, pc, bc_a(*retpc));
+	setcframe_pc(cf, pc);
       }
     }
   }
@@ -27,12 +27,14 @@ TREDEF(CUNROLL,	"call unroll limit reached")
 TREDEF(DOWNREC,	"down-recursion, restarting")
 TREDEF(NYIFFU,	"NYI: unsupported variant of FastFunc %s")
 TREDEF(NYIRETL,	"NYI: return to lower frame")
+TREDEF(NYIUCLO,	"NYI: close upvalue of a closure not created on trace")
 
 /* Recording indexed load/store. */
 TREDEF(STORENN,	"store with nil or NaN key")
 TREDEF(NOMM,	"missing metamethod")
 TREDEF(IDXLOOP,	"looping index lookup")
 TREDEF(NYITMIX,	"NYI: mixed sparse/dense table")
+TREDEF(TABFROZ,	"store to frozen table")
 
 /* Recording C data operations. */
 TREDEF(NOCACHE,	"symbol not in cache")
@@ -14,6 +14,7 @@ GCudata *lj_udata_new(lua_State *L, MSize sz, GCtab *env)
 {
   GCudata *ud = lj_mem_newt(L, sizeof(GCudata) + sz, GCudata);
   global_State *g = G(L);
+  lj_gc_acctinc(g, ~LJ_TUDATA, sizeof(GCudata) + sz);
   newwhite(g, ud);  /* Not finalized. */
   ud->gct = ~LJ_TUDATA;
   ud->udtype = UDTYPE_USERDATA;
@@ -29,6 +30,7 @@ GCudata *lj_udata_new(lua_State *L, MSize sz, GCtab *env)
 
 void LJ_FASTCALL lj_udata_free(global_State *g, GCudata *ud)
 {
+  lj_gc_acctdec(g, ~LJ_TUDATA, sizeudata(ud));
   lj_mem_free(g, ud, sizeudata(ud));
 }
 
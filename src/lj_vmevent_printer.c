@@ -208,6 +208,8 @@ static const char* getflushreason(FlushReason reason)
       return "setmetatable used on a built-in type";
     case FLUSHREASON_SET_IMMUTABLEUV:
       return "setupvalue used on immutable upvalue";
+    case FLUSHREASON_FREEZE_TABLE:
+      return "table.freeze used for the first time";
     default:
     case FLUSHREASON_OTHER:
       return "Other";
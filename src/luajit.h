@@ -74,6 +74,18 @@ LUA_API void luaJIT_profile_stop(lua_State *L);
 LUA_API const char *luaJIT_profile_dumpstack(lua_State *L, const char *fmt,
 					     int depth, size_t *len);
 
+/* Memory limit and per-type memory statistics. */
+enum {
+  LUAJIT_MEM_STR, LUAJIT_MEM_UPVAL, LUAJIT_MEM_THREAD, LUAJIT_MEM_PROTO,
+  LUAJIT_MEM_FUNC, LUAJIT_MEM_TRACE, LUAJIT_MEM_CDATA, LUAJIT_MEM_TAB,
+  LUAJIT_MEM_UDATA,
+  LUAJIT_MEM__MAX
+};
+
+LUA_API size_t luaJIT_setmemlimit(lua_State *L, size_t limit);
+LUA_API size_t luaJIT_memstats(lua_State *L, size_t *typesize);
+LUA_API int luaJIT_allocstats(lua_State *L, size_t *mapped, size_t *committed);
+
 LUA_API int luaJIT_vmevent_sethook(lua_State *L, luaJIT_vmevent_callback cb, void *data);
 LUA_API luaJIT_vmevent_callback luaJIT_vmevent_gethook(lua_State *L, void **data);
 
@@ -32,6 +32,7 @@ typedef enum FlushReason {
   FLUSHREASON_PROFILETOGGLE,
   FLUSHREASON_SET_BUILTINMT,
   FLUSHREASON_SET_IMMUTABLEUV,
+  FLUSHREASON_FREEZE_TABLE,
   FLUSHREASON__MAX
 } FlushReason;
 
@@ -168,6 +168,30 @@ function tests.multiloop_hotcounters()
   assert(tstarts == 2 and tstops == 2, tstarts)
 end
 
+function tests.pairs_hotcounters()
+  teststart()
+  local function f1(t)
+    local a = 0
+    for k, v in pairs(t) do a = a + v end
+    return a
+  end
+
+  local t = {}
+  for i = 1, lhot - 2 do t[i] = 1 end
+
+  -- ITERN is also run once to end the traversal. Its hot counter should be
+  -- zero after this call
+  f1(t)
+  assert(tstarts == 0, tstarts)
+
+  f1({1, 1})
+  assert(tstarts == 1 and tstops == 1, tstarts)
+
+  -- The loop is jit'ed now and should not trigger any more traces
+  f1(t)
+  assert(tstarts == 1 and tstops == 1, tstarts)
+end
+
 function tests.func_backoff()
   teststart()
   local function f1(loopn)
@@ -327,7 +351,15 @@ end
 
 local failed = false
 
-for name, test in pairs(tests) do
+-- Run the tests in a fixed order, since some depend on the JIT state left behind
+local names = {}
+for name in pairs(tests) do
+  names[#names + 1] = name
+end
+table.sort(names)
+
+for _, name in ipairs(names) do
+  local test = tests[name]
   io.stdout:write("Running: "..name.."\n")
   if decoda_output then
     test()
@@ -0,0 +1,777 @@
+-- Regression tests. Most tests run their code in a hot loop, so it gets
+-- compiled, and check the results.
+
+local jit = require"jit"
+
+if not pcall(require, "jit.opt") then
+  return
+end
+
+local tests = {}
+
+-- Create a new Lua state with the standard libraries through the C API.
+local function newstate()
+  local ffi = require"ffi"
+  if not pcall(ffi.typeof, "struct regressions_lua_State") then
+    ffi.cdef[[
+typedef struct regressions_lua_State regressions_lua_State;
+regressions_lua_State *luaL_newstate(void);
+void luaL_openlibs(regressions_lua_State *L);
+int luaL_loadstring(regressions_lua_State *L, const char *s);
+int lua_pcall(regressions_lua_State *L, int nargs, int nres, int errfunc);
+const char *lua_tolstring(regressions_lua_State *L, int idx, size_t *len);
+int lua_gc(regressions_lua_State *L, int what, int data);
+size_t luaJIT_setmemlimit(regressions_lua_State *L, size_t limit);
+int luaJIT_allocstats(regressions_lua_State *L, size_t *mapped,
+		      size_t *committed);
+void lua_close(regressions_lua_State *L);
+]]
+  end
+  local L = ffi.C.luaL_newstate()
+  ffi.C.luaL_openlibs(L)
+  return ffi.C, L
+end
+
+-- Run code in a new Lua state. The chunk returns a function, which is
+-- called with a memory limit of extra bytes above the current usage.
+-- Returns the status and the error message or the first result.
+local function run_memlimit(extra, code)
+  local ffi = require"ffi"
+  local C, L = newstate()
+  assert(C.luaL_loadstring(L, code) == 0)
+  assert(C.lua_pcall(L, 0, 1, 0) == 0)
+  local total = C.lua_gc(L, 3, 0)*1024 + C.lua_gc(L, 4, 0)
+  C.luaJIT_setmemlimit(L, total + extra)
+  local status = C.lua_pcall(L, 0, 1, 0)
+  local s = C.lua_tolstring(L, -1, nil)
+  s = s ~= nil and ffi.string(s) or nil
+  C.lua_close(L)
+  return status == 0, s
+end
+
+-- Sunk stores keep the delta to their allocation in the spill slot field.
+-- It must not be reused as a spill slot by other instructions.
+function tests.sunk_store_spill()
+  local function vf(...)
+    local n = select('#', ...)
+    local x = {...}
+    return n, #x, (...)
+  end
+  local out = {}
+  for i = 1, 300 do
+    local n = i % 5
+    local r = {vf(unpack({1,2,3,4,5}, 1, n))}
+    if i > 290 then
+      out[#out+1] = table.concat({tostring(r[1]), tostring(r[2]),
+                                  tostring(r[3])}, ",")
+    end
+  end
+  assert(table.concat(out, " ") ==
+         "1,1,1 2,2,1 3,3,1 4,4,1 0,0,nil 1,1,1 2,2,1 3,3,1 4,4,1 0,0,nil")
+end
+
+-- ISNEXT must despecialize an ITERN that has been patched to a JLOOP.
+function tests.isnext_jloop()
+  local function walk(pairs, t)
+    local n = 0
+    for k, v in pairs(t) do n = n + v end
+    return n
+  end
+  local function range(n)
+    local t = {}
+    for i = 1, n do t[i] = i end
+    return t
+  end
+  jit.off(range)
+  -- The walk() loop must be trace 1, so the JLOOP operand is not a valid
+  -- ITERC operand.
+  local t = range(1000)
+  jit.flush()
+  assert(walk(pairs, t) == 500500)
+  assert(walk(pairs, t) == 500500)
+  assert(walk(ipairs, t) == 500500)
+end
+
+-- Patterns that may exceed the recursion limit must not be matched by a
+-- trace, which cannot throw the error.
+function tests.strmatch_too_complex()
+  local pat = ("a?"):rep(250)
+  local strs = {}
+  for i = 1, 300 do strs[i] = i > 250 and ("a"):rep(250) or "aaa" end
+  local ok, n = 0, 0
+  for i = 1, 300 do
+    if pcall(string.match, strs[i], pat) then ok = ok + 1 else n = n + 1 end
+  end
+  assert(ok == 250 and n == 50, ok)
+end
+
+-- An allocation over the memory limit runs an emergency GC first.
+function tests.memlimit_emergency_gc()
+  local ok, err = run_memlimit(1024*1024, [[
+    local tnew = require"table.new"
+    local t = {}
+    for i = 1, 40000 do t[i] = {i} end
+    collectgarbage("step")  -- Everything is anchored here.
+    return function()
+      t = nil
+      local big = tnew(2*1024*1024/8, 0)
+      return tostring(#big)
+    end
+  ]])
+  assert(ok and err == "0", err)
+end
+
+-- A failed pattern compile must not leave a freed entry in the cache.
+function tests.strmatch_cache_oom()
+  local ok, err = run_memlimit(1200, [[
+    local pats, big, res = {}, {}, {}
+    for i = 1, 200 do pats[i] = "(%d+)x"..i end
+    for i = 1, 20 do big[i] = ("[%a%d_]"):rep(35)..i end
+    local s = ("123x"):rep(60)..("1x"):rep(200)
+    for i = 1, 200 do res[i] = s:find(pats[i]) end
+    return function()
+      local nfail = 0
+      for _ = 1, 3 do
+        for i = 1, 20 do
+          if not pcall(string.find, s, big[i]) then nfail = nfail + 1 end
+        end
+        for i = 1, 200 do
+          if s:find(pats[i]) ~= res[i] then return "bad match "..i end
+        end
+      end
+      return nfail > 0 and "ok" or "no failed compile"
+    end
+  ]])
+  assert(ok and err == "ok", err)
+end
+
+-- Large free chunks are decommitted at the end of a GC cycle, if enough of
+-- the committed memory is free.
+function tests.alloc_decommit()
+  local ffi = require"ffi"
+  local C, L = newstate()
+  assert(C.luaL_loadstring(L, [[
+    local tnew = require"table.new"
+    local t = {}
+    for i = 1, 400 do t[i] = tnew(4000, 0) end
+    KEEP = {}
+    for i = 1, 400, 10 do KEEP[#KEEP+1] = t[i] end
+    t = nil
+    collectgarbage()
+    collectgarbage()
+  ]]) == 0)
+  assert(C.lua_pcall(L, 0, 0, 0) == 0)
+  local mapped, committed = ffi.new("size_t[1]"), ffi.new("size_t[1]")
+  if C.luaJIT_allocstats(L, mapped, committed) ~= 0 then
+    assert(mapped[0] - committed[0] > 2*1024*1024,
+	   tostring(mapped[0] - committed[0]))
+  end
+  C.lua_close(L)
+end
+
+-- table.sort must sort correctly with and without a comparison function,
+-- also when it is compiled.
+function tests.sort()
+  local seed = 1
+  local function rand(n)
+    seed = (seed * 1103515245 + 12345) % 2147483648
+    return seed % n
+  end
+  for n = 0, 200 do
+    local t, s = {}, {}
+    for i = 1, n do t[i] = rand(50); s[i] = tostring(t[i]) end
+    table.sort(t)
+    table.sort(s, function(a, b) return a > b end)
+    for i = 2, n do
+      assert(t[i-1] <= t[i])
+      assert(s[i-1] >= s[i])
+    end
+  end
+end
+
+-- Errors from inside table.sort have no location, except for an invalid
+-- order function, which is reported at the caller. Missing arguments are
+-- reported as such.
+function tests.sort_errors()
+  local ok, err = pcall(table.sort, {{}, {}})
+  assert(not ok and err == "attempt to compare two table values", err)
+  ok, err = pcall(table.sort, {1, 2}, function(a, b) error("cmp", 0) end)
+  assert(not ok and err == "cmp", err)
+  ok, err = pcall(function() table.sort() end)
+  assert(not ok and string.find(err, "got no value", 1, true), err)
+  ok, err = pcall(function() table.sort({}, 1) end)
+  assert(not ok and string.find(err, "function expected, got number",
+				1, true), err)
+  local olderror = error
+  error = function() return "ignored" end
+  local t = {}
+  for i = 1, 100 do t[i] = i % 7 end
+  ok, err = pcall(function() table.sort(t, function() return true end) end)
+  error = olderror
+  assert(not ok and string.find(err, "^.-:%d+: invalid order function"),
+	 err)
+end
+
+-- table.sort uses raw accesses.
+function tests.sort_raw()
+  local called = false
+  local mt = {
+    __index = function() called = true; return 2 end,
+    __newindex = function() called = true end,
+  }
+  for n = 1, 100 do
+    local t = setmetatable({}, mt)
+    for i = 1, n do rawset(t, i, (n - i) * 3 % 17) end
+    table.sort(t)
+    for i = 2, n do assert(rawget(t, i-1) <= rawget(t, i)) end
+  end
+  assert(not called)
+  local t = setmetatable({3, nil, 1, 0}, mt)
+  local ok, err = pcall(table.sort, t)
+  assert(not ok and string.find(err, "compare nil", 1, true), err)
+  assert(not called)
+end
+
+-- Frozen tables reject all modifications, also from compiled code.
+function tests.freeze_errors()
+  local freeze = require"table.freeze"
+  local w = setmetatable({}, {__mode = "v"})
+  w[1] = {}
+  local ok, err = pcall(freeze, w)
+  assert(not ok and err == "cannot freeze a weak table", err)
+  local t = freeze({1, 2, 3, x = 1})
+  local function check(ok, err)
+    assert(not ok and string.find(err, "attempt to modify a frozen table",
+				  1, true), tostring(err))
+  end
+  for i = 1, 100 do
+    check(pcall(setmetatable, t, {__mode = "k"}))
+    check(pcall(setmetatable, t, nil))
+    check(pcall(debug.setmetatable, t, {}))
+    check(pcall(rawset, t, 1, i))
+    check(pcall(rawset, t, "y", i))
+    check(pcall(function() t[4] = i end))
+    check(pcall(function() t.x = i end))
+    check(pcall(table.insert, t, i))
+    check(pcall(table.insert, t, 1, i))
+    check(pcall(table.remove, t))
+    check(pcall(table.remove, t, 1))
+    check(pcall(table.move, {i}, 1, 1, 1, t))
+  end
+  assert(getmetatable(t) == nil)
+  assert(t[1] == 1 and t[2] == 2 and t[3] == 3 and t[4] == nil)
+  assert(t.x == 1 and t.y == nil)
+  -- Moving out of a frozen table is fine.
+  local u = table.move(t, 1, 3, 2, {})
+  assert(u[1] == nil and u[2] == 1 and u[4] == 3)
+end
+
+-- Loads from frozen tables are folded to constants on traces.
+function tests.freeze_fold()
+  local freeze = require"table.freeze"
+  local t = freeze({10, 20, x = 30, sub = freeze({40})})
+  local function f() return t[1] + t[2] + t.x + t.sub[1] end
+  local function g(i) return t[i] end
+  for i = 1, 200 do
+    assert(f() == 100)
+    assert(g(i % 2 + 1) == (i % 2 + 1) * 10)
+    if i % 50 == 0 then collectgarbage() end
+  end
+end
+
+-- table.remove, table.insert in the middle and table.move must give the
+-- same results when interpreted and when compiled.
+function tests.table_move()
+  local function run()
+    local res = {}
+    for i = 1, 100 do
+      local t = {}
+      for j = 1, 20 do t[j] = j end
+      table.insert(t, i % 22 + 1, -i)
+      res[#res+1] = table.remove(t, i % 21 + 1)
+      res[#res+1] = table.remove(t)
+      table.move(t, 2, 10, i % 5 + 1)
+      table.move(t, 1, 19, 1 + i % 3, t)
+      local u = table.move(t, i % 4 + 1, 18, 3, {})
+      for j = 1, 22 do res[#res+1] = t[j] or 0; res[#res+1] = u[j] or 0 end
+    end
+    return table.concat(res, " ")
+  end
+  local compiled = run()
+  jit.off(run)
+  assert(run() == compiled)
+  jit.on(run)
+end
+
+-- The element count and the destination range of table.move must not wrap
+-- around, also when compiled.
+function tests.table_move_overflow()
+  local M = 0x7fffffff
+  local t = {1, 2}
+  for i = 1, 100 do
+    local ok, err = pcall(table.move, t, -M, M, 1)
+    assert(not ok and string.find(err, "too many elements", 1, true), err)
+    ok, err = pcall(table.move, t, 1, 2, M)
+    assert(not ok and string.find(err, "wrap around", 1, true), err)
+    ok, err = pcall(table.insert, t, -M, 1)
+    assert(not ok and string.find(err, "too many elements", 1, true), err)
+    assert(table.move(t, M - 1, M, 1, {}) and #t == 2)
+    local u = table.move(t, 1, 2, M - 1, {})
+    assert(u[M - 1] == 1 and u[M] == 2)
+  end
+  -- Guards on the trace for arguments that only overflow later.
+  for i = 1, 200 do
+    assert(pcall(table.move, t, i > 150 and -M or 1, 2, 1, {}) == (i <= 150))
+    assert(pcall(table.move, t, 1, 2, i > 150 and M or 1, {}) == (i <= 150))
+  end
+end
+
+-- The recorded coroutine.status, coroutine.running and
+-- coroutine.isyieldable must follow changes of the status and of the
+-- running coroutine.
+function tests.coroutine_status()
+  local main = coroutine.running()
+  local function info(co)
+    local r = coroutine.running()
+    return coroutine.status(co), r == main, coroutine.isyieldable()
+  end
+  local co
+  co = coroutine.create(function()
+    for i = 1, 100 do
+      local st, ismain, y = info(co)
+      assert(st == "running" and not ismain and y)
+      coroutine.yield(i)
+    end
+  end)
+  for i = 1, 100 do
+    local st, ismain, y = info(co)
+    assert(st == "suspended" and ismain and not y)
+    assert(select(2, coroutine.resume(co)) == i)
+  end
+  coroutine.resume(co)
+  for i = 1, 100 do
+    assert(info(co) == "dead")
+  end
+end
+
+-- A producer/consumer pipeline gives the same results when the traces on
+-- both sides of the coroutine switches are compiled.
+function tests.coroutine_pipeline()
+  local function producer(n)
+    return coroutine.wrap(function()
+      for i = 1, n do coroutine.yield(i) end
+    end)
+  end
+  local function filter(src)
+    return coroutine.wrap(function()
+      for x in src do if x % 3 ~= 0 then coroutine.yield(x * 2) end end
+    end)
+  end
+  local sum = 0
+  for x in filter(producer(1000)) do sum = sum + x end
+  assert(sum == 2 * (500500 - 3 * 333 * 334 / 2))
+end
+
+-- Simple loops over arrays of doubles are vectorized. The results must be
+-- the same as for the interpreter, also for in-place and overlapping
+-- arrays, and for loops that only look like they can be vectorized.
+function tests.vec_loops()
+  local ffi = require"ffi"
+  local n = 101
+  local function arr(seed)
+    local a = ffi.new("double[?]", n+4)
+    for i = 0, n+3 do a[i] = (i*seed) % 13 - 2.5 end
+    return a
+  end
+  local loops = {
+    function(d, x, y, k) for i = 0, n-1 do d[i] = x[i] + y[i] end end,
+    function(d, x, y, k) for i = 0, n-1 do d[i] = x[i] - k end end,
+    function(d, x, y, k) for i = 1, n do d[i] = 3 / y[i] end end,
+    function(d, x, y, k) for i = 0, n-1 do d[i] = x[i]*y[i] end end,
+    function(d, x, y, k) for i = 0, n-1 do d[i] = x[i]*k + y[i] end end,
+    function(d, x, y, k) for i = 0, n-1 do d[i] = y[i] + k*x[i] end end,
+    function(d, x, y, k) for i = 0, n-1 do d[i] = d[i] * k end end,
+    function(d, x, y, k) for i = 0, n-1 do d[i] = d[i+1] - x[i] end end,
+    function(d, x, y, k) for i = 1, n do d[i] = d[i-1] + x[i] end end,
+    function(d, x, y, k) for i = 0, n-1 do d[i] = x[i]*k + k end end,
+  }
+  for j, f in ipairs(loops) do
+    local x, y = arr(3), arr(5)
+    for _, shift in ipairs{0, 1} do
+      local d1, d2 = arr(7), arr(7)
+      jit.off(f)
+      for r = 1, 3 do f(d1, shift == 0 and x or d1+shift, y, 1.25) end
+      jit.on(f)
+      jit.flush(f)
+      for r = 1, 3 do f(d2, shift == 0 and x or d2+shift, y, 1.25) end
+      for i = 0, n+3 do assert(d1[i] == d2[i], j..":"..shift..":"..i) end
+    end
+  end
+  -- Stores to const arrays must still raise an error.
+  local c = ffi.cast("const double *", arr(3))
+  assert(not pcall(function()
+    for r = 1, 100 do for i = 0, n-1 do c[i] = c[i] * 2 end end
+  end))
+end
+
+-- With -O+align, the loops of all traces are aligned to a cache line on
+-- x86/x64. The results must be the same as without it.
+function tests.loop_align()
+  local jutil = require"jit.util"
+  local function run()
+    local t, s = {}, 0
+    for i = 1, 200 do t[i] = i end
+    for i = 1, 200 do s = s + t[i] end
+    for i = 1, 200 do
+      s = s + t[i]*i % 7 + math.floor(t[i]/3) + bit.band(i, 5) +
+	  (t[i] > 100 and 1 or 2) + #tostring(i % 10)
+    end
+    return s
+  end
+  local function loops()
+    local res = {}
+    for tr = 1, 1000 do
+      local mcode, addr, loop = jutil.tracemc(tr)
+      if not mcode then break end
+      if loop > 0 then res[#res+1] = (addr + loop) % 64 end
+    end
+    return res
+  end
+  local s = run()
+  local noalign = loops()
+  assert(#noalign == 3)
+  jit.flush()
+  jit.opt.start("+align")
+  local ok, err = pcall(function()
+    assert(run() == s)
+    local align = loops()
+    assert(#align == 3)
+    if jit.arch == "x86" or jit.arch == "x64" then
+      for _, ofs in ipairs(align) do assert(ofs == 0) end
+    end
+  end)
+  jit.opt.start("-align")
+  assert(ok, err)
+end
+
+-- Tables stored in other sunk tables are sunk, too. They must be restored
+-- together with the outer table at exits, and replayed for side traces,
+-- which may sink them again.
+function tests.sink_nested()
+  local function run(n)
+    local res, out, s = {}, {}, 0
+    for i = 1, n do
+      local r = {pos = {x = i, y = -i}, n = i, deep = {inner = {i}}}
+      if i % 50 == 0 then res[#res+1] = r end
+      local q = {pos = {x = i}}
+      if i % 70 == 0 then out[#out+1] = q; out[#out+1] = q.pos end
+      local p = {pos = {x = i, y = -i}}
+      if i % 3 == 0 then s = s + p.pos.y else s = s + p.pos.x end
+    end
+    return res, out, s
+  end
+  local res, out, s = run(3000)
+  assert(#res == 60 and #out == 84)
+  for _, r in ipairs(res) do
+    assert(r.pos.x == r.n and r.pos.y == -r.n and r.deep.inner[1] == r.n)
+  end
+  for j = 1, #out, 2 do assert(out[j].pos == out[j+1]) end
+  jit.off(run)
+  assert(select(3, run(3000)) == s)
+  jit.on(run)
+end
+
+-- Forwarding wrappers with f(...) and f(unpack(t)) compile inline into a
+-- single loop trace, specialized to the number of arguments. Other argument
+-- counts must leave the trace.
+function tests.unpack_varg()
+  local jutil = require"jit.util"
+  local function add(a, b, c, d) return (a or 0) + (b or 0) + (c or 0) + (d or 0) end
+  local function count(...) return select('#', ...) end
+  local function fwd(...) return add(...) * count(...) end
+  local function run(args)
+    local s = 0
+    for i = 1, 300 do
+      local a = args[i % #args + 1]
+      s = s + fwd(unpack(a)) + fwd(unpack(a, 2)) + count(unpack(a, 1, 3))
+    end
+    return s
+  end
+  assert(run({{1, 2, 3}}) == 300*(18 + 10 + 3))
+  local loops = 0
+  for tr = 1, 1000 do
+    local ti = jutil.traceinfo(tr)
+    if not ti then break end
+    assert(ti.linktype ~= "stitch")
+    if ti.linktype == "loop" then loops = loops + 1 end
+  end
+  assert(loops == 1)
+  local args = {{1, 2, 3}, {4, nil, 6, 7}, {}, {8}, {1, 2, 3, 4, 5}}
+  local compiled = run(args)
+  jit.off()
+  local interpreted = run(args)
+  jit.on()
+  assert(compiled == interpreted)
+end
+
+-- Traces follow returns and tail calls out of vararg functions to the
+-- frames below the trace start, without aborting. Other argument counts
+-- must leave the trace with the right results.
+function tests.varg_return_lower()
+  local function inner(...)
+    local s = 0
+    for i = 1, select('#', ...) * 10 do s = s + i end
+    return s, ...
+  end
+  local function tail(...)
+    for i = 1, 5 do end
+    return inner(...)
+  end
+  local function run(args)
+    local r = 0
+    for i = 1, 500 do
+      local a = args[i % #args + 1]
+      local s, x = inner(unpack(a))
+      r = r + s + (x or 0)
+      r = r + tail(unpack(a))
+    end
+    return r
+  end
+  local aborts = 0
+  local function onabort(what) if what == "abort" then aborts = aborts + 1 end end
+  jit.attach(onabort, "trace")
+  local ok, err = pcall(run, {{1, 2, 3}})
+  jit.attach(onabort)
+  assert(ok, err)
+  assert(err == 500*(465 + 1 + 465) and aborts == 0)
+  local args = {{1, 2, 3}, {4}, {}, {5, 6, 7, 8, 9}}
+  local compiled = run(args)
+  jit.off()
+  local interpreted = run(args)
+  jit.on()
+  assert(compiled == interpreted)
+end
+
+-- string.format with %s and %q for numbers, nil and booleans, and with %p,
+-- is recorded without stitching. The results must be the same as for the
+-- interpreter, also for values that change their type.
+function tests.format_spec()
+  local jutil = require"jit.util"
+  local t, f = {}, function() end
+  local vals = {1, 2.5, -0.125, 1e300, nil, true, false, 42}
+  local function run(n)
+    local res = {}
+    for i = 1, n do
+      local v = vals[i % 8 + 1]
+      res[#res+1] = string.format("%s|%q|%p|%p|%g|%.3f", v, v, t, f, i/7, i/3)
+    end
+    return table.concat(res, "\n")
+  end
+  local compiled = run(300)
+  for tr = 1, 1000 do
+    local ti = jutil.traceinfo(tr)
+    if not ti then break end
+    assert(ti.linktype ~= "stitch")
+  end
+  jit.off()
+  assert(run(300) == compiled)
+  jit.on()
+  -- Other types and a __tostring metamethod leave or stop the trace.
+  vals[3] = setmetatable({}, {__tostring = function() return "obj" end})
+  vals[4] = "str\n\0"
+  compiled = run(300)
+  jit.off()
+  assert(run(300) == compiled)
+  jit.on()
+end
+
+-- a*b+c, a*b-c and c-a*b are only fused to FMA with -O+fma. Without it,
+-- the compiled results must be the same as for the interpreter.
+function tests.fma_results()
+  local e = 2^-30
+  local as, bs = {}, {}
+  for i = 1, 8 do as[i], bs[i] = 1 + e, 1 - e end
+  local function run()
+    local r1, r2, r3 = 0, 0, 0
+    for i = 1, 300 do
+      local a, b = as[i % 8 + 1], bs[i % 8 + 1]
+      r1, r2, r3 = a*b + -1, a*b - 1, 1 - a*b
+    end
+    return r1, r2, r3
+  end
+  local r1, r2, r3 = run()
+  assert(r1 == 0 and r2 == 0 and r3 == 0)
+  jit.flush()
+  jit.opt.start("+fma")
+  local ok, x1, x2, x3 = pcall(run)
+  jit.opt.start("-fma")
+  assert(ok, x1)
+  local fused = 0
+  for _, flag in ipairs{jit.status()} do
+    if flag == "FMA" then fused = 2^-60 end
+  end
+  assert(x1 == -fused and x2 == -fused and x3 == fused)
+end
+
+-- Field loads from tables duplicated from the same template are guarded by
+-- their shape. Objects whose key layout changed behind the trace's back
+-- must leave the trace with the right results.
+function tests.shape_guard()
+  local function new(i) return {x = i, y = 2*i, z = 3*i} end
+  local function run(objs)
+    local s = 0
+    for i = 1, 600 do
+      local o = objs[i % #objs + 1]
+      s = s + o.x + o.y * 2 + o.z * 3
+    end
+    return s
+  end
+  local function grow(n)
+    local s = 0
+    for i = 1, n do
+      local o = new(i)
+      o.w = i
+      s = s + o.x + o.w + (o.v or 0)
+    end
+    return s
+  end
+  local objs = {}
+  for i = 1, 10 do objs[i] = new(i) end
+  assert(run(objs) == 60*14*55)
+  objs[2].w = 1
+  objs[3].x = nil; objs[3].x = 5
+  for k = 1, 100 do objs[4]["k"..k] = k end
+  objs[5] = {z = 15, y = 10, x = 5}
+  objs[6] = setmetatable({}, {__index = new(6)})
+  require("table.clear")(objs[7]); objs[7].z, objs[7].y, objs[7].x = 1, 2, 3
+  local compiled, grown = run(objs), grow(300)
+  jit.off()
+  assert(run(objs) == compiled and grow(300) == grown)
+  jit.on()
+end
+
+-- Global reads on traces are guarded by the shape of the environment.
+-- Defining new globals inside the loop, directly or through a call, must
+-- invalidate them, also while keys are added to other tables.
+function tests.global_define()
+  local function mkrun()
+    local env = {a = 1, b = 2, rawset = rawset}
+    local function def(i) rawset(env, "k"..i, i) end
+    return setfenv(function(n)
+      local s, other = 0, {}
+      for i = 1, n do
+	other["o"..(i % 50)] = i
+	s = s + a + b + (c or 0) + (k350 or 0)
+	if i == 200 then c = 10 end
+	if i >= 300 and i < 400 then def(i) end
+	if i == 500 then a = 5 end
+      end
+      return s
+    end, env)
+  end
+  local compiled = mkrun()(600)
+  jit.off()
+  local interpreted = mkrun()(600)
+  jit.on()
+  assert(compiled == interpreted)
+end
+
+-- Frequent exits from a trace running close to the maximum stack size must
+-- restore the same values as the interpreter, both with and without sunk
+-- allocations, or raise a stack overflow error.
+function tests.exit_maxstack()
+  local function work(n, sunk)
+    local s = 0
+    for i = 1, n do
+      local t = sunk and {i, -i} or nil
+      if i % 4 == 0 then s = s + (t and t[2] or i) else s = s - 1 end
+    end
+    return s
+  end
+  local function deep(d, n, sunk)
+    if d == 0 then return work(n, sunk) end
+    return (deep(d-1, n, sunk))
+  end
+  local lo, hi = 1, 1000000
+  while lo < hi do
+    local mid = math.floor((lo + hi + 1) / 2)
+    if pcall(deep, mid, 0, false) then lo = mid else hi = mid - 1 end
+  end
+  for _, sunk in ipairs{false, true} do
+    jit.off()
+    local expect = work(1000, sunk)
+    jit.on()
+    local near = 0
+    for _, k in ipairs{0, 1, 3, 10, 50, 1000} do
+      local ok, r = pcall(deep, lo - k, 1000, sunk)
+      if ok then
+	assert(r == expect)
+	if k <= 10 then near = near + 1 end
+      else
+	assert(string.find(r, "stack overflow", 1, true), r)
+      end
+    end
+    assert(near > 0)
+  end
+end
+
+-- Bounds checks for t[k-i+1] are hoisted out of the loop. The results must
+-- be the same as for the interpreter, when k is variable and when the term
+-- changes inside the loop, also for keys that leave the array part.
+function tests.abc_affine()
+  local t = {}
+  for i = 1, 100 do t[i] = i * 3 end
+  local steps = {}
+  for i = 1, 200 do steps[i] = i % 3 == 0 and 1 or 0 end
+  local function rev(k, n)
+    local s = 0
+    for i = 1, n do s = s + (t[k-i+1] or -1) end
+    return s
+  end
+  local function variant(k, n)
+    local s = 0
+    for i = 1, n do
+      s = s + (t[k-i+1] or -1)
+      k = k + steps[i]
+    end
+    return s
+  end
+  local function run()
+    local res = {}
+    for _, k in ipairs{100, 60, 150, 99, 101, 0, -5} do
+      for _, n in ipairs{100, 50, 130, 0} do
+	res[#res+1] = rev(k, n)
+	res[#res+1] = variant(k, n)
+      end
+    end
+    return table.concat(res, " ")
+  end
+  local compiled = run()
+  jit.off()
+  local interpreted = run()
+  jit.on()
+  assert(compiled == interpreted)
+end
+
+local failed = false
+
+local names = {}
+for name in pairs(tests) do
+  names[#names + 1] = name
+end
+table.sort(names)
+
+for _, name in ipairs(names) do
+  local test = tests[name]
+  io.stdout:write("Running: "..name.."\n")
+  jit.flush()
+  local success, err = pcall(test)
+  if not success then
+    failed = true
+    io.stderr:write("  FAILED ".. err.."\n")
+  end
+end
+
+if failed then
+  os.exit(1)
+end